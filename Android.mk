@@ -24,6 +24,7 @@ LOCAL_PATH := $(my-dir)
 local_use_binder := $(if $(BRILLO_USE_BINDER),$(BRILLO_USE_BINDER),1)
 local_use_hwid_override := \
     $(if $(BRILLO_USE_HWID_OVERRIDE),$(BRILLO_USE_HWID_OVERRIDE),0)
+local_use_io_uring := $(if $(BRILLO_USE_IO_URING),$(BRILLO_USE_IO_URING),0)
 local_use_mtd := $(if $(BRILLO_USE_MTD),$(BRILLO_USE_MTD),0)
 local_use_chrome_network_proxy := 0
 local_use_chrome_kiosk_app := 0
@@ -36,6 +37,7 @@ ue_common_cflags := \
     -DUSE_CHROME_NETWORK_PROXY=$(local_use_chrome_network_proxy) \
     -DUSE_CHROME_KIOSK_APP=$(local_use_chrome_kiosk_app) \
     -DUSE_HWID_OVERRIDE=$(local_use_hwid_override) \
+    -DUSE_IO_URING=$(local_use_io_uring) \
     -DUSE_MTD=$(local_use_mtd) \
     -DUSE_OMAHA=$(local_use_omaha) \
     -D_FILE_OFFSET_BITS=64 \
@@ -128,9 +130,13 @@ ue_libpayload_consumer_src_files := \
     common/multi_range_http_fetcher.cc \
     common/platform_constants_android.cc \
     common/prefs.cc \
+    common/sha256_x86.cc \
     common/subprocess.cc \
     common/terminator.cc \
+    common/throughput_estimator.cc \
+    common/token_bucket.cc \
     common/utils.cc \
+    payload_consumer/async_file_writer.cc \
     payload_consumer/bzip_extent_writer.cc \
     payload_consumer/cached_file_descriptor.cc \
     payload_consumer/delta_performer.cc \
@@ -147,7 +153,13 @@ ue_libpayload_consumer_src_files := \
     payload_consumer/payload_metadata.cc \
     payload_consumer/payload_verifier.cc \
     payload_consumer/postinstall_runner_action.cc \
+    payload_consumer/source_block_cache.cc \
+    payload_consumer/source_prefetcher.cc \
     payload_consumer/xz_extent_writer.cc
+ifeq ($(local_use_io_uring),1)
+ue_libpayload_consumer_src_files += \
+    payload_consumer/io_uring_file_descriptor.cc
+endif  # local_use_io_uring == 1
 
 ifeq ($(HOST_OS),linux)
 # Build for the host.
@@ -917,7 +929,10 @@ LOCAL_SRC_FILES := \
     common/subprocess_unittest.cc \
     common/terminator_unittest.cc \
     common/test_utils.cc \
+    common/throughput_estimator_unittest.cc \
+    common/token_bucket_unittest.cc \
     common/utils_unittest.cc \
+    payload_consumer/async_file_writer_unittest.cc \
     payload_consumer/bzip_extent_writer_unittest.cc \
     payload_consumer/cached_file_descriptor_unittest.cc \
     payload_consumer/delta_performer_integration_test.cc \
@@ -929,6 +944,8 @@ LOCAL_SRC_FILES := \
     payload_consumer/file_writer_unittest.cc \
     payload_consumer/filesystem_verifier_action_unittest.cc \
     payload_consumer/postinstall_runner_action_unittest.cc \
+    payload_consumer/source_block_cache_unittest.cc \
+    payload_consumer/source_prefetcher_unittest.cc \
     payload_consumer/xz_extent_writer_unittest.cc \
     payload_generator/ab_generator_unittest.cc \
     payload_generator/blob_file_writer_unittest.cc \
@@ -953,6 +970,10 @@ LOCAL_SRC_FILES := \
     payload_generator/zip_unittest.cc \
     proxy_resolver_unittest.cc \
     testrunner.cc
+ifeq ($(local_use_io_uring),1)
+LOCAL_SRC_FILES += \
+    payload_consumer/io_uring_file_descriptor_unittest.cc
+endif  # local_use_io_uring == 1
 ifeq ($(local_use_omaha),1)
 LOCAL_C_INCLUDES += \
     $(ue_libupdate_engine_exported_c_includes)
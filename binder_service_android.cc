@@ -175,4 +175,12 @@ Status BinderUpdateEngineAndroidService::setPerformanceMode(bool enable) {
   return Status::ok();
 }
 
+Status BinderUpdateEngineAndroidService::setDownloadRateLimit(
+    int64_t bytes_per_second) {
+  brillo::ErrorPtr error;
+  if (!service_delegate_->SetDownloadRateLimit(bytes_per_second, &error))
+    return ErrorPtrToStatus(error);
+  return Status::ok();
+}
+
 }  // namespace chromeos_update_engine
@@ -80,10 +80,13 @@ extern const char kPrefsUpdateServerCertificate[];
 extern const char kPrefsUpdateStateNextDataLength[];
 extern const char kPrefsUpdateStateNextDataOffset[];
 extern const char kPrefsUpdateStateNextOperation[];
+extern const char kPrefsUpdateStateOperationProgress[];
+extern const char kPrefsUpdateStateOperationSHA256Context[];
 extern const char kPrefsUpdateStatePayloadIndex[];
 extern const char kPrefsUpdateStateSHA256Context[];
 extern const char kPrefsUpdateStateSignatureBlob[];
 extern const char kPrefsUpdateStateSignedSHA256Context[];
+extern const char kPrefsUpdateStateSourceChecked[];
 extern const char kPrefsUpdateTimestampStart[];
 extern const char kPrefsUrlSwitchCount[];
 extern const char kPrefsWallClockWaitPeriod[];
@@ -170,6 +173,12 @@ const int kDownloadLowSpeedTimeSeconds = 90;
 const int kDownloadDevModeLowSpeedTimeSeconds = 180;
 const int kDownloadP2PLowSpeedTimeSeconds = 60;
 
+// A URL failing while its measured throughput is under this many bytes per
+// second is given up on at its first failure, if there are other URLs to try.
+// Once measured, the low speed limit of a transfer follows the throughput of
+// the link, so a slow but steady URL doesn't fail because of it.
+const int kDownloadSlowUrlThroughputBps = 10 * 1024;
+
 // The maximum amount of HTTP server reconnect attempts.
 //
 // This is set high in order to maximize the attempt's chance of
@@ -188,6 +197,14 @@ const int kDownloadP2PMaxRetryCount = 5;
 const int kDownloadConnectTimeoutSeconds = 30;
 const int kDownloadP2PConnectTimeoutSeconds = 5;
 
+// The number of HTTP connections used to download the payload in parallel.
+//
+// A single connection is limited by its congestion window on links with a
+// high latency, so the payload is split in chunks downloaded over several
+// connections. Not used with p2p, where the peer may not have received the
+// following chunks yet.
+const int kDownloadParallelConnections = 4;
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_COMMON_CONSTANTS_H_
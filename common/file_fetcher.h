@@ -29,7 +29,8 @@
 #include "update_engine/common/http_fetcher.h"
 
 // This is a concrete implementation of HttpFetcher that reads files
-// asynchronously.
+// asynchronously. Regular files on local filesystems are memory-mapped, and
+// the data passed to the delegate points directly into the mapping.
 
 namespace chromeos_update_engine {
 
@@ -69,6 +70,8 @@ class FileFetcher : public HttpFetcher {
     return static_cast<size_t>(bytes_copied_);
   }
 
+  bool IsLocal() const override { return true; }
+
   // Ignore all the time limits for files.
   void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {}
   void set_connect_timeout(int connect_timeout_seconds) override {}
@@ -78,10 +81,18 @@ class FileFetcher : public HttpFetcher {
   // Cleans up the fetcher, resetting its status to a newly constructed one.
   void CleanUp();
 
+  // Opens |path| to be memory-mapped, if it's a regular file on a local
+  // filesystem. Returns whether it was opened.
+  bool OpenMapped(const std::string& path);
+
   // Schedule a new asynchronous read if the stream is not paused and no other
   // read is in process. This method can be called at any point.
   void ScheduleRead();
 
+  // Maps the next chunk of |mapped_fd_|, passes it to the delegate and unmaps
+  // it.
+  void OnMapTaskCallback();
+
   // Called from the main loop when a single read from |stream_| succeeds or
   // fails, calling OnReadDoneCallback() and OnReadErrorCallback() respectively.
   void OnReadDoneCallback(size_t bytes_read);
@@ -111,6 +122,14 @@ class FileFetcher : public HttpFetcher {
   // The buffer used for reading from the stream.
   brillo::Blob buffer_;
 
+  // The file read through memory mappings instead of |stream_|, or -1, and its
+  // size.
+  int mapped_fd_{-1};
+  uint64_t mapped_file_size_{0};
+
+  // The task mapping the next chunk of |mapped_fd_|, if scheduled.
+  brillo::MessageLoop::TaskId map_task_{brillo::MessageLoop::kTaskIdNull};
+
   DISALLOW_COPY_AND_ASSIGN(FileFetcher);
 };
 
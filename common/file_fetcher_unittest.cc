@@ -18,13 +18,49 @@
 
 #include <string>
 
+#include <base/bind.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
 
+using std::string;
+
 namespace chromeos_update_engine {
 
-class FileFetcherUnitTest : public ::testing::Test {};
+namespace {
+
+class FileFetcherTestDelegate : public HttpFetcherDelegate {
+ public:
+  void ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    data_.append(static_cast<const char*>(bytes), length);
+  }
+
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    completed_ = true;
+    successful_ = successful;
+  }
+
+  void TransferTerminated(HttpFetcher* fetcher) override { ADD_FAILURE(); }
+
+  string data_;
+  bool completed_{false};
+  bool successful_{false};
+};
+
+}  // namespace
+
+class FileFetcherUnitTest : public ::testing::Test {
+ protected:
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  void TearDown() override { EXPECT_FALSE(loop_.PendingTasks()); }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+};
 
 TEST_F(FileFetcherUnitTest, SupporterUrlsTest) {
   EXPECT_TRUE(FileFetcher::SupportedUrl("file:///path/to/somewhere.bin"));
@@ -34,4 +70,32 @@ TEST_F(FileFetcherUnitTest, SupporterUrlsTest) {
   EXPECT_FALSE(FileFetcher::SupportedUrl("http:///no_http_here"));
 }
 
+TEST_F(FileFetcherUnitTest, MappedRangeTest) {
+  // The range starts past the first page, at an offset not page-aligned.
+  string contents;
+  for (size_t i = 0; i < 3000; i++)
+    contents += "abcdefghij";
+  test_utils::ScopedTempFile temp_file("ue_file_fetcher.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(temp_file.path(), contents));
+
+  FileFetcher fetcher;
+  FileFetcherTestDelegate delegate;
+  fetcher.set_delegate(&delegate);
+  EXPECT_TRUE(fetcher.IsLocal());
+  fetcher.SetOffset(5000);
+  fetcher.SetLength(12345);
+  fetcher.BeginTransfer("file://" + temp_file.path());
+  brillo::MessageLoopRunUntil(
+      &loop_,
+      base::TimeDelta::FromSeconds(10),
+      base::Bind(
+          [](FileFetcherTestDelegate* delegate) { return delegate->completed_; },
+          &delegate));
+
+  EXPECT_TRUE(delegate.completed_);
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ(contents.substr(5000, 12345), delegate.data_);
+  EXPECT_EQ(12345U, fetcher.GetBytesDownloaded());
+}
+
 }  // namespace chromeos_update_engine
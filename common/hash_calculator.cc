@@ -18,31 +18,139 @@
 
 #include <fcntl.h>
 
+#include <algorithm>
+
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
 
+#include "update_engine/common/sha256_x86.h"
 #include "update_engine/common/utils.h"
 
+using std::min;
 using std::string;
+using std::vector;
 
 namespace chromeos_update_engine {
 
-HashCalculator::HashCalculator() : valid_(false) {
+HashCalculator::HashCalculator() : HashCalculator(DefaultBackend()) {}
+
+HashCalculator::HashCalculator(Backend backend)
+    : valid_(false), backend_(backend) {
   valid_ = (SHA256_Init(&ctx_) == 1);
   LOG_IF(ERROR, !valid_) << "SHA256_Init failed";
+  if (!IsBackendSupported(backend_)) {
+    LOG(ERROR) << "SHA-256 backend not supported by this CPU";
+    valid_ = false;
+  }
+}
+
+bool HashCalculator::IsBackendSupported(Backend backend) {
+  switch (backend) {
+    case Backend::kOpenSSL:
+      return true;
+    case Backend::kX86ShaExtensions: {
+      static const bool supported = Sha256X86Supported();
+      return supported;
+    }
+  }
+  return false;
+}
+
+HashCalculator::Backend HashCalculator::DefaultBackend() {
+  if (IsBackendSupported(Backend::kX86ShaExtensions))
+    return Backend::kX86ShaExtensions;
+  return Backend::kOpenSSL;
 }
 
 // Update is called with all of the data that should be hashed in order.
-// Mostly just passes the data through to OpenSSL's SHA256_Update()
+// Mostly just passes the data through to OpenSSL's SHA256_Update(), except
+// for the full blocks hashed by the other backends.
 bool HashCalculator::Update(const void* data, size_t length) {
   TEST_AND_RETURN_FALSE(valid_);
   TEST_AND_RETURN_FALSE(raw_hash_.empty());
+  if (backend_ == Backend::kX86ShaExtensions) {
+    TEST_AND_RETURN_FALSE(CompleteBufferedBlock(&data, &length));
+    size_t hashed = UpdateX86Blocks(data, length) * SHA256_CBLOCK;
+    data = static_cast<const uint8_t*>(data) + hashed;
+    length -= hashed;
+  }
   static_assert(sizeof(size_t) <= sizeof(unsigned long),  // NOLINT(runtime/int)
                 "length param may be truncated in SHA256_Update");
   TEST_AND_RETURN_FALSE(SHA256_Update(&ctx_, data, length) == 1);
   return true;
 }
 
+bool HashCalculator::UpdateLanes(const vector<Lane>& lanes) {
+  // The lanes hashed with the SHA extensions, with their data advanced past
+  // the block their context buffered.
+  vector<Lane> x86_lanes;
+  for (const Lane& lane : lanes) {
+    HashCalculator* calc = lane.calculator;
+    if (calc->backend_ != Backend::kX86ShaExtensions) {
+      TEST_AND_RETURN_FALSE(calc->Update(lane.data, lane.length));
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(calc->valid_);
+    TEST_AND_RETURN_FALSE(calc->raw_hash_.empty());
+    Lane x86_lane = lane;
+    TEST_AND_RETURN_FALSE(
+        calc->CompleteBufferedBlock(&x86_lane.data, &x86_lane.length));
+    x86_lanes.push_back(x86_lane);
+  }
+
+  // Hash the blocks the lanes have in common two lanes at a time, then the
+  // rest of each lane on its own.
+  for (size_t i = 0; i + 1 < x86_lanes.size(); i += 2) {
+    Lane* lane0 = &x86_lanes[i];
+    Lane* lane1 = &x86_lanes[i + 1];
+    size_t num_blocks = min(lane0->length, lane1->length) / SHA256_CBLOCK;
+    if (num_blocks == 0)
+      continue;
+    Sha256X86BlocksX2(lane0->calculator->ctx_.h,
+                      static_cast<const uint8_t*>(lane0->data),
+                      lane1->calculator->ctx_.h,
+                      static_cast<const uint8_t*>(lane1->data),
+                      num_blocks);
+    for (Lane* lane : {lane0, lane1}) {
+      lane->calculator->AddHashedBlocks(num_blocks);
+      lane->data =
+          static_cast<const uint8_t*>(lane->data) + num_blocks * SHA256_CBLOCK;
+      lane->length -= num_blocks * SHA256_CBLOCK;
+    }
+  }
+  for (const Lane& lane : x86_lanes)
+    TEST_AND_RETURN_FALSE(lane.calculator->Update(lane.data, lane.length));
+  return true;
+}
+
+bool HashCalculator::CompleteBufferedBlock(const void** data, size_t* length) {
+  if (ctx_.num == 0)
+    return true;
+  size_t size = min(*length, static_cast<size_t>(SHA256_CBLOCK - ctx_.num));
+  TEST_AND_RETURN_FALSE(SHA256_Update(&ctx_, *data, size) == 1);
+  *data = static_cast<const uint8_t*>(*data) + size;
+  *length -= size;
+  return true;
+}
+
+size_t HashCalculator::UpdateX86Blocks(const void* data, size_t length) {
+  size_t num_blocks = length / SHA256_CBLOCK;
+  if (num_blocks == 0)
+    return 0;
+  DCHECK_EQ(ctx_.num, 0U);
+  Sha256X86Blocks(ctx_.h, static_cast<const uint8_t*>(data), num_blocks);
+  AddHashedBlocks(num_blocks);
+  return num_blocks;
+}
+
+void HashCalculator::AddHashedBlocks(size_t num_blocks) {
+  // The hashed length is kept in bits, split in two 32-bit words.
+  uint64_t bits = (static_cast<uint64_t>(ctx_.Nh) << 32 | ctx_.Nl) +
+                  static_cast<uint64_t>(num_blocks) * SHA256_CBLOCK * 8;
+  ctx_.Nl = static_cast<uint32_t>(bits);
+  ctx_.Nh = static_cast<uint32_t>(bits >> 32);
+}
+
 off_t HashCalculator::UpdateFile(const string& name, off_t length) {
   int fd = HANDLE_EINTR(open(name.c_str(), O_RDONLY));
   if (fd < 0) {
@@ -37,13 +37,45 @@ namespace chromeos_update_engine {
 
 class HashCalculator {
  public:
+  // The implementations of the SHA-256 block function.
+  enum class Backend {
+    // OpenSSL's, which uses the CPU crypto extensions if OpenSSL was built with
+    // them.
+    kOpenSSL,
+    // The x86 SHA extensions, which can also hash two lanes interleaved in
+    // UpdateLanes().
+    kX86ShaExtensions,
+  };
+
+  // A stream of data to hash with UpdateLanes().
+  struct Lane {
+    HashCalculator* calculator;
+    const void* data;
+    size_t length;
+  };
+
+  // Uses the fastest backend supported by the running CPU.
   HashCalculator();
+  explicit HashCalculator(Backend backend);
+
+  // Returns whether |backend| can be used on the running CPU.
+  static bool IsBackendSupported(Backend backend);
+
+  // Returns the fastest backend supported by the running CPU.
+  static Backend DefaultBackend();
 
   // Update is called with all of the data that should be hashed in order.
   // Update will read |length| bytes of |data|.
   // Returns true on success.
   bool Update(const void* data, size_t length);
 
+  // Updates the calculator of each of the |lanes| with the |length| bytes of
+  // |data| of the lane, which is the same as calling Update() on each of them
+  // but faster when the lanes are hashed interleaved by their backend. The
+  // calculators must be different.
+  // Returns true on success.
+  static bool UpdateLanes(const std::vector<Lane>& lanes);
+
   // Updates the hash with up to |length| bytes of data from |file|. If |length|
   // is negative, reads in and updates with the whole file. Returns the number
   // of bytes that the hash was updated with, or -1 on error.
@@ -77,6 +109,18 @@ class HashCalculator {
                              brillo::Blob* out_hash);
 
  private:
+  // Passes the first bytes of |*data| to OpenSSL until the block it buffered
+  // is complete, advancing |*data| and decreasing |*length| accordingly.
+  // Returns true on success.
+  bool CompleteBufferedBlock(const void** data, size_t* length);
+
+  // Hashes the full blocks at the beginning of |data| with the SHA extensions,
+  // and returns their number. No partial block must be buffered.
+  size_t UpdateX86Blocks(const void* data, size_t length);
+
+  // Accounts for |num_blocks| blocks hashed outside of OpenSSL.
+  void AddHashedBlocks(size_t num_blocks);
+
   // If non-empty, the final raw hash. Will only be set to non-empty when
   // Finalize is called.
   brillo::Blob raw_hash_;
@@ -84,7 +128,10 @@ class HashCalculator {
   // Init success
   bool valid_;
 
-  // The hash state used by OpenSSL
+  const Backend backend_;
+
+  // The hash state used by OpenSSL. The other backends update its hash words
+  // and length directly, so it can always be finalized and saved by OpenSSL.
   SHA256_CTX ctx_;
   DISALLOW_COPY_AND_ASSIGN(HashCalculator);
 };
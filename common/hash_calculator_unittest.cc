@@ -19,9 +19,12 @@
 #include <math.h>
 #include <unistd.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <base/logging.h>
+#include <base/time/time.h>
 #include <brillo/data_encoding.h>
 #include <brillo/secure_blob.h>
 #include <gtest/gtest.h>
@@ -33,6 +36,37 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Returns the backends supported by the running CPU.
+vector<HashCalculator::Backend> SupportedBackends() {
+  vector<HashCalculator::Backend> backends;
+  for (HashCalculator::Backend backend :
+       {HashCalculator::Backend::kOpenSSL,
+        HashCalculator::Backend::kX86ShaExtensions}) {
+    if (HashCalculator::IsBackendSupported(backend))
+      backends.push_back(backend);
+  }
+  return backends;
+}
+
+// Returns |size| bytes of data that aren't the same in every block.
+brillo::Blob MakeData(size_t size) {
+  brillo::Blob data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = static_cast<uint8_t>(i * 7 + i / 251);
+  return data;
+}
+
+// Returns the hash of |data| computed by OpenSSL alone.
+brillo::Blob OpenSSLHash(const brillo::Blob& data) {
+  brillo::Blob hash(SHA256_DIGEST_LENGTH);
+  SHA256(data.data(), data.size(), hash.data());
+  return hash;
+}
+
+}  // namespace
+
 // Generated by running this on a linux shell:
 // $ echo -n hi | openssl dgst -sha256 -binary |
 //   hexdump -v -e '"    " 12/1 "0x%02x, " "\n"'
@@ -107,6 +141,111 @@ TEST_F(HashCalculatorTest, BigTest) {
             brillo::data_encoding::Base64Encode(calc.raw_hash()));
 }
 
+TEST_F(HashCalculatorTest, BackendsTest) {
+  EXPECT_TRUE(HashCalculator::IsBackendSupported(
+      HashCalculator::Backend::kOpenSSL));
+  EXPECT_TRUE(HashCalculator::IsBackendSupported(
+      HashCalculator::DefaultBackend()));
+
+  // Updates of all sizes, so that some start or end in the middle of a block.
+  brillo::Blob data = MakeData(100 * 1000);
+  brillo::Blob expected_hash = OpenSSLHash(data);
+  for (HashCalculator::Backend backend : SupportedBackends()) {
+    HashCalculator calc(backend);
+    size_t offset = 0;
+    for (size_t size = 0; offset + size <= data.size(); size++) {
+      EXPECT_TRUE(calc.Update(data.data() + offset, size));
+      offset += size;
+    }
+    EXPECT_TRUE(calc.Update(data.data() + offset, data.size() - offset));
+    EXPECT_TRUE(calc.Finalize());
+    EXPECT_EQ(expected_hash, calc.raw_hash());
+  }
+}
+
+TEST_F(HashCalculatorTest, ContextBackendsTest) {
+  // The context saved with a backend can be restored with any other.
+  brillo::Blob data = MakeData(1000);
+  brillo::Blob expected_hash = OpenSSLHash(data);
+  for (HashCalculator::Backend backend : SupportedBackends()) {
+    for (HashCalculator::Backend next_backend : SupportedBackends()) {
+      HashCalculator calc(backend);
+      EXPECT_TRUE(calc.Update(data.data(), 300));
+      HashCalculator calc_next(next_backend);
+      EXPECT_TRUE(calc_next.SetContext(calc.GetContext()));
+      EXPECT_TRUE(calc_next.Update(data.data() + 300, data.size() - 300));
+      EXPECT_TRUE(calc_next.Finalize());
+      EXPECT_EQ(expected_hash, calc_next.raw_hash());
+    }
+  }
+}
+
+TEST_F(HashCalculatorTest, UpdateLanesTest) {
+  // Lanes of different lengths, some of them with a partial block buffered,
+  // with every backend, and an odd number of lanes of the same backend.
+  const size_t kLengths[] = {0, 10, 64, 1000, 4096, 5000, 100 * 1000};
+  for (HashCalculator::Backend backend : SupportedBackends()) {
+    vector<brillo::Blob> data;
+    vector<std::unique_ptr<HashCalculator>> calcs;
+    vector<HashCalculator::Lane> lanes;
+    for (size_t i = 0; i < arraysize(kLengths); i++) {
+      data.push_back(MakeData(kLengths[i] + i));
+      calcs.emplace_back(new HashCalculator(backend));
+      EXPECT_TRUE(calcs.back()->Update(data.back().data(), i));
+      lanes.push_back(
+          {calcs.back().get(), data.back().data() + i, kLengths[i]});
+    }
+    EXPECT_TRUE(HashCalculator::UpdateLanes(lanes));
+    for (size_t i = 0; i < calcs.size(); i++) {
+      EXPECT_TRUE(calcs[i]->Finalize());
+      EXPECT_EQ(OpenSSLHash(data[i]), calcs[i]->raw_hash()) << "lane " << i;
+    }
+  }
+
+  // Lanes hashing the same data with different backends.
+  brillo::Blob data = MakeData(10 * 1000);
+  vector<std::unique_ptr<HashCalculator>> calcs;
+  vector<HashCalculator::Lane> lanes;
+  for (HashCalculator::Backend backend : SupportedBackends()) {
+    for (size_t i = 0; i < 2; i++) {
+      calcs.emplace_back(new HashCalculator(backend));
+      lanes.push_back({calcs.back().get(), data.data(), data.size()});
+    }
+  }
+  EXPECT_TRUE(HashCalculator::UpdateLanes(lanes));
+  for (const auto& calc : calcs) {
+    EXPECT_TRUE(calc->Finalize());
+    EXPECT_EQ(OpenSSLHash(data), calc->raw_hash());
+  }
+}
+
+// Compares the throughput of the backends. Run it with
+// --gtest_also_run_disabled_tests.
+TEST_F(HashCalculatorTest, DISABLED_BackendsBenchmark) {
+  const size_t kDataSize = 64 * 1024 * 1024;
+  const size_t kUpdateSize = 128 * 1024;
+  brillo::Blob data = MakeData(kDataSize);
+  for (HashCalculator::Backend backend : SupportedBackends()) {
+    for (size_t num_lanes : {1, 2}) {
+      vector<std::unique_ptr<HashCalculator>> calcs;
+      for (size_t i = 0; i < num_lanes; i++)
+        calcs.emplace_back(new HashCalculator(backend));
+      base::TimeTicks start = base::TimeTicks::Now();
+      for (size_t offset = 0; offset < kDataSize; offset += kUpdateSize) {
+        vector<HashCalculator::Lane> lanes;
+        for (const auto& calc : calcs)
+          lanes.push_back({calc.get(), data.data() + offset, kUpdateSize});
+        EXPECT_TRUE(HashCalculator::UpdateLanes(lanes));
+      }
+      base::TimeDelta elapsed = base::TimeTicks::Now() - start;
+      LOG(INFO) << "Backend " << static_cast<int>(backend) << ", " << num_lanes
+                << " lane(s): "
+                << kDataSize * num_lanes / 1024 / 1024 / elapsed.InSecondsF()
+                << " MiB/s";
+    }
+  }
+}
+
 TEST_F(HashCalculatorTest, UpdateFileSimpleTest) {
   string data_path;
   ASSERT_TRUE(
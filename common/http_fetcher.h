@@ -24,9 +24,11 @@
 #include <base/callback.h>
 #include <base/logging.h>
 #include <base/macros.h>
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/common/http_common.h"
+#include "update_engine/common/token_bucket.h"
 #include "update_engine/proxy_resolver.h"
 
 // This class is a simple wrapper around an HTTP library (libcurl). We can
@@ -127,9 +129,27 @@ class HttpFetcher {
   // Sets the number of allowed retries.
   virtual void set_max_retry_count(int max_retry_count) = 0;
 
+  // Limits the download rate to the tokens of |rate_limiter|, which may be
+  // shared by several fetchers and whose rate can be changed while
+  // downloading. The transfer is paused while the bucket is in debt. Pass
+  // nullptr to remove the limit. |rate_limiter| isn't owned.
+  virtual void set_rate_limiter(TokenBucket* rate_limiter) {}
+
   // Get the total number of bytes downloaded by fetcher.
   virtual size_t GetBytesDownloaded() = 0;
 
+  // Returns in |bytes_per_second| and |round_trip_time| the throughput and
+  // the round trip time measured on the transfers. Returns false if they
+  // weren't measured yet.
+  virtual bool GetThroughputEstimate(int64_t* bytes_per_second,
+                                     base::TimeDelta* round_trip_time) {
+    return false;
+  }
+
+  // Returns whether the data is read from local storage, as fast as the
+  // delegate consumes it, so there is no point buffering it ahead.
+  virtual bool IsLocal() const { return false; }
+
   ProxyResolver* proxy_resolver() const { return proxy_resolver_; }
 
  protected:
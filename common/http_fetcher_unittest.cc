@@ -485,6 +485,37 @@ TYPED_TEST(HttpFetcherTest, SimpleBigTest) {
   EXPECT_EQ(0, delegate.times_transfer_terminated_called_);
 }
 
+// The connections to the server are shared by all the fetchers and may outlive
+// the one that opened them. The next fetcher must still be able to use them,
+// and no socket may be left watched on the message loop once a fetcher is gone.
+TYPED_TEST(HttpFetcherTest, SequentialFetchersTest) {
+  if (this->test_.IsMock() || !this->test_.IsHttpSupported())
+    return;
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  // The second fetcher is created first so the connections opened by the first
+  // one are kept after it is destroyed.
+  unique_ptr<HttpFetcher> first_fetcher(this->test_.NewLargeFetcher());
+  unique_ptr<HttpFetcher> second_fetcher(this->test_.NewLargeFetcher());
+  for (unique_ptr<HttpFetcher>* fetcher : {&first_fetcher, &second_fetcher}) {
+    HttpFetcherTestDelegate delegate;
+    (*fetcher)->set_delegate(&delegate);
+    this->loop_.PostTask(FROM_HERE, base::Bind(
+        StartTransfer,
+        fetcher->get(),
+        this->test_.BigUrl(server->GetPort())));
+    this->loop_.Run();
+    EXPECT_EQ(1, delegate.times_transfer_complete_called_);
+    EXPECT_EQ(0, delegate.times_transfer_terminated_called_);
+    EXPECT_EQ(static_cast<size_t>(kBigLength), delegate.data.size());
+
+    fetcher->reset();
+    EXPECT_EQ(0, brillo::MessageLoopRunMaxIterations(&this->loop_, 1));
+  }
+}
+
 // Issue #9648: when server returns an error HTTP response, the fetcher needs to
 // terminate transfer prematurely, rather than try to process the error payload.
 TYPED_TEST(HttpFetcherTest, ErrorTest) {
@@ -1264,6 +1295,81 @@ TYPED_TEST(HttpFetcherTest, MultiHttpFetcherErrorIfOffsetUnrecoverableTest) {
             kHttpResponseUndefined);
 }
 
+namespace {
+// This HttpFetcherDelegate pauses the transfer after every call to
+// ReceivedBytes and resumes it from the message loop.
+class ParallelHttpFetcherTestDelegate : public HttpFetcherDelegate {
+ public:
+  void ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    EXPECT_EQ(fetcher, fetcher_.get());
+    data.append(reinterpret_cast<const char*>(bytes), length);
+    fetcher->Pause();
+    MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&ParallelHttpFetcherTestDelegate::Unpause,
+                   base::Unretained(this)));
+  }
+
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    EXPECT_EQ(fetcher, fetcher_.get());
+    EXPECT_TRUE(successful);
+    // Destroy the fetcher (because we're allowed to).
+    fetcher_.reset(nullptr);
+    MessageLoop::current()->BreakLoop();
+  }
+
+  void TransferTerminated(HttpFetcher* fetcher) override {
+    ADD_FAILURE();
+  }
+
+  void Unpause() {
+    if (fetcher_)
+      fetcher_->Unpause();
+  }
+
+  unique_ptr<HttpFetcher> fetcher_;
+  string data;
+};
+}  // namespace
+
+// Downloads the ranges in chunks over several connections, which receive
+// them out of order, and checks that the delegate still receives them in
+// order.
+TEST(MultiRangeHttpFetcherParallelTest, ReorderedChunksTest) {
+  base::MessageLoopForIO base_loop;
+  brillo::BaseMessageLoop loop(&base_loop);
+  loop.SetAsCurrent();
+
+  string payload;
+  for (int i = 0; i < 200000; i++)
+    payload += static_cast<char>('a' + (i * 7 + i / 26) % 26);
+
+  ParallelHttpFetcherTestDelegate delegate;
+  MultiRangeHttpFetcher* multi_fetcher = new MultiRangeHttpFetcher(
+      new MockHttpFetcher(payload.data(), payload.size(), nullptr));
+  delegate.fetcher_.reset(multi_fetcher);
+  for (int i = 0; i < 3; i++) {
+    multi_fetcher->AddParallelFetcher(
+        new MockHttpFetcher(payload.data(), payload.size(), nullptr));
+  }
+  multi_fetcher->set_parallel_chunk_size(10000, 30000);
+  multi_fetcher->ClearRanges();
+  multi_fetcher->AddRange(5, 70000);
+  multi_fetcher->AddRange(100000, 95000);
+  multi_fetcher->set_delegate(&delegate);
+
+  MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(StartTransfer, multi_fetcher, string("http://fake_url")));
+  MessageLoop::current()->Run();
+
+  EXPECT_EQ(nullptr, delegate.fetcher_.get());
+  EXPECT_EQ(payload.substr(5, 70000) + payload.substr(100000, 95000),
+            delegate.data);
+}
+
 namespace {
 // This HttpFetcherDelegate calls TerminateTransfer at a configurable point.
 class MultiHttpFetcherTerminateTestDelegate : public HttpFetcherDelegate {
@@ -16,15 +16,24 @@
 
 #include "update_engine/common/multi_range_http_fetcher.h"
 
+#include <base/bind.h>
 #include <base/strings/stringprintf.h>
+#include <base/time/time.h>
 
 #include <algorithm>
 #include <string>
 
 #include "update_engine/common/utils.h"
 
+using brillo::MessageLoop;
+
 namespace chromeos_update_engine {
 
+MultiRangeHttpFetcher::~MultiRangeHttpFetcher() {
+  if (parallel_step_id_ != MessageLoop::kTaskIdNull)
+    MessageLoop::current()->CancelTask(parallel_step_id_);
+}
+
 // Begins the transfer to the specified URL.
 // State change: Stopped -> Downloading
 // (corner case: Stopped -> Stopped for an empty request)
@@ -42,6 +51,10 @@ void MultiRangeHttpFetcher::BeginTransfer(const std::string& url) {
   url_ = url;
   current_index_ = 0;
   bytes_received_this_range_ = 0;
+  if (ShouldTransferInParallel()) {
+    BeginParallelTransfer();
+    return;
+  }
   LOG(INFO) << "starting first transfer";
   base_fetcher_->set_delegate(this);
   StartTransfer();
@@ -49,6 +62,12 @@ void MultiRangeHttpFetcher::BeginTransfer(const std::string& url) {
 
 // State change: Downloading -> Pending transfer ended
 void MultiRangeHttpFetcher::TerminateTransfer() {
+  if (parallel_) {
+    terminating_ = true;
+    TerminateConnections();
+    ScheduleParallelTransferStep();
+    return;
+  }
   if (!base_fetcher_active_) {
     LOG(INFO) << "Called TerminateTransfer but not active.";
     // Note that after the callback returns this object may be destroyed.
@@ -89,6 +108,10 @@ void MultiRangeHttpFetcher::StartTransfer() {
 void MultiRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
                                           const void* bytes,
                                           size_t length) {
+  if (parallel_) {
+    ParallelReceivedBytes(fetcher, bytes, length);
+    return;
+  }
   CHECK_LT(current_index_, ranges_.size());
   CHECK_EQ(fetcher, base_fetcher_.get());
   CHECK(!pending_transfer_ended_);
@@ -117,6 +140,10 @@ void MultiRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
 // State change: Downloading or Pending transfer ended -> Stopped
 void MultiRangeHttpFetcher::TransferEnded(HttpFetcher* fetcher,
                                           bool successful) {
+  if (parallel_) {
+    ParallelTransferEnded(fetcher);
+    return;
+  }
   CHECK(base_fetcher_active_) << "Transfer ended unexpectedly.";
   CHECK_EQ(fetcher, base_fetcher_.get());
   pending_transfer_ended_ = false;
@@ -177,6 +204,358 @@ void MultiRangeHttpFetcher::Reset() {
   base_fetcher_active_ = pending_transfer_ended_ = terminating_ = false;
   current_index_ = 0;
   bytes_received_this_range_ = 0;
+  parallel_ = parallel_failed_ = paused_ = false;
+  connections_.clear();
+  chunks_.clear();
+  next_chunk_ = head_chunk_ = 0;
+}
+
+bool MultiRangeHttpFetcher::ShouldTransferInParallel() const {
+  if (!parallel_transfers_ || parallel_fetchers_.empty())
+    return false;
+  uint64_t total_length = 0;
+  for (const Range& range : ranges_) {
+    if (!range.HasLength())
+      return false;
+    total_length += range.length();
+  }
+  return total_length > parallel_chunk_size_;
+}
+
+void MultiRangeHttpFetcher::BeginParallelTransfer() {
+  chunks_.clear();
+  uint64_t stream_offset = 0;
+  for (const Range& range : ranges_) {
+    for (size_t chunk_offset = 0; chunk_offset < range.length();
+         chunk_offset += parallel_chunk_size_) {
+      Chunk chunk;
+      chunk.offset = range.offset() + chunk_offset;
+      chunk.length =
+          std::min(parallel_chunk_size_, range.length() - chunk_offset);
+      chunk.stream_offset = stream_offset;
+      chunk.starts_range = chunk_offset == 0;
+      chunk.bytes_received = 0;
+      chunk.bytes_delivered = 0;
+      stream_offset += chunk.length;
+      chunks_.push_back(std::move(chunk));
+    }
+  }
+
+  connections_.clear();
+  connections_.push_back({base_fetcher_.get(), false, false, false, 0});
+  for (const auto& fetcher : parallel_fetchers_)
+    connections_.push_back({fetcher.get(), false, false, false, 0});
+  for (const Connection& connection : connections_)
+    connection.fetcher->set_delegate(this);
+  connections_tuner_.Reset(connections_.size());
+
+  LOG(INFO) << "starting parallel transfer of " << chunks_.size()
+            << " chunks over " << connections_.size() << " connections";
+  parallel_ = true;
+  parallel_failed_ = false;
+  next_chunk_ = head_chunk_ = 0;
+  StartConnections();
+}
+
+void MultiRangeHttpFetcher::StartConnections() {
+  if (paused_ || terminating_ || parallel_failed_)
+    return;
+  size_t active_connections = 0;
+  for (const Connection& connection : connections_) {
+    if (connection.active)
+      active_connections++;
+  }
+  size_t connections_to_use = connections_tuner_.connections();
+  for (Connection& connection : connections_) {
+    if (connection.active)
+      continue;
+    if (next_chunk_ >= chunks_.size() ||
+        active_connections >= connections_to_use) {
+      return;
+    }
+    const Chunk& chunk = chunks_[next_chunk_];
+    // The chunk being passed to the delegate is always started, so the
+    // buffered data can be flushed.
+    if (next_chunk_ != head_chunk_ &&
+        chunk.stream_offset + chunk.length >
+            DeliveredOffset() + max_reorder_size_) {
+      return;
+    }
+    connection.active = true;
+    active_connections++;
+    connection.chunk = next_chunk_++;
+    connection.fetcher->SetOffset(chunk.offset);
+    connection.fetcher->SetLength(chunk.length);
+    connection.fetcher->BeginTransfer(url_);
+  }
+}
+
+void MultiRangeHttpFetcher::TerminateConnections() {
+  for (Connection& connection : connections_) {
+    if (connection.active && !connection.pending_transfer_ended) {
+      connection.pending_transfer_ended = true;
+      connection.fetcher->TerminateTransfer();
+    }
+  }
+}
+
+void MultiRangeHttpFetcher::FlushChunks() {
+  bool advanced = false;
+  while (!paused_ && !terminating_ && !parallel_failed_ &&
+         head_chunk_ < chunks_.size()) {
+    Chunk* chunk = &chunks_[head_chunk_];
+    if (!chunk->buffer.empty()) {
+      brillo::Blob buffer;
+      buffer.swap(chunk->buffer);
+      DeliverBytes(chunk, buffer.data(), buffer.size());
+      continue;
+    }
+    if (chunk->bytes_delivered < chunk->length)
+      break;
+    head_chunk_++;
+    advanced = true;
+  }
+  // More chunks may fit in the reorder window now.
+  if (advanced)
+    ScheduleParallelTransferStep();
+}
+
+void MultiRangeHttpFetcher::DeliverBytes(Chunk* chunk,
+                                         const void* bytes,
+                                         size_t length) {
+  if (chunk->bytes_delivered == 0 && chunk->starts_range && delegate_)
+    delegate_->SeekToOffset(chunk->offset);
+  chunk->bytes_delivered += length;
+  if (delegate_)
+    delegate_->ReceivedBytes(this, bytes, length);
+}
+
+uint64_t MultiRangeHttpFetcher::DeliveredOffset() const {
+  if (head_chunk_ >= chunks_.size()) {
+    return chunks_.empty()
+               ? 0
+               : chunks_.back().stream_offset + chunks_.back().length;
+  }
+  const Chunk& chunk = chunks_[head_chunk_];
+  return chunk.stream_offset + chunk.bytes_delivered;
+}
+
+MultiRangeHttpFetcher::Connection* MultiRangeHttpFetcher::FindConnection(
+    HttpFetcher* fetcher) {
+  for (Connection& connection : connections_) {
+    if (connection.fetcher == fetcher)
+      return &connection;
+  }
+  return nullptr;
+}
+
+bool MultiRangeHttpFetcher::HasActiveConnections() const {
+  for (const Connection& connection : connections_) {
+    if (connection.active)
+      return true;
+  }
+  return false;
+}
+
+void MultiRangeHttpFetcher::ScheduleParallelTransferStep() {
+  if (parallel_step_id_ != MessageLoop::kTaskIdNull)
+    return;
+  parallel_step_id_ = MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&MultiRangeHttpFetcher::ParallelTransferStep,
+                 base::Unretained(this)));
+}
+
+void MultiRangeHttpFetcher::ParallelTransferStep() {
+  parallel_step_id_ = MessageLoop::kTaskIdNull;
+  if (terminating_ || parallel_failed_ || head_chunk_ >= chunks_.size()) {
+    // Waits for all the connections to end before notifying the delegate.
+    if (HasActiveConnections())
+      return;
+    bool terminated = terminating_;
+    bool successful = !parallel_failed_;
+    LOG(INFO) << "Done w/ parallel transfer";
+    Reset();
+    // Note that after the callback returns this object may be destroyed.
+    if (!delegate_)
+      return;
+    if (terminated)
+      delegate_->TransferTerminated(this);
+    else
+      delegate_->TransferComplete(this, successful);
+    return;
+  }
+  StartConnections();
+}
+
+void MultiRangeHttpFetcher::ParallelReceivedBytes(HttpFetcher* fetcher,
+                                                  const void* bytes,
+                                                  size_t length) {
+  Connection* connection = FindConnection(fetcher);
+  CHECK(connection && connection->active);
+  CHECK(!connection->pending_transfer_ended);
+  Chunk* chunk = &chunks_[connection->chunk];
+  size_t next_size = std::min(length, chunk->length - chunk->bytes_received);
+  LOG_IF(WARNING, next_size <= 0) << "Asked to write length <= 0";
+  chunk->bytes_received += next_size;
+  connections_tuner_.BytesReceived(next_size, base::TimeTicks::Now());
+  // Like for the ranges in serial mode, the transfer is terminated once the
+  // whole chunk is received, and the connection is reused for the next chunk
+  // after its TransferTerminated callback. It is marked first so it isn't
+  // paused or terminated by the delegate in the meantime.
+  bool chunk_received = chunk->bytes_received >= chunk->length;
+  if (chunk_received)
+    connection->pending_transfer_ended = true;
+
+  // The chunk being passed to the delegate doesn't need to be buffered.
+  if (connection->chunk == head_chunk_ && chunk->buffer.empty() && !paused_) {
+    DeliverBytes(chunk, bytes, next_size);
+  } else {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    chunk->buffer.insert(chunk->buffer.end(), data, data + next_size);
+  }
+  FlushChunks();
+
+  if (chunk_received)
+    fetcher->TerminateTransfer();
+}
+
+void MultiRangeHttpFetcher::ParallelTransferEnded(HttpFetcher* fetcher) {
+  Connection* connection = FindConnection(fetcher);
+  CHECK(connection && connection->active) << "Transfer ended unexpectedly.";
+  connection->active = false;
+  connection->pending_transfer_ended = false;
+  connection->paused = false;
+  http_response_code_ = fetcher->http_response_code();
+
+  const Chunk& chunk = chunks_[connection->chunk];
+  if (!terminating_ && !parallel_failed_ &&
+      chunk.bytes_received < chunk.length) {
+    LOG(INFO) << "Didn't get enough bytes for chunk " << connection->chunk
+              << ". Ending w/ failure.";
+    parallel_failed_ = true;
+    TerminateConnections();
+  }
+  ScheduleParallelTransferStep();
+}
+
+void MultiRangeHttpFetcher::SetHeader(const std::string& header_name,
+                                      const std::string& header_value) {
+  base_fetcher_->SetHeader(header_name, header_value);
+  for (const auto& fetcher : parallel_fetchers_)
+    fetcher->SetHeader(header_name, header_value);
+}
+
+void MultiRangeHttpFetcher::Pause() {
+  if (!parallel_) {
+    base_fetcher_->Pause();
+    return;
+  }
+  paused_ = true;
+  connections_tuner_.Stopped();
+  for (Connection& connection : connections_) {
+    if (connection.active && !connection.pending_transfer_ended &&
+        !connection.paused) {
+      connection.paused = true;
+      connection.fetcher->Pause();
+    }
+  }
+}
+
+void MultiRangeHttpFetcher::Unpause() {
+  if (!parallel_) {
+    base_fetcher_->Unpause();
+    return;
+  }
+  paused_ = false;
+  for (Connection& connection : connections_) {
+    // The delegate may pause the transfer again while receiving the data.
+    if (paused_)
+      return;
+    if (connection.paused) {
+      connection.paused = false;
+      connection.fetcher->Unpause();
+    }
+  }
+  FlushChunks();
+  ScheduleParallelTransferStep();
+}
+
+void MultiRangeHttpFetcher::set_idle_seconds(int seconds) {
+  base_fetcher_->set_idle_seconds(seconds);
+  for (const auto& fetcher : parallel_fetchers_)
+    fetcher->set_idle_seconds(seconds);
+}
+
+void MultiRangeHttpFetcher::set_retry_seconds(int seconds) {
+  base_fetcher_->set_retry_seconds(seconds);
+  for (const auto& fetcher : parallel_fetchers_)
+    fetcher->set_retry_seconds(seconds);
+}
+
+void MultiRangeHttpFetcher::SetProxies(
+    const std::deque<std::string>& proxies) {
+  base_fetcher_->SetProxies(proxies);
+  for (const auto& fetcher : parallel_fetchers_)
+    fetcher->SetProxies(proxies);
+}
+
+size_t MultiRangeHttpFetcher::GetBytesDownloaded() {
+  size_t bytes_downloaded = base_fetcher_->GetBytesDownloaded();
+  for (const auto& fetcher : parallel_fetchers_)
+    bytes_downloaded += fetcher->GetBytesDownloaded();
+  return bytes_downloaded;
+}
+
+bool MultiRangeHttpFetcher::GetThroughputEstimate(
+    int64_t* bytes_per_second, base::TimeDelta* round_trip_time) {
+  int64_t total_throughput = 0;
+  int64_t total_round_trip_us = 0;
+  int measured_fetchers = 0;
+  auto add_estimate = [&](HttpFetcher* fetcher) {
+    int64_t throughput;
+    base::TimeDelta fetcher_round_trip_time;
+    if (fetcher->GetThroughputEstimate(&throughput,
+                                       &fetcher_round_trip_time)) {
+      total_throughput += throughput;
+      total_round_trip_us += fetcher_round_trip_time.InMicroseconds();
+      measured_fetchers++;
+    }
+  };
+  add_estimate(base_fetcher_.get());
+  for (const auto& fetcher : parallel_fetchers_)
+    add_estimate(fetcher.get());
+  if (measured_fetchers == 0)
+    return false;
+  *bytes_per_second = total_throughput;
+  *round_trip_time = base::TimeDelta::FromMicroseconds(total_round_trip_us /
+                                                       measured_fetchers);
+  return true;
+}
+
+void MultiRangeHttpFetcher::set_low_speed_limit(int low_speed_bps,
+                                                int low_speed_sec) {
+  base_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
+  for (const auto& fetcher : parallel_fetchers_)
+    fetcher->set_low_speed_limit(low_speed_bps, low_speed_sec);
+}
+
+void MultiRangeHttpFetcher::set_connect_timeout(int connect_timeout_seconds) {
+  base_fetcher_->set_connect_timeout(connect_timeout_seconds);
+  for (const auto& fetcher : parallel_fetchers_)
+    fetcher->set_connect_timeout(connect_timeout_seconds);
+}
+
+void MultiRangeHttpFetcher::set_max_retry_count(int max_retry_count) {
+  base_fetcher_->set_max_retry_count(max_retry_count);
+  for (const auto& fetcher : parallel_fetchers_)
+    fetcher->set_max_retry_count(max_retry_count);
+}
+
+void MultiRangeHttpFetcher::set_rate_limiter(TokenBucket* rate_limiter) {
+  base_fetcher_->set_rate_limiter(rate_limiter);
+  for (const auto& fetcher : parallel_fetchers_)
+    fetcher->set_rate_limiter(rate_limiter);
 }
 
 std::string MultiRangeHttpFetcher::Range::ToString() const {
@@ -23,7 +23,10 @@
 #include <utility>
 #include <vector>
 
+#include <brillo/message_loops/message_loop.h>
+
 #include "update_engine/common/http_fetcher.h"
+#include "update_engine/common/throughput_estimator.h"
 
 // This class is a simple wrapper around an HttpFetcher. The client
 // specifies a vector of byte ranges. MultiRangeHttpFetcher will fetch bytes
@@ -33,6 +36,13 @@
 // for the last range specified to have unlimited length, tho it is legal for
 // other entries to have unlimited length.
 
+// When additional fetchers are passed with AddParallelFetcher() and all the
+// ranges have a length, the ranges are instead split in chunks downloaded in
+// parallel, one per fetcher. The chunks received out of order are buffered
+// until all the previous ones were passed to the delegate, which still
+// receives the bytes in order. Fewer connections are only used when the
+// throughput measured with them doesn't drop, see ConnectionCountTuner.
+
 // There are three states a MultiRangeHttpFetcher object will be in:
 // - Stopped (start state)
 // - Downloading
@@ -53,7 +63,7 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
         terminating_(false),
         current_index_(0),
         bytes_received_this_range_(0) {}
-  ~MultiRangeHttpFetcher() override {}
+  ~MultiRangeHttpFetcher() override;
 
   void ClearRanges() { ranges_.clear(); }
 
@@ -66,6 +76,28 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
     ranges_.push_back(Range(offset));
   }
 
+  // Takes ownership of |fetcher|, used as an additional connection to
+  // download the ranges in parallel.
+  void AddParallelFetcher(HttpFetcher* fetcher) {
+    parallel_fetchers_.emplace_back(fetcher);
+  }
+
+  // Whether the fetchers passed to AddParallelFetcher() are used by the next
+  // transfers.
+  void set_parallel_transfers(bool parallel_transfers) {
+    parallel_transfers_ = parallel_transfers;
+  }
+
+  // Sets the size of the chunks downloaded in parallel and the maximum
+  // amount of data received out of order buffered until it can be passed
+  // to the delegate.
+  void set_parallel_chunk_size(size_t chunk_size, size_t max_reorder_size) {
+    CHECK_GT(chunk_size, static_cast<size_t>(0));
+    CHECK_GE(max_reorder_size, chunk_size);
+    parallel_chunk_size_ = chunk_size;
+    max_reorder_size_ = max_reorder_size;
+  }
+
   // HttpFetcher overrides.
   void SetOffset(off_t offset) override;
 
@@ -80,43 +112,37 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   // State change: Downloading -> Pending transfer ended
   void TerminateTransfer() override;
 
+  // The settings below apply to the base fetcher and to the parallel ones.
   void SetHeader(const std::string& header_name,
-                 const std::string& header_value) override {
-    base_fetcher_->SetHeader(header_name, header_value);
-  }
+                 const std::string& header_value) override;
 
-  void Pause() override { base_fetcher_->Pause(); }
+  void Pause() override;
 
-  void Unpause() override { base_fetcher_->Unpause(); }
+  void Unpause() override;
 
   // These functions are overloaded in LibcurlHttp fetcher for testing purposes.
-  void set_idle_seconds(int seconds) override {
-    base_fetcher_->set_idle_seconds(seconds);
-  }
-  void set_retry_seconds(int seconds) override {
-    base_fetcher_->set_retry_seconds(seconds);
-  }
+  void set_idle_seconds(int seconds) override;
+  void set_retry_seconds(int seconds) override;
   // TODO(deymo): Determine if this method should be virtual in HttpFetcher so
   // this call is sent to the base_fetcher_.
-  virtual void SetProxies(const std::deque<std::string>& proxies) {
-    base_fetcher_->SetProxies(proxies);
-  }
+  virtual void SetProxies(const std::deque<std::string>& proxies);
 
-  inline size_t GetBytesDownloaded() override {
-    return base_fetcher_->GetBytesDownloaded();
-  }
+  size_t GetBytesDownloaded() override;
 
-  void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {
-    base_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
-  }
+  // Returns the sum of the throughputs of the fetchers, and the average of
+  // their round trip times.
+  bool GetThroughputEstimate(int64_t* bytes_per_second,
+                             base::TimeDelta* round_trip_time) override;
 
-  void set_connect_timeout(int connect_timeout_seconds) override {
-    base_fetcher_->set_connect_timeout(connect_timeout_seconds);
-  }
+  bool IsLocal() const override { return base_fetcher_->IsLocal(); }
 
-  void set_max_retry_count(int max_retry_count) override {
-    base_fetcher_->set_max_retry_count(max_retry_count);
-  }
+  void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override;
+
+  void set_connect_timeout(int connect_timeout_seconds) override;
+
+  void set_max_retry_count(int max_retry_count) override;
+
+  void set_rate_limiter(TokenBucket* rate_limiter) override;
 
  private:
   // A range object defining the offset and length of a download chunk.  Zero
@@ -141,9 +167,74 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   typedef std::vector<Range> RangesVect;
 
+  // A piece of a range downloaded by one of the |connections_| in parallel
+  // mode.
+  struct Chunk {
+    off_t offset;
+    size_t length;
+    // The offset of the chunk in the data passed to the delegate.
+    uint64_t stream_offset;
+    // Whether the chunk is the first one of its range, so the delegate is
+    // told to seek before receiving it.
+    bool starts_range;
+    size_t bytes_received;
+    size_t bytes_delivered;
+    // The bytes received but not passed to the delegate yet, because the
+    // previous chunks weren't.
+    brillo::Blob buffer;
+  };
+
+  // One of the fetchers used in parallel mode.
+  struct Connection {
+    HttpFetcher* fetcher;
+    // Whether the fetcher is downloading |chunk|, until its transfer ended.
+    bool active;
+    bool pending_transfer_ended;
+    bool paused;
+    size_t chunk;
+  };
+
   // State change: Stopped or Downloading -> Downloading
   void StartTransfer();
 
+  // Returns whether the ranges are split in chunks downloaded in parallel.
+  bool ShouldTransferInParallel() const;
+
+  // State change: Stopped -> Downloading
+  void BeginParallelTransfer();
+
+  // Starts the download of the next chunks on the idle connections, as long
+  // as they are within |max_reorder_size_| bytes of the data passed to the
+  // delegate.
+  void StartConnections();
+
+  // Terminates the transfers of all the active connections.
+  void TerminateConnections();
+
+  // Passes the buffered data of the next chunks to the delegate, in order.
+  void FlushChunks();
+
+  // Passes |length| bytes of |chunk| to the delegate.
+  void DeliverBytes(Chunk* chunk, const void* bytes, size_t length);
+
+  // Returns the offset of the next byte to pass to the delegate, in the data
+  // of all the ranges.
+  uint64_t DeliveredOffset() const;
+
+  Connection* FindConnection(HttpFetcher* fetcher);
+  bool HasActiveConnections() const;
+
+  // Starts the next chunks or ends the parallel transfer from the message
+  // loop, so that the delegate is never notified from a callback of one of
+  // the fetchers.
+  void ScheduleParallelTransferStep();
+  void ParallelTransferStep();
+
+  void ParallelReceivedBytes(HttpFetcher* fetcher,
+                             const void* bytes,
+                             size_t length);
+  void ParallelTransferEnded(HttpFetcher* fetcher);
+
   // HttpFetcherDelegate overrides.
   // State change: Downloading -> Downloading or Pending transfer ended
   void ReceivedBytes(HttpFetcher* fetcher,
@@ -176,6 +267,27 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   RangesVect::size_type current_index_;  // index into ranges_
   size_t bytes_received_this_range_;
 
+  // The additional fetchers used in parallel mode.
+  std::vector<std::unique_ptr<HttpFetcher>> parallel_fetchers_;
+  bool parallel_transfers_{true};
+  size_t parallel_chunk_size_{1024 * 1024};  // 1 MiB
+  size_t max_reorder_size_{8 * 1024 * 1024};  // 8 MiB
+
+  // Whether the current transfer is done in parallel, and its state.
+  bool parallel_{false};
+  std::vector<Connection> connections_;
+  // Picks how many of the |connections_| download chunks at once.
+  ConnectionCountTuner connections_tuner_;
+  std::vector<Chunk> chunks_;
+  // The next chunk to download, and the one being passed to the delegate.
+  size_t next_chunk_{0};
+  size_t head_chunk_{0};
+  // Whether the transfer of a chunk failed.
+  bool parallel_failed_{false};
+  bool paused_{false};
+  brillo::MessageLoop::TaskId parallel_step_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
   DISALLOW_COPY_AND_ASSIGN(MultiRangeHttpFetcher);
 };
 
@@ -0,0 +1,202 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/sha256_x86.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif  // defined(__x86_64__) || defined(__i386__)
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The functions using the SHA extensions are built for them regardless of the
+// compiler flags, and only called after checking the CPU supports them.
+#define SHA256_X86_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+namespace {
+
+alignas(16) const uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+// The hash state of a lane, with the words rearranged as the round
+// instructions use them, and the message schedule of the current block.
+struct Lane {
+  __m128i abef;
+  __m128i cdgh;
+  __m128i msg[4];
+};
+
+// The helpers below are always inlined so the lanes stay in registers.
+#define SHA256_X86_INLINE SHA256_X86_TARGET inline __attribute__((always_inline))
+
+SHA256_X86_INLINE void LoadState(const uint32_t state[8], Lane* lane) {
+  __m128i dcba = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+  __m128i hgfe = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4));
+  __m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+  __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+  lane->abef = _mm_alignr_epi8(cdab, efgh, 8);
+  lane->cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+}
+
+SHA256_X86_INLINE void StoreState(const Lane& lane, uint32_t state[8]) {
+  __m128i feba = _mm_shuffle_epi32(lane.abef, 0x1B);
+  __m128i dchg = _mm_shuffle_epi32(lane.cdgh, 0xB1);
+  __m128i dcba = _mm_blend_epi16(feba, dchg, 0xF0);
+  __m128i hgfe = _mm_alignr_epi8(dchg, feba, 8);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state), dcba);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), hgfe);
+}
+
+// Loads the first 16 words of the message schedule from |block|.
+SHA256_X86_INLINE void LoadBlock(const uint8_t* block, Lane* lane) {
+  const __m128i kByteSwap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  const __m128i* words = reinterpret_cast<const __m128i*>(block);
+  lane->msg[0] = _mm_shuffle_epi8(_mm_loadu_si128(words), kByteSwap);
+  lane->msg[1] = _mm_shuffle_epi8(_mm_loadu_si128(words + 1), kByteSwap);
+  lane->msg[2] = _mm_shuffle_epi8(_mm_loadu_si128(words + 2), kByteSwap);
+  lane->msg[3] = _mm_shuffle_epi8(_mm_loadu_si128(words + 3), kByteSwap);
+}
+
+// Runs rounds 4 * kGroup to 4 * kGroup + 3, computing their message words
+// from the previous ones if needed.
+template <int kGroup>
+SHA256_X86_INLINE void Rounds(Lane* lane) {
+  __m128i* msg = lane->msg;
+  if (kGroup >= 4) {
+    __m128i w = _mm_sha256msg1_epu32(msg[kGroup & 3], msg[(kGroup + 1) & 3]);
+    w = _mm_add_epi32(
+        w, _mm_alignr_epi8(msg[(kGroup + 3) & 3], msg[(kGroup + 2) & 3], 4));
+    msg[kGroup & 3] = _mm_sha256msg2_epu32(w, msg[(kGroup + 3) & 3]);
+  }
+  __m128i wk = _mm_add_epi32(
+      msg[kGroup & 3],
+      _mm_load_si128(
+          reinterpret_cast<const __m128i*>(kRoundConstants + 4 * kGroup)));
+  lane->cdgh = _mm_sha256rnds2_epu32(lane->cdgh, lane->abef, wk);
+  lane->abef = _mm_sha256rnds2_epu32(
+      lane->abef, lane->cdgh, _mm_shuffle_epi32(wk, 0x0E));
+}
+
+// Runs the rounds from group kGroup on, alternating between the kLanes
+// |lanes| after each group.
+template <int kGroup, size_t kLanes>
+struct RoundGroups {
+  static SHA256_X86_INLINE void Run(Lane* lanes) {
+    for (size_t i = 0; i < kLanes; i++)
+      Rounds<kGroup>(&lanes[i]);
+    RoundGroups<kGroup + 1, kLanes>::Run(lanes);
+  }
+};
+
+template <size_t kLanes>
+struct RoundGroups<16, kLanes> {
+  static SHA256_X86_INLINE void Run(Lane* lanes) {}
+};
+
+// Hashes |num_blocks| blocks of each of the kLanes |data| into the
+// corresponding |states|.
+template <size_t kLanes>
+SHA256_X86_INLINE void HashBlocks(uint32_t* const states[kLanes],
+                                  const uint8_t* const data[kLanes],
+                                  size_t num_blocks) {
+  Lane lanes[kLanes];
+  for (size_t i = 0; i < kLanes; i++)
+    LoadState(states[i], &lanes[i]);
+  for (size_t block = 0; block < num_blocks; block++) {
+    __m128i abef[kLanes], cdgh[kLanes];
+    for (size_t i = 0; i < kLanes; i++) {
+      abef[i] = lanes[i].abef;
+      cdgh[i] = lanes[i].cdgh;
+      LoadBlock(data[i] + block * 64, &lanes[i]);
+    }
+    RoundGroups<0, kLanes>::Run(lanes);
+    for (size_t i = 0; i < kLanes; i++) {
+      lanes[i].abef = _mm_add_epi32(lanes[i].abef, abef[i]);
+      lanes[i].cdgh = _mm_add_epi32(lanes[i].cdgh, cdgh[i]);
+    }
+  }
+  for (size_t i = 0; i < kLanes; i++)
+    StoreState(lanes[i], states[i]);
+}
+
+}  // namespace
+
+bool Sha256X86Supported() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  const bool has_sse = (ecx & bit_SSSE3) && (ecx & bit_SSE4_1);
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  // CPUID.(EAX=7,ECX=0):EBX bit 29 is the SHA extensions.
+  return has_sse && (ebx & (1U << 29));
+}
+
+SHA256_X86_TARGET void Sha256X86Blocks(uint32_t state[8],
+                                       const uint8_t* data,
+                                       size_t num_blocks) {
+  uint32_t* const states[] = {state};
+  const uint8_t* const lane_data[] = {data};
+  HashBlocks<1>(states, lane_data, num_blocks);
+}
+
+SHA256_X86_TARGET void Sha256X86BlocksX2(uint32_t state0[8],
+                                         const uint8_t* data0,
+                                         uint32_t state1[8],
+                                         const uint8_t* data1,
+                                         size_t num_blocks) {
+  uint32_t* const states[] = {state0, state1};
+  const uint8_t* const lane_data[] = {data0, data1};
+  HashBlocks<2>(states, lane_data, num_blocks);
+}
+
+#else  // !(defined(__x86_64__) || defined(__i386__))
+
+bool Sha256X86Supported() {
+  return false;
+}
+
+void Sha256X86Blocks(uint32_t state[8], const uint8_t* data, size_t num_blocks) {
+  NOTREACHED();
+}
+
+void Sha256X86BlocksX2(uint32_t state0[8],
+                       const uint8_t* data0,
+                       uint32_t state1[8],
+                       const uint8_t* data1,
+                       size_t num_blocks) {
+  NOTREACHED();
+}
+
+#endif  // defined(__x86_64__) || defined(__i386__)
+
+}  // namespace chromeos_update_engine
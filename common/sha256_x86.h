@@ -0,0 +1,50 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_SHA256_X86_H_
+#define UPDATE_ENGINE_COMMON_SHA256_X86_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The SHA-256 block function implemented with the x86 SHA extensions
+// (SHA-NI). The |state| arrays hold the eight hash words in the same layout as
+// the |h| field of SHA256_CTX, so they can be used on a context initialized and
+// finalized by OpenSSL.
+
+namespace chromeos_update_engine {
+
+// Returns whether the running CPU supports the SHA extensions and the SSE
+// instructions used along with them. The functions below must only be called
+// if this returns true.
+bool Sha256X86Supported();
+
+// Hashes |num_blocks| 64-byte blocks of |data| into |state|.
+void Sha256X86Blocks(uint32_t state[8], const uint8_t* data, size_t num_blocks);
+
+// Hashes |num_blocks| blocks of |data0| into |state0| and |num_blocks| blocks
+// of |data1| into |state1|. The rounds of both lanes are interleaved, which
+// hides the latency of the round instructions and is faster than two calls to
+// Sha256X86Blocks().
+void Sha256X86BlocksX2(uint32_t state0[8],
+                       const uint8_t* data0,
+                       uint32_t state1[8],
+                       const uint8_t* data1,
+                       size_t num_blocks);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_SHA256_X86_H_
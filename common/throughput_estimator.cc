@@ -0,0 +1,200 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/throughput_estimator.h"
+
+#include <algorithm>
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The minimum duration of the data flow over which a throughput sample is
+// measured, so that the bursts of a single socket read don't count.
+const int kSampleMilliseconds = 1000;
+
+// The weights of the new samples in the moving averages. The round trip time
+// uses the same weight as the TCP smoothed round trip time.
+const double kThroughputWeight = 0.25;
+const double kRoundTripTimeWeight = 0.125;
+
+// A transfer is stalled when it's slower than this fraction of the estimated
+// throughput, or the fixed limit if lower, for this many round trips, or at
+// least this many seconds. A dead link is then detected in seconds rather
+// than minutes, while a slow link isn't held to a limit meant for fast ones.
+const int kLowSpeedThroughputDivisor = 16;
+const int kLowSpeedTimeRoundTrips = 20;
+const int kMinLowSpeedTimeSeconds = 20;
+
+// The first retry waits for this many round trips, or at least this many
+// seconds, doubling with every retry.
+const int kRetryDelayRoundTrips = 4;
+const int kMinRetryDelaySeconds = 1;
+const int kMaxRetryDelayDoublings = 16;
+
+// The duration over which the throughput of a number of parallel connections
+// is measured, long enough to span several chunks per connection. One less
+// connection is kept if it reaches this fraction of the previous throughput.
+const int kConnectionsSampleSeconds = 10;
+const double kMinConnectionsThroughputRatio = 0.95;
+
+}  // namespace
+
+void ThroughputEstimator::Reset() {
+  waiting_response_ = false;
+  measuring_ = false;
+  sample_bytes_ = 0;
+  sample_time_ = TimeDelta();
+  throughput_ = 0;
+  round_trip_time_ = TimeDelta();
+}
+
+void ThroughputEstimator::RequestStarted(TimeTicks now) {
+  AddElapsedTime(now);
+  measuring_ = false;
+  waiting_response_ = true;
+  request_time_ = now;
+}
+
+void ThroughputEstimator::BytesReceived(size_t bytes, TimeTicks now) {
+  if (waiting_response_) {
+    waiting_response_ = false;
+    TimeDelta sample = now - request_time_;
+    if (round_trip_time_.is_zero()) {
+      round_trip_time_ = sample;
+    } else {
+      round_trip_time_ += TimeDelta::FromMicroseconds(static_cast<int64_t>(
+          (sample - round_trip_time_).InMicroseconds() *
+          kRoundTripTimeWeight));
+    }
+  }
+  if (!measuring_) {
+    // The time over which these bytes were received isn't known, so the flow
+    // is only measured from now on.
+    measuring_ = true;
+    last_time_ = now;
+    return;
+  }
+  AddElapsedTime(now);
+  sample_bytes_ += bytes;
+  if (sample_time_.InMilliseconds() < kSampleMilliseconds)
+    return;
+
+  double sample = sample_bytes_ / sample_time_.InSecondsF();
+  if (throughput_ == 0)
+    throughput_ = sample;
+  else
+    throughput_ += (sample - throughput_) * kThroughputWeight;
+  sample_bytes_ = 0;
+  sample_time_ = TimeDelta();
+}
+
+void ThroughputEstimator::Stopped(TimeTicks now) {
+  AddElapsedTime(now);
+  measuring_ = false;
+  // The response may come while the transfer is stopped, so the time until
+  // the next bytes isn't a round trip.
+  waiting_response_ = false;
+}
+
+bool ThroughputEstimator::HasEstimate() const {
+  return throughput_ > 0 && !round_trip_time_.is_zero();
+}
+
+int ThroughputEstimator::GetLowSpeedLimitBps(int max_bps) const {
+  if (!HasEstimate())
+    return max_bps;
+  // A limit of zero would disable the low speed check.
+  int64_t limit = std::max(static_cast<int64_t>(1),
+                           throughput() / kLowSpeedThroughputDivisor);
+  return static_cast<int>(std::min(static_cast<int64_t>(max_bps), limit));
+}
+
+int ThroughputEstimator::GetLowSpeedTimeSeconds(int max_seconds) const {
+  if (!HasEstimate())
+    return max_seconds;
+  int64_t seconds =
+      (round_trip_time_ * kLowSpeedTimeRoundTrips).InSeconds() + 1;
+  return static_cast<int>(std::min(
+      static_cast<int64_t>(max_seconds),
+      std::max(static_cast<int64_t>(kMinLowSpeedTimeSeconds), seconds)));
+}
+
+TimeDelta ThroughputEstimator::GetRetryDelay(int retry_count,
+                                             TimeDelta max_delay) const {
+  if (!HasEstimate())
+    return max_delay;
+  TimeDelta delay =
+      std::max(TimeDelta::FromSeconds(kMinRetryDelaySeconds),
+               round_trip_time_ * kRetryDelayRoundTrips);
+  int doublings =
+      std::min(std::max(retry_count - 1, 0), kMaxRetryDelayDoublings);
+  delay = delay * (static_cast<int64_t>(1) << doublings);
+  return std::min(delay, max_delay);
+}
+
+void ThroughputEstimator::AddElapsedTime(TimeTicks now) {
+  if (!measuring_)
+    return;
+  sample_time_ += now - last_time_;
+  last_time_ = now;
+}
+
+void ConnectionCountTuner::Reset(size_t max_connections) {
+  connections_ = std::max(max_connections, static_cast<size_t>(1));
+  measuring_ = false;
+  sample_bytes_ = 0;
+  previous_throughput_ = 0;
+  settled_ = false;
+}
+
+void ConnectionCountTuner::BytesReceived(size_t bytes, TimeTicks now) {
+  if (!measuring_) {
+    measuring_ = true;
+    sample_start_ = now;
+    sample_bytes_ = 0;
+    return;
+  }
+  sample_bytes_ += bytes;
+  TimeDelta sample_time = now - sample_start_;
+  if (sample_time.InSeconds() < kConnectionsSampleSeconds)
+    return;
+  SampleMeasured(sample_bytes_ / sample_time.InSecondsF());
+  sample_start_ = now;
+  sample_bytes_ = 0;
+}
+
+void ConnectionCountTuner::Stopped() {
+  measuring_ = false;
+}
+
+void ConnectionCountTuner::SampleMeasured(double throughput) {
+  if (previous_throughput_ > 0 &&
+      throughput < previous_throughput_ * kMinConnectionsThroughputRatio) {
+    connections_++;
+    settled_ = true;
+  }
+  previous_throughput_ = 0;
+  if (settled_ || connections_ <= 1)
+    return;
+  previous_throughput_ = throughput;
+  connections_--;
+}
+
+}  // namespace chromeos_update_engine
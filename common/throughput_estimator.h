@@ -0,0 +1,148 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_THROUGHPUT_ESTIMATOR_H_
+#define UPDATE_ENGINE_COMMON_THROUGHPUT_ESTIMATOR_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// Estimates online the throughput and the round trip time of the transfers of
+// one connection, from the bytes received and the time at which they were
+// received. The throughput is only measured while the data is flowing: the
+// time waiting for the response of a request, or while the transfer is
+// stopped, isn't counted. Both estimates are exponentially weighted moving
+// averages, so they follow the changes of the link.
+class ThroughputEstimator {
+ public:
+  ThroughputEstimator() = default;
+
+  // Drops the estimates, e.g. when switching to another server.
+  void Reset();
+
+  // Called when a request is sent. The first bytes received afterwards give a
+  // sample of the round trip time.
+  void RequestStarted(base::TimeTicks now);
+
+  // Called with the number of bytes received at |now|.
+  void BytesReceived(size_t bytes, base::TimeTicks now);
+
+  // Called when the transfer is paused or ended. The flow is measured again
+  // from the next bytes received.
+  void Stopped(base::TimeTicks now);
+
+  // Whether both the throughput and the round trip time were measured.
+  bool HasEstimate() const;
+
+  // The estimated throughput in bytes per second, and round trip time.
+  int64_t throughput() const { return static_cast<int64_t>(throughput_); }
+  base::TimeDelta round_trip_time() const { return round_trip_time_; }
+
+  // Returns the rate, in bytes per second, under which the transfer is
+  // considered stalled: a fraction of the estimated throughput, but never more
+  // than |max_bps|, so that the throughput dips of a bursty link don't abort
+  // transfers the fixed limit would let through.
+  int GetLowSpeedLimitBps(int max_bps) const;
+
+  // Returns for how long the transfer must stay under the low speed limit
+  // before it's aborted: a multiple of the round trip time, but never more
+  // than |max_seconds|.
+  int GetLowSpeedTimeSeconds(int max_seconds) const;
+
+  // Returns how long to wait before the retry number |retry_count| of an
+  // interrupted transfer. The delay starts from a few round trip times and
+  // doubles with every retry, up to |max_delay|.
+  base::TimeDelta GetRetryDelay(int retry_count,
+                                base::TimeDelta max_delay) const;
+
+ private:
+  // Adds the time elapsed since |last_time_| to the current sample, if the
+  // data is flowing.
+  void AddElapsedTime(base::TimeTicks now);
+
+  // Whether a request was sent and no byte was received since then.
+  bool waiting_response_{false};
+  base::TimeTicks request_time_;
+
+  // Whether the data is flowing since |last_time_|.
+  bool measuring_{false};
+  base::TimeTicks last_time_;
+
+  // The bytes received and the time elapsed in the current sample.
+  uint64_t sample_bytes_{0};
+  base::TimeDelta sample_time_;
+
+  // The estimates, zero until measured.
+  double throughput_{0};
+  base::TimeDelta round_trip_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThroughputEstimator);
+};
+
+// Picks how many of the parallel connections of a transfer to use, from the
+// throughput measured over all of them. All the connections are used at
+// first. Once the throughput was measured, one connection less is tried, and
+// only kept if the throughput doesn't drop: the connections of a link limited
+// by the window of each connection, rather than by its bandwidth, are all
+// kept.
+class ConnectionCountTuner {
+ public:
+  ConnectionCountTuner() = default;
+
+  // Starts over using all the |max_connections|.
+  void Reset(size_t max_connections);
+
+  // Called with the number of bytes received over all the connections at
+  // |now|.
+  void BytesReceived(size_t bytes, base::TimeTicks now);
+
+  // Called when the transfer is paused. The throughput is measured again from
+  // the next bytes received.
+  void Stopped();
+
+  // The number of connections to use.
+  size_t connections() const { return connections_; }
+
+ private:
+  // Adjusts |connections_| given the |throughput| measured with them.
+  void SampleMeasured(double throughput);
+
+  size_t connections_{1};
+
+  // Whether the data is flowing since |sample_start_|, and the bytes received
+  // since then.
+  bool measuring_{false};
+  base::TimeTicks sample_start_;
+  uint64_t sample_bytes_{0};
+
+  // The throughput measured with one more connection than |connections_|,
+  // while trying whether it's needed, or 0.
+  double previous_throughput_{0};
+
+  // Whether using fewer connections was found to cost throughput.
+  bool settled_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(ConnectionCountTuner);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_THROUGHPUT_ESTIMATOR_H_
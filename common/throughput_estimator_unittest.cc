@@ -0,0 +1,167 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/throughput_estimator.h"
+
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+class ThroughputEstimatorTest : public ::testing::Test {
+ protected:
+  // Receives |bytes_per_second| during |seconds|, in ten writes per second.
+  void Receive(int64_t bytes_per_second, int seconds) {
+    for (int i = 0; i < seconds * 10; i++) {
+      now_ += TimeDelta::FromMilliseconds(100);
+      estimator_.BytesReceived(bytes_per_second / 10, now_);
+    }
+  }
+
+  // Sends a request answered after |round_trip_ms|.
+  void Request(int round_trip_ms) {
+    estimator_.RequestStarted(now_);
+    now_ += TimeDelta::FromMilliseconds(round_trip_ms);
+    estimator_.BytesReceived(1000, now_);
+  }
+
+  ThroughputEstimator estimator_;
+  TimeTicks now_ = TimeTicks::Now();
+};
+
+TEST_F(ThroughputEstimatorTest, NoEstimateTest) {
+  EXPECT_FALSE(estimator_.HasEstimate());
+  EXPECT_EQ(1, estimator_.GetLowSpeedLimitBps(1));
+  EXPECT_EQ(90, estimator_.GetLowSpeedTimeSeconds(90));
+  EXPECT_EQ(TimeDelta::FromSeconds(20),
+            estimator_.GetRetryDelay(1, TimeDelta::FromSeconds(20)));
+
+  // The round trip time alone isn't enough.
+  Request(100);
+  EXPECT_FALSE(estimator_.HasEstimate());
+}
+
+TEST_F(ThroughputEstimatorTest, EstimateTest) {
+  Request(200);
+  Receive(100000, 5);
+  EXPECT_TRUE(estimator_.HasEstimate());
+  EXPECT_EQ(100000, estimator_.throughput());
+  EXPECT_EQ(TimeDelta::FromMilliseconds(200), estimator_.round_trip_time());
+
+  // The time waiting for the response and the pauses aren't counted.
+  estimator_.Stopped(now_);
+  now_ += TimeDelta::FromSeconds(10);
+  Request(1000);
+  Receive(100000, 5);
+  EXPECT_EQ(100000, estimator_.throughput());
+  EXPECT_EQ(TimeDelta::FromMilliseconds(300), estimator_.round_trip_time());
+
+  // The estimate follows the changes of the link.
+  Receive(10000, 30);
+  EXPECT_NEAR(10000, estimator_.throughput(), 100);
+
+  estimator_.Reset();
+  EXPECT_FALSE(estimator_.HasEstimate());
+}
+
+TEST_F(ThroughputEstimatorTest, LowSpeedLimitTest) {
+  Request(100);
+  Receive(160000, 2);
+  EXPECT_EQ(1, estimator_.GetLowSpeedLimitBps(1));
+  EXPECT_EQ(10000, estimator_.GetLowSpeedLimitBps(25000));
+  // Twenty round trips, but at least 20 seconds.
+  EXPECT_EQ(20, estimator_.GetLowSpeedTimeSeconds(90));
+  EXPECT_EQ(10, estimator_.GetLowSpeedTimeSeconds(10));
+
+  estimator_.Reset();
+  Request(3000);
+  Receive(160000, 2);
+  EXPECT_EQ(61, estimator_.GetLowSpeedTimeSeconds(90));
+}
+
+TEST_F(ThroughputEstimatorTest, ThroughputDipTest) {
+  const int kFixedLimitBps = 4096;
+  Request(100);
+  Receive(1000000, 2);
+  EXPECT_EQ(kFixedLimitBps, estimator_.GetLowSpeedLimitBps(kFixedLimitBps));
+
+  // A bursty link dipping well under a sixteenth of its throughput is still
+  // held to the fixed limit at most, and to a fraction of its new throughput
+  // once the estimate caught up.
+  Receive(2000, 1);
+  EXPECT_EQ(kFixedLimitBps, estimator_.GetLowSpeedLimitBps(kFixedLimitBps));
+  Receive(2000, 30);
+  EXPECT_GT(kFixedLimitBps, estimator_.GetLowSpeedLimitBps(kFixedLimitBps));
+  EXPECT_LE(1, estimator_.GetLowSpeedLimitBps(kFixedLimitBps));
+  EXPECT_EQ(20, estimator_.GetLowSpeedTimeSeconds(90));
+}
+
+TEST_F(ThroughputEstimatorTest, RetryDelayTest) {
+  const TimeDelta kMaxDelay = TimeDelta::FromSeconds(20);
+  Request(500);
+  Receive(100000, 2);
+  EXPECT_EQ(TimeDelta::FromSeconds(2), estimator_.GetRetryDelay(0, kMaxDelay));
+  EXPECT_EQ(TimeDelta::FromSeconds(2), estimator_.GetRetryDelay(1, kMaxDelay));
+  EXPECT_EQ(TimeDelta::FromSeconds(4), estimator_.GetRetryDelay(2, kMaxDelay));
+  EXPECT_EQ(TimeDelta::FromSeconds(16),
+            estimator_.GetRetryDelay(4, kMaxDelay));
+  EXPECT_EQ(kMaxDelay, estimator_.GetRetryDelay(5, kMaxDelay));
+  EXPECT_EQ(kMaxDelay, estimator_.GetRetryDelay(100, kMaxDelay));
+}
+
+class ConnectionCountTunerTest : public ::testing::Test {
+ protected:
+  // Receives during |seconds|, in ten writes per second, at the throughput of
+  // a link delivering |window_bps| per connection used, up to |link_bps|.
+  void Receive(int64_t window_bps, int64_t link_bps, int seconds) {
+    for (int i = 0; i < seconds * 10; i++) {
+      now_ += TimeDelta::FromMilliseconds(100);
+      int64_t bytes_per_second = std::min(
+          link_bps, window_bps * static_cast<int64_t>(tuner_.connections()));
+      tuner_.BytesReceived(bytes_per_second / 10, now_);
+    }
+  }
+
+  ConnectionCountTuner tuner_;
+  TimeTicks now_ = TimeTicks::Now();
+};
+
+// Each connection of a link limited by the window of its connections adds to
+// the throughput, so none is dropped.
+TEST_F(ConnectionCountTunerTest, WindowLimitedLinkTest) {
+  tuner_.Reset(4);
+  EXPECT_EQ(4u, tuner_.connections());
+  Receive(100000, 1000000000, 120);
+  EXPECT_EQ(4u, tuner_.connections());
+}
+
+// The connections beyond those filling the link are dropped.
+TEST_F(ConnectionCountTunerTest, BandwidthLimitedLinkTest) {
+  tuner_.Reset(4);
+  Receive(100000, 200000, 120);
+  EXPECT_EQ(2u, tuner_.connections());
+
+  // The measurement starts over after a pause.
+  tuner_.Stopped();
+  Receive(100000, 200000, 5);
+  EXPECT_EQ(2u, tuner_.connections());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,75 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/token_bucket.h"
+
+#include <algorithm>
+#include <cmath>
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The bucket holds the tokens of this many milliseconds at the rate set, but
+// at least the size of a socket read so the receiver isn't always in debt.
+// A small burst keeps the flow smooth.
+const int kBurstMilliseconds = 250;
+const double kMinBurstSize = 16 * 1024;
+
+}  // namespace
+
+void TokenBucket::SetRate(int64_t bytes_per_second, TimeTicks now) {
+  Refill(now);
+  bool was_limited = IsLimited();
+  rate_ = std::max(bytes_per_second, static_cast<int64_t>(0));
+  if (!was_limited)
+    tokens_ = BurstSize();
+  tokens_ = std::min(tokens_, BurstSize());
+}
+
+void TokenBucket::Consume(size_t bytes, TimeTicks now) {
+  if (!IsLimited())
+    return;
+  Refill(now);
+  tokens_ -= bytes;
+}
+
+TimeDelta TokenBucket::GetDelay(TimeTicks now) {
+  if (!IsLimited())
+    return TimeDelta();
+  Refill(now);
+  if (tokens_ >= 0)
+    return TimeDelta();
+  return TimeDelta::FromMicroseconds(
+      static_cast<int64_t>(std::ceil(-tokens_ * 1000000 / rate_)));
+}
+
+void TokenBucket::Refill(TimeTicks now) {
+  if (IsLimited() && !last_refill_.is_null() && now > last_refill_) {
+    tokens_ = std::min(
+        BurstSize(), tokens_ + (now - last_refill_).InSecondsF() * rate_);
+  }
+  last_refill_ = now;
+}
+
+double TokenBucket::BurstSize() const {
+  return std::max(kMinBurstSize, rate_ * kBurstMilliseconds / 1000.0);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,69 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_TOKEN_BUCKET_H_
+#define UPDATE_ENGINE_COMMON_TOKEN_BUCKET_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// A token bucket limiting the rate of a flow of bytes, which may be shared by
+// several fetchers to cap their total download rate. The bucket fills up at
+// the rate set, up to a small burst, and every byte received takes a token
+// from it. The bytes are received before they can be refused, so the bucket
+// may go into debt: the receiver then waits for GetDelay() before receiving
+// more.
+class TokenBucket {
+ public:
+  TokenBucket() = default;
+
+  // Sets the rate to |bytes_per_second|, or removes the limit if zero. The
+  // rate can be changed at any time, it applies to the bytes received from
+  // then on.
+  void SetRate(int64_t bytes_per_second, base::TimeTicks now);
+
+  int64_t rate() const { return rate_; }
+  bool IsLimited() const { return rate_ > 0; }
+
+  // Takes |bytes| tokens from the bucket, if the rate is limited.
+  void Consume(size_t bytes, base::TimeTicks now);
+
+  // Returns how long to wait before the bucket is out of debt, or zero if
+  // more bytes can be received right away.
+  base::TimeDelta GetDelay(base::TimeTicks now);
+
+ private:
+  // Adds the tokens accumulated since |last_refill_|.
+  void Refill(base::TimeTicks now);
+
+  // The maximum number of tokens the bucket holds.
+  double BurstSize() const;
+
+  int64_t rate_{0};
+  double tokens_{0};
+  base::TimeTicks last_refill_;
+
+  DISALLOW_COPY_AND_ASSIGN(TokenBucket);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_TOKEN_BUCKET_H_
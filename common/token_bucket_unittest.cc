@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/token_bucket.h"
+
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+namespace {
+// With this rate, the bucket holds 16 KiB.
+const int64_t kRate = 64 * 1024;
+const size_t kBurstSize = 16 * 1024;
+}  // namespace
+
+class TokenBucketTest : public ::testing::Test {
+ protected:
+  TokenBucket bucket_;
+  TimeTicks now_ = TimeTicks::Now();
+};
+
+TEST_F(TokenBucketTest, UnlimitedTest) {
+  EXPECT_FALSE(bucket_.IsLimited());
+  bucket_.Consume(100 * 1024 * 1024, now_);
+  EXPECT_EQ(TimeDelta(), bucket_.GetDelay(now_));
+}
+
+TEST_F(TokenBucketTest, DebtTest) {
+  bucket_.SetRate(kRate, now_);
+  EXPECT_TRUE(bucket_.IsLimited());
+  // The bucket starts full.
+  bucket_.Consume(kBurstSize, now_);
+  EXPECT_EQ(TimeDelta(), bucket_.GetDelay(now_));
+
+  bucket_.Consume(kRate / 2, now_);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(500), bucket_.GetDelay(now_));
+  now_ += TimeDelta::FromMilliseconds(250);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(250), bucket_.GetDelay(now_));
+  now_ += TimeDelta::FromMilliseconds(250);
+  EXPECT_EQ(TimeDelta(), bucket_.GetDelay(now_));
+
+  // The tokens don't accumulate past the burst size.
+  now_ += TimeDelta::FromSeconds(10);
+  bucket_.Consume(kBurstSize + kRate, now_);
+  EXPECT_EQ(TimeDelta::FromSeconds(1), bucket_.GetDelay(now_));
+}
+
+TEST_F(TokenBucketTest, ChangeRateTest) {
+  bucket_.SetRate(kRate, now_);
+  bucket_.Consume(kBurstSize + kRate, now_);
+  EXPECT_EQ(TimeDelta::FromSeconds(1), bucket_.GetDelay(now_));
+
+  // The debt is paid at the new rate.
+  bucket_.SetRate(kRate * 4, now_);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(250), bucket_.GetDelay(now_));
+
+  // Removing the limit drops the debt.
+  bucket_.SetRate(0, now_);
+  EXPECT_FALSE(bucket_.IsLimited());
+  EXPECT_EQ(TimeDelta(), bucket_.GetDelay(now_));
+  bucket_.SetRate(kRate, now_);
+  EXPECT_EQ(TimeDelta(), bucket_.GetDelay(now_));
+}
+
+}  // namespace chromeos_update_engine
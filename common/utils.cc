@@ -57,6 +57,7 @@
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 
 using base::Time;
 using base::TimeDelta;
@@ -1034,6 +1035,26 @@ bool GetMinorVersion(const brillo::KeyValueStore& store,
   return false;
 }
 
+google::protobuf::RepeatedPtrField<Extent> CoalesceExtents(
+    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  google::protobuf::RepeatedPtrField<Extent> result;
+  for (const Extent& extent : extents) {
+    if (extent.num_blocks() == 0)
+      continue;
+    if (!result.empty()) {
+      Extent* last = result.Mutable(result.size() - 1);
+      if (last->start_block() != kSparseHole &&
+          extent.start_block() != kSparseHole &&
+          last->start_block() + last->num_blocks() == extent.start_block()) {
+        last->set_num_blocks(last->num_blocks() + extent.num_blocks());
+        continue;
+      }
+    }
+    *result.Add() = extent;
+  }
+  return result;
+}
+
 bool ReadExtents(const string& path, const vector<Extent>& extents,
                  brillo::Blob* out_data, ssize_t out_data_size,
                  size_t block_size) {
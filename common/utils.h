@@ -266,6 +266,12 @@ uint64_t BlocksInExtents(const T& extents) {
   return sum;
 }
 
+// Returns |extents| with the consecutive extents adjacent on disk merged into
+// one, so they can be read or written at once, and the empty extents dropped.
+// The order of the blocks is kept.
+google::protobuf::RepeatedPtrField<Extent> CoalesceExtents(
+    const google::protobuf::RepeatedPtrField<Extent>& extents);
+
 // Converts seconds into human readable notation including days, hours, minutes
 // and seconds. For example, 185 will yield 3m5s, 4300 will yield 1h11m40s, and
 // 360000 will yield 4d4h0m0s.  Zero padding not applied. Seconds are always
@@ -31,6 +31,7 @@
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 
 using std::string;
 using std::vector;
@@ -200,6 +201,34 @@ TEST(UtilsTest, FuzzIntTest) {
   }
 }
 
+TEST(UtilsTest, CoalesceExtentsTest) {
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  auto add_extent = [&extents](uint64_t start_block, uint64_t num_blocks) {
+    Extent* extent = extents.Add();
+    extent->set_start_block(start_block);
+    extent->set_num_blocks(num_blocks);
+  };
+  add_extent(1, 1);
+  add_extent(2, 3);
+  add_extent(7, 0);
+  add_extent(5, 1);
+  add_extent(0, 1);
+  add_extent(kSparseHole, 1);
+  add_extent(kSparseHole, 2);
+  add_extent(9, 2);
+  add_extent(11, 1);
+
+  auto result = utils::CoalesceExtents(extents);
+  const vector<std::pair<uint64_t, uint64_t>> kExpectedExtents = {
+      {1, 5}, {0, 1}, {kSparseHole, 1}, {kSparseHole, 2}, {9, 3}};
+  ASSERT_EQ(kExpectedExtents.size(), static_cast<size_t>(result.size()));
+  for (size_t i = 0; i < kExpectedExtents.size(); i++) {
+    EXPECT_EQ(kExpectedExtents[i].first, result.Get(i).start_block());
+    EXPECT_EQ(kExpectedExtents[i].second, result.Get(i).num_blocks());
+  }
+  EXPECT_EQ(utils::BlocksInExtents(extents), utils::BlocksInExtents(result));
+}
+
 namespace {
 void GetFileFormatTester(const string& expected,
                          const vector<uint8_t>& contents) {
@@ -37,8 +37,10 @@
 #include "update_engine/certificate_checker.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/common/utils.h"
 
 using base::TimeDelta;
+using base::TimeTicks;
 using brillo::MessageLoop;
 using std::max;
 using std::string;
@@ -52,6 +54,10 @@ namespace {
 
 const int kNoNetworkRetrySeconds = 10;
 
+// While the transfer is throttled, the rate limiter is checked at least this
+// often so a change of the rate applies quickly.
+const int kThrottleCheckSeconds = 1;
+
 // libcurl's CURLOPT_SOCKOPTFUNCTION callback function. Called after the socket
 // is created but before it is connected. This callback tags the created socket
 // so the network usage can be tracked in Android.
@@ -69,25 +75,100 @@ int LibcurlSockoptCallback(void* /* clientp */,
 
 }  // namespace
 
+// The handle sharing the DNS cache, the TLS sessions and the connections of
+// all the fetchers, so the requests to the same server don't pay for a new
+// handshake each time, including the retries and the requests of other
+// fetchers. It lives as long as any fetcher: the last one cleans it up,
+// closing the connections it cached. All the fetchers run on the message loop
+// thread, so the handle doesn't need lock functions.
+class LibcurlHttpFetcher::CurlShare {
+ public:
+  // Returns the instance, creating it if needed, and adds a reference to it.
+  static CurlShare* Acquire() {
+    if (!instance_)
+      instance_ = new CurlShare();
+    instance_->ref_count_++;
+    return instance_;
+  }
+
+  // Removes a reference, cleaning up the instance with the last one.
+  void Release() {
+    if (--ref_count_ > 0)
+      return;
+    instance_ = nullptr;
+    delete this;
+  }
+
+  CURLSH* handle() const { return handle_; }
+
+  // Records that |fetcher| watches |fd| from the message loop, or stopped
+  // watching it.
+  void SetSocketFetcher(curl_socket_t fd, LibcurlHttpFetcher* fetcher) {
+    socket_fetchers_[fd] = fetcher;
+  }
+  void ClearSocketFetcher(curl_socket_t fd, LibcurlHttpFetcher* fetcher) {
+    auto it = socket_fetchers_.find(fd);
+    if (it != socket_fetchers_.end() && it->second == fetcher)
+      socket_fetchers_.erase(it);
+  }
+
+  // Returns the fetcher watching |fd|, if any.
+  LibcurlHttpFetcher* GetSocketFetcher(curl_socket_t fd) const {
+    auto it = socket_fetchers_.find(fd);
+    return it == socket_fetchers_.end() ? nullptr : it->second;
+  }
+
+ private:
+  CurlShare() {
+    handle_ = curl_share_init();
+    CHECK(handle_);
+    CHECK_EQ(curl_share_setopt(handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS),
+             CURLSHE_OK);
+    CHECK_EQ(curl_share_setopt(
+                 handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION),
+             CURLSHE_OK);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    // Sharing the connection cache requires libcurl 7.57.0. Older versions
+    // only reuse the connections of the same fetcher.
+    CHECK_EQ(
+        curl_share_setopt(handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT),
+        CURLSHE_OK);
+#endif  // LIBCURL_VERSION_NUM >= 0x073900
+  }
+
+  // Closes the cached connections, which calls LibcurlCloseSocketCallback()
+  // with this instance.
+  ~CurlShare() { CHECK_EQ(curl_share_cleanup(handle_), CURLSHE_OK); }
+
+  static CurlShare* instance_;
+
+  CURLSH* handle_{nullptr};
+  int ref_count_{0};
+
+  // The fetcher watching each socket. The connections are cached after the
+  // transfer that opened them, so a socket may be watched by another fetcher
+  // than the one that opened it, or by none.
+  std::map<curl_socket_t, LibcurlHttpFetcher*> socket_fetchers_;
+
+  DISALLOW_COPY_AND_ASSIGN(CurlShare);
+};
+
+LibcurlHttpFetcher::CurlShare* LibcurlHttpFetcher::CurlShare::instance_ =
+    nullptr;
+
 // static
 int LibcurlHttpFetcher::LibcurlCloseSocketCallback(void* clientp,
                                                    curl_socket_t item) {
 #ifdef __ANDROID__
   qtaguid_untagSocket(item);
 #endif  // __ANDROID__
-  LibcurlHttpFetcher* fetcher = static_cast<LibcurlHttpFetcher*>(clientp);
-  // Stop watching the socket before closing it.
-  for (size_t t = 0; t < arraysize(fetcher->fd_task_maps_); ++t) {
-    const auto fd_task_pair = fetcher->fd_task_maps_[t].find(item);
-    if (fd_task_pair != fetcher->fd_task_maps_[t].end()) {
-      if (!MessageLoop::current()->CancelTask(fd_task_pair->second)) {
-        LOG(WARNING) << "Error canceling the watch task "
-                     << fd_task_pair->second << " for "
-                     << (t ? "writing" : "reading") << " the fd " << item;
-      }
-      fetcher->fd_task_maps_[t].erase(item);
-    }
-  }
+  // Stop watching the socket before closing it. |clientp| is the CurlShare
+  // rather than a fetcher, since the connection may outlive the fetcher that
+  // opened it.
+  CurlShare* curl_share = static_cast<CurlShare*>(clientp);
+  LibcurlHttpFetcher* fetcher = curl_share->GetSocketFetcher(item);
+  if (fetcher)
+    fetcher->StopWatchingSocket(item);
 
   // Documentation for this callback says to return 0 on success or 1 on error.
   if (!IGNORE_EINTR(close(item)))
@@ -97,7 +178,9 @@ int LibcurlHttpFetcher::LibcurlCloseSocketCallback(void* clientp,
 
 LibcurlHttpFetcher::LibcurlHttpFetcher(ProxyResolver* proxy_resolver,
                                        HardwareInterface* hardware)
-    : HttpFetcher(proxy_resolver), hardware_(hardware) {
+    : HttpFetcher(proxy_resolver),
+      hardware_(hardware),
+      curl_share_(CurlShare::Acquire()) {
   // Dev users want a longer timeout (180 seconds) because they may
   // be waiting on the dev server to build an image.
   if (!hardware_->IsOfficialBuild())
@@ -111,6 +194,11 @@ LibcurlHttpFetcher::~LibcurlHttpFetcher() {
       << "Destroying the fetcher while a transfer is in progress.";
   CancelProxyResolution();
   CleanUp();
+  if (curl_multi_handle_) {
+    CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
+    curl_multi_handle_ = nullptr;
+  }
+  curl_share_->Release();
 }
 
 bool LibcurlHttpFetcher::GetProxyType(const string& proxy,
@@ -145,20 +233,42 @@ bool LibcurlHttpFetcher::GetProxyType(const string& proxy,
 void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
   LOG(INFO) << "Starting/Resuming transfer";
   CHECK(!transfer_in_progress_);
+  // The measures of another server don't apply to this one.
+  if (url != url_)
+    throughput_estimator_.Reset();
   url_ = url;
-  curl_multi_handle_ = curl_multi_init();
-  CHECK(curl_multi_handle_);
+  // The multi handle is kept across the transfers so the connections it
+  // cached can be reused by the retries and the next ranges.
+  if (!curl_multi_handle_) {
+    curl_multi_handle_ = curl_multi_init();
+    CHECK(curl_multi_handle_);
+  }
 
   curl_handle_ = curl_easy_init();
   CHECK(curl_handle_);
   ignore_failure_ = false;
 
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_SHARE, curl_share_->handle()),
+           CURLE_OK);
+  // Keeps the idle connections alive between the transfers.
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_TCP_KEEPALIVE, 1L),
+           CURLE_OK);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+  // Negotiates HTTP/2 with the HTTPS servers supporting it, if libcurl was
+  // built with it. Plain HTTP keeps using HTTP/1.1.
+  if (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2) {
+    CHECK_EQ(curl_easy_setopt(
+                 curl_handle_, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS),
+             CURLE_OK);
+  }
+#endif  // LIBCURL_VERSION_NUM >= 0x072f00
+
   // Tag and untag the socket for network usage stats.
   curl_easy_setopt(
       curl_handle_, CURLOPT_SOCKOPTFUNCTION, LibcurlSockoptCallback);
   curl_easy_setopt(
       curl_handle_, CURLOPT_CLOSESOCKETFUNCTION, LibcurlCloseSocketCallback);
-  curl_easy_setopt(curl_handle_, CURLOPT_CLOSESOCKETDATA, this);
+  curl_easy_setopt(curl_handle_, CURLOPT_CLOSESOCKETDATA, curl_share_);
 
   CHECK(HasProxy());
   bool is_direct = (GetCurrentProxy() == kNoProxy);
@@ -245,12 +355,32 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
 
   // If the connection drops under |low_speed_limit_bps_| (10
   // bytes/sec by default) for |low_speed_time_seconds_| (90 seconds,
-  // 180 on non-official builds), reconnect.
+  // 180 on non-official builds), reconnect. Once the link was measured, the
+  // limit is a fraction of its throughput, but never above the fixed one, and
+  // the time a multiple of its round trip time, so a dead link is detected
+  // sooner. The throughput of the link doesn't apply while the download rate
+  // is limited.
+  int low_speed_limit_bps = low_speed_limit_bps_;
+  int low_speed_time_seconds = low_speed_time_seconds_;
+  if (!rate_limiter_ || !rate_limiter_->IsLimited()) {
+    low_speed_limit_bps =
+        throughput_estimator_.GetLowSpeedLimitBps(low_speed_limit_bps_);
+    low_speed_time_seconds =
+        throughput_estimator_.GetLowSpeedTimeSeconds(low_speed_time_seconds_);
+  }
+  if (low_speed_limit_bps != low_speed_limit_bps_ ||
+      low_speed_time_seconds != low_speed_time_seconds_) {
+    LOG(INFO) << "Measured " << throughput_estimator_.throughput()
+              << " bytes/sec with a round trip time of "
+              << throughput_estimator_.round_trip_time().InMilliseconds()
+              << " ms, low speed limit set to " << low_speed_limit_bps
+              << " bytes/sec for " << low_speed_time_seconds << " seconds";
+  }
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_LOW_SPEED_LIMIT,
-                            low_speed_limit_bps_),
+                            low_speed_limit_bps),
            CURLE_OK);
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_LOW_SPEED_TIME,
-                            low_speed_time_seconds_),
+                            low_speed_time_seconds),
            CURLE_OK);
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_CONNECTTIMEOUT,
                             connect_timeout_seconds_),
@@ -289,6 +419,7 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
 
   CHECK_EQ(curl_multi_add_handle(curl_multi_handle_, curl_handle_), CURLM_OK);
   transfer_in_progress_ = true;
+  throughput_estimator_.RequestStarted(TimeTicks::Now());
 }
 
 // Lock down only the protocol in case of HTTP.
@@ -499,12 +630,15 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
       return;
     }
     // Need to restart transfer
-    LOG(INFO) << "Restarting transfer to download the remaining bytes";
+    TimeDelta retry_delay = throughput_estimator_.GetRetryDelay(
+        retry_count_, TimeDelta::FromSeconds(retry_seconds_));
+    LOG(INFO) << "Restarting transfer to download the remaining bytes in "
+              << utils::FormatTimeDelta(retry_delay);
     retry_task_id_ = MessageLoop::current()->PostDelayedTask(
         FROM_HERE,
         base::Bind(&LibcurlHttpFetcher::RetryTimeoutCallback,
                    base::Unretained(this)),
-        TimeDelta::FromSeconds(retry_seconds_));
+        retry_delay);
   } else {
     LOG(INFO) << "Transfer completed (" << http_response_code_
               << "), " << bytes_downloaded_ << " bytes downloaded";
@@ -544,10 +678,15 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void *ptr, size_t size, size_t nmemb) {
     }
   }
   bytes_downloaded_ += payload_size;
+  throughput_estimator_.BytesReceived(payload_size, TimeTicks::Now());
   in_write_callback_ = true;
   if (delegate_)
     delegate_->ReceivedBytes(this, ptr, payload_size);
   in_write_callback_ = false;
+  if (rate_limiter_ && !terminate_requested_) {
+    rate_limiter_->Consume(payload_size, TimeTicks::Now());
+    ThrottleTransfer();
+  }
   return payload_size;
 }
 
@@ -557,6 +696,7 @@ void LibcurlHttpFetcher::Pause() {
     return;
   }
   transfer_paused_ = true;
+  throughput_estimator_.Stopped(TimeTicks::Now());
   if (!transfer_in_progress_) {
     // If pause before we started a connection, we don't need to notify curl
     // about that, we will simply not start the connection later.
@@ -583,6 +723,11 @@ void LibcurlHttpFetcher::Unpause() {
     // anybody. We will simply start the connection once it is time.
     return;
   }
+  if (transfer_throttled_) {
+    // The transfer continues once the rate limiter allows it, see
+    // ThrottleCallback().
+    return;
+  }
   CHECK(curl_handle_);
   CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
   // Since the transfer is in progress, we need to dispatch a CurlPerformOnce()
@@ -641,6 +786,8 @@ void LibcurlHttpFetcher::SetupMessageLoopSources() {
         if (tracked) {
           MessageLoop::current()->CancelTask(fd_task_it->second);
           fd_task_maps_[t].erase(fd_task_it);
+          if (!fd_task_maps_[0].count(fd) && !fd_task_maps_[1].count(fd))
+            curl_share_->ClearSocketFetcher(fd, this);
         }
         continue;
       }
@@ -657,6 +804,7 @@ void LibcurlHttpFetcher::SetupMessageLoopSources() {
           true,  // persistent
           base::Bind(&LibcurlHttpFetcher::CurlPerformOnce,
                      base::Unretained(this)));
+      curl_share_->SetSocketFetcher(fd, this);
 
       static int io_counter = 0;
       io_counter++;
@@ -687,6 +835,46 @@ void LibcurlHttpFetcher::RetryTimeoutCallback() {
   CurlPerformOnce();
 }
 
+void LibcurlHttpFetcher::ThrottleTransfer() {
+  if (transfer_throttled_)
+    return;
+  TimeDelta delay = rate_limiter_->GetDelay(TimeTicks::Now());
+  if (delay.is_zero())
+    return;
+  transfer_throttled_ = true;
+  throughput_estimator_.Stopped(TimeTicks::Now());
+  if (!transfer_paused_) {
+    CHECK(curl_handle_);
+    CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_ALL), CURLE_OK);
+  }
+  throttle_task_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&LibcurlHttpFetcher::ThrottleCallback,
+                 base::Unretained(this)),
+      std::min(delay, TimeDelta::FromSeconds(kThrottleCheckSeconds)));
+}
+
+void LibcurlHttpFetcher::ThrottleCallback() {
+  throttle_task_id_ = MessageLoop::kTaskIdNull;
+  TimeDelta delay;
+  if (rate_limiter_)
+    delay = rate_limiter_->GetDelay(TimeTicks::Now());
+  if (!delay.is_zero()) {
+    throttle_task_id_ = MessageLoop::current()->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&LibcurlHttpFetcher::ThrottleCallback,
+                   base::Unretained(this)),
+        std::min(delay, TimeDelta::FromSeconds(kThrottleCheckSeconds)));
+    return;
+  }
+  transfer_throttled_ = false;
+  if (transfer_paused_ || !transfer_in_progress_)
+    return;
+  CHECK(curl_handle_);
+  CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
+  CurlPerformOnce();
+}
+
 void LibcurlHttpFetcher::TimeoutCallback() {
   // We always re-schedule the callback, even if we don't want to be called
   // anymore. We will remove the event source separately if we don't want to
@@ -709,6 +897,10 @@ void LibcurlHttpFetcher::CleanUp() {
   MessageLoop::current()->CancelTask(timeout_id_);
   timeout_id_ = MessageLoop::kTaskIdNull;
 
+  MessageLoop::current()->CancelTask(throttle_task_id_);
+  throttle_task_id_ = MessageLoop::kTaskIdNull;
+  transfer_throttled_ = false;
+
   for (size_t t = 0; t < arraysize(fd_task_maps_); ++t) {
     for (const auto& fd_taks_pair : fd_task_maps_[t]) {
       if (!MessageLoop::current()->CancelTask(fd_taks_pair.second)) {
@@ -717,6 +909,7 @@ void LibcurlHttpFetcher::CleanUp() {
                      << (t ? "writing" : "reading") << " the fd "
                      << fd_taks_pair.first;
       }
+      curl_share_->ClearSocketFetcher(fd_taks_pair.first, this);
     }
     fd_task_maps_[t].clear();
   }
@@ -733,15 +926,37 @@ void LibcurlHttpFetcher::CleanUp() {
     curl_easy_cleanup(curl_handle_);
     curl_handle_ = nullptr;
   }
-  if (curl_multi_handle_) {
-    CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
-    curl_multi_handle_ = nullptr;
-  }
+  if (transfer_in_progress_)
+    throughput_estimator_.Stopped(TimeTicks::Now());
   transfer_in_progress_ = false;
   transfer_paused_ = false;
   restart_transfer_on_unpause_ = false;
 }
 
+void LibcurlHttpFetcher::StopWatchingSocket(int fd) {
+  for (size_t t = 0; t < arraysize(fd_task_maps_); ++t) {
+    const auto fd_task_pair = fd_task_maps_[t].find(fd);
+    if (fd_task_pair != fd_task_maps_[t].end()) {
+      if (!MessageLoop::current()->CancelTask(fd_task_pair->second)) {
+        LOG(WARNING) << "Error canceling the watch task "
+                     << fd_task_pair->second << " for "
+                     << (t ? "writing" : "reading") << " the fd " << fd;
+      }
+      fd_task_maps_[t].erase(fd_task_pair);
+    }
+  }
+  curl_share_->ClearSocketFetcher(fd, this);
+}
+
+bool LibcurlHttpFetcher::GetThroughputEstimate(int64_t* bytes_per_second,
+                                               TimeDelta* round_trip_time) {
+  if (!throughput_estimator_.HasEstimate())
+    return false;
+  *bytes_per_second = throughput_estimator_.throughput();
+  *round_trip_time = throughput_estimator_.round_trip_time();
+  return true;
+}
+
 void LibcurlHttpFetcher::GetHttpResponseCode() {
   long http_response_code = 0;  // NOLINT(runtime/int) - curl needs long.
   if (base::StartsWith(url_, "file://", base::CompareCase::INSENSITIVE_ASCII)) {
@@ -31,6 +31,7 @@
 #include "update_engine/certificate_checker.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/http_fetcher.h"
+#include "update_engine/common/throughput_estimator.h"
 
 // This is a concrete implementation of HttpFetcher that uses libcurl to do the
 // http work.
@@ -93,6 +94,12 @@ class LibcurlHttpFetcher : public HttpFetcher {
     return static_cast<size_t>(bytes_downloaded_);
   }
 
+  bool GetThroughputEstimate(int64_t* bytes_per_second,
+                             base::TimeDelta* round_trip_time) override;
+
+  // The low speed limit is only used until the throughput of the transfers
+  // is measured, then the limit follows the link. |low_speed_bps| stays the
+  // minimum and |low_speed_sec| the maximum.
   void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {
     low_speed_limit_bps_ = low_speed_bps;
     low_speed_time_seconds_ = low_speed_sec;
@@ -106,11 +113,23 @@ class LibcurlHttpFetcher : public HttpFetcher {
     max_retry_count_ = max_retry_count;
   }
 
+  void set_rate_limiter(TokenBucket* rate_limiter) override {
+    rate_limiter_ = rate_limiter;
+  }
+
  private:
+  // The libcurl share handle of all the fetchers alive, with the fetcher
+  // watching each of its sockets.
+  class CurlShare;
+
   // libcurl's CURLOPT_CLOSESOCKETFUNCTION callback function. Called when
   // closing a socket created with the CURLOPT_OPENSOCKETFUNCTION callback.
+  // |clientp| is the CurlShare of the fetcher that opened the socket.
   static int LibcurlCloseSocketCallback(void* clientp, curl_socket_t item);
 
+  // Stops watching |fd| from the message loop before it is closed.
+  void StopWatchingSocket(int fd);
+
   // Callback for when proxy resolution has completed. This begins the
   // transfer.
   void ProxiesResolved();
@@ -137,6 +156,11 @@ class LibcurlHttpFetcher : public HttpFetcher {
   void TimeoutCallback();
   void RetryTimeoutCallback();
 
+  // Pauses the transfer if |rate_limiter_| is in debt, until the callback
+  // below finds it isn't anymore.
+  void ThrottleTransfer();
+  void ThrottleCallback();
+
   // Calls into curl_multi_perform to let libcurl do its work. Returns after
   // curl_multi_perform is finished, which may actually be after more than
   // one call to curl_multi_perform. This method will set up the message
@@ -159,7 +183,8 @@ class LibcurlHttpFetcher : public HttpFetcher {
   }
 
   // Cleans up the following if they are non-null:
-  // curl(m) handles, fd_task_maps_, timeout_id_.
+  // curl handle, fd_task_maps_, timeout_id_. The curl multi handle, with the
+  // connections it cached, is only cleaned up with the fetcher.
   void CleanUp();
 
   // Force terminate the transfer. This will invoke the delegate's (if any)
@@ -184,6 +209,9 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Hardware interface used to query dev-mode and official build settings.
   HardwareInterface* hardware_;
 
+  // The share handle, referenced for the lifetime of this fetcher.
+  CurlShare* curl_share_;
+
   // Handles for the libcurl library
   CURLM* curl_multi_handle_{nullptr};
   CURL* curl_handle_{nullptr};
@@ -205,6 +233,15 @@ class LibcurlHttpFetcher : public HttpFetcher {
   bool transfer_in_progress_{false};
   bool transfer_paused_{false};
 
+  // Whether the transfer is paused by the rate limiter rather than by the
+  // delegate, and the task checking when to unpause it.
+  bool transfer_throttled_{false};
+  brillo::MessageLoop::TaskId throttle_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
+  // The token bucket limiting the download rate, or nullptr. Not owned.
+  TokenBucket* rate_limiter_{nullptr};
+
   // Whether it should ignore transfer failures for the purpose of retrying the
   // connection.
   bool ignore_failure_{false};
@@ -234,7 +271,8 @@ class LibcurlHttpFetcher : public HttpFetcher {
   int retry_count_{0};
   int max_retry_count_{kDownloadMaxRetryCount};
 
-  // Seconds to wait before retrying a resume.
+  // Seconds to wait before retrying a resume. Once the link is measured, the
+  // retries start sooner and back off up to this delay.
   int retry_seconds_{20};
 
   // When waiting for a retry, the task id of the retry callback.
@@ -263,6 +301,10 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // ServerToCheck::kNone.
   ServerToCheck server_to_check_{ServerToCheck::kNone};
 
+  // Measures the transfers to adapt the low speed limit and the retry delay
+  // to the link. Reset when the URL changes.
+  ThroughputEstimator throughput_estimator_;
+
   int low_speed_limit_bps_{kDownloadLowSpeedLimitBps};
   int low_speed_time_seconds_{kDownloadLowSpeedTimeSeconds};
   int connect_timeout_seconds_{kDownloadConnectTimeoutSeconds};
@@ -0,0 +1,323 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_file_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <base/bind.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/utils.h"
+
+using brillo::MessageLoop;
+using std::min;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The maximum number of bytes passed to the underlying writer at once. This
+// bounds the buffer used to read back spilled data and how long the queued
+// data waits before the caller is notified that the buffer is not full.
+const size_t kMaxWriteSize = 1024 * 1024;  // 1 MiB
+
+}  // namespace
+
+AsyncFileWriter::AsyncFileWriter(FileWriter* writer,
+                                 size_t memory_size,
+                                 size_t spill_size,
+                                 const string& spill_file_template)
+    : writer_(writer),
+      memory_size_(memory_size),
+      spill_size_(spill_size),
+      spill_file_template_(spill_file_template) {
+  DCHECK_GT(memory_size_, 0U);
+}
+
+AsyncFileWriter::~AsyncFileWriter() {
+  Stop();
+}
+
+bool AsyncFileWriter::Init(const base::Closure& callback) {
+  callback_ = callback;
+  ring_.resize(memory_size_);
+
+  if (spill_size_ > 0) {
+    string spill_path;
+    if (utils::MakeTempFile(spill_file_template_, &spill_path, &spill_fd_)) {
+      // The file is only accessed through |spill_fd_|, so make sure it goes
+      // away once closed.
+      unlink(spill_path.c_str());
+    } else {
+      LOG(WARNING) << "Unable to create a spill file, buffering only "
+                   << memory_size_ << " bytes in memory.";
+      spill_fd_ = -1;
+    }
+  }
+
+  TEST_AND_RETURN_FALSE_ERRNO(pipe2(notify_fds_, O_CLOEXEC | O_NONBLOCK) == 0);
+  notify_task_ = MessageLoop::current()->WatchFileDescriptor(
+      FROM_HERE,
+      notify_fds_[0],
+      MessageLoop::WatchMode::kWatchRead,
+      true,
+      base::Bind(&AsyncFileWriter::OnNotifyFdReady, base::Unretained(this)));
+  TEST_AND_RETURN_FALSE(notify_task_ != MessageLoop::kTaskIdNull);
+
+  thread_.reset(new base::DelegateSimpleThread(this, "async-file-writer"));
+  thread_->Start();
+  return true;
+}
+
+bool AsyncFileWriter::Write(const void* bytes, size_t count) {
+  ErrorCode error;
+  return Write(bytes, count, &error);
+}
+
+bool AsyncFileWriter::Write(const void* bytes,
+                            size_t count,
+                            ErrorCode* error) {
+  const uint8_t* data = static_cast<const uint8_t*>(bytes);
+  base::AutoLock auto_lock(lock_);
+  if (failed_) {
+    *error = error_;
+    return false;
+  }
+  while (count > 0) {
+    // Data goes to memory unless older data is waiting in the spill file or
+    // the overflow queue, and to the spill file unless older data is waiting
+    // in the overflow queue.
+    if (spill_queued_ == 0 && overflow_.empty()) {
+      size_t tail = (ring_head_ + ring_size_) % ring_.size();
+      size_t length =
+          min(count, min(ring_.size() - ring_size_, ring_.size() - tail));
+      if (length > 0) {
+        memcpy(ring_.data() + tail, data, length);
+        ring_size_ += length;
+        data += length;
+        count -= length;
+        data_queued_.Signal();
+        continue;
+      }
+    }
+
+    if (spill_fd_ >= 0 && spill_queued_ < spill_size_ && overflow_.empty()) {
+      // The spill file is a ring buffer of |spill_size_| bytes. It is only
+      // written from this thread, and the worker thread only reads the part
+      // queued, so the free part can be written without holding the lock.
+      size_t tail = (spill_head_ + spill_queued_) % spill_size_;
+      size_t length =
+          min(count, min(spill_size_ - spill_queued_, spill_size_ - tail));
+      bool success;
+      {
+        base::AutoUnlock auto_unlock(lock_);
+        success = utils::PWriteAll(spill_fd_, data, length, tail);
+      }
+      if (!success) {
+        PLOG(ERROR) << "Unable to write " << length << " bytes to spill file";
+        *error = ErrorCode::kDownloadWriteError;
+        return false;
+      }
+      spill_queued_ += length;
+      data += length;
+      count -= length;
+      data_queued_.Signal();
+      continue;
+    }
+
+    // There's no room left. Rather than blocking the caller until the worker
+    // thread catches up, keep the rest in memory; the caller stops writing
+    // once IsFull() so this is at most about one write.
+    overflow_.emplace_back(data, data + count);
+    overflow_size_ += count;
+    data_queued_.Signal();
+    break;
+  }
+
+  size_t capacity = memory_size_ + (spill_fd_ >= 0 ? spill_size_ : 0);
+  if (QueuedSize() >= capacity)
+    full_ = true;
+  return true;
+}
+
+int AsyncFileWriter::Close() {
+  Stop();
+  return writer_->Close();
+}
+
+bool AsyncFileWriter::IsFull() {
+  base::AutoLock auto_lock(lock_);
+  return full_;
+}
+
+bool AsyncFileWriter::IsIdle() {
+  base::AutoLock auto_lock(lock_);
+  return !writing_ && QueuedSize() == 0;
+}
+
+bool AsyncFileWriter::Failed(ErrorCode* error) {
+  base::AutoLock auto_lock(lock_);
+  if (failed_)
+    *error = error_;
+  return failed_;
+}
+
+void AsyncFileWriter::Run() {
+  const size_t capacity = memory_size_ + (spill_fd_ >= 0 ? spill_size_ : 0);
+  brillo::Blob spill_buffer;
+
+  base::AutoLock auto_lock(lock_);
+  while (true) {
+    while (!stopping_ && QueuedSize() == 0)
+      data_queued_.Wait();
+    if (stopping_)
+      break;
+
+    // Data in memory is always older than the data in the spill file, which is
+    // older than the data in the overflow queue.
+    const bool from_spill = ring_size_ == 0 && spill_queued_ > 0;
+    const bool from_overflow = ring_size_ == 0 && spill_queued_ == 0;
+    const size_t spill_offset = spill_head_;
+    const uint8_t* data;
+    size_t size;
+    if (from_spill) {
+      size = min(spill_queued_, min(spill_size_ - spill_head_, kMaxWriteSize));
+      spill_buffer.resize(size);
+      data = spill_buffer.data();
+    } else if (from_overflow) {
+      // Write() only appends to |overflow_|, which doesn't move the existing
+      // blobs.
+      const brillo::Blob& blob = overflow_.front();
+      size = min(blob.size() - overflow_head_, kMaxWriteSize);
+      data = blob.data() + overflow_head_;
+    } else {
+      size = min(ring_size_, min(ring_.size() - ring_head_, kMaxWriteSize));
+      data = ring_.data() + ring_head_;
+    }
+
+    writing_ = true;
+    bool success = true;
+    ErrorCode error = ErrorCode::kSuccess;
+    {
+      // The data being written is not modified by Write() until consumed.
+      base::AutoUnlock auto_unlock(lock_);
+      if (from_spill) {
+        ssize_t bytes_read = 0;
+        success = utils::PReadAll(spill_fd_,
+                                  spill_buffer.data(),
+                                  size,
+                                  spill_offset,
+                                  &bytes_read) &&
+                  bytes_read == static_cast<ssize_t>(size);
+        if (!success) {
+          PLOG(ERROR) << "Unable to read " << size << " bytes from spill file";
+          error = ErrorCode::kDownloadWriteError;
+        }
+      }
+      if (success)
+        success = writer_->Write(data, size, &error);
+    }
+    writing_ = false;
+
+    if (from_spill) {
+      spill_head_ = (spill_head_ + size) % spill_size_;
+      spill_queued_ -= size;
+    } else if (from_overflow) {
+      overflow_head_ += size;
+      overflow_size_ -= size;
+      if (overflow_head_ == overflow_.front().size()) {
+        overflow_.pop_front();
+        overflow_head_ = 0;
+      }
+    } else {
+      ring_head_ = (ring_head_ + size) % ring_.size();
+      ring_size_ -= size;
+    }
+
+    if (!success) {
+      failed_ = true;
+      error_ = error;
+      Notify();
+      break;
+    }
+    if (full_ && QueuedSize() <= capacity / 2) {
+      full_ = false;
+      Notify();
+    } else if (full_ || QueuedSize() == 0) {
+      // The caller waits while the buffer is full; let it know about every
+      // write so it can keep checking on the update meanwhile.
+      Notify();
+    }
+  }
+}
+
+uint64_t AsyncFileWriter::QueuedSize() const {
+  return ring_size_ + spill_queued_ + overflow_size_;
+}
+
+void AsyncFileWriter::Stop() {
+  if (thread_) {
+    {
+      base::AutoLock auto_lock(lock_);
+      stopping_ = true;
+      data_queued_.Signal();
+    }
+    thread_->Join();
+    thread_.reset();
+    LOG_IF(INFO, QueuedSize() > 0)
+        << "Discarding " << QueuedSize() << " bytes not yet written";
+  }
+  if (notify_task_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(notify_task_);
+    notify_task_ = MessageLoop::kTaskIdNull;
+  }
+  for (int& fd : notify_fds_) {
+    if (fd >= 0)
+      IGNORE_EINTR(close(fd));
+    fd = -1;
+  }
+  if (spill_fd_ >= 0) {
+    IGNORE_EINTR(close(spill_fd_));
+    spill_fd_ = -1;
+  }
+}
+
+void AsyncFileWriter::Notify() {
+  const char byte = 0;
+  // A full pipe already has a pending notification.
+  if (HANDLE_EINTR(write(notify_fds_[1], &byte, 1)) < 0 && errno != EAGAIN)
+    PLOG(WARNING) << "Unable to notify the async writer progress";
+}
+
+void AsyncFileWriter::OnNotifyFdReady() {
+  char buf[64];
+  while (HANDLE_EINTR(read(notify_fds_[0], buf, sizeof(buf))) > 0) {
+  }
+  // The callback may destroy this object, so run it from a copy and don't
+  // access any member after it returns.
+  base::Closure callback = callback_;
+  callback.Run();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,163 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_FILE_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_FILE_WRITER_H_
+
+#include <deque>
+#include <memory>
+#include <string>
+
+#include <base/callback.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/simple_thread.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_writer.h"
+
+// AsyncFileWriter is a FileWriter that queues the data passed to Write() in a
+// bounded buffer and writes it to another FileWriter from a dedicated thread,
+// so the caller doesn't block while the data is processed.
+
+namespace chromeos_update_engine {
+
+class AsyncFileWriter : public FileWriter,
+                        public base::DelegateSimpleThread::Delegate {
+ public:
+  // Queued data is written to |writer| in order from the worker thread. Up to
+  // |memory_size| bytes are held in a ring buffer in memory; once it is full,
+  // up to |spill_size| more bytes are spilled to a temporary file created from
+  // |spill_file_template| (see utils::MakeTempFile()), used as a ring buffer
+  // too so it never grows past |spill_size|. A |spill_size| of 0 disables
+  // spilling. Data written past that capacity is kept in memory; callers are
+  // expected to stop writing once IsFull() so that it stays small.
+  AsyncFileWriter(FileWriter* writer,
+                  size_t memory_size,
+                  size_t spill_size,
+                  const std::string& spill_file_template);
+  ~AsyncFileWriter() override;
+
+  // Starts the worker thread. Must be called from a thread running a
+  // brillo::MessageLoop, where |callback| is called whenever the worker thread
+  // made progress the caller may be waiting for: some data was written while
+  // the buffer is full (see IsFull()), the buffer stopped being full, all the
+  // queued data was written or a write failed.
+  // Returns whether the worker thread was started.
+  bool Init(const base::Closure& callback);
+
+  // FileWriter overrides. Write() queues the data and returns immediately,
+  // never waiting for the worker thread, even if the buffer is already full.
+  // It fails if a previous write to |writer| failed, setting |error| to the
+  // error of that write, or if the spill file can't be written.
+  bool Write(const void* bytes, size_t count) override;
+  bool Write(const void* bytes, size_t count, ErrorCode* error) override;
+
+  // Stops the worker thread after the current write, if any, completes,
+  // discarding any data still queued, and closes the underlying writer.
+  // Returns the result of closing the underlying writer.
+  int Close() override;
+
+  // Returns whether the queued data reached the buffer capacity. Callers should
+  // stop calling Write() until |callback| is called and this returns false.
+  // Once full, the buffer is reported as full until half of it is drained.
+  bool IsFull();
+
+  // Returns whether all the queued data was written to |writer|.
+  bool IsIdle();
+
+  // Returns whether a write to |writer| failed, setting |error| to the error
+  // code it returned in that case.
+  bool Failed(ErrorCode* error);
+
+  // base::DelegateSimpleThread::Delegate overrides.
+  void Run() override;
+
+ private:
+  // Returns the number of bytes queued. Must be called with |lock_| held.
+  uint64_t QueuedSize() const;
+
+  // Stops the worker thread and releases the resources used to communicate
+  // with it.
+  void Stop();
+
+  // Wakes up the thread running |callback_|. Must be called with |lock_| held.
+  void Notify();
+
+  // Called whenever |notify_fds_[0]| has data available to read.
+  void OnNotifyFdReady();
+
+  // The writer receiving the data, only used from the worker thread.
+  FileWriter* writer_;
+
+  const size_t memory_size_;
+  const size_t spill_size_;
+  const std::string spill_file_template_;
+
+  base::Closure callback_;
+
+  std::unique_ptr<base::DelegateSimpleThread> thread_;
+
+  // Pipe used to wake up the message loop from the worker thread.
+  int notify_fds_[2]{-1, -1};
+  brillo::MessageLoop::TaskId notify_task_{brillo::MessageLoop::kTaskIdNull};
+
+  // Protects all the members below.
+  base::Lock lock_;
+
+  // Signaled when data was queued or the worker thread should stop.
+  base::ConditionVariable data_queued_{&lock_};
+
+  // The in-memory ring buffer, holding |ring_size_| bytes starting at
+  // |ring_head_|. All the data in memory is queued before the data in the
+  // spill file.
+  brillo::Blob ring_;
+  size_t ring_head_{0};
+  size_t ring_size_{0};
+
+  // The spill file, or -1 if spilling is disabled. Like |ring_|, it holds
+  // |spill_queued_| bytes starting at offset |spill_head_|, wrapping around at
+  // |spill_size_|.
+  int spill_fd_{-1};
+  size_t spill_head_{0};
+  size_t spill_queued_{0};
+
+  // The data that didn't fit in |ring_| or the spill file, queued after both.
+  // The first |overflow_head_| bytes of the first blob were already consumed.
+  std::deque<brillo::Blob> overflow_;
+  size_t overflow_head_{0};
+  size_t overflow_size_{0};
+
+  // Whether IsFull() reports the buffer as full.
+  bool full_{false};
+
+  // Whether the worker thread is writing data to |writer_|.
+  bool writing_{false};
+
+  // Whether the worker thread should stop.
+  bool stopping_{false};
+
+  // Whether a write to |writer_| failed and the error it returned.
+  bool failed_{false};
+  ErrorCode error_{ErrorCode::kSuccess};
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncFileWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_FILE_WRITER_H_
@@ -0,0 +1,209 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_file_writer.h"
+
+#include <memory>
+#include <string>
+
+#include <base/bind.h>
+#include <base/message_loop/message_loop.h>
+#include <base/synchronization/waitable_event.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/base_message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// A FileWriter storing the data written to it, whose writes block until
+// Release() is called.
+class BlockingFileWriter : public FileWriter {
+ public:
+  BlockingFileWriter()
+      : released_(base::WaitableEvent::ResetPolicy::MANUAL,
+                  base::WaitableEvent::InitialState::NOT_SIGNALED) {}
+
+  bool Write(const void* bytes, size_t count) override {
+    ErrorCode error;
+    return Write(bytes, count, &error);
+  }
+
+  bool Write(const void* bytes, size_t count, ErrorCode* error) override {
+    released_.Wait();
+    if (fail_) {
+      *error = ErrorCode::kDownloadOperationExecutionError;
+      return false;
+    }
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    data_.insert(data_.end(), data, data + count);
+    return true;
+  }
+
+  int Close() override {
+    closed_ = true;
+    return 0;
+  }
+
+  void Release() { released_.Signal(); }
+  void Block() { released_.Reset(); }
+
+  brillo::Blob data_;
+  bool fail_{false};
+  bool closed_{false};
+
+ private:
+  base::WaitableEvent released_;
+};
+
+}  // namespace
+
+class AsyncFileWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  void InitWriter(size_t memory_size, size_t spill_size) {
+    async_writer_.reset(new AsyncFileWriter(
+        &writer_, memory_size, spill_size, "AsyncFileWriter-XXXXXX"));
+    EXPECT_TRUE(async_writer_->Init(base::Bind(
+        [](int* callback_count) { (*callback_count)++; }, &callback_count_)));
+  }
+
+  // Runs the message loop until |async_writer_| wrote all the queued data.
+  void RunUntilIdle() {
+    brillo::MessageLoopRunUntil(
+        &loop_,
+        TimeDelta::FromSeconds(10),
+        base::Bind([](AsyncFileWriter* writer) { return writer->IsIdle(); },
+                   async_writer_.get()));
+  }
+
+  base::MessageLoopForIO base_loop_;
+  brillo::BaseMessageLoop loop_{&base_loop_};
+
+  BlockingFileWriter writer_;
+  std::unique_ptr<AsyncFileWriter> async_writer_;
+  int callback_count_{0};
+};
+
+TEST_F(AsyncFileWriterTest, WritesInOrderTest) {
+  InitWriter(64, 4096);
+  // Everything past the first 64 bytes is spilled while the writer is blocked.
+  string expected;
+  for (size_t i = 0; i < 40; i++) {
+    string chunk(i + 1, 'a' + i % 26);
+    EXPECT_TRUE(async_writer_->Write(chunk.data(), chunk.size()));
+    expected += chunk;
+  }
+  writer_.Release();
+  RunUntilIdle();
+
+  EXPECT_TRUE(async_writer_->IsIdle());
+  EXPECT_EQ(expected, string(writer_.data_.begin(), writer_.data_.end()));
+  EXPECT_LT(0, callback_count_);
+
+  // Data written after the spill file was drained goes to memory again.
+  EXPECT_TRUE(async_writer_->Write("tail", 4));
+  RunUntilIdle();
+  EXPECT_EQ(expected + "tail",
+            string(writer_.data_.begin(), writer_.data_.end()));
+
+  EXPECT_EQ(0, async_writer_->Close());
+  EXPECT_TRUE(writer_.closed_);
+}
+
+TEST_F(AsyncFileWriterTest, FullTest) {
+  InitWriter(16, 16);
+  brillo::Blob data(40, 'x');
+  EXPECT_TRUE(async_writer_->Write(data.data(), data.size()));
+  EXPECT_TRUE(async_writer_->IsFull());
+  EXPECT_FALSE(async_writer_->IsIdle());
+
+  writer_.Release();
+  RunUntilIdle();
+  EXPECT_FALSE(async_writer_->IsFull());
+  EXPECT_EQ(data, writer_.data_);
+  EXPECT_EQ(0, async_writer_->Close());
+}
+
+TEST_F(AsyncFileWriterTest, WriteWhileFullDoesNotBlockTest) {
+  InitWriter(16, 16);
+  // The writer stays blocked, so these writes would never return if Write()
+  // waited for room in the buffer.
+  string expected;
+  for (char c : {'a', 'b', 'c'}) {
+    string chunk(24, c);
+    EXPECT_TRUE(async_writer_->Write(chunk.data(), chunk.size()));
+    EXPECT_TRUE(async_writer_->IsFull());
+    expected += chunk;
+  }
+
+  // The data past the buffer capacity is written in order after the rest, and
+  // the buffer is used again once it drained.
+  writer_.Release();
+  RunUntilIdle();
+  EXPECT_FALSE(async_writer_->IsFull());
+  EXPECT_TRUE(async_writer_->Write("tail", 4));
+  RunUntilIdle();
+  EXPECT_EQ(expected + "tail",
+            string(writer_.data_.begin(), writer_.data_.end()));
+  EXPECT_EQ(0, async_writer_->Close());
+}
+
+TEST_F(AsyncFileWriterTest, SpillWrapsAroundTest) {
+  InitWriter(16, 32);
+  string expected;
+  for (char c : {'a', 'b'}) {
+    string chunk(c == 'a' ? 36 : 48, c);
+    // The second chunk is spilled after the 20 bytes of the first one spilled
+    // and drained, so it wraps around the end of the spill file.
+    EXPECT_TRUE(async_writer_->Write(chunk.data(), chunk.size()));
+    expected += chunk;
+    writer_.Release();
+    RunUntilIdle();
+    writer_.Block();
+  }
+  EXPECT_EQ(expected, string(writer_.data_.begin(), writer_.data_.end()));
+  EXPECT_EQ(0, async_writer_->Close());
+}
+
+TEST_F(AsyncFileWriterTest, FailedWriteTest) {
+  InitWriter(16, 0);
+  writer_.fail_ = true;
+  writer_.Release();
+  EXPECT_TRUE(async_writer_->Write("data", 4));
+  brillo::MessageLoopRunUntil(
+      &loop_,
+      TimeDelta::FromSeconds(10),
+      base::Bind([](int* callback_count) { return *callback_count > 0; },
+                 &callback_count_));
+
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_TRUE(async_writer_->Failed(&error));
+  EXPECT_EQ(ErrorCode::kDownloadOperationExecutionError, error);
+
+  error = ErrorCode::kSuccess;
+  EXPECT_FALSE(async_writer_->Write("more", 4, &error));
+  EXPECT_EQ(ErrorCode::kDownloadOperationExecutionError, error);
+  EXPECT_EQ(0, async_writer_->Close());
+}
+
+}  // namespace chromeos_update_engine
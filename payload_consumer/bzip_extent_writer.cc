@@ -34,12 +34,11 @@ bool BzipExtentWriter::Init(FileDescriptorPtr fd,
 
   TEST_AND_RETURN_FALSE(rc == BZ_OK);
 
+  output_buffer_.resize(kOutputBufferLength);
   return next_->Init(fd, extents, block_size);
 }
 
 bool BzipExtentWriter::Write(const void* bytes, size_t count) {
-  brillo::Blob output_buffer(kOutputBufferLength);
-
   // Copy the input data into |input_buffer_| only if |input_buffer_| already
   // contains unconsumed data. Otherwise, process the data directly from the
   // source.
@@ -54,18 +53,18 @@ bool BzipExtentWriter::Write(const void* bytes, size_t count) {
   stream_.avail_in = input_end - input;
 
   for (;;) {
-    stream_.next_out = reinterpret_cast<char*>(output_buffer.data());
-    stream_.avail_out = output_buffer.size();
+    stream_.next_out = reinterpret_cast<char*>(output_buffer_.data());
+    stream_.avail_out = output_buffer_.size();
 
     int rc = BZ2_bzDecompress(&stream_);
     TEST_AND_RETURN_FALSE(rc == BZ_OK || rc == BZ_STREAM_END);
 
-    if (stream_.avail_out == output_buffer.size())
+    if (stream_.avail_out == output_buffer_.size())
       break;  // got no new bytes
 
     TEST_AND_RETURN_FALSE(
-        next_->Write(output_buffer.data(),
-                     output_buffer.size() - stream_.avail_out));
+        next_->Write(output_buffer_.data(),
+                     output_buffer_.size() - stream_.avail_out));
 
     if (rc == BZ_STREAM_END)
       CHECK_EQ(stream_.avail_in, 0u);
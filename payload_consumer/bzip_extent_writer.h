@@ -50,6 +50,8 @@ class BzipExtentWriter : public ExtentWriter {
   std::unique_ptr<ExtentWriter> next_;  // The underlying ExtentWriter.
   bz_stream stream_;  // the libbz2 stream
   brillo::Blob input_buffer_;
+  // The buffer the data is decompressed to before being written.
+  brillo::Blob output_buffer_;
 };
 
 }  // namespace chromeos_update_engine
@@ -54,6 +54,16 @@ class CachedFileDescriptor : public FileDescriptor {
                 int* result) override {
     return fd_->BlkIoctl(request, start, length, result);
   }
+  bool CopyRangeFrom(FileDescriptor* source,
+                     uint64_t source_offset,
+                     uint64_t offset,
+                     uint64_t length) override {
+    // The copy must land after the cached writes.
+    return FlushCache() &&
+           fd_->CopyRangeFrom(source, source_offset, offset, length);
+  }
+  // The file may be missing the cached writes.
+  int GetReadFd() override { return -1; }
   bool Flush() override;
   bool Close() override;
   bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
@@ -18,9 +18,13 @@
 
 #include <errno.h>
 #include <linux/fs.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
@@ -32,6 +36,7 @@
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
+#include <base/threading/simple_thread.h>
 #include <base/time/time.h>
 #include <brillo/data_encoding.h>
 #include <bsdiff/bspatch.h>
@@ -49,6 +54,9 @@
 #include "update_engine/payload_consumer/extent_reader.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#if USE_IO_URING
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+#endif
 #include "update_engine/payload_consumer/mount_history.h"
 #if USE_MTD
 #include "update_engine/payload_consumer/mtd_file_descriptor.h"
@@ -71,6 +79,10 @@ const unsigned DeltaPerformer::kProgressLogMaxChunks = 10;
 const unsigned DeltaPerformer::kProgressLogTimeoutSeconds = 30;
 const unsigned DeltaPerformer::kProgressDownloadWeight = 50;
 const unsigned DeltaPerformer::kProgressOperationsWeight = 50;
+const size_t DeltaPerformer::kCheckpointMaxOperations = 100;
+const uint64_t DeltaPerformer::kCheckpointMaxDataSize =
+    8 * 1024 * 1024;  // 8 MiB
+const unsigned DeltaPerformer::kCheckpointIntervalSeconds = 5;
 
 namespace {
 const int kUpdateStateOperationInvalid = -1;
@@ -81,6 +93,70 @@ const int kUbiVolumeAttachTimeout = 5 * 60;
 
 const uint64_t kCacheSize = 1024 * 1024;  // 1MB
 
+// Maximum size of the source blocks kept in memory because they are read
+// more than once.
+const uint64_t kSourceCacheSize = 16 * 1024 * 1024;  // 16 MiB
+
+// Limits on the source data read ahead of the operations by the
+// SourcePrefetcher while their data is downloaded.
+const size_t kMaxPrefetchedOperations = 64;
+const uint64_t kMaxPrefetchedSourceSize = 16 * 1024 * 1024;  // 16 MiB
+
+// Once a source partition matched its hash, one out of this many SOURCE_COPY
+// operations still validates its source while it's applied.
+const int kSourceCopyHashSampleInterval = 16;
+
+// The source partitions are hashed in chunks of this size, and the delegate is
+// polled at this interval while they're checked, so that a canceled update
+// doesn't wait for the whole source to be read.
+const uint64_t kSourceCheckChunkSize = 1024 * 1024;  // 1 MiB
+const int kSourceCheckCancelPollIntervalMs = 100;
+
+// Limits on the cache of puffed source data used by puffin::PuffPatch(). The
+// puffed data is several times larger than the deflated source it comes from,
+// and up to a fraction of the available memory is shared by the operations
+// applied in parallel. See PuffCacheSize().
+const uint64_t kMinPuffCacheSize = 5 * 1024 * 1024;  // 5 MiB
+const uint64_t kMaxPuffCacheSize = 64 * 1024 * 1024;  // 64 MiB
+const uint64_t kPuffCacheSourceRatio = 4;
+const uint64_t kPuffCacheMemoryDivisor = 16;
+
+// Size and alignment of the reads from the source of PUFFDIFF operations.
+const size_t kPuffinReadBufferSize = 256 * 1024;  // 256 KiB
+
+// The source of the diff operations up to this size is read and hashed at once
+// before applying them, larger sources are hashed while the patch reads them.
+const uint64_t kMaxPreloadedSourceSize = 1024 * 1024;  // 1 MiB
+
+#if USE_IO_URING
+// Maximum number of writes in flight on each partition file descriptor.
+const unsigned kIoUringQueueDepth = 16;
+#endif
+
+// Maximum number of worker threads used to apply operations in parallel.
+const long kMaxParallelOperationThreads = 4;  // NOLINT(runtime/int)
+
+// Limits on the operations queued to be applied in parallel, bounding both the
+// memory used to hold their blobs and the work lost if the update is
+// interrupted before they are checkpointed.
+const size_t kMaxParallelOperations = 64;
+const uint64_t kMaxParallelOperationsDataSize = 16 * 1024 * 1024;  // 16 MiB
+
+// The blobs of the operations queued from a Write() call of at least this size
+// aren't copied but point into the written data, such as a chunk of a mapped
+// local payload, and the operations are applied before Write() returns. The
+// batch is then large enough to keep the workers busy.
+const uint64_t kMinUncopiedWriteSize = 4 * 1024 * 1024;  // 4 MiB
+
+// The largest buffer kept allocated after its data was processed, to be reused
+// for the next operations. Full payloads split the data in operations of at
+// most 2 MiB.
+const size_t kMaxRetainedBufferSize = 2 * 1024 * 1024;  // 2 MiB
+
+// REPLACE_BZ and REPLACE_XZ operations with a blob of at least this size are
+// applied while their blob is received, unless it's received all at once.
+const uint64_t kMinStreamedOperationSize = 512 * 1024;  // 512 KiB
+
 FileDescriptorPtr CreateFileDescriptor(const char* path) {
   FileDescriptorPtr ret;
 #if USE_MTD
@@ -102,13 +178,31 @@ FileDescriptorPtr CreateFileDescriptor(const char* path) {
   } else {
     LOG(INFO) << path << " is not an MTD nor a UBI device.";
 #endif
+#if USE_IO_URING
+    if (IoUringFileDescriptor::IsSupported()) {
+      ret.reset(new IoUringFileDescriptor(kIoUringQueueDepth));
+    } else {
+      ret.reset(new EintrSafeFileDescriptor);
+    }
+#else
     ret.reset(new EintrSafeFileDescriptor);
+#endif
 #if USE_MTD
   }
 #endif
   return ret;
 }
 
+// Returns whether |next_operation| is the first operation of the payload and
+// it was partially applied, according to the progress saved in |prefs|.
+bool HasOperationProgress(PrefsInterface* prefs, int64_t next_operation) {
+  int64_t operation_progress = 0;
+  return next_operation == 0 &&
+         prefs->GetInt64(kPrefsUpdateStateOperationProgress,
+                         &operation_progress) &&
+         operation_progress > 0;
+}
+
 // Opens path for read/write. On success returns an open FileDescriptor
 // and sets *err to 0. On failure, sets *err to errno and returns nullptr.
 FileDescriptorPtr OpenFile(const char* path,
@@ -173,6 +267,59 @@ bool DiscardPartitionTail(const FileDescriptorPtr& fd, uint64_t data_size) {
   return false;
 }
 
+// Returns whether any of the |extents| overlaps with the block ranges in
+// |blocks|, a map from the first block of each range to the block past its end.
+bool ExtentsOverlap(const std::map<uint64_t, uint64_t>& blocks,
+                    const RepeatedPtrField<Extent>& extents) {
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole)
+      continue;
+    const uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    auto it = blocks.upper_bound(start);
+    if (it != blocks.end() && it->first < end)
+      return true;
+    if (it != blocks.begin() && std::prev(it)->second > start)
+      return true;
+  }
+  return false;
+}
+
+// Adds the |extents| to the block ranges in |blocks|. See ExtentsOverlap().
+void AddExtents(std::map<uint64_t, uint64_t>* blocks,
+                const RepeatedPtrField<Extent>& extents) {
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole)
+      continue;
+    uint64_t& end = (*blocks)[extent.start_block()];
+    end = std::max(end, extent.start_block() + extent.num_blocks());
+  }
+}
+
+// Adds the |extents| to the block ranges in |blocks|, merging the ranges that
+// overlap or are adjacent, so that each block is in at most one range.
+void MergeExtents(std::map<uint64_t, uint64_t>* blocks,
+                  const RepeatedPtrField<Extent>& extents) {
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole)
+      continue;
+    uint64_t start = extent.start_block();
+    uint64_t end = start + extent.num_blocks();
+    auto it = blocks->upper_bound(start);
+    if (it != blocks->begin() && std::prev(it)->second >= start) {
+      --it;
+      start = it->first;
+      end = std::max(end, it->second);
+      it = blocks->erase(it);
+    }
+    while (it != blocks->end() && it->first <= end) {
+      end = std::max(end, it->second);
+      it = blocks->erase(it);
+    }
+    (*blocks)[start] = end;
+  }
+}
+
 }  // namespace
 
 
@@ -182,6 +329,11 @@ static uint64_t IntRatio(uint64_t part, uint64_t total, uint64_t norm) {
   return part * norm / total;
 }
 
+DeltaPerformer::~DeltaPerformer() {
+  source_prefetcher_.reset();
+  StopOperationWorkers();
+}
+
 void DeltaPerformer::LogProgress(const char* message_prefix) {
   // Format operations total count and percentage.
   string total_operations_str("?");
@@ -282,13 +434,28 @@ size_t DeltaPerformer::CopyDataToBuffer(const char** bytes_p, size_t* count_p,
   const char* bytes_end = bytes_start + read_len;
   buffer_.reserve(max);
   buffer_.insert(buffer_.end(), bytes_start, bytes_end);
+  buffer_data_ = buffer_.data();
+  buffer_size_ = buffer_.size();
   *bytes_p = bytes_end;
   *count_p = count - read_len;
   return read_len;
 }
 
+size_t DeltaPerformer::ReadDataToBuffer(const char** bytes_p, size_t* count_p,
+                                        size_t max) {
+  if (buffer_size_ > 0 || *count_p < max)
+    return CopyDataToBuffer(bytes_p, count_p, max);
+  buffer_data_ = reinterpret_cast<const uint8_t*>(*bytes_p);
+  buffer_size_ = max;
+  *bytes_p += max;
+  *count_p -= max;
+  return max;
+}
+
 
-bool DeltaPerformer::HandleOpResult(bool op_result, const char* op_type_name,
+bool DeltaPerformer::HandleOpResult(bool op_result,
+                                    const char* op_type_name,
+                                    size_t op_num,
                                     ErrorCode* error) {
   if (op_result)
     return true;
@@ -296,8 +463,8 @@ bool DeltaPerformer::HandleOpResult(bool op_result, const char* op_type_name,
   size_t partition_first_op_num =
       current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0;
   LOG(ERROR) << "Failed to perform " << op_type_name << " operation "
-             << next_operation_num_ << ", which is the operation "
-             << next_operation_num_ - partition_first_op_num
+             << op_num << ", which is the operation "
+             << op_num - partition_first_op_num
              << " in partition \""
              << partitions_[current_partition_].partition_name() << "\"";
   if (*error == ErrorCode::kSuccess)
@@ -306,20 +473,56 @@ bool DeltaPerformer::HandleOpResult(bool op_result, const char* op_type_name,
 }
 
 int DeltaPerformer::Close() {
+  // Saves the progress of the operations applied since the last checkpoint,
+  // unless the data of the next operation was already partially consumed and
+  // its progress can't be saved.
+  if (next_operation_num_ > checkpoint_operation_num_ &&
+      buffer_offset_ == applied_buffer_offset_ &&
+      parallel_operations_.empty() && !streaming_writer_) {
+    ErrorCode error;
+    MaybeCheckpointUpdateProgress(true, &error);
+  } else if (CanCheckpointStreamedOperation() &&
+             buffer_offset_ > checkpoint_buffer_offset_) {
+    ErrorCode error;
+    MaybeCheckpointUpdateProgress(true, &error);
+  }
   int err = -CloseCurrentPartition();
   LOG_IF(ERROR, !payload_hash_calculator_.Finalize() ||
                 !signed_hash_calculator_.Finalize())
       << "Unable to finalize the hash.";
-  if (!buffer_.empty()) {
-    LOG(INFO) << "Discarding " << buffer_.size() << " unused downloaded bytes";
+  if (buffer_size_ > 0) {
+    LOG(INFO) << "Discarding " << buffer_size_ << " unused downloaded bytes";
+    if (err >= 0)
+      err = 1;
+  }
+  if (CanCheckpointStreamedOperation() && checkpoint_operation_progress_ > 0 &&
+      checkpoint_buffer_offset_ == buffer_offset_) {
+    // A resumed update will apply the rest of the operation, starting with the
+    // partially written block, which mustn't be padded.
+    LOG(INFO) << "Saved the progress of partially applied operation "
+              << next_operation_num_;
+    streaming_writer_.reset();
+    streaming_hash_calculator_.reset();
+    streaming_operation_ = nullptr;
+  } else if (streaming_writer_) {
+    // The operation wasn't checkpointed, so a resumed update will apply it
+    // again from the start.
+    LOG(INFO) << "Discarding partially applied operation "
+              << next_operation_num_;
+    streaming_writer_->End();
+    streaming_writer_.reset();
+    streaming_hash_calculator_.reset();
+    streaming_operation_ = nullptr;
     if (err >= 0)
       err = 1;
   }
+  DiscardParallelOperations();
   return -err;
 }
 
 int DeltaPerformer::CloseCurrentPartition() {
-  int err = 0;
+  source_prefetcher_.reset();
+  int err = -CloseParallelFileDescriptors();
   if (source_fd_ && !source_fd_->Close()) {
     err = errno;
     PLOG(ERROR) << "Error closing source partition";
@@ -327,6 +530,7 @@ int DeltaPerformer::CloseCurrentPartition() {
       err = 1;
   }
   source_fd_.reset();
+  source_cache_.reset();
   source_path_.clear();
 
   if (target_fd_ && !target_fd_->Close()) {
@@ -363,6 +567,35 @@ bool DeltaPerformer::OpenCurrentPartition() {
       return false;
     }
   }
+  const size_t partition_first_operation =
+      current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0;
+  if (source_fd_ && source_path_ != install_part.target_path) {
+    source_cache_ = std::make_shared<SourceBlockCache>(
+        partition.operations(),
+        next_operation_num_ - partition_first_operation,
+        block_size_,
+        kSourceCacheSize / block_size_);
+    source_fd_ = std::make_shared<SourceCacheFileDescriptor>(source_fd_,
+                                                             source_cache_);
+
+    // The source is only read ahead on a file descriptor of its own, since
+    // |source_fd_| is used by this thread; the operations read it themselves
+    // otherwise.
+    int err;
+    FileDescriptorPtr prefetch_fd =
+        OpenFile(source_path_.c_str(), O_RDONLY, false, &err);
+    if (prefetch_fd) {
+      source_prefetcher_.reset(new SourcePrefetcher(
+          &partition.operations(),
+          next_operation_num_ - partition_first_operation,
+          std::make_shared<SourceCacheFileDescriptor>(prefetch_fd,
+                                                      source_cache_),
+          block_size_,
+          kMaxPrefetchedOperations,
+          kMaxPrefetchedSourceSize));
+      source_prefetcher_->Start();
+    }
+  }
 
   target_path_ = install_part.target_path;
   int err;
@@ -390,9 +623,94 @@ bool DeltaPerformer::OpenCurrentPartition() {
   // Discard the end of the partition, but ignore failures.
   DiscardPartitionTail(target_fd_, install_part.target_size);
 
+  // The partition can only be hashed while it's written if all its operations
+  // are applied by this instance, which isn't the case when resuming.
+  target_hash_calculator_.reset();
+  target_hashed_blocks_ = 0;
+  target_written_blocks_.clear();
+  if (next_operation_num_ == partition_first_operation &&
+      install_part.target_size > 0) {
+    target_hash_calculator_.reset(new HashCalculator());
+  }
+
+  if (!OpenParallelFileDescriptors())
+    CloseParallelFileDescriptors();
+
   return true;
 }
 
+bool DeltaPerformer::OpenParallelFileDescriptors() {
+  // The operations of full payloads only write to the target partition, while
+  // the ones of delta payloads need a source partition other than the one
+  // being written.
+  if (payload_->type != InstallPayloadType::kFull &&
+      (!source_fd_ || source_path_ == target_path_)) {
+    return false;
+  }
+#if USE_MTD
+  // NAND devices can't be opened more than once for writing.
+  if (UbiFileDescriptor::IsUbi(target_path_.c_str()) ||
+      MtdFileDescriptor::IsMtd(target_path_.c_str())) {
+    return false;
+  }
+#endif
+
+  long num_threads = std::min(sysconf(_SC_NPROCESSORS_ONLN),  // NOLINT
+                              kMaxParallelOperationThreads);
+  if (num_threads < 2)
+    return false;
+
+  int flags = O_RDWR;
+  if (!is_interactive_)
+    flags |= O_DSYNC;
+
+  for (long i = 0; i < num_threads; i++) {  // NOLINT(runtime/int)
+    int err;
+    FileDescriptorPtr source_fd;
+    if (source_fd_) {
+      source_fd = OpenFile(source_path_.c_str(), O_RDONLY, false, &err);
+      if (!source_fd)
+        return false;
+      source_fd = std::make_shared<SourceCacheFileDescriptor>(source_fd,
+                                                              source_cache_);
+    }
+    // The worker threads write directly to the target, without a cache, so
+    // nothing is pending on their file descriptors once they are done.
+    FileDescriptorPtr target_fd =
+        OpenFile(target_path_.c_str(), flags, false, &err);
+    if (!target_fd) {
+      if (source_fd)
+        source_fd->Close();
+      return false;
+    }
+    parallel_fds_.emplace_back(source_fd, target_fd);
+  }
+  LOG(INFO) << "Applying independent operations using " << num_threads
+            << " threads.";
+  return true;
+}
+
+int DeltaPerformer::CloseParallelFileDescriptors() {
+  StopOperationWorkers();
+  int err = 0;
+  for (const auto& fds : parallel_fds_) {
+    if (fds.first && !fds.first->Close()) {
+      err = errno;
+      PLOG(ERROR) << "Error closing source partition";
+      if (!err)
+        err = 1;
+    }
+    if (!fds.second->Close()) {
+      err = errno;
+      PLOG(ERROR) << "Error closing target partition";
+      if (!err)
+        err = 1;
+    }
+  }
+  parallel_fds_.clear();
+  return -err;
+}
+
 namespace {
 
 void LogPartitionInfoHash(const PartitionInfo& info, const string& tag) {
@@ -428,6 +746,10 @@ bool DeltaPerformer::IsHeaderParsed() const {
   return metadata_size_ != 0;
 }
 
+uint64_t DeltaPerformer::GetMetadataAndSignatureSize() const {
+  return IsHeaderParsed() ? metadata_size_ + metadata_signature_size_ : 0;
+}
+
 MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
     const brillo::Blob& payload, ErrorCode* error) {
   *error = ErrorCode::kSuccess;
@@ -527,6 +849,23 @@ MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
 // were written, or false on any error, regardless of progress
 // and stores an action exit code in |error|.
 bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
+  // The operations queued with a blob pointing into |bytes| must be applied
+  // before it goes away, or dropped on failure.
+  queue_uncopied_blobs_ = count >= kMinUncopiedWriteSize;
+  bool result = WriteImpl(bytes, count, error);
+  queue_uncopied_blobs_ = false;
+  if (num_uncopied_blobs_ == 0)
+    return result;
+  if (result)
+    result = ApplyParallelOperations(error);
+  if (!result)
+    DiscardParallelOperations();
+  return result;
+}
+
+bool DeltaPerformer::WriteImpl(const void* bytes,
+                               size_t count,
+                               ErrorCode* error) {
   *error = ErrorCode::kSuccess;
   const char* c_bytes = reinterpret_cast<const char*>(bytes);
 
@@ -591,6 +930,9 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
       return false;
     }
 
+    if (!CheckSourcePartitions(error))
+      return false;
+
     if (!OpenCurrentPartition()) {
       *error = ErrorCode::kInstallDeviceOpenError;
       return false;
@@ -608,6 +950,19 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
     if (download_delegate_ && download_delegate_->ShouldCancel(error))
       return false;
 
+    // Index of the next operation to read from the payload, which is past
+    // |next_operation_num_| while there are operations queued.
+    const size_t op_num = next_operation_num_ + parallel_operations_.size();
+
+    // Queued operations never span more than one partition, so apply them
+    // before moving on to the next partition.
+    if (!parallel_operations_.empty() &&
+        op_num >= acc_num_operations_[current_partition_]) {
+      if (!ApplyParallelOperations(error))
+        return false;
+      continue;
+    }
+
     // We know there are more operations to perform because we didn't reach the
     // |num_total_operations_| limit yet.
     while (next_operation_num_ >= acc_num_operations_[current_partition_]) {
@@ -618,41 +973,75 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
         return false;
       }
     }
-    const size_t partition_operation_num = next_operation_num_ - (
+    const size_t partition_operation_num = op_num - (
         current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0);
 
     const InstallOperation& op =
         partitions_[current_partition_].operations(partition_operation_num);
 
-    CopyDataToBuffer(&c_bytes, &count, op.data_length());
+    if (resumed_operation_progress_ > 0 && !ResumeStreamedOperation(op)) {
+      *error = ErrorCode::kDownloadStateInitializationError;
+      return false;
+    }
+
+    if (streaming_writer_ || ShouldStreamOperation(op, count)) {
+      // The operation is applied to |target_fd_| as its blob is received, so
+      // it must be applied after all the queued ones.
+      if (!ApplyParallelOperations(error))
+        return false;
+      if (!StreamOperation(op, &c_bytes, &count, error)) {
+        if (*error == ErrorCode::kSuccess)
+          *error = ErrorCode::kDownloadOperationExecutionError;
+        return false;
+      }
+      // Needs more data to complete the operation.
+      if (streaming_writer_)
+        return MaybeCheckpointStreamedOperation(error);
+
+      OperationApplied(op);
+      next_operation_num_++;
+      UpdateOverallProgress(false, "Completed ");
+      if (!MaybeCheckpointUpdateProgress(false, error))
+        return false;
+      continue;
+    }
+
+    ReadDataToBuffer(&c_bytes, &count, op.data_length());
 
     // Check whether we received all of the next operation's data payload.
     if (!CanPerformInstallOperation(op))
       return true;
 
-    // Validate the operation only if the metadata signature is present.
-    // Otherwise, keep the old behavior. This serves as a knob to disable
-    // the validation logic in case we find some regression after rollout.
-    // NOTE: If hash checks are mandatory and if metadata_signature is empty,
-    // we would have already failed in ParsePayloadMetadata method and thus not
-    // even be here. So no need to handle that case again here.
-    if (!payload_->metadata_signature.empty()) {
-      // Note: Validate must be called only if CanPerformInstallOperation is
-      // called. Otherwise, we might be failing operations before even if there
-      // isn't sufficient data to compute the proper hash.
-      *error = ValidateOperationHash(op);
-      if (*error != ErrorCode::kSuccess) {
-        if (install_plan_->hash_checks_mandatory) {
-          LOG(ERROR) << "Mandatory operation hash check failed";
-          return false;
-        }
+    // Note: Validate must be called only if CanPerformInstallOperation is
+    // called. Otherwise, we might be failing operations before even if there
+    // isn't sufficient data to compute the proper hash.
+    if (!CheckOperationHash(op, error))
+      return false;
 
-        // For non-mandatory cases, just send a UMA stat.
-        LOG(WARNING) << "Ignoring operation validation errors";
-        *error = ErrorCode::kSuccess;
+    if (CanApplyInParallel(op)) {
+      // An operation writing to blocks already written by a queued one must be
+      // applied after it.
+      if (ExtentsOverlap(parallel_dst_blocks_, op.dst_extents()) &&
+          !ApplyParallelOperations(error)) {
+        return false;
+      }
+      if (!QueueParallelOperation(op)) {
+        *error = ErrorCode::kDownloadOperationExecutionError;
+        return false;
+      }
+      if (parallel_operations_.size() >= kMaxParallelOperations ||
+          parallel_operations_data_size_ >= kMaxParallelOperationsDataSize) {
+        if (!ApplyParallelOperations(error))
+          return false;
       }
+      continue;
     }
 
+    // The remaining operations are applied in payload order, after all the
+    // queued ones.
+    if (!ApplyParallelOperations(error))
+      return false;
+
     // Makes sure we unblock exit when this operation completes.
     ScopedTerminatorExitUnblocker exit_unblocker =
         ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
@@ -696,16 +1085,18 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
       default:
         op_result = false;
     }
-    if (!HandleOpResult(op_result, InstallOperationTypeName(op.type()), error))
-      return false;
-
-    if (!target_fd_->Flush()) {
+    if (!HandleOpResult(op_result,
+                        InstallOperationTypeName(op.type()),
+                        next_operation_num_,
+                        error)) {
       return false;
     }
 
+    OperationApplied(op);
     next_operation_num_++;
     UpdateOverallProgress(false, "Completed ");
-    CheckpointUpdateProgress();
+    if (!MaybeCheckpointUpdateProgress(false, error))
+      return false;
   }
 
   // In major version 2, we don't add dummy operation to the payload.
@@ -721,9 +1112,9 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
       *error = ErrorCode::kDownloadPayloadVerificationError;
       return false;
     }
-    CopyDataToBuffer(&c_bytes, &count, manifest_.signatures_size());
+    ReadDataToBuffer(&c_bytes, &count, manifest_.signatures_size());
     // Needs more data to cover entire signature.
-    if (buffer_.size() < manifest_.signatures_size())
+    if (buffer_size_ < manifest_.signatures_size())
       return true;
     if (!ExtractSignatureMessage()) {
       LOG(ERROR) << "Extract payload signature failed.";
@@ -734,7 +1125,8 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode *error) {
     // Since we extracted the SignatureMessage we need to advance the
     // checkpoint, otherwise we would reload the signature and try to extract
     // it again.
-    CheckpointUpdateProgress();
+    if (!MaybeCheckpointUpdateProgress(true, error))
+      return false;
   }
 
   return true;
@@ -847,7 +1239,7 @@ bool DeltaPerformer::CanPerformInstallOperation(
   }
 
   return (operation.data_offset() + operation.data_length() <=
-          buffer_offset_ + buffer_.size());
+          buffer_offset_ + buffer_size_);
 }
 
 bool DeltaPerformer::PerformReplaceOperation(
@@ -859,7 +1251,7 @@ bool DeltaPerformer::PerformReplaceOperation(
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(buffer_size_ >= operation.data_length());
 
   // Extract the signature message if it's in this operation.
   if (ExtractSignatureMessageFromOperation(operation)) {
@@ -869,26 +1261,232 @@ bool DeltaPerformer::PerformReplaceOperation(
     return true;
   }
 
-  // Setup the ExtentWriter stack based on the operation type.
+  TEST_AND_RETURN_FALSE(ApplyReplaceOperation(operation,
+                                              target_fd_,
+                                              block_size_,
+                                              buffer_data_,
+                                              operation.data_length(),
+                                              &xz_decoder_pool_));
+
+  // Update buffer
+  DiscardBuffer(true, buffer_size_);
+  return true;
+}
+
+namespace {
+
+// Returns the ExtentWriter stack applying a replace operation of type |type|,
+// decoding xz with a decoder from |xz_decoder_pool|.
+std::unique_ptr<ExtentWriter> CreateReplaceExtentWriter(
+    InstallOperation::Type type, XzDecoderPool* xz_decoder_pool) {
   std::unique_ptr<ExtentWriter> writer = std::make_unique<ZeroPadExtentWriter>(
       std::make_unique<DirectExtentWriter>());
 
-  if (operation.type() == InstallOperation::REPLACE_BZ) {
+  if (type == InstallOperation::REPLACE_BZ) {
     writer.reset(new BzipExtentWriter(std::move(writer)));
-  } else if (operation.type() == InstallOperation::REPLACE_XZ) {
-    writer.reset(new XzExtentWriter(std::move(writer)));
+  } else if (type == InstallOperation::REPLACE_XZ) {
+    writer.reset(new XzExtentWriter(std::move(writer), xz_decoder_pool));
   }
+  return writer;
+}
 
+}  // namespace
+
+bool DeltaPerformer::ApplyReplaceOperation(const InstallOperation& operation,
+                                           FileDescriptorPtr target_fd,
+                                           uint32_t block_size,
+                                           const uint8_t* data,
+                                           size_t data_size,
+                                           XzDecoderPool* xz_decoder_pool) {
+  // Setup the ExtentWriter stack based on the operation type.
+  std::unique_ptr<ExtentWriter> writer =
+      CreateReplaceExtentWriter(operation.type(), xz_decoder_pool);
   TEST_AND_RETURN_FALSE(
-      writer->Init(target_fd_, operation.dst_extents(), block_size_));
-  TEST_AND_RETURN_FALSE(writer->Write(buffer_.data(), operation.data_length()));
+      writer->Init(target_fd, operation.dst_extents(), block_size));
+  TEST_AND_RETURN_FALSE(writer->Write(data, data_size));
   TEST_AND_RETURN_FALSE(writer->End());
+  return true;
+}
 
-  // Update buffer
-  DiscardBuffer(true, buffer_.size());
+bool DeltaPerformer::CanStreamOperations() const {
+  // A streamed blob is decoded before its hash is validated, so the decoders
+  // would process data that a signed payload or mandatory hash checks require
+  // to be validated first. Update servers only serve signed payloads, so this
+  // only applies to the unsigned payloads used for development and testing.
+  return !install_plan_->hash_checks_mandatory &&
+         payload_->metadata_signature.empty() &&
+         metadata_signature_size_ == 0 && !manifest_.has_signatures_offset();
+}
+
+bool DeltaPerformer::ShouldStreamOperation(const InstallOperation& operation,
+                                           size_t available) const {
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+      // The blob is written as is, nothing parses it. A corrupted blob fails
+      // the hash of the operation once received, and the payload signature,
+      // before the target slot is ever marked bootable.
+      break;
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+      if (!CanStreamOperations())
+        return false;
+      break;
+    default:
+      return false;
+  }
+  // The signature blob of major version 1 payloads is extracted whole.
+  if (manifest_.has_signatures_offset() &&
+      manifest_.signatures_offset() == operation.data_offset()) {
+    return false;
+  }
+  // Full payloads are made of chunks decompressed faster in parallel once
+  // received than while received, as long as several fit in a batch.
+  if (payload_->type == InstallPayloadType::kFull &&
+      CanApplyInParallel(operation) &&
+      operation.data_length() <=
+          kMaxParallelOperationsDataSize / parallel_fds_.size()) {
+    return false;
+  }
+  // A blob received all at once is applied from the received data directly,
+  // and may be applied in parallel with other operations.
+  if (buffer_size_ > 0 || available == 0 ||
+      available >= operation.data_length() ||
+      operation.data_length() < kMinStreamedOperationSize) {
+    return false;
+  }
   return true;
 }
 
+bool DeltaPerformer::StreamOperation(const InstallOperation& operation,
+                                     const char** bytes_p,
+                                     size_t* count_p,
+                                     ErrorCode* error) {
+  if (!streaming_writer_) {
+    // Since we delete data off the beginning of the buffer as we use it,
+    // the data we need should be exactly at the beginning of the buffer.
+    TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
+    TEST_AND_RETURN_FALSE(buffer_size_ == 0);
+    streaming_writer_ =
+        CreateReplaceExtentWriter(operation.type(), &xz_decoder_pool_);
+    streaming_hash_calculator_.reset(new HashCalculator());
+    streaming_data_size_ = 0;
+    streaming_operation_ = &operation;
+    if (!HandleOpResult(streaming_writer_->Init(target_fd_,
+                                                operation.dst_extents(),
+                                                block_size_),
+                        InstallOperationTypeName(operation.type()),
+                        next_operation_num_,
+                        error)) {
+      return false;
+    }
+  }
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(*bytes_p);
+  const size_t length =
+      min(static_cast<uint64_t>(*count_p),
+          operation.data_length() - streaming_data_size_);
+  TEST_AND_RETURN_FALSE(HashCalculator::UpdateLanes(
+      {{&payload_hash_calculator_, data, length},
+       {&signed_hash_calculator_, data, length},
+       {streaming_hash_calculator_.get(), data, length}}));
+  buffer_offset_ += length;
+  streaming_data_size_ += length;
+  *bytes_p += length;
+  *count_p -= length;
+  if (!HandleOpResult(streaming_writer_->Write(data, length),
+                      InstallOperationTypeName(operation.type()),
+                      next_operation_num_,
+                      error)) {
+    return false;
+  }
+  if (streaming_data_size_ < operation.data_length())
+    return true;
+
+  bool op_result = streaming_writer_->End();
+  streaming_writer_.reset();
+  streaming_operation_ = nullptr;
+  if (!HandleOpResult(op_result,
+                      InstallOperationTypeName(operation.type()),
+                      next_operation_num_,
+                      error)) {
+    return false;
+  }
+  // The hash can only be checked once the whole blob was received, after it
+  // was applied. A mismatch fails the update, so the target slot written with
+  // a corrupted blob is never marked bootable.
+  bool hash_result = CheckOperationHash(operation, error);
+  streaming_hash_calculator_.reset();
+  TEST_AND_RETURN_FALSE(hash_result);
+  if (!target_fd_->Flush()) {
+    PLOG(ERROR) << "Unable to flush " << target_path_;
+    *error = ErrorCode::kDownloadWriteError;
+    return false;
+  }
+  return true;
+}
+
+bool DeltaPerformer::ResumeStreamedOperation(
+    const InstallOperation& operation) {
+  const uint64_t progress = resumed_operation_progress_;
+  resumed_operation_progress_ = 0;
+  TEST_AND_RETURN_FALSE(operation.type() == InstallOperation::REPLACE);
+  TEST_AND_RETURN_FALSE(progress < operation.data_length());
+  TEST_AND_RETURN_FALSE(buffer_offset_ ==
+                        operation.data_offset() + progress);
+  TEST_AND_RETURN_FALSE(buffer_size_ == 0);
+
+  // The blob applied so far was written as is, ending in the middle of a
+  // block. The remaining blocks are written from that one, which is read back
+  // from the target.
+  uint64_t blocks_to_skip = progress / block_size_;
+  RepeatedPtrField<Extent> extents;
+  for (const Extent& extent : operation.dst_extents()) {
+    if (blocks_to_skip >= extent.num_blocks()) {
+      blocks_to_skip -= extent.num_blocks();
+      continue;
+    }
+    Extent* remaining = extents.Add();
+    remaining->set_start_block(extent.start_block() + blocks_to_skip);
+    remaining->set_num_blocks(extent.num_blocks() - blocks_to_skip);
+    blocks_to_skip = 0;
+  }
+  TEST_AND_RETURN_FALSE(!extents.empty());
+  brillo::Blob partial_block(progress % block_size_);
+  if (!partial_block.empty()) {
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(
+        utils::PReadAll(target_fd_,
+                        partial_block.data(),
+                        partial_block.size(),
+                        extents.Get(0).start_block() * block_size_,
+                        &bytes_read) &&
+        bytes_read == static_cast<ssize_t>(partial_block.size()));
+  }
+
+  std::unique_ptr<ExtentWriter> writer =
+      CreateReplaceExtentWriter(operation.type(), &xz_decoder_pool_);
+  TEST_AND_RETURN_FALSE(writer->Init(target_fd_, extents, block_size_));
+  TEST_AND_RETURN_FALSE(
+      writer->Write(partial_block.data(), partial_block.size()));
+  auto hash_calculator = std::make_unique<HashCalculator>();
+  TEST_AND_RETURN_FALSE(
+      hash_calculator->SetContext(resumed_operation_hash_context_));
+  resumed_operation_hash_context_.clear();
+
+  streaming_writer_ = std::move(writer);
+  streaming_hash_calculator_ = std::move(hash_calculator);
+  streaming_data_size_ = progress;
+  streaming_operation_ = &operation;
+  LOG(INFO) << "Resuming operation " << next_operation_num_ << " after "
+            << progress << " bytes of its data.";
+  return true;
+}
+
+bool DeltaPerformer::CanCheckpointStreamedOperation() const {
+  return streaming_writer_ &&
+         streaming_operation_->type() == InstallOperation::REPLACE;
+}
+
 bool DeltaPerformer::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
   CHECK(operation.type() == InstallOperation::DISCARD ||
@@ -1018,24 +1616,296 @@ bool DeltaPerformer::ValidateSourceHash(const brillo::Blob& calculated_hash,
   return true;
 }
 
+class DeltaPerformer::SourceCheckWorker
+    : public base::DelegateSimpleThread::Delegate {
+ public:
+  // Checks the source of |partition| from |first_operation| on, see
+  // CheckSourcePartition(). The last worker done, according to
+  // |running_workers|, signals |done|.
+  SourceCheckWorker(PartitionUpdate* partition,
+                    size_t first_operation,
+                    const string& source_path,
+                    uint32_t block_size,
+                    const std::atomic<bool>* canceled,
+                    std::atomic<size_t>* running_workers,
+                    base::WaitableEvent* done)
+      : partition_(partition),
+        first_operation_(first_operation),
+        source_path_(source_path),
+        block_size_(block_size),
+        canceled_(canceled),
+        running_workers_(running_workers),
+        done_(done) {}
+
+  // DelegateSimpleThread::Delegate overrides.
+  void Run() override {
+    result_ = CheckSourcePartition(*partition_,
+                                   first_operation_,
+                                   source_path_,
+                                   block_size_,
+                                   *canceled_,
+                                   &matches_partition_hash_,
+                                   &error_);
+    if (--(*running_workers_) == 0)
+      done_->Signal();
+  }
+
+  PartitionUpdate* partition() const { return partition_; }
+  bool result() const { return result_; }
+  bool matches_partition_hash() const { return matches_partition_hash_; }
+  ErrorCode error() const { return error_; }
+
+ private:
+  PartitionUpdate* partition_;
+  size_t first_operation_;
+  string source_path_;
+  uint32_t block_size_;
+  const std::atomic<bool>* canceled_;
+  std::atomic<size_t>* running_workers_;
+  base::WaitableEvent* done_;
+
+  bool result_{false};
+  bool matches_partition_hash_{false};
+  ErrorCode error_{ErrorCode::kSuccess};
+
+  DISALLOW_COPY_AND_ASSIGN(SourceCheckWorker);
+};
+
+bool DeltaPerformer::CheckSourcePartitions(ErrorCode* error) {
+  if (payload_->type != InstallPayloadType::kDelta ||
+      GetMinorVersion() == kInPlaceMinorPayloadVersion) {
+    return true;
+  }
+
+  // The source is only read again after an interruption if it wasn't checked
+  // yet. The per-operation hashes are kept in that case.
+  bool source_checked = false;
+  if (prefs_->GetBoolean(kPrefsUpdateStateSourceChecked, &source_checked) &&
+      source_checked) {
+    LOG(INFO) << "The source partitions were already checked.";
+    return true;
+  }
+
+  base::TimeTicks start_time = base::TimeTicks::Now();
+  size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  std::atomic<bool> canceled{false};
+  std::atomic<size_t> running_workers{0};
+  base::WaitableEvent workers_done(
+      base::WaitableEvent::ResetPolicy::MANUAL,
+      base::WaitableEvent::InitialState::NOT_SIGNALED);
+  vector<std::unique_ptr<SourceCheckWorker>> workers;
+  for (size_t i = 0; i < partitions_.size(); i++) {
+    if (next_operation_num_ >= acc_num_operations_[i])
+      continue;
+    const InstallPlan::Partition& install_part =
+        install_plan_->partitions[num_previous_partitions + i];
+    // Partitions updated in place are validated while they're written.
+    if (install_part.source_path.empty() ||
+        install_part.source_path == install_part.target_path) {
+      continue;
+    }
+    const size_t partition_first_operation =
+        i ? acc_num_operations_[i - 1] : 0;
+    workers.emplace_back(new SourceCheckWorker(
+        &partitions_[i],
+        std::max(next_operation_num_, partition_first_operation) -
+            partition_first_operation,
+        install_part.source_path,
+        block_size_,
+        &canceled,
+        &running_workers,
+        &workers_done));
+  }
+  if (workers.empty())
+    return true;
+
+  const size_t num_threads =
+      min(workers.size(), static_cast<size_t>(kMaxParallelOperationThreads));
+  base::DelegateSimpleThreadPool thread_pool("source-check", num_threads);
+  thread_pool.Start();
+  running_workers = workers.size();
+  for (const auto& worker : workers)
+    thread_pool.AddWork(worker.get());
+  // The workers stop between two chunks of the source once the update is
+  // canceled, which is checked here like between two operations.
+  while (!workers_done.TimedWait(base::TimeDelta::FromMilliseconds(
+      kSourceCheckCancelPollIntervalMs))) {
+    if (!canceled && download_delegate_ &&
+        download_delegate_->ShouldCancel(error)) {
+      LOG(INFO) << "Canceling the check of the source partitions.";
+      canceled = true;
+    }
+  }
+  thread_pool.JoinAll();
+  if (canceled)
+    return false;
+
+  for (const auto& worker : workers) {
+    if (!worker->result()) {
+      LOG(ERROR) << "The source partition "
+                 << worker->partition()->partition_name()
+                 << " doesn't match the payload, not downloading the update.";
+      *error = worker->error();
+      return false;
+    }
+  }
+  LOG(INFO) << "Checked the source of " << workers.size() << " partitions in "
+            << utils::FormatTimeDelta(base::TimeTicks::Now() - start_time);
+  LOG_IF(WARNING, !prefs_->SetBoolean(kPrefsUpdateStateSourceChecked, true))
+      << "Unable to save that the source partitions were checked.";
+
+  // When the whole source partition matches its hash, so does the source of
+  // each of its operations, which is only sampled from then on: the
+  // SOURCE_COPY operations without a source hash may copy their blocks without
+  // reading them. The operations of a partition checked one by one keep their
+  // hash, since the source may change after it was checked.
+  for (const auto& worker : workers) {
+    if (!worker->matches_partition_hash())
+      continue;
+    int num_source_copy = 0;
+    for (InstallOperation& operation :
+         *worker->partition()->mutable_operations()) {
+      if (operation.type() == InstallOperation::SOURCE_COPY &&
+          num_source_copy++ % kSourceCopyHashSampleInterval != 0) {
+        operation.clear_src_sha256_hash();
+      }
+    }
+  }
+  return true;
+}
+
+bool DeltaPerformer::CheckSourcePartition(const PartitionUpdate& partition,
+                                          size_t first_operation,
+                                          const string& source_path,
+                                          uint32_t block_size,
+                                          const std::atomic<bool>& canceled,
+                                          bool* matches_partition_hash,
+                                          ErrorCode* error) {
+  *matches_partition_hash = false;
+  bool has_source_hash = false;
+  for (int i = first_operation; i < partition.operations_size(); i++)
+    has_source_hash |= partition.operations(i).has_src_sha256_hash();
+  if (!has_source_hash)
+    return true;
+
+  int err;
+  FileDescriptorPtr source_fd =
+      OpenFile(source_path.c_str(), O_RDONLY, false, &err);
+  if (!source_fd) {
+    LOG(ERROR) << "Unable to open source partition "
+               << partition.partition_name() << ", file " << source_path;
+    *error = ErrorCode::kInstallDeviceOpenError;
+    return false;
+  }
+
+  const PartitionInfo& info = partition.old_partition_info();
+  if (info.size() > 0 && !info.hash().empty()) {
+    HashCalculator hash_calculator;
+    brillo::Blob buffer(min(info.size(), kSourceCheckChunkSize));
+    bool read_ok = true;
+    for (uint64_t offset = 0; read_ok && offset < info.size();
+         offset += buffer.size()) {
+      if (canceled) {
+        source_fd->Close();
+        return false;
+      }
+      size_t count = min(static_cast<uint64_t>(buffer.size()),
+                         info.size() - offset);
+      ssize_t bytes_read;
+      read_ok =
+          utils::PReadAll(
+              source_fd, buffer.data(), count, offset, &bytes_read) &&
+          bytes_read == static_cast<ssize_t>(count) &&
+          hash_calculator.Update(buffer.data(), count);
+    }
+    if (read_ok && hash_calculator.Finalize() &&
+        hash_calculator.raw_hash() ==
+            brillo::Blob(info.hash().begin(), info.hash().end())) {
+      LOG(INFO) << "Source partition " << partition.partition_name()
+                << " matches its hash.";
+      *matches_partition_hash = true;
+      source_fd->Close();
+      return true;
+    }
+    LOG(WARNING) << "Source partition " << partition.partition_name()
+                 << " doesn't match its hash, checking the source of each "
+                    "operation.";
+  }
+
+  bool valid = true;
+  for (int i = first_operation; valid && i < partition.operations_size();
+       i++) {
+    if (canceled) {
+      valid = false;
+      break;
+    }
+    const InstallOperation& operation = partition.operations(i);
+    if (!operation.has_src_sha256_hash())
+      continue;
+    brillo::Blob source_hash;
+    if (!fd_utils::ReadAndHashExtents(
+            source_fd, operation.src_extents(), block_size, &source_hash)) {
+      LOG(ERROR) << "Unable to read the source of operation " << i
+                 << " of partition " << partition.partition_name();
+      *error = ErrorCode::kDownloadStateInitializationError;
+      valid = false;
+    } else {
+      valid = ValidateSourceHash(source_hash, operation, source_fd, error);
+    }
+  }
+  source_fd->Close();
+  return valid;
+}
+
 bool DeltaPerformer::PerformSourceCopyOperation(
     const InstallOperation& operation, ErrorCode* error) {
+  brillo::Blob source_data;
+  bool prefetched = TakePrefetchedSource(next_operation_num_, &source_data);
+  return ApplySourceCopyOperation(operation,
+                                  source_fd_,
+                                  target_fd_,
+                                  block_size_,
+                                  prefetched ? &source_data : nullptr,
+                                  error);
+}
+
+bool DeltaPerformer::ApplySourceCopyOperation(
+    const InstallOperation& operation,
+    FileDescriptorPtr source_fd,
+    FileDescriptorPtr target_fd,
+    uint32_t block_size,
+    const brillo::Blob* source_data,
+    ErrorCode* error) {
   if (operation.has_src_length())
-    TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
+    TEST_AND_RETURN_FALSE(operation.src_length() % block_size == 0);
   if (operation.has_dst_length())
-    TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
+    TEST_AND_RETURN_FALSE(operation.dst_length() % block_size == 0);
+
+  // The source data read ahead was already validated.
+  if (source_data) {
+    DirectExtentWriter writer;
+    TEST_AND_RETURN_FALSE(
+        writer.Init(target_fd, operation.dst_extents(), block_size));
+    TEST_AND_RETURN_FALSE(writer.Write(source_data->data(),
+                                       source_data->size()));
+    return writer.End();
+  }
 
+  // Without a source hash to validate, the blocks may be copied without being
+  // read at all.
   brillo::Blob source_hash;
-  TEST_AND_RETURN_FALSE(fd_utils::CopyAndHashExtents(source_fd_,
-                                                     operation.src_extents(),
-                                                     target_fd_,
-                                                     operation.dst_extents(),
-                                                     block_size_,
-                                                     &source_hash));
+  TEST_AND_RETURN_FALSE(fd_utils::CopyAndHashExtents(
+      source_fd,
+      operation.src_extents(),
+      target_fd,
+      operation.dst_extents(),
+      block_size,
+      operation.has_src_sha256_hash() ? &source_hash : nullptr));
 
   if (operation.has_src_sha256_hash()) {
     TEST_AND_RETURN_FALSE(
-        ValidateSourceHash(source_hash, operation, source_fd_, error));
+        ValidateSourceHash(source_hash, operation, source_fd, error));
   }
 
   return true;
@@ -1067,7 +1937,7 @@ bool DeltaPerformer::PerformBsdiffOperation(const InstallOperation& operation) {
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(buffer_size_ >= operation.data_length());
 
   string input_positions;
   TEST_AND_RETURN_FALSE(ExtentsToBsdiffPositionsString(operation.src_extents(),
@@ -1082,11 +1952,11 @@ bool DeltaPerformer::PerformBsdiffOperation(const InstallOperation& operation) {
 
   TEST_AND_RETURN_FALSE(bsdiff::bspatch(target_path_.c_str(),
                                         target_path_.c_str(),
-                                        buffer_.data(),
-                                        buffer_.size(),
+                                        buffer_data_,
+                                        buffer_size_,
                                         input_positions.c_str(),
                                         output_positions.c_str()) == 0);
-  DiscardBuffer(true, buffer_.size());
+  DiscardBuffer(true, buffer_size_);
 
   if (operation.dst_length() % block_size_) {
     // Zero out rest of final block.
@@ -1108,7 +1978,7 @@ namespace {
 
 class BsdiffExtentFile : public bsdiff::FileInterface {
  public:
-  BsdiffExtentFile(std::unique_ptr<ExtentReader> reader, size_t size)
+  BsdiffExtentFile(std::shared_ptr<ExtentReader> reader, size_t size)
       : BsdiffExtentFile(std::move(reader), nullptr, size) {}
   BsdiffExtentFile(std::unique_ptr<ExtentWriter> writer, size_t size)
       : BsdiffExtentFile(nullptr, std::move(writer), size) {}
@@ -1154,7 +2024,7 @@ class BsdiffExtentFile : public bsdiff::FileInterface {
   }
 
  private:
-  BsdiffExtentFile(std::unique_ptr<ExtentReader> reader,
+  BsdiffExtentFile(std::shared_ptr<ExtentReader> reader,
                    std::unique_ptr<ExtentWriter> writer,
                    size_t size)
       : reader_(std::move(reader)),
@@ -1162,7 +2032,7 @@ class BsdiffExtentFile : public bsdiff::FileInterface {
         size_(size),
         offset_(0) {}
 
-  std::unique_ptr<ExtentReader> reader_;
+  std::shared_ptr<ExtentReader> reader_;
   std::unique_ptr<ExtentWriter> writer_;
   uint64_t size_;
   uint64_t offset_;
@@ -1170,6 +2040,59 @@ class BsdiffExtentFile : public bsdiff::FileInterface {
   DISALLOW_COPY_AND_ASSIGN(BsdiffExtentFile);
 };
 
+// Creates the reader of the source extents of |operation|. The reader serves
+// the validated |source_data| if not null. Otherwise, if the operation has a
+// source hash, the reader hashes the data it reads and is also stored in
+// |hashing_reader|, unless the data was preloaded and validated already.
+bool InitSourceReader(const InstallOperation& operation,
+                      FileDescriptorPtr source_fd,
+                      uint32_t block_size,
+                      const brillo::Blob* source_data,
+                      std::shared_ptr<ExtentReader>* reader,
+                      std::shared_ptr<HashingExtentReader>* hashing_reader,
+                      ErrorCode* error) {
+  if (source_data) {
+    *reader = std::make_shared<MemoryExtentReader>(source_data->data(),
+                                                   source_data->size());
+    return (*reader)->Init(source_fd, operation.src_extents(), block_size);
+  }
+  if (!operation.has_src_sha256_hash()) {
+    *reader = std::make_shared<DirectExtentReader>();
+    return (*reader)->Init(source_fd, operation.src_extents(), block_size);
+  }
+  *hashing_reader =
+      std::make_shared<HashingExtentReader>(kMaxPreloadedSourceSize);
+  *reader = *hashing_reader;
+  TEST_AND_RETURN_FALSE(
+      (*reader)->Init(source_fd, operation.src_extents(), block_size));
+  if ((*hashing_reader)->preloaded()) {
+    brillo::Blob source_hash;
+    TEST_AND_RETURN_FALSE((*hashing_reader)->Finish(&source_hash));
+    TEST_AND_RETURN_FALSE(DeltaPerformer::ValidateSourceHash(
+        source_hash, operation, source_fd, error));
+    hashing_reader->reset();
+  }
+  return true;
+}
+
+// Validates the source hash of |operation| once its patch was applied reading
+// from |hashing_reader|, if any. |patched| tells whether applying the patch
+// succeeded; a source hash mismatch is reported first since it's the likely
+// cause of a failure.
+bool ValidateSourceAfterPatch(const InstallOperation& operation,
+                              FileDescriptorPtr source_fd,
+                              HashingExtentReader* hashing_reader,
+                              bool patched,
+                              ErrorCode* error) {
+  if (hashing_reader) {
+    brillo::Blob source_hash;
+    TEST_AND_RETURN_FALSE(hashing_reader->Finish(&source_hash));
+    TEST_AND_RETURN_FALSE(DeltaPerformer::ValidateSourceHash(
+        source_hash, operation, source_fd, error));
+  }
+  return patched;
+}
+
 }  // namespace
 
 bool DeltaPerformer::PerformSourceBsdiffOperation(
@@ -1177,39 +2100,64 @@ bool DeltaPerformer::PerformSourceBsdiffOperation(
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(buffer_size_ >= operation.data_length());
+  brillo::Blob source_data;
+  bool prefetched = TakePrefetchedSource(next_operation_num_, &source_data);
+  TEST_AND_RETURN_FALSE(
+      ApplySourceBsdiffOperation(operation,
+                                 source_fd_,
+                                 target_fd_,
+                                 block_size_,
+                                 buffer_data_,
+                                 buffer_size_,
+                                 prefetched ? &source_data : nullptr,
+                                 error));
+  DiscardBuffer(true, buffer_size_);
+  return true;
+}
+
+bool DeltaPerformer::ApplySourceBsdiffOperation(
+    const InstallOperation& operation,
+    FileDescriptorPtr source_fd,
+    FileDescriptorPtr target_fd,
+    uint32_t block_size,
+    const uint8_t* data,
+    size_t data_size,
+    const brillo::Blob* source_data,
+    ErrorCode* error) {
   if (operation.has_src_length())
-    TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
+    TEST_AND_RETURN_FALSE(operation.src_length() % block_size == 0);
   if (operation.has_dst_length())
-    TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
-
-  if (operation.has_src_sha256_hash()) {
-    brillo::Blob source_hash;
-    TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
-        source_fd_, operation.src_extents(), block_size_, &source_hash));
-    TEST_AND_RETURN_FALSE(
-        ValidateSourceHash(source_hash, operation, source_fd_, error));
-  }
-
-  auto reader = std::make_unique<DirectExtentReader>();
-  TEST_AND_RETURN_FALSE(
-      reader->Init(source_fd_, operation.src_extents(), block_size_));
+    TEST_AND_RETURN_FALSE(operation.dst_length() % block_size == 0);
+
+  // The source is hashed while the patch reads it, rather than reading it
+  // once more just to validate it.
+  std::shared_ptr<ExtentReader> reader;
+  std::shared_ptr<HashingExtentReader> hashing_reader;
+  TEST_AND_RETURN_FALSE(InitSourceReader(operation,
+                                         source_fd,
+                                         block_size,
+                                         source_data,
+                                         &reader,
+                                         &hashing_reader,
+                                         error));
   auto src_file = std::make_unique<BsdiffExtentFile>(
       std::move(reader),
-      utils::BlocksInExtents(operation.src_extents()) * block_size_);
+      utils::BlocksInExtents(operation.src_extents()) * block_size);
 
   auto writer = std::make_unique<DirectExtentWriter>();
   TEST_AND_RETURN_FALSE(
-      writer->Init(target_fd_, operation.dst_extents(), block_size_));
+      writer->Init(target_fd, operation.dst_extents(), block_size));
   auto dst_file = std::make_unique<BsdiffExtentFile>(
       std::move(writer),
-      utils::BlocksInExtents(operation.dst_extents()) * block_size_);
-
-  TEST_AND_RETURN_FALSE(bsdiff::bspatch(std::move(src_file),
-                                        std::move(dst_file),
-                                        buffer_.data(),
-                                        buffer_.size()) == 0);
-  DiscardBuffer(true, buffer_.size());
+      utils::BlocksInExtents(operation.dst_extents()) * block_size);
+
+  bool patched = bsdiff::bspatch(std::move(src_file),
+                                 std::move(dst_file),
+                                 data,
+                                 data_size) == 0;
+  TEST_AND_RETURN_FALSE(ValidateSourceAfterPatch(
+      operation, source_fd, hashing_reader.get(), patched, error));
   return true;
 }
 
@@ -1219,9 +2167,22 @@ namespace {
 // into |target_fd_|.
 class PuffinExtentStream : public puffin::StreamInterface {
  public:
-  // Constructor for creating a stream for reading from an |ExtentReader|.
-  PuffinExtentStream(std::unique_ptr<ExtentReader> reader, uint64_t size)
-      : PuffinExtentStream(std::move(reader), nullptr, size) {}
+  // The number of Read() calls on a stream, and how many of them were served
+  // from the data already buffered.
+  struct ReadStats {
+    uint64_t reads{0};
+    uint64_t buffered_reads{0};
+  };
+
+  // Constructor for creating a stream for reading from an |ExtentReader|. The
+  // small reads are served from aligned reads of kPuffinReadBufferSize bytes,
+  // and counted in |stats|.
+  PuffinExtentStream(std::shared_ptr<ExtentReader> reader,
+                     uint64_t size,
+                     ReadStats* stats)
+      : PuffinExtentStream(std::move(reader), nullptr, size) {
+    stats_ = stats;
+  }
 
   // Constructor for creating a stream for writing to an |ExtentWriter|.
   PuffinExtentStream(std::unique_ptr<ExtentWriter> writer, uint64_t size)
@@ -1241,7 +2202,8 @@ class PuffinExtentStream : public puffin::StreamInterface {
 
   bool Seek(uint64_t offset) override {
     if (is_read_) {
-      TEST_AND_RETURN_FALSE(reader_->Seek(offset));
+      // |reader_| is only moved when the buffer is refilled.
+      TEST_AND_RETURN_FALSE(offset <= size_);
       offset_ = offset;
     } else {
       // For writes technically there should be no change of position, or it
@@ -1253,8 +2215,35 @@ class PuffinExtentStream : public puffin::StreamInterface {
 
   bool Read(void* buffer, size_t count) override {
     TEST_AND_RETURN_FALSE(is_read_);
-    TEST_AND_RETURN_FALSE(reader_->Read(buffer, count));
-    offset_ += count;
+    TEST_AND_RETURN_FALSE(count <= size_ - offset_);
+    stats_->reads++;
+    bool buffered = true;
+    uint8_t* bytes = static_cast<uint8_t*>(buffer);
+    while (count > 0) {
+      if (offset_ >= buffer_offset_ &&
+          offset_ < buffer_offset_ + buffer_.size()) {
+        size_t buffer_bytes =
+            min(static_cast<uint64_t>(count),
+                buffer_offset_ + buffer_.size() - offset_);
+        memcpy(bytes, buffer_.data() + (offset_ - buffer_offset_),
+               buffer_bytes);
+        bytes += buffer_bytes;
+        count -= buffer_bytes;
+        offset_ += buffer_bytes;
+        continue;
+      }
+      buffered = false;
+      if (count >= kPuffinReadBufferSize) {
+        // Large reads don't need to go through the buffer.
+        TEST_AND_RETURN_FALSE(reader_->Seek(offset_));
+        TEST_AND_RETURN_FALSE(reader_->Read(bytes, count));
+        offset_ += count;
+        break;
+      }
+      TEST_AND_RETURN_FALSE(FillBuffer());
+    }
+    if (buffered)
+      stats_->buffered_reads++;
     return true;
   }
 
@@ -1273,7 +2262,7 @@ class PuffinExtentStream : public puffin::StreamInterface {
   }
 
  private:
-  PuffinExtentStream(std::unique_ptr<ExtentReader> reader,
+  PuffinExtentStream(std::shared_ptr<ExtentReader> reader,
                      std::unique_ptr<ExtentWriter> writer,
                      uint64_t size)
       : reader_(std::move(reader)),
@@ -1282,12 +2271,32 @@ class PuffinExtentStream : public puffin::StreamInterface {
         offset_(0),
         is_read_(reader_ ? true : false) {}
 
-  std::unique_ptr<ExtentReader> reader_;
+  // Reads the kPuffinReadBufferSize aligned bytes containing |offset_| into
+  // |buffer_|.
+  bool FillBuffer() {
+    buffer_offset_ = offset_ - offset_ % kPuffinReadBufferSize;
+    buffer_.resize(
+        min(static_cast<uint64_t>(kPuffinReadBufferSize),
+            size_ - buffer_offset_));
+    if (!reader_->Seek(buffer_offset_) ||
+        !reader_->Read(buffer_.data(), buffer_.size())) {
+      buffer_.clear();
+      return false;
+    }
+    return true;
+  }
+
+  std::shared_ptr<ExtentReader> reader_;
   std::unique_ptr<ExtentWriter> writer_;
   uint64_t size_;
   uint64_t offset_;
   bool is_read_;
 
+  // The data read from |reader_| at |buffer_offset_|.
+  brillo::Blob buffer_;
+  uint64_t buffer_offset_{0};
+  ReadStats* stats_{nullptr};
+
   DISALLOW_COPY_AND_ASSIGN(PuffinExtentStream);
 };
 
@@ -1298,40 +2307,366 @@ bool DeltaPerformer::PerformPuffDiffOperation(const InstallOperation& operation,
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
-
-  if (operation.has_src_sha256_hash()) {
-    brillo::Blob source_hash;
-    TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
-        source_fd_, operation.src_extents(), block_size_, &source_hash));
-    TEST_AND_RETURN_FALSE(
-        ValidateSourceHash(source_hash, operation, source_fd_, error));
-  }
-
-  auto reader = std::make_unique<DirectExtentReader>();
+  TEST_AND_RETURN_FALSE(buffer_size_ >= operation.data_length());
+  brillo::Blob source_data;
+  bool prefetched = TakePrefetchedSource(next_operation_num_, &source_data);
   TEST_AND_RETURN_FALSE(
-      reader->Init(source_fd_, operation.src_extents(), block_size_));
-  puffin::UniqueStreamPtr src_stream(new PuffinExtentStream(
-      std::move(reader),
-      utils::BlocksInExtents(operation.src_extents()) * block_size_));
+      ApplyPuffDiffOperation(operation,
+                             source_fd_,
+                             target_fd_,
+                             block_size_,
+                             buffer_data_,
+                             buffer_size_,
+                             prefetched ? &source_data : nullptr,
+                             error));
+  DiscardBuffer(true, buffer_size_);
+  return true;
+}
+
+bool DeltaPerformer::ApplyPuffDiffOperation(const InstallOperation& operation,
+                                            FileDescriptorPtr source_fd,
+                                            FileDescriptorPtr target_fd,
+                                            uint32_t block_size,
+                                            const uint8_t* data,
+                                            size_t data_size,
+                                            const brillo::Blob* source_data,
+                                            ErrorCode* error) {
+  // The source is hashed while the patch reads it, rather than reading it
+  // once more just to validate it.
+  std::shared_ptr<ExtentReader> reader;
+  std::shared_ptr<HashingExtentReader> hashing_reader;
+  TEST_AND_RETURN_FALSE(InitSourceReader(operation,
+                                         source_fd,
+                                         block_size,
+                                         source_data,
+                                         &reader,
+                                         &hashing_reader,
+                                         error));
+  const uint64_t source_size =
+      utils::BlocksInExtents(operation.src_extents()) * block_size;
+  PuffinExtentStream::ReadStats read_stats;
+  puffin::UniqueStreamPtr src_stream(
+      new PuffinExtentStream(std::move(reader), source_size, &read_stats));
 
   auto writer = std::make_unique<DirectExtentWriter>();
   TEST_AND_RETURN_FALSE(
-      writer->Init(target_fd_, operation.dst_extents(), block_size_));
+      writer->Init(target_fd, operation.dst_extents(), block_size));
   puffin::UniqueStreamPtr dst_stream(new PuffinExtentStream(
       std::move(writer),
-      utils::BlocksInExtents(operation.dst_extents()) * block_size_));
-
-  const size_t kMaxCacheSize = 5 * 1024 * 1024;  // Total 5MB cache.
-  TEST_AND_RETURN_FALSE(puffin::PuffPatch(std::move(src_stream),
-                                          std::move(dst_stream),
-                                          buffer_.data(),
-                                          buffer_.size(),
-                                          kMaxCacheSize));
-  DiscardBuffer(true, buffer_.size());
+      utils::BlocksInExtents(operation.dst_extents()) * block_size));
+
+  const uint64_t available_memory =
+      static_cast<uint64_t>(sysconf(_SC_AVPHYS_PAGES)) *
+      sysconf(_SC_PAGESIZE);
+  bool patched =
+      puffin::PuffPatch(std::move(src_stream),
+                        std::move(dst_stream),
+                        data,
+                        data_size,
+                        PuffCacheSize(source_size, available_memory));
+  if (read_stats.reads > 0) {
+    LOCAL_HISTOGRAM_PERCENTAGE(
+        "UpdateEngine.DownloadAction.InstallOperation::PUFFDIFF."
+        "SourceReadHitRate",
+        read_stats.buffered_reads * 100 / read_stats.reads);
+  }
+  TEST_AND_RETURN_FALSE(ValidateSourceAfterPatch(
+      operation, source_fd, hashing_reader.get(), patched, error));
+  return true;
+}
+
+size_t DeltaPerformer::PuffCacheSize(uint64_t source_size,
+                                     uint64_t available_memory) {
+  const uint64_t max_size =
+      std::max(kMinPuffCacheSize,
+               std::min(kMaxPuffCacheSize,
+                        available_memory / kPuffCacheMemoryDivisor /
+                            kMaxParallelOperationThreads));
+  return std::min(max_size, source_size * kPuffCacheSourceRatio);
+}
+
+bool DeltaPerformer::ApplyOperation(const InstallOperation& operation,
+                                    FileDescriptorPtr source_fd,
+                                    FileDescriptorPtr target_fd,
+                                    uint32_t block_size,
+                                    const uint8_t* data,
+                                    size_t data_size,
+                                    XzDecoderPool* xz_decoder_pool,
+                                    const brillo::Blob* source_data,
+                                    ErrorCode* error) {
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+      return ApplyReplaceOperation(
+          operation, target_fd, block_size, data, data_size, xz_decoder_pool);
+    case InstallOperation::SOURCE_COPY:
+      return ApplySourceCopyOperation(
+          operation, source_fd, target_fd, block_size, source_data, error);
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+      return ApplySourceBsdiffOperation(operation,
+                                        source_fd,
+                                        target_fd,
+                                        block_size,
+                                        data,
+                                        data_size,
+                                        source_data,
+                                        error);
+    case InstallOperation::PUFFDIFF:
+      return ApplyPuffDiffOperation(operation,
+                                    source_fd,
+                                    target_fd,
+                                    block_size,
+                                    data,
+                                    data_size,
+                                    source_data,
+                                    error);
+    default:
+      return false;
+  }
+}
+
+class DeltaPerformer::OperationWorker
+    : public base::DelegateSimpleThread::Delegate {
+ public:
+  // Applies the operations in |operations| handed out by |next_operation|,
+  // which is shared by all the workers, using |source_fd| and |target_fd|.
+  // Each run applies one batch; the last worker done with it, according to
+  // |running_workers|, signals |done|.
+  OperationWorker(FileDescriptorPtr source_fd,
+                  FileDescriptorPtr target_fd,
+                  uint32_t block_size,
+                  XzDecoderPool* xz_decoder_pool,
+                  vector<ParallelOperation>* operations,
+                  std::atomic<size_t>* next_operation,
+                  std::atomic<size_t>* running_workers,
+                  base::WaitableEvent* done)
+      : source_fd_(source_fd),
+        target_fd_(target_fd),
+        block_size_(block_size),
+        xz_decoder_pool_(xz_decoder_pool),
+        operations_(operations),
+        next_operation_(next_operation),
+        running_workers_(running_workers),
+        done_(done) {}
+
+  // DelegateSimpleThread::Delegate overrides.
+  void Run() override {
+    for (size_t i = (*next_operation_)++; i < operations_->size();
+         i = (*next_operation_)++) {
+      ParallelOperation* pop = &(*operations_)[i];
+      pop->result = ApplyOperation(*pop->operation,
+                                   source_fd_,
+                                   target_fd_,
+                                   block_size_,
+                                   pop->uncopied_data ? pop->uncopied_data
+                                                      : pop->data.data(),
+                                   pop->uncopied_data ? pop->uncopied_data_size
+                                                      : pop->data.size(),
+                                   xz_decoder_pool_,
+                                   pop->source_data.empty()
+                                       ? nullptr
+                                       : &pop->source_data,
+                                   &pop->error);
+      if (!pop->result) {
+        // Don't start any other operation after a failure.
+        *next_operation_ = operations_->size();
+        break;
+      }
+    }
+    if (--(*running_workers_) == 0)
+      done_->Signal();
+  }
+
+ private:
+  FileDescriptorPtr source_fd_;
+  FileDescriptorPtr target_fd_;
+  uint32_t block_size_;
+  XzDecoderPool* xz_decoder_pool_;
+  vector<ParallelOperation>* operations_;
+  std::atomic<size_t>* next_operation_;
+  std::atomic<size_t>* running_workers_;
+  base::WaitableEvent* done_;
+
+  DISALLOW_COPY_AND_ASSIGN(OperationWorker);
+};
+
+bool DeltaPerformer::CanApplyInParallel(
+    const InstallOperation& operation) const {
+  if (parallel_fds_.empty())
+    return false;
+
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+      // The payload signature must be extracted in payload order.
+      return !manifest_.has_signatures_offset() ||
+             manifest_.signatures_offset() != operation.data_offset();
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::SOURCE_COPY:
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool DeltaPerformer::QueueParallelOperation(const InstallOperation& operation) {
+  // Since we delete data off the beginning of the buffer as we use it,
+  // the data we need should be exactly at the beginning of the buffer.
+  if (operation.has_data_offset())
+    TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
+  TEST_AND_RETURN_FALSE(buffer_size_ == operation.data_length());
+
+  ParallelOperation pop;
+  pop.operation = &operation;
+  pop.operation_num = next_operation_num_ + parallel_operations_.size();
+  if (buffer_size_ > 0) {
+    TEST_AND_RETURN_FALSE(HashCalculator::UpdateLanes(
+        {{&payload_hash_calculator_, buffer_data_, buffer_size_},
+         {&signed_hash_calculator_, buffer_data_, buffer_size_}}));
+    buffer_offset_ += buffer_size_;
+    if (buffer_.empty() && queue_uncopied_blobs_) {
+      // The blob points into the data passed to Write(), which applies the
+      // operation before returning.
+      pop.uncopied_data = reinterpret_cast<const uint8_t*>(buffer_data_);
+      pop.uncopied_data_size = buffer_size_;
+      num_uncopied_blobs_++;
+    } else if (buffer_.empty()) {
+      // The blob points into the data passed to Write(), which won't be around
+      // when the operation is applied.
+      pop.data = TakeSpareBuffer();
+      pop.data.assign(buffer_data_, buffer_data_ + buffer_size_);
+    } else {
+      pop.data.swap(buffer_);
+      buffer_ = TakeSpareBuffer();
+    }
+    buffer_data_ = buffer_.data();
+    buffer_size_ = 0;
+  }
+  TakePrefetchedSource(pop.operation_num, &pop.source_data);
+  AddExtents(&parallel_dst_blocks_, operation.dst_extents());
+  parallel_operations_data_size_ +=
+      pop.data.size() + pop.uncopied_data_size + pop.source_data.size();
+  parallel_operations_.push_back(std::move(pop));
   return true;
 }
 
+bool DeltaPerformer::TakePrefetchedSource(size_t operation_num,
+                                          brillo::Blob* source_data) {
+  if (!source_prefetcher_)
+    return false;
+  const size_t partition_first_operation =
+      current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0;
+  return source_prefetcher_->Take(operation_num - partition_first_operation,
+                                  source_data);
+}
+
+bool DeltaPerformer::ApplyParallelOperations(ErrorCode* error) {
+  if (parallel_operations_.empty())
+    return true;
+
+  // Makes sure we unblock exit when these operations complete.
+  ScopedTerminatorExitUnblocker exit_unblocker =
+      ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+
+  // The operations applied before the batch may still be in the write cache of
+  // |target_fd_|, which the workers bypass. Flushing it later would overwrite
+  // the blocks the workers write.
+  if (!target_fd_->Flush()) {
+    PLOG(ERROR) << "Unable to flush " << target_path_;
+    *error = ErrorCode::kDownloadWriteError;
+    return false;
+  }
+
+  applied_operations_.swap(parallel_operations_);
+  parallel_operations_data_size_ = 0;
+  parallel_dst_blocks_.clear();
+  num_uncopied_blobs_ = 0;
+
+  if (!operation_thread_pool_)
+    StartOperationWorkers();
+  const size_t num_workers =
+      min(operation_workers_.size(), applied_operations_.size());
+  next_applied_operation_ = 0;
+  running_operation_workers_ = num_workers;
+  for (size_t i = 0; i < num_workers; i++)
+    operation_thread_pool_->AddWork(operation_workers_[i].get());
+  operation_workers_done_.Wait();
+
+  vector<ParallelOperation> operations;
+  operations.swap(applied_operations_);
+  for (ParallelOperation& pop : operations)
+    RecycleBuffer(&pop.data);
+
+  // Operations are handed out in order and the workers only stop early after a
+  // failure, so the first operation without a result is the one that failed.
+  for (const ParallelOperation& pop : operations) {
+    if (!pop.result) {
+      *error = pop.error;
+      return HandleOpResult(false,
+                            InstallOperationTypeName(pop.operation->type()),
+                            pop.operation_num,
+                            error);
+    }
+  }
+
+  for (const auto& fds : parallel_fds_) {
+    if (!fds.second->Flush()) {
+      PLOG(ERROR) << "Unable to flush " << target_path_;
+      *error = ErrorCode::kDownloadWriteError;
+      return false;
+    }
+  }
+
+  for (const ParallelOperation& pop : operations)
+    OperationApplied(*pop.operation);
+  next_operation_num_ += operations.size();
+  UpdateOverallProgress(false, "Completed ");
+  return MaybeCheckpointUpdateProgress(false, error);
+}
+
+void DeltaPerformer::DiscardParallelOperations() {
+  // Operations still queued weren't checkpointed, so a resumed update will
+  // download and apply them again.
+  LOG_IF(INFO, !parallel_operations_.empty())
+      << "Discarding " << parallel_operations_.size()
+      << " operations not yet applied";
+  parallel_operations_.clear();
+  parallel_operations_data_size_ = 0;
+  parallel_dst_blocks_.clear();
+  num_uncopied_blobs_ = 0;
+}
+
+void DeltaPerformer::StartOperationWorkers() {
+  operation_thread_pool_.reset(
+      new base::DelegateSimpleThreadPool("delta-performer",
+                                         parallel_fds_.size()));
+  operation_thread_pool_->Start();
+  for (const auto& fds : parallel_fds_) {
+    operation_workers_.emplace_back(
+        new OperationWorker(fds.first,
+                            fds.second,
+                            block_size_,
+                            &xz_decoder_pool_,
+                            &applied_operations_,
+                            &next_applied_operation_,
+                            &running_operation_workers_,
+                            &operation_workers_done_));
+  }
+}
+
+void DeltaPerformer::StopOperationWorkers() {
+  if (operation_thread_pool_) {
+    operation_thread_pool_->JoinAll();
+    operation_thread_pool_.reset();
+  }
+  operation_workers_.clear();
+}
+
 bool DeltaPerformer::ExtractSignatureMessageFromOperation(
     const InstallOperation& operation) {
   if (operation.type() != InstallOperation::REPLACE ||
@@ -1348,10 +2683,10 @@ bool DeltaPerformer::ExtractSignatureMessageFromOperation(
 bool DeltaPerformer::ExtractSignatureMessage() {
   TEST_AND_RETURN_FALSE(signatures_message_data_.empty());
   TEST_AND_RETURN_FALSE(buffer_offset_ == manifest_.signatures_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= manifest_.signatures_size());
+  TEST_AND_RETURN_FALSE(buffer_size_ >= manifest_.signatures_size());
   signatures_message_data_.assign(
-      buffer_.begin(),
-      buffer_.begin() + manifest_.signatures_size());
+      buffer_data_,
+      buffer_data_ + manifest_.signatures_size());
 
   // Save the signature blob because if the update is interrupted after the
   // download phase we don't go through this path anymore. Some alternatives to
@@ -1462,6 +2797,31 @@ ErrorCode DeltaPerformer::ValidateManifest() {
   return ErrorCode::kSuccess;
 }
 
+bool DeltaPerformer::CheckOperationHash(const InstallOperation& operation,
+                                        ErrorCode* error) {
+  // Validate the operation only if the metadata signature is present.
+  // Otherwise, keep the old behavior. This serves as a knob to disable
+  // the validation logic in case we find some regression after rollout.
+  // NOTE: If hash checks are mandatory and if metadata_signature is empty,
+  // we would have already failed in ParsePayloadMetadata method and thus not
+  // even be here. So no need to handle that case again here.
+  if (payload_->metadata_signature.empty())
+    return true;
+
+  *error = ValidateOperationHash(operation);
+  if (*error != ErrorCode::kSuccess) {
+    if (install_plan_->hash_checks_mandatory) {
+      LOG(ERROR) << "Mandatory operation hash check failed";
+      return false;
+    }
+
+    // For non-mandatory cases, just send a UMA stat.
+    LOG(WARNING) << "Ignoring operation validation errors";
+    *error = ErrorCode::kSuccess;
+  }
+  return true;
+}
+
 ErrorCode DeltaPerformer::ValidateOperationHash(
     const InstallOperation& operation) {
   if (!operation.data_sha256_hash().size()) {
@@ -1505,8 +2865,16 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
                            operation.data_sha256_hash().size()));
 
   brillo::Blob calculated_op_hash;
-  if (!HashCalculator::RawHashOfBytes(
-          buffer_.data(), operation.data_length(), &calculated_op_hash)) {
+  if (streaming_hash_calculator_) {
+    // The blob of a streamed operation was hashed as it was received.
+    if (!streaming_hash_calculator_->Finalize()) {
+      LOG(ERROR) << "Unable to compute actual hash of operation "
+                 << next_operation_num_;
+      return ErrorCode::kDownloadOperationHashVerificationError;
+    }
+    calculated_op_hash = streaming_hash_calculator_->raw_hash();
+  } else if (!HashCalculator::RawHashOfBytes(
+                 buffer_data_, operation.data_length(), &calculated_op_hash)) {
     LOG(ERROR) << "Unable to compute actual hash of operation "
                << next_operation_num_;
     return ErrorCode::kDownloadOperationHashVerificationError;
@@ -1601,14 +2969,43 @@ void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
                                    size_t signed_hash_buffer_size) {
   // Update the buffer offset.
   if (do_advance_offset)
-    buffer_offset_ += buffer_.size();
+    buffer_offset_ += buffer_size_;
+
+  // Hash the content. Both hashes cover mostly the same data, so they're
+  // computed in parallel lanes.
+  HashCalculator::UpdateLanes(
+      {{&payload_hash_calculator_, buffer_data_, buffer_size_},
+       {&signed_hash_calculator_, buffer_data_, signed_hash_buffer_size}});
+
+  // Keep the allocated memory around for the next operation, unless it's
+  // larger than what most operations need.
+  buffer_.clear();
+  if (buffer_.capacity() > kMaxRetainedBufferSize)
+    brillo::Blob().swap(buffer_);
+  buffer_data_ = buffer_.data();
+  buffer_size_ = 0;
+}
 
-  // Hash the content.
-  payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
-  signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+brillo::Blob DeltaPerformer::TakeSpareBuffer() {
+  brillo::Blob blob;
+  if (!spare_buffers_.empty()) {
+    blob.swap(spare_buffers_.back());
+    spare_buffers_.pop_back();
+    spare_buffers_capacity_ -= blob.capacity();
+  }
+  return blob;
+}
 
-  // Swap content with an empty vector to ensure that all memory is released.
-  brillo::Blob().swap(buffer_);
+void DeltaPerformer::RecycleBuffer(brillo::Blob* blob) {
+  if (blob->capacity() == 0 || blob->capacity() > kMaxRetainedBufferSize ||
+      spare_buffers_capacity_ + blob->capacity() >
+          kMaxParallelOperationsDataSize) {
+    brillo::Blob().swap(*blob);
+    return;
+  }
+  blob->clear();
+  spare_buffers_capacity_ += blob->capacity();
+  spare_buffers_.push_back(std::move(*blob));
 }
 
 bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
@@ -1616,7 +3013,7 @@ bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
   int64_t next_operation = kUpdateStateOperationInvalid;
   if (!(prefs->GetInt64(kPrefsUpdateStateNextOperation, &next_operation) &&
         next_operation != kUpdateStateOperationInvalid &&
-        next_operation > 0))
+        (next_operation > 0 || HasOperationProgress(prefs, next_operation))))
     return false;
 
   string interrupted_hash;
@@ -1663,9 +3060,12 @@ bool DeltaPerformer::ResetUpdateProgress(PrefsInterface* prefs, bool quick) {
   if (!quick) {
     prefs->SetInt64(kPrefsUpdateStateNextDataOffset, -1);
     prefs->SetInt64(kPrefsUpdateStateNextDataLength, 0);
+    prefs->SetInt64(kPrefsUpdateStateOperationProgress, 0);
+    prefs->SetString(kPrefsUpdateStateOperationSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSignedSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSignatureBlob, "");
+    prefs->Delete(kPrefsUpdateStateSourceChecked);
     prefs->SetInt64(kPrefsManifestMetadataSize, -1);
     prefs->SetInt64(kPrefsManifestSignatureSize, -1);
     prefs->SetInt64(kPrefsResumedUpdateFailures, 0);
@@ -1675,6 +3075,12 @@ bool DeltaPerformer::ResetUpdateProgress(PrefsInterface* prefs, bool quick) {
 }
 
 bool DeltaPerformer::CheckpointUpdateProgress() {
+  // The blobs of queued operations were already hashed, so the saved state
+  // would skip them.
+  DCHECK(parallel_operations_.empty());
+  // Likewise for the part of the blob of a streamed operation received so far,
+  // unless the operation can be resumed from there.
+  DCHECK(!streaming_writer_ || CanCheckpointStreamedOperation());
   Terminator::set_exit_blocked(true);
   if (last_updated_buffer_offset_ != buffer_offset_) {
     // Resets the progress in case we die in the middle of the state update.
@@ -1697,26 +3103,164 @@ bool DeltaPerformer::CheckpointUpdateProgress() {
           partition_index ? acc_num_operations_[partition_index - 1] : 0);
       const InstallOperation& op =
           partitions_[partition_index].operations(partition_operation_num);
-      TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataLength,
-                                             op.data_length()));
+      TEST_AND_RETURN_FALSE(prefs_->SetInt64(
+          kPrefsUpdateStateNextDataLength,
+          op.data_length() - (streaming_writer_ ? streaming_data_size_ : 0)));
     } else {
       TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataLength,
                                              0));
     }
+
+    // The part of the blob of the next operation already applied.
+    const uint64_t operation_progress =
+        streaming_writer_ ? streaming_data_size_ : 0;
+    if (operation_progress > 0 || checkpoint_operation_progress_ > 0) {
+      TEST_AND_RETURN_FALSE(prefs_->SetString(
+          kPrefsUpdateStateOperationSHA256Context,
+          operation_progress > 0 ? streaming_hash_calculator_->GetContext()
+                                 : ""));
+      TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateOperationProgress,
+                                             operation_progress));
+    }
+    checkpoint_operation_progress_ = operation_progress;
   }
   TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextOperation,
                                          next_operation_num_));
+  checkpoint_operation_num_ = next_operation_num_;
+  checkpoint_buffer_offset_ = buffer_offset_;
+  checkpoint_time_ = base::TimeTicks::Now();
+  return true;
+}
+
+bool DeltaPerformer::ShouldCheckpointUpdateProgress() const {
+  // In-place operations may read blocks written by the following operations,
+  // so only the interrupted one can be applied again.
+  if (GetMinorVersion() == kInPlaceMinorPayloadVersion)
+    return true;
+  if (next_operation_num_ >= acc_num_operations_[current_partition_])
+    return true;
+  return next_operation_num_ - checkpoint_operation_num_ >=
+             checkpoint_policy_.max_operations ||
+         buffer_offset_ - checkpoint_buffer_offset_ >=
+             checkpoint_policy_.max_data_size ||
+         base::TimeTicks::Now() - checkpoint_time_ >=
+             checkpoint_policy_.max_interval;
+}
+
+bool DeltaPerformer::MaybeCheckpointUpdateProgress(bool force,
+                                                   ErrorCode* error) {
+  applied_buffer_offset_ = buffer_offset_;
+  if (!force && !ShouldCheckpointUpdateProgress())
+    return true;
+  if (target_fd_ && !target_fd_->Flush()) {
+    PLOG(ERROR) << "Unable to flush " << target_path_;
+    *error = ErrorCode::kDownloadWriteError;
+    return false;
+  }
+  HashWrittenTargetBlocks();
+  CheckpointUpdateProgress();
   return true;
 }
 
+bool DeltaPerformer::MaybeCheckpointStreamedOperation(ErrorCode* error) {
+  if (!CanCheckpointStreamedOperation())
+    return true;
+  if (buffer_offset_ - checkpoint_buffer_offset_ <
+          checkpoint_policy_.max_data_size &&
+      base::TimeTicks::Now() - checkpoint_time_ <
+          checkpoint_policy_.max_interval) {
+    return true;
+  }
+  return MaybeCheckpointUpdateProgress(true, error);
+}
+
+void DeltaPerformer::OperationApplied(const InstallOperation& operation) {
+  if (source_cache_)
+    source_cache_->OperationApplied(operation);
+  AddWrittenTargetBlocks(operation);
+}
+
+void DeltaPerformer::AddWrittenTargetBlocks(
+    const InstallOperation& operation) {
+  if (!target_hash_calculator_)
+    return;
+  for (const Extent& extent : operation.dst_extents()) {
+    if (extent.start_block() < target_hashed_blocks_) {
+      LOG(INFO) << "Operation " << next_operation_num_
+                << " rewrites target blocks already hashed, the partition will "
+                   "be hashed after it's written.";
+      target_hash_calculator_.reset();
+      target_written_blocks_.clear();
+      return;
+    }
+  }
+  MergeExtents(&target_written_blocks_, operation.dst_extents());
+}
+
+void DeltaPerformer::HashWrittenTargetBlocks() {
+  if (!target_hash_calculator_)
+    return;
+  const size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  InstallPlan::Partition* install_part =
+      &install_plan_->partitions[num_previous_partitions + current_partition_];
+  const uint64_t target_size = install_part->target_size;
+
+  // Hashes the blocks written right after the ones already hashed. Ranges are
+  // merged, so at most one range starts there.
+  auto it = target_written_blocks_.begin();
+  if (it != target_written_blocks_.end() &&
+      it->first == target_hashed_blocks_) {
+    // Blocks past the end of the partition are not part of its hash.
+    const uint64_t start = it->first * block_size_;
+    const uint64_t end =
+        std::max(start, std::min(it->second * block_size_, target_size));
+    brillo::Blob buffer(std::min(end - start, kCacheSize));
+    for (uint64_t offset = start; offset < end; offset += buffer.size()) {
+      const size_t bytes_to_read = std::min(end - offset, buffer.size());
+      ssize_t bytes_read;
+      if (!utils::PReadAll(target_fd_, buffer.data(), bytes_to_read, offset,
+                           &bytes_read) ||
+          bytes_read != static_cast<ssize_t>(bytes_to_read) ||
+          !target_hash_calculator_->Update(buffer.data(), bytes_read)) {
+        LOG(WARNING) << "Unable to hash the target partition while it's "
+                        "written, it will be hashed after it's written.";
+        target_hash_calculator_.reset();
+        target_written_blocks_.clear();
+        return;
+      }
+    }
+    target_hashed_blocks_ = it->second;
+    target_written_blocks_.erase(it);
+  }
+
+  // Once the last operation of the partition was applied, the hash is complete
+  // if all of it was written.
+  if (next_operation_num_ < acc_num_operations_[current_partition_])
+    return;
+  if (target_hashed_blocks_ * block_size_ >= target_size &&
+      target_hash_calculator_->Finalize()) {
+    install_part->written_target_hash = target_hash_calculator_->raw_hash();
+    LOG(INFO) << "Hashed partition " << install_part->name
+              << " while it was written.";
+  } else {
+    LOG(INFO) << "Partition " << install_part->name
+              << " wasn't written in order, it will be hashed after it's "
+                 "written.";
+  }
+  target_hash_calculator_.reset();
+  target_written_blocks_.clear();
+}
+
 bool DeltaPerformer::PrimeUpdateState() {
   CHECK(manifest_valid_);
   block_size_ = manifest_.block_size();
+  checkpoint_time_ = base::TimeTicks::Now();
 
   int64_t next_operation = kUpdateStateOperationInvalid;
   if (!prefs_->GetInt64(kPrefsUpdateStateNextOperation, &next_operation) ||
       next_operation == kUpdateStateOperationInvalid ||
-      next_operation <= 0) {
+      (next_operation <= 0 && !HasOperationProgress(prefs_, next_operation))) {
     // Initiating a new update, no more state needs to be initialized.
     return true;
   }
@@ -1728,6 +3272,9 @@ bool DeltaPerformer::PrimeUpdateState() {
                                          &next_data_offset) &&
                         next_data_offset >= 0);
   buffer_offset_ = next_data_offset;
+  checkpoint_operation_num_ = next_operation_num_;
+  checkpoint_buffer_offset_ = buffer_offset_;
+  applied_buffer_offset_ = buffer_offset_;
 
   // The signed hash context and the signature blob may be empty if the
   // interrupted update didn't reach the signature.
@@ -1749,6 +3296,19 @@ bool DeltaPerformer::PrimeUpdateState() {
                                           &hash_context) &&
                         payload_hash_calculator_.SetContext(hash_context));
 
+  // The next operation may have been partially applied from the first part of
+  // its blob, see ResumeStreamedOperation().
+  int64_t operation_progress = 0;
+  if (prefs_->GetInt64(kPrefsUpdateStateOperationProgress,
+                       &operation_progress) &&
+      operation_progress > 0) {
+    TEST_AND_RETURN_FALSE(
+        prefs_->GetString(kPrefsUpdateStateOperationSHA256Context,
+                          &resumed_operation_hash_context_));
+    resumed_operation_progress_ = operation_progress;
+    checkpoint_operation_progress_ = operation_progress;
+  }
+
   int64_t manifest_metadata_size = 0;
   TEST_AND_RETURN_FALSE(prefs_->GetInt64(kPrefsManifestMetadataSize,
                                          &manifest_metadata_size) &&
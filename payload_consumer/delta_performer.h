@@ -19,10 +19,16 @@
 
 #include <inttypes.h>
 
+#include <atomic>
 #include <limits>
+#include <map>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include <base/synchronization/waitable_event.h>
+#include <base/threading/simple_thread.h>
 #include <base/time/time.h>
 #include <brillo/secure_blob.h>
 #include <google/protobuf/repeated_field.h>
@@ -30,10 +36,14 @@
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_writer.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_consumer/source_block_cache.h"
+#include "update_engine/payload_consumer/source_prefetcher.h"
+#include "update_engine/payload_consumer/xz_extent_writer.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -63,6 +73,25 @@ class DeltaPerformer : public FileWriter {
   // operations. They must add up to one hundred (100).
   static const unsigned kProgressDownloadWeight;
   static const unsigned kProgressOperationsWeight;
+  // Default limits of the CheckpointPolicy.
+  static const size_t kCheckpointMaxOperations;
+  static const uint64_t kCheckpointMaxDataSize;
+  static const unsigned kCheckpointIntervalSeconds;
+
+  // Limits on the progress made since the update progress was last
+  // checkpointed. After an operation is applied, a new checkpoint is saved only
+  // once any of them is reached, so that an update made of many small
+  // operations doesn't rewrite the whole progress state after each of them.
+  struct CheckpointPolicy {
+    // The number of operations applied.
+    size_t max_operations{kCheckpointMaxOperations};
+    // The number of payload data bytes consumed, which would be downloaded
+    // again when resuming.
+    uint64_t max_data_size{kCheckpointMaxDataSize};
+    // The time elapsed.
+    base::TimeDelta max_interval{
+        base::TimeDelta::FromSeconds(kCheckpointIntervalSeconds)};
+  };
 
   DeltaPerformer(PrefsInterface* prefs,
                  BootControlInterface* boot_control,
@@ -79,6 +108,10 @@ class DeltaPerformer : public FileWriter {
         payload_(payload),
         is_interactive_(is_interactive) {}
 
+  // Stops reading ahead the operations of |partitions_| before they're gone,
+  // and the threads applying operations in parallel.
+  ~DeltaPerformer() override;
+
   // FileWriter's Write implementation where caller doesn't care about
   // error codes.
   bool Write(const void* bytes, size_t count) override {
@@ -154,9 +187,18 @@ class DeltaPerformer : public FileWriter {
     public_key_path_ = public_key_path;
   }
 
+  void set_checkpoint_policy(const CheckpointPolicy& policy) {
+    checkpoint_policy_ = policy;
+  }
+
   // Return true if header parsing is finished and no errors occurred.
   bool IsHeaderParsed() const;
 
+  // Returns the size of the payload header, the manifest and the metadata
+  // signature, or 0 if the header wasn't parsed yet. Only this part of a
+  // payload already applied needs to be downloaded.
+  uint64_t GetMetadataAndSignatureSize() const;
+
   // Returns the delta minor version. If this value is defined in the manifest,
   // it returns that value, otherwise it returns the default value.
   uint32_t GetMinorVersion() const;
@@ -169,27 +211,75 @@ class DeltaPerformer : public FileWriter {
                                  const FileDescriptorPtr source_fd,
                                  ErrorCode* error);
 
+  // Returns the size of the cache puffin may use to apply a PUFFDIFF operation
+  // reading |source_size| bytes, when |available_memory| bytes of memory are
+  // available. The cache grows with the available memory, but is never larger
+  // than needed to hold the whole puffed source.
+  static size_t PuffCacheSize(uint64_t source_size, uint64_t available_memory);
+
  private:
   friend class DeltaPerformerTest;
   friend class DeltaPerformerIntegrationTest;
   FRIEND_TEST(DeltaPerformerTest, BrilloMetadataSignatureSizeTest);
   FRIEND_TEST(DeltaPerformerTest, BrilloParsePayloadMetadataTest);
   FRIEND_TEST(DeltaPerformerTest, UsePublicKeyFromResponse);
+  FRIEND_TEST(DeltaPerformerTest, CheckSourcePartitionTest);
+
+  // Parses and applies the |count| bytes of the payload at |bytes|, see
+  // Write().
+  bool WriteImpl(const void* bytes, size_t count, ErrorCode* error);
 
   // Parse and move the update instructions of all partitions into our local
   // |partitions_| variable based on the version of the payload. Requires the
   // manifest to be parsed and valid.
   bool ParseManifestPartitions(ErrorCode* error);
 
+  // Validates the source of the operations not applied yet of all the
+  // partitions, checking the partitions in parallel, so that an A/B delta
+  // update whose source doesn't match fails before the data of any operation
+  // is downloaded. The check stops early if the delegate cancels the update
+  // meanwhile, setting |error| to the reason. The success is saved in the prefs so that a resumed update
+  // doesn't read the source again. In the partitions whose whole source
+  // matched their hash, only a sample of the SOURCE_COPY operations keep their
+  // source hash to validate it again while they're applied.
+  bool CheckSourcePartitions(ErrorCode* error);
+
+  // Validates the source hash of the operations of |partition| from index
+  // |first_operation| on against |source_path|. They all match if the whole
+  // source matches the |old_partition_info| of |partition|, which is checked
+  // first, setting |matches_partition_hash| in that case. |error| is set as
+  // in ValidateSourceHash() on failure. Returns false as soon as |canceled| is
+  // set.
+  static bool CheckSourcePartition(const PartitionUpdate& partition,
+                                   size_t first_operation,
+                                   const std::string& source_path,
+                                   uint32_t block_size,
+                                   const std::atomic<bool>& canceled,
+                                   bool* matches_partition_hash,
+                                   ErrorCode* error);
+
+  // The delegate checking the source of a partition in
+  // CheckSourcePartitions().
+  class SourceCheckWorker;
+
   // Appends up to |*count_p| bytes from |*bytes_p| to |buffer_|, but only to
   // the extent that the size of |buffer_| does not exceed |max|. Advances
   // |*cbytes_p| and decreases |*count_p| by the actual number of bytes copied,
   // and returns this number.
   size_t CopyDataToBuffer(const char** bytes_p, size_t* count_p, size_t max);
 
+  // Same as CopyDataToBuffer(), except that when |buffer_| is empty and
+  // |*bytes_p| holds at least |max| bytes, |buffer_data_| is pointed directly
+  // at them instead of copying them. In that case the data must be processed
+  // before returning from Write().
+  size_t ReadDataToBuffer(const char** bytes_p, size_t* count_p, size_t max);
+
   // If |op_result| is false, emits an error message using |op_type_name| and
-  // sets |*error| accordingly. Otherwise does nothing. Returns |op_result|.
-  bool HandleOpResult(bool op_result, const char* op_type_name,
+  // the payload-wide operation index |op_num| and sets |*error| accordingly.
+  // Otherwise does nothing. Returns |op_result|.
+  bool HandleOpResult(bool op_result,
+                      const char* op_type_name,
+                      size_t op_num,
                       ErrorCode* error);
 
   // Logs the progress of downloading/applying an update.
@@ -211,6 +301,45 @@ class DeltaPerformer : public FileWriter {
   // Returns ErrorCode::kSuccess on match or a suitable error code otherwise.
   ErrorCode ValidateOperationHash(const InstallOperation& operation);
 
+  // Validates the hash of the blob of |operation| if the metadata signature is
+  // present, setting |error| and returning false only if the validation failed
+  // and hash checks are mandatory.
+  bool CheckOperationHash(const InstallOperation& operation, ErrorCode* error);
+
+  // Returns whether the compressed operations of this payload may be decoded
+  // while their blob is received, before its hash is validated: only unsigned
+  // payloads, used for development and testing, without mandatory hash checks.
+  // REPLACE operations are streamed for any payload, see
+  // ShouldStreamOperation().
+  bool CanStreamOperations() const;
+
+  // Returns whether |operation| should be applied while its blob is received
+  // instead of buffering the whole blob first, given that |available| bytes of
+  // it were passed to the current Write() call.
+  bool ShouldStreamOperation(const InstallOperation& operation,
+                             size_t available) const;
+
+  // Passes the bytes of the blob of |operation| at |*bytes_p| to
+  // |streaming_writer_|, creating it first if needed. Advances |*bytes_p| and
+  // decreases |*count_p| by the number of bytes consumed. Once the whole blob
+  // was received, completes the operation, validates its hash and resets
+  // |streaming_writer_|. Returns false on error, setting |error| if known.
+  bool StreamOperation(const InstallOperation& operation,
+                       const char** bytes_p,
+                       size_t* count_p,
+                       ErrorCode* error);
+
+  // Recreates |streaming_writer_| to resume applying |operation| after the
+  // |resumed_operation_progress_| bytes of its blob applied before the update
+  // was interrupted. Returns false if the operation can't be resumed.
+  bool ResumeStreamedOperation(const InstallOperation& operation);
+
+  // Returns whether the progress of the operation being streamed can be
+  // checkpointed. Only the blob of REPLACE operations is written to the target
+  // as is, so they can be resumed from the part of their blob already applied;
+  // the state of the decompressors of the other operations isn't saved.
+  bool CanCheckpointStreamedOperation() const;
+
   // Returns true on success.
   bool PerformInstallOperation(const InstallOperation& operation);
 
@@ -228,6 +357,123 @@ class DeltaPerformer : public FileWriter {
   bool PerformPuffDiffOperation(const InstallOperation& operation,
                                 ErrorCode* error);
 
+  // These apply a specific type of operation reading from |source_fd| and
+  // writing to |target_fd|, with the operation blob in the |data_size| bytes
+  // at |data|. They don't use any member state, so they can be called from the
+  // worker threads applying operations in parallel. |error| is set as in the
+  // Perform*Operation() methods above. REPLACE_XZ operations take their
+  // decoder from |xz_decoder_pool|. The operations reading the source use the
+  // |source_data| read ahead and validated by a SourcePrefetcher, if not null,
+  // instead of reading |source_fd|.
+  static bool ApplyReplaceOperation(const InstallOperation& operation,
+                                    FileDescriptorPtr target_fd,
+                                    uint32_t block_size,
+                                    const uint8_t* data,
+                                    size_t data_size,
+                                    XzDecoderPool* xz_decoder_pool);
+  static bool ApplySourceCopyOperation(const InstallOperation& operation,
+                                       FileDescriptorPtr source_fd,
+                                       FileDescriptorPtr target_fd,
+                                       uint32_t block_size,
+                                       const brillo::Blob* source_data,
+                                       ErrorCode* error);
+  static bool ApplySourceBsdiffOperation(const InstallOperation& operation,
+                                         FileDescriptorPtr source_fd,
+                                         FileDescriptorPtr target_fd,
+                                         uint32_t block_size,
+                                         const uint8_t* data,
+                                         size_t data_size,
+                                         const brillo::Blob* source_data,
+                                         ErrorCode* error);
+  static bool ApplyPuffDiffOperation(const InstallOperation& operation,
+                                     FileDescriptorPtr source_fd,
+                                     FileDescriptorPtr target_fd,
+                                     uint32_t block_size,
+                                     const uint8_t* data,
+                                     size_t data_size,
+                                     const brillo::Blob* source_data,
+                                     ErrorCode* error);
+
+  // Dispatches |operation| to one of the Apply*Operation() methods above. Only
+  // the operation types accepted by CanApplyInParallel() are supported.
+  static bool ApplyOperation(const InstallOperation& operation,
+                             FileDescriptorPtr source_fd,
+                             FileDescriptorPtr target_fd,
+                             uint32_t block_size,
+                             const uint8_t* data,
+                             size_t data_size,
+                             XzDecoderPool* xz_decoder_pool,
+                             const brillo::Blob* source_data,
+                             ErrorCode* error);
+
+  // An operation whose blob was already received and validated, waiting in
+  // |parallel_operations_| to be applied together with other operations.
+  struct ParallelOperation {
+    const InstallOperation* operation{nullptr};
+    // Index of the operation in the whole payload.
+    size_t operation_num{0};
+    // The operation blob, moved or copied out of |buffer_|.
+    brillo::Blob data;
+    // The operation blob when it points into the data passed to the current
+    // Write() call instead, see |queue_uncopied_blobs_|.
+    const uint8_t* uncopied_data{nullptr};
+    size_t uncopied_data_size{0};
+    // The source data taken from |source_prefetcher_|, if any.
+    brillo::Blob source_data;
+    // Result of applying the operation; only valid after
+    // ApplyParallelOperations() ran it.
+    bool result{false};
+    ErrorCode error{ErrorCode::kSuccess};
+  };
+
+  // The delegate run by each worker thread in ApplyParallelOperations().
+  class OperationWorker;
+
+  // Opens one extra pair of source and target file descriptors per worker
+  // thread on the current partition, since FileDescriptor instances can't be
+  // shared between threads. Returns false if operations should be applied
+  // serially on this partition.
+  bool OpenParallelFileDescriptors();
+
+  // Closes the file descriptors opened by OpenParallelFileDescriptors(),
+  // stopping the worker threads using them first. Returns 0 on success or
+  // -errno on error.
+  int CloseParallelFileDescriptors();
+
+  // Starts one worker thread per pair of |parallel_fds_|, kept for all the
+  // batches of operations applied in parallel on the current partition.
+  void StartOperationWorkers();
+
+  // Waits for the worker threads started by StartOperationWorkers() to exit.
+  void StopOperationWorkers();
+
+  // Returns whether |operation| can be queued in |parallel_operations_|
+  // instead of being applied right away. Only the operations of full and A/B
+  // delta payloads, which never read from the target partition, are applied
+  // in parallel; two of them depend on each other only when their
+  // |dst_extents| overlap.
+  bool CanApplyInParallel(const InstallOperation& operation) const;
+
+  // Moves or copies the blob of |operation| out of |buffer_| into a new entry
+  // of |parallel_operations_|, updating the payload hashes like DiscardBuffer()
+  // does. Returns false if |buffer_| doesn't hold exactly that blob.
+  bool QueueParallelOperation(const InstallOperation& operation);
+
+  // Moves the source data of the operation at index |operation_num| in the
+  // whole payload, read ahead by |source_prefetcher_|, to |source_data|.
+  // Returns false if it wasn't read ahead.
+  bool TakePrefetchedSource(size_t operation_num, brillo::Blob* source_data);
+
+  // Applies all the operations in |parallel_operations_| concurrently and, on
+  // success, advances |next_operation_num_| past them and checkpoints the
+  // progress. The progress is never checkpointed while operations are queued,
+  // so the resume point is always at or before the first operation that was
+  // not applied yet.
+  bool ApplyParallelOperations(ErrorCode* error);
+
+  // Drops the operations in |parallel_operations_| without applying them.
+  void DiscardParallelOperations();
+
   // Extracts the payload signature message from the blob on the |operation| if
   // the offset matches the one specified by the manifest. Returns whether the
   // signature was extracted.
@@ -240,15 +486,63 @@ class DeltaPerformer : public FileWriter {
 
   // Updates the payload hash calculator with the bytes in |buffer_|, also
   // updates the signed hash calculator with the first |signed_hash_buffer_size|
-  // bytes in |buffer_|. Then discard the content, ensuring that memory is being
-  // deallocated. If |do_advance_offset|, advances the internal offset counter
-  // accordingly.
+  // bytes in |buffer_|. Then discard the content, keeping the memory allocated
+  // for the next operation unless it's too large. If |do_advance_offset|,
+  // advances the internal offset counter accordingly.
   void DiscardBuffer(bool do_advance_offset, size_t signed_hash_buffer_size);
 
+  // Returns an empty blob, reusing the memory of a blob passed to
+  // RecycleBuffer() if available.
+  brillo::Blob TakeSpareBuffer();
+
+  // Keeps the memory of |blob| to be returned by a later TakeSpareBuffer()
+  // call, or releases it if enough memory is kept already.
+  void RecycleBuffer(brillo::Blob* blob);
+
   // Checkpoints the update progress into persistent storage to allow this
   // update attempt to be resumed after reboot.
   bool CheckpointUpdateProgress();
 
+  // Returns whether the update progress should be checkpointed after the
+  // operation just applied, according to |checkpoint_policy_|.
+  bool ShouldCheckpointUpdateProgress() const;
+
+  // Called after each applied operation. Flushes the target partition and
+  // checkpoints the update progress if |force| is true or
+  // ShouldCheckpointUpdateProgress() returns true. Returns false and sets
+  // |error| only if the target partition couldn't be flushed; failing to save
+  // the checkpoint only makes a resumed update start from an older one.
+  //
+  // The checkpoint is crash consistent: the target partition is flushed before
+  // the progress is saved, so it never covers data not written to disk yet,
+  // and the next operation number is saved last and invalidated first, so a
+  // checkpoint interrupted while being saved is ignored. After a crash, the
+  // operations applied since the last checkpoint are downloaded and applied
+  // again. This is safe because they only read the source partition, except
+  // in in-place payloads where each operation is checkpointed. The end of each
+  // partition is always checkpointed since only the current one is flushed.
+  bool MaybeCheckpointUpdateProgress(bool force, ErrorCode* error);
+
+  // Called while an operation is streamed, after each part of its blob was
+  // applied. Checkpoints the progress within the operation, if possible, once
+  // |checkpoint_policy_| limits on data size or time are reached.
+  bool MaybeCheckpointStreamedOperation(ErrorCode* error);
+
+  // Called after applying |operation|, before moving to the next operation.
+  void OperationApplied(const InstallOperation& operation);
+
+  // Records the target blocks written by |operation|, just applied, to be
+  // hashed by HashWrittenTargetBlocks(). Gives up hashing the target partition
+  // if |operation| rewrites blocks already hashed.
+  void AddWrittenTargetBlocks(const InstallOperation& operation);
+
+  // Called once the target partition was flushed. Updates the hash of the
+  // target partition with the written blocks following the ones hashed so far,
+  // reading them back while they are still cached. After the last operation of
+  // the partition, stores the hash in the InstallPlan if the whole partition
+  // was hashed, so the FilesystemVerifierAction doesn't need to read it again.
+  void HashWrittenTargetBlocks();
+
   // Primes the required update state. Returns true if the update state was
   // successfully initialized to a saved resume state or if the update is a new
   // update. Returns false otherwise.
@@ -283,6 +577,16 @@ class DeltaPerformer : public FileWriter {
   // partition when using a delta payload.
   FileDescriptorPtr source_fd_{nullptr};
 
+  // The cache of the source blocks read more than once, shared by |source_fd_|
+  // and the source file descriptors in |parallel_fds_|. Only set along with
+  // |source_fd_| for A/B delta payloads.
+  std::shared_ptr<SourceBlockCache> source_cache_;
+
+  // Reads and validates the source of the next operations of the current
+  // partition ahead of them, on its own source file descriptor. Only set along
+  // with |source_cache_|.
+  std::unique_ptr<SourcePrefetcher> source_prefetcher_;
+
   // File descriptor of the target partition. Only set while performing the
   // operations of a given partition.
   FileDescriptorPtr target_fd_{nullptr};
@@ -291,13 +595,90 @@ class DeltaPerformer : public FileWriter {
   std::string source_path_;
   std::string target_path_;
 
+  // Source and target file descriptors for each worker thread applying
+  // operations in parallel, without source file descriptors for full payloads.
+  // Empty when the operations of the current partition are applied serially.
+  std::vector<std::pair<FileDescriptorPtr, FileDescriptorPtr>> parallel_fds_;
+
+  // Operations received but not applied yet, in payload order. They are all
+  // from the current partition and start at |next_operation_num_|.
+  std::vector<ParallelOperation> parallel_operations_;
+
+  // The threads running |operation_workers_|, started on the first batch of
+  // operations applied in parallel on the current partition.
+  std::unique_ptr<base::DelegateSimpleThreadPool> operation_thread_pool_;
+  std::vector<std::unique_ptr<base::DelegateSimpleThread::Delegate>>
+      operation_workers_;
+
+  // The batch of operations being applied by |operation_workers_|, the index
+  // of the next one to hand out and the number of workers still running it.
+  // |operation_workers_done_| is signaled once the last worker is done.
+  std::vector<ParallelOperation> applied_operations_;
+  std::atomic<size_t> next_applied_operation_{0};
+  std::atomic<size_t> running_operation_workers_{0};
+  base::WaitableEvent operation_workers_done_{
+      base::WaitableEvent::ResetPolicy::AUTOMATIC,
+      base::WaitableEvent::InitialState::NOT_SIGNALED};
+
+  // Total size of the blobs held in |parallel_operations_|.
+  uint64_t parallel_operations_data_size_{0};
+
+  // Whether the blobs of the operations queued by the current Write() call
+  // may point into its data, which it applies before returning, and the
+  // number of |parallel_operations_| doing so.
+  bool queue_uncopied_blobs_{false};
+  size_t num_uncopied_blobs_{0};
+
+  // Target blocks written by |parallel_operations_|, as a map from the first
+  // block of each range to the block past its end.
+  std::map<uint64_t, uint64_t> parallel_dst_blocks_;
+
+  // The xz decoders reused by the REPLACE_XZ operations, which must outlive
+  // the writers using them.
+  XzDecoderPool xz_decoder_pool_;
+
+  // The writer applying the operation at |next_operation_num_| while its blob
+  // is received, the hash of the part of the blob received so far and its size.
+  // See ShouldStreamOperation().
+  std::unique_ptr<ExtentWriter> streaming_writer_;
+  std::unique_ptr<HashCalculator> streaming_hash_calculator_;
+  uint64_t streaming_data_size_{0};
+  const InstallOperation* streaming_operation_{nullptr};
+
+  // The size of the blob of the operation at |next_operation_num_| applied
+  // before the update was interrupted, and the hash context of that part of
+  // the blob, loaded by PrimeUpdateState() and used by the next Write() call.
+  uint64_t resumed_operation_progress_{0};
+  std::string resumed_operation_hash_context_;
+
+  // The size of the blob of the streamed operation saved by the last
+  // checkpoint, or 0 if it saved no partially applied operation.
+  uint64_t checkpoint_operation_progress_{0};
+
+  // Hashes the target partition as it's written, or null if it can't be
+  // hashed before it's fully written. See HashWrittenTargetBlocks().
+  std::unique_ptr<HashCalculator> target_hash_calculator_;
+  // Number of blocks at the start of the target partition already hashed.
+  uint64_t target_hashed_blocks_{0};
+  // Target blocks written but not hashed yet, as a map from the first block of
+  // each range to the block past its end. The ranges don't overlap and aren't
+  // adjacent.
+  std::map<uint64_t, uint64_t> target_written_blocks_;
+
+  // Blobs of applied operations kept to hold the data of the next ones, and
+  // their total capacity.
+  std::vector<brillo::Blob> spare_buffers_;
+  size_t spare_buffers_capacity_{0};
+
   PayloadMetadata payload_metadata_;
 
   // Parsed manifest. Set after enough bytes to parse the manifest were
   // downloaded.
   DeltaArchiveManifest manifest_;
   bool manifest_parsed_{false};
-  bool manifest_valid_{false};
+  // Atomic since IsManifestValid() may be called from another thread while
+  // the payload is written from an AsyncFileWriter.
+  std::atomic<bool> manifest_valid_{false};
   uint64_t metadata_size_{0};
   uint32_t metadata_signature_size_{0};
   uint64_t major_payload_version_{0};
@@ -328,12 +709,31 @@ class DeltaPerformer : public FileWriter {
   // payload metadata; once that's downloaded and parsed, it stores data for the
   // next update operation.
   brillo::Blob buffer_;
+  // The data in the buffer. It points at |buffer_| unless the data was passed
+  // to the current Write() call in full, in which case it points directly at
+  // it to avoid copying it; see ReadDataToBuffer().
+  const uint8_t* buffer_data_{nullptr};
+  size_t buffer_size_{0};
   // Offset of buffer_ in the binary blobs section of the update.
   uint64_t buffer_offset_{0};
 
   // Last |buffer_offset_| value updated as part of the progress update.
   uint64_t last_updated_buffer_offset_{std::numeric_limits<uint64_t>::max()};
 
+  // Controls how often the update progress is checkpointed.
+  CheckpointPolicy checkpoint_policy_;
+
+  // The next operation, |buffer_offset_| and time of the last checkpoint,
+  // or of the start of the update if none was saved yet.
+  size_t checkpoint_operation_num_{0};
+  uint64_t checkpoint_buffer_offset_{0};
+  base::TimeTicks checkpoint_time_;
+
+  // The |buffer_offset_| right after the last applied operation. The progress
+  // can only be checkpointed when closing if the offset didn't move since,
+  // i.e. if no operation was partially consumed.
+  uint64_t applied_buffer_offset_{0};
+
   // The block size (parsed from the manifest).
   uint32_t block_size_{0};
 
@@ -20,6 +20,7 @@
 #include <sys/mount.h>
 
 #include <algorithm>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -34,6 +35,7 @@
 #include "update_engine/common/constants.h"
 #include "update_engine/common/fake_boot_control.h"
 #include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/fake_prefs.h"
 #include "update_engine/common/mock_prefs.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
@@ -122,6 +124,10 @@ class DeltaPerformerIntegrationTest : public ::testing::Test {
                                   uint64_t minor_version) {
     performer->supported_minor_version_ = minor_version;
   }
+
+  static size_t GetNextOperation(DeltaPerformer* performer) {
+    return performer->next_operation_num_;
+  }
 };
 
 static void CompareFilesByBlock(const string& a_file, const string& b_file,
@@ -709,6 +715,10 @@ static void ApplyDeltaFile(bool full_kernel, bool full_rootfs, bool noop,
       .WillRepeatedly(Return(true));
   EXPECT_CALL(prefs, SetString(kPrefsUpdateStateSignedSHA256Context, _))
       .WillRepeatedly(Return(true));
+  EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateOperationProgress, _))
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(prefs, SetString(kPrefsUpdateStateOperationSHA256Context, _))
+      .WillRepeatedly(Return(true));
   if (op_hash_test == kValidOperationData && signature_test != kSignatureNone) {
     EXPECT_CALL(prefs, SetString(kPrefsUpdateStateSignatureBlob, _))
         .WillOnce(Return(true));
@@ -966,6 +976,118 @@ void DoOperationHashMismatchTest(OperationHashTest op_hash_test,
   delete performer;
 }
 
+// Applies a delta payload in two attempts. The first one is interrupted in the
+// middle of the payload and the DeltaPerformer destroyed without closing it,
+// as if the device crashed. The second one resumes from the checkpoint saved by
+// the first one, which must produce the same partitions as a single attempt.
+void DoInterruptedUpdateTest() {
+  DeltaState state;
+  uint32_t minor_version = kSourceMinorPayloadVersion;
+  GenerateDeltaFile(false, false, false, -1, kSignatureGenerator, &state,
+                    minor_version);
+  ScopedPathUnlinker a_img_unlinker(state.a_img);
+  ScopedPathUnlinker b_img_unlinker(state.b_img);
+  ScopedPathUnlinker new_img_unlinker(state.result_img);
+  ScopedPathUnlinker delta_unlinker(state.delta_path);
+  ScopedPathUnlinker old_kernel_unlinker(state.old_kernel);
+  ScopedPathUnlinker new_kernel_unlinker(state.new_kernel);
+  ScopedPathUnlinker result_kernel_unlinker(state.result_kernel);
+
+  EXPECT_TRUE(PayloadSigner::LoadPayloadMetadata(
+      state.delta_path, nullptr, nullptr, nullptr, &state.metadata_size,
+      nullptr));
+  EXPECT_TRUE(utils::ReadFile(state.delta_path, &state.delta));
+
+  InstallPlan* install_plan = &state.install_plan;
+  install_plan->payloads = {{.metadata_size = state.metadata_size,
+                             .type = InstallPayloadType::kDelta}};
+  install_plan->source_slot = 0;
+  install_plan->target_slot = 1;
+  ASSERT_TRUE(PayloadSigner::GetMetadataSignature(
+      state.delta.data(),
+      state.metadata_size,
+      GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+      &install_plan->payloads[0].metadata_signature));
+
+  state.fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan->source_slot, state.a_img);
+  state.fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan->source_slot, state.old_kernel);
+  state.fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameRoot, install_plan->target_slot, state.result_img);
+  state.fake_boot_control_.SetPartitionDevice(
+      kLegacyPartitionNameKernel, install_plan->target_slot,
+      state.result_kernel);
+  EXPECT_CALL(state.mock_delegate_, ShouldCancel(_))
+      .WillRepeatedly(Return(false));
+
+  FakePrefs prefs;
+  DeltaPerformer::CheckpointPolicy checkpoint_policy;
+  checkpoint_policy.max_operations = 2;
+  checkpoint_policy.max_data_size = state.delta.size();
+  checkpoint_policy.max_interval = base::TimeDelta::FromHours(1);
+  auto create_performer = [&]() {
+    std::unique_ptr<DeltaPerformer> performer(
+        new DeltaPerformer(&prefs,
+                           &state.fake_boot_control_,
+                           &state.fake_hardware_,
+                           &state.mock_delegate_,
+                           install_plan,
+                           &install_plan->payloads[0],
+                           false /* is_interactive */));
+    performer->set_public_key_path(
+        GetBuildArtifactsPath(kUnittestPublicKeyPath));
+    performer->set_checkpoint_policy(checkpoint_policy);
+    DeltaPerformerIntegrationTest::SetSupportedVersion(performer.get(),
+                                                       minor_version);
+    return performer;
+  };
+
+  // Applies the first half of the payload, then "crashes".
+  std::unique_ptr<DeltaPerformer> performer = create_performer();
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_TRUE(performer->Write(state.delta.data(), state.delta.size() / 2,
+                               &error));
+  size_t applied_operations =
+      DeltaPerformerIntegrationTest::GetNextOperation(performer.get());
+  performer.reset();
+
+  // The checkpoint never covers operations not applied yet, and at most
+  // |max_operations| - 1 applied operations are not covered.
+  int64_t next_operation = 0;
+  EXPECT_TRUE(prefs.GetInt64(kPrefsUpdateStateNextOperation, &next_operation));
+  ASSERT_LT(0, next_operation);
+  EXPECT_LE(static_cast<size_t>(next_operation), applied_operations);
+  EXPECT_GT(checkpoint_policy.max_operations,
+            applied_operations - static_cast<size_t>(next_operation));
+  EXPECT_TRUE(prefs.SetString(kPrefsUpdateCheckResponseHash, "response-hash"));
+  EXPECT_TRUE(DeltaPerformer::CanResumeUpdate(&prefs, "response-hash"));
+
+  // Resumes the update the way DownloadAction does: the metadata is downloaded
+  // again, followed by the data from the checkpointed offset.
+  int64_t metadata_signature_size = 0;
+  int64_t next_data_offset = 0;
+  EXPECT_TRUE(prefs.GetInt64(kPrefsManifestSignatureSize,
+                             &metadata_signature_size));
+  EXPECT_TRUE(prefs.GetInt64(kPrefsUpdateStateNextDataOffset,
+                             &next_data_offset));
+  const size_t resume_offset =
+      state.metadata_size + metadata_signature_size + next_data_offset;
+  ASSERT_LT(resume_offset, state.delta.size());
+
+  performer = create_performer();
+  EXPECT_TRUE(performer->Write(state.delta.data(),
+                               state.metadata_size + metadata_signature_size,
+                               &error));
+  EXPECT_TRUE(performer->Write(state.delta.data() + resume_offset,
+                               state.delta.size() - resume_offset,
+                               &error));
+  EXPECT_EQ(ErrorCode::kSuccess, error);
+  EXPECT_EQ(0, performer->Close());
+
+  VerifyPayloadResult(performer.get(), &state, ErrorCode::kSuccess,
+                      minor_version);
+}
 
 TEST(DeltaPerformerIntegrationTest, RunAsRootSmallImageTest) {
   DoSmallImageTest(false, false, false, -1, kSignatureGenerator,
@@ -1043,4 +1165,8 @@ TEST(DeltaPerformerIntegrationTest, RunAsRootMandatoryOperationHashMismatchTest)
   DoOperationHashMismatchTest(kInvalidOperationData, true);
 }
 
+TEST(DeltaPerformerIntegrationTest, RunAsRootInterruptedSmallImageTest) {
+  DoInterruptedUpdateTest();
+}
+
 }  // namespace chromeos_update_engine
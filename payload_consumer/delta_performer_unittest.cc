@@ -19,6 +19,9 @@
 #include <endian.h>
 #include <inttypes.h>
 
+#include <algorithm>
+#include <atomic>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -40,10 +43,12 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/mock_download_action.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/xz.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -262,8 +267,16 @@ class DeltaPerformerTest : public ::testing::Test {
     fake_boot_control_.SetPartitionDevice(
         kLegacyPartitionNameKernel, install_plan_.source_slot, "/dev/null");
 
-    EXPECT_EQ(expect_success,
-              performer_.Write(payload_data.data(), payload_data.size()));
+    // Pass the payload in pieces of |write_size_| bytes, if set.
+    size_t write_size = write_size_ ? write_size_ : payload_data.size();
+    bool success = true;
+    for (size_t offset = 0; success && offset < payload_data.size();
+         offset += write_size) {
+      success = performer_.Write(
+          payload_data.data() + offset,
+          std::min(write_size, payload_data.size() - offset));
+    }
+    EXPECT_EQ(expect_success, success);
     EXPECT_EQ(0, performer_.Close());
 
     brillo::Blob partition_data;
@@ -375,9 +388,123 @@ class DeltaPerformerTest : public ::testing::Test {
     EXPECT_EQ(payload_.metadata_size, performer_.metadata_size_);
   }
 
+  // Interrupts the update in the middle of a large REPLACE operation, which is
+  // resumed from the part of its blob already applied.
+  void DoResumeStreamedReplaceOperationTest(bool sign_payload) {
+    brillo::Blob expected_data(160 * 4096);
+    std::minstd_rand random_engine(42);
+    for (uint8_t& byte : expected_data)
+      byte = random_engine();
+
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(0, 160);
+    aop.op.set_data_offset(0);
+    aop.op.set_data_length(expected_data.size());
+    aop.op.set_type(InstallOperation::REPLACE);
+    vector<AnnotatedOperation> aops = {aop};
+    brillo::Blob payload_data =
+        GeneratePayload(expected_data, aops, sign_payload);
+    if (sign_payload) {
+      ASSERT_TRUE(PayloadSigner::GetMetadataSignature(
+          payload_data.data(),
+          payload_.metadata_size,
+          GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+          &payload_.metadata_signature));
+      install_plan_.hash_checks_mandatory = true;
+      performer_.set_public_key_path(
+          GetBuildArtifactsPath(kUnittestPublicKeyPath));
+    }
+    // The blob follows the metadata signature, if any.
+    PayloadMetadata payload_metadata;
+    ErrorCode error;
+    ASSERT_EQ(MetadataParseResult::kSuccess,
+              payload_metadata.ParsePayloadHeader(
+                  payload_data, DeltaPerformer::kSupportedMajorPayloadVersion,
+                  &error));
+    const size_t metadata_size =
+        payload_.metadata_size + payload_metadata.GetMetadataSignatureSize();
+
+    string target_path;
+    EXPECT_TRUE(
+        utils::MakeTempFile("Partition-XXXXXX", &target_path, nullptr));
+    ScopedPathUnlinker partition_unlinker(target_path);
+    fake_boot_control_.SetPartitionDevice(
+        kLegacyPartitionNameRoot, install_plan_.target_slot, target_path);
+    fake_boot_control_.SetPartitionDevice(
+        kLegacyPartitionNameRoot, install_plan_.source_slot, "/dev/null");
+    fake_boot_control_.SetPartitionDevice(
+        kLegacyPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+    fake_boot_control_.SetPartitionDevice(
+        kLegacyPartitionNameKernel, install_plan_.source_slot, "/dev/null");
+
+    DeltaPerformer::CheckpointPolicy checkpoint_policy;
+    checkpoint_policy.max_data_size = 64 * 1024;
+    performer_.set_checkpoint_policy(checkpoint_policy);
+
+    // The update is interrupted in the middle of a block.
+    const size_t kWriteSize = 10000;
+    const uint64_t kAppliedSize = 100 * 4096 + 123;
+    const size_t interrupted_size = metadata_size + kAppliedSize;
+    for (size_t offset = 0; offset < interrupted_size; offset += kWriteSize) {
+      EXPECT_TRUE(performer_.Write(
+          payload_data.data() + offset,
+          std::min(kWriteSize, interrupted_size - offset)));
+    }
+    EXPECT_EQ(0, performer_.Close());
+
+    int64_t next_operation = -1;
+    int64_t operation_progress = 0;
+    int64_t next_data_offset = 0;
+    EXPECT_TRUE(
+        prefs_.GetInt64(kPrefsUpdateStateNextOperation, &next_operation));
+    EXPECT_EQ(0, next_operation);
+    EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateOperationProgress,
+                                &operation_progress));
+    EXPECT_EQ(static_cast<int64_t>(kAppliedSize), operation_progress);
+    EXPECT_TRUE(
+        prefs_.GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset));
+    EXPECT_EQ(static_cast<int64_t>(kAppliedSize), next_data_offset);
+
+    // Resumes with the manifest and its signature followed by the rest of the
+    // blob, like a resumed download does.
+    InstallPlan install_plan = install_plan_;
+    install_plan.partitions.clear();
+    InstallPlan::Payload payload = payload_;
+    DeltaPerformer resumed_performer(&prefs_,
+                                     &fake_boot_control_,
+                                     &fake_hardware_,
+                                     &mock_delegate_,
+                                     &install_plan,
+                                     &payload,
+                                     false /* is_interactive */);
+    if (sign_payload) {
+      resumed_performer.set_public_key_path(
+          GetBuildArtifactsPath(kUnittestPublicKeyPath));
+    }
+    EXPECT_TRUE(resumed_performer.Write(payload_data.data(), metadata_size));
+    EXPECT_TRUE(resumed_performer.Write(
+        payload_data.data() + interrupted_size,
+        payload_data.size() - interrupted_size));
+    EXPECT_EQ(0, resumed_performer.Close());
+
+    brillo::Blob partition_data;
+    EXPECT_TRUE(utils::ReadFile(target_path, &partition_data));
+    EXPECT_EQ(expected_data, partition_data);
+    EXPECT_TRUE(
+        prefs_.GetInt64(kPrefsUpdateStateNextOperation, &next_operation));
+    EXPECT_EQ(1, next_operation);
+    EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateOperationProgress,
+                                &operation_progress));
+    EXPECT_EQ(0, operation_progress);
+  }
+
   void SetSupportedMajorVersion(uint64_t major_version) {
     performer_.supported_major_version_ = major_version;
   }
+  // The number of bytes passed to each performer_.Write() call by
+  // ApplyPayloadToData(), or 0 to pass the whole payload at once.
+  size_t write_size_{0};
+
   FakePrefs prefs_;
   InstallPlan install_plan_;
   InstallPlan::Payload payload_;
@@ -454,6 +581,28 @@ TEST_F(DeltaPerformerTest, ReplaceOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+TEST_F(DeltaPerformerTest, SplitWriteTest) {
+  brillo::Blob blob_data;
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < 3; i++) {
+    brillo::Blob block(std::begin(kRandomString), std::end(kRandomString));
+    block.resize(4096, 'a' + i);  // block size
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aop.op.set_data_offset(blob_data.size());
+    aop.op.set_data_length(block.size());
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+    blob_data.insert(blob_data.end(), block.begin(), block.end());
+  }
+
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false);
+
+  // Operation blobs are received either in full or split across Write() calls.
+  write_size_ = 5000;
+  EXPECT_EQ(blob_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
 TEST_F(DeltaPerformerTest, ReplaceBzOperationTest) {
   brillo::Blob expected_data = brillo::Blob(std::begin(kRandomString),
                                             std::end(kRandomString));
@@ -494,6 +643,240 @@ TEST_F(DeltaPerformerTest, ReplaceXzOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+TEST_F(DeltaPerformerTest, WrittenTargetHashTest) {
+  // The first two blocks of the partition are written in reverse order, both
+  // before the partition is flushed.
+  brillo::Blob blob_data(std::begin(kRandomString), std::end(kRandomString));
+  blob_data.resize(2 * 4096, 'a');
+  vector<AnnotatedOperation> aops;
+  for (uint64_t i = 0; i < 2; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(1 - i, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false);
+
+  brillo::Blob expected_data(blob_data.begin() + 4096, blob_data.end());
+  expected_data.insert(
+      expected_data.end(), blob_data.begin(), blob_data.begin() + 4096);
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+
+  ASSERT_FALSE(install_plan_.partitions.empty());
+  const InstallPlan::Partition& partition = install_plan_.partitions[0];
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+      expected_data.data(), partition.target_size, &expected_hash));
+  EXPECT_EQ(expected_hash, partition.written_target_hash);
+}
+
+TEST_F(DeltaPerformerTest, RewrittenTargetHashTest) {
+  // The second operation rewrites the block written by the first one after it
+  // was checkpointed and hashed.
+  DeltaPerformer::CheckpointPolicy checkpoint_policy;
+  checkpoint_policy.max_operations = 1;
+  performer_.set_checkpoint_policy(checkpoint_policy);
+
+  brillo::Blob blob_data(std::begin(kRandomString), std::end(kRandomString));
+  blob_data.resize(2 * 4096, 'a');
+  vector<AnnotatedOperation> aops;
+  for (uint64_t i = 0; i < 2; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false);
+
+  brillo::Blob expected_data(blob_data.begin() + 4096, blob_data.end());
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+
+  ASSERT_FALSE(install_plan_.partitions.empty());
+  EXPECT_TRUE(install_plan_.partitions[0].written_target_hash.empty());
+}
+
+TEST_F(DeltaPerformerTest, StreamedReplaceXzOperationTest) {
+  // Random data doesn't compress, so the blob is large enough to be applied
+  // while it's received.
+  brillo::Blob expected_data(160 * 4096);
+  std::minstd_rand random_engine(42);
+  for (uint8_t& byte : expected_data)
+    byte = random_engine();
+  brillo::Blob xz_data;
+  EXPECT_TRUE(XzCompress(expected_data, &xz_data));
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 160);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(xz_data.size());
+  aop.op.set_type(InstallOperation::REPLACE_XZ);
+  vector<AnnotatedOperation> aops = {aop};
+
+  brillo::Blob payload_data = GeneratePayload(xz_data, aops, false);
+
+  write_size_ = 64 * 1024;
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+
+  int64_t next_operation = 0;
+  EXPECT_TRUE(
+      prefs_.GetInt64(kPrefsUpdateStateNextOperation, &next_operation));
+  EXPECT_EQ(1, next_operation);
+}
+
+// The blob of a signed payload is validated before being applied, even when
+// it's large enough to be streamed, so a corrupted blob doesn't reach the
+// target.
+TEST_F(DeltaPerformerTest, CorruptedSignedReplaceXzOperationTest) {
+  brillo::Blob expected_data(160 * 4096);
+  std::minstd_rand random_engine(42);
+  for (uint8_t& byte : expected_data)
+    byte = random_engine();
+  brillo::Blob xz_data;
+  EXPECT_TRUE(XzCompress(expected_data, &xz_data));
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 160);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(xz_data.size());
+  aop.op.set_type(InstallOperation::REPLACE_XZ);
+  vector<AnnotatedOperation> aops = {aop};
+
+  brillo::Blob payload_data = GeneratePayload(xz_data, aops, true);
+  ASSERT_TRUE(PayloadSigner::GetMetadataSignature(
+      payload_data.data(),
+      payload_.metadata_size,
+      GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+      &payload_.metadata_signature));
+  install_plan_.hash_checks_mandatory = true;
+  performer_.set_public_key_path(GetBuildArtifactsPath(kUnittestPublicKeyPath));
+
+  // The middle of the payload is in the middle of the blob.
+  payload_data[payload_data.size() / 2] ^= 0xff;
+
+  write_size_ = 64 * 1024;
+  brillo::Blob target_data(expected_data.size());
+  EXPECT_EQ(target_data,
+            ApplyPayloadToData(payload_data, "/dev/null", target_data, false));
+}
+
+// Interrupts the update in the middle of a large REPLACE operation of an
+// unsigned payload.
+TEST_F(DeltaPerformerTest, ResumeStreamedReplaceOperationTest) {
+  DoResumeStreamedReplaceOperationTest(false);
+}
+
+// The blob of a signed payload with mandatory hash checks is streamed and
+// resumed the same way, its hash is validated once it was all received.
+TEST_F(DeltaPerformerTest, ResumeSignedStreamedReplaceOperationTest) {
+  DoResumeStreamedReplaceOperationTest(true);
+}
+
+// Applies the chunks of a full payload, which are decompressed in parallel
+// once received even though they are large enough to be streamed.
+TEST_F(DeltaPerformerTest, FullPayloadReplaceXzChunksTest) {
+  payload_.type = InstallPayloadType::kFull;
+  const size_t kNumChunks = 4;
+  const size_t kChunkBlocks = 128;
+  brillo::Blob expected_data(kNumChunks * kChunkBlocks * 4096);
+  std::minstd_rand random_engine(42);
+  for (uint8_t& byte : expected_data)
+    byte = random_engine();
+
+  // The chunks are stored in the payload in reverse order of their blocks.
+  brillo::Blob blob_data;
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < kNumChunks; i++) {
+    size_t chunk = kNumChunks - 1 - i;
+    brillo::Blob chunk_data(
+        expected_data.begin() + chunk * kChunkBlocks * 4096,
+        expected_data.begin() + (chunk + 1) * kChunkBlocks * 4096);
+    brillo::Blob xz_data;
+    EXPECT_TRUE(XzCompress(chunk_data, &xz_data));
+
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) =
+        ExtentForRange(chunk * kChunkBlocks, kChunkBlocks);
+    aop.op.set_data_offset(blob_data.size());
+    aop.op.set_data_length(xz_data.size());
+    aop.op.set_type(InstallOperation::REPLACE_XZ);
+    aops.push_back(aop);
+    blob_data.insert(blob_data.end(), xz_data.begin(), xz_data.end());
+  }
+
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false,
+      kChromeOSMajorPayloadVersion, kFullPayloadMinorVersion);
+
+  write_size_ = 64 * 1024;
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+
+  int64_t next_operation = 0;
+  EXPECT_TRUE(
+      prefs_.GetInt64(kPrefsUpdateStateNextOperation, &next_operation));
+  EXPECT_EQ(static_cast<int64_t>(kNumChunks), next_operation);
+}
+
+// Applies a full payload passed in a single large write, whose operations are
+// applied in parallel from the written data before the write returns.
+TEST_F(DeltaPerformerTest, FullPayloadLargeWriteTest) {
+  payload_.type = InstallPayloadType::kFull;
+  const size_t kNumChunks = 8;
+  const size_t kChunkBlocks = 128;
+  brillo::Blob expected_data(kNumChunks * kChunkBlocks * 4096);
+  std::minstd_rand random_engine(42);
+  for (uint8_t& byte : expected_data)
+    byte = random_engine();
+
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < kNumChunks; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) =
+        ExtentForRange(i * kChunkBlocks, kChunkBlocks);
+    aop.op.set_data_offset(i * kChunkBlocks * 4096);
+    aop.op.set_data_length(kChunkBlocks * 4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false,
+      kChromeOSMajorPayloadVersion, kFullPayloadMinorVersion);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+
+  int64_t next_operation = 0;
+  EXPECT_TRUE(
+      prefs_.GetInt64(kPrefsUpdateStateNextOperation, &next_operation));
+  EXPECT_EQ(static_cast<int64_t>(kNumChunks), next_operation);
+}
+
+// The blocks written by an operation applied in parallel aren't overwritten by
+// those of a previous operation, which were cached.
+TEST_F(DeltaPerformerTest, ParallelOperationAfterCachedWriteTest) {
+  brillo::Blob blob_data(std::begin(kRandomString), std::end(kRandomString));
+  blob_data.resize(4096, 'a');
+
+  vector<AnnotatedOperation> aops(2);
+  *(aops[0].op.add_dst_extents()) = ExtentForRange(0, 2);
+  aops[0].op.set_type(InstallOperation::ZERO);
+  *(aops[1].op.add_dst_extents()) = ExtentForRange(0, 1);
+  aops[1].op.set_data_offset(0);
+  aops[1].op.set_data_length(blob_data.size());
+  aops[1].op.set_type(InstallOperation::REPLACE);
+
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false);
+
+  brillo::Blob expected_data = blob_data;
+  expected_data.resize(2 * 4096, 0);
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(payload_data,
+                               "/dev/null",
+                               brillo::Blob(2 * 4096, 'b'),
+                               true));
+}
+
 TEST_F(DeltaPerformerTest, ZeroOperationTest) {
   brillo::Blob existing_data = brillo::Blob(4096 * 10, 'a');
   brillo::Blob expected_data = existing_data;
@@ -541,6 +924,69 @@ TEST_F(DeltaPerformerTest, SourceCopyOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, source_path, true));
 }
 
+// Applies many independent operations, which may run in parallel, followed by
+// one that overwrites a block written by the first of them.
+TEST_F(DeltaPerformerTest, IndependentOperationsTest) {
+  const size_t kNumBlocks = 8;
+  brillo::Blob source_data(kNumBlocks * 4096);
+  for (size_t i = 0; i < source_data.size(); i++)
+    source_data[i] = i / 4096 + 1;
+
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_src_extents()) = ExtentForRange(i, 1);
+    *(aop.op.add_dst_extents()) = ExtentForRange(kNumBlocks - 1 - i, 1);
+    aop.op.set_type(InstallOperation::SOURCE_COPY);
+    aops.push_back(aop);
+  }
+  brillo::Blob replace_data(std::begin(kRandomString), std::end(kRandomString));
+  replace_data.resize(4096);  // block size
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(kNumBlocks - 1, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(replace_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+
+  brillo::Blob payload_data = GeneratePayload(replace_data, aops, false);
+
+  string source_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker path_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(
+      source_path.c_str(), source_data.data(), source_data.size()));
+
+  brillo::Blob expected_data;
+  for (size_t i = 0; i < kNumBlocks - 1; i++) {
+    size_t src_block = kNumBlocks - 1 - i;
+    expected_data.insert(expected_data.end(),
+                         source_data.begin() + src_block * 4096,
+                         source_data.begin() + (src_block + 1) * 4096);
+  }
+  expected_data.insert(
+      expected_data.end(), replace_data.begin(), replace_data.end());
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, source_path, true));
+
+  int64_t next_operation = 0;
+  EXPECT_TRUE(
+      prefs_.GetInt64(kPrefsUpdateStateNextOperation, &next_operation));
+  EXPECT_EQ(static_cast<int64_t>(aops.size()), next_operation);
+}
+
+TEST_F(DeltaPerformerTest, PuffCacheSizeTest) {
+  const uint64_t kMiB = 1024 * 1024;
+  // The cache grows with the available memory, within limits.
+  EXPECT_EQ(5 * kMiB, DeltaPerformer::PuffCacheSize(100 * kMiB, 0));
+  EXPECT_EQ(16 * kMiB,
+            DeltaPerformer::PuffCacheSize(100 * kMiB, 1024 * kMiB));
+  EXPECT_EQ(64 * kMiB,
+            DeltaPerformer::PuffCacheSize(100 * kMiB, 16 * 1024 * kMiB));
+  // It never exceeds what the puffed source may need.
+  EXPECT_EQ(4 * kMiB, DeltaPerformer::PuffCacheSize(kMiB, 1024 * kMiB));
+  EXPECT_EQ(16384U, DeltaPerformer::PuffCacheSize(4096, 0));
+}
+
 TEST_F(DeltaPerformerTest, PuffdiffOperationTest) {
   AnnotatedOperation aop;
   *(aop.op.add_src_extents()) = ExtentForRange(0, 1);
@@ -589,7 +1035,113 @@ TEST_F(DeltaPerformerTest, SourceHashMismatchTest) {
   EXPECT_TRUE(utils::WriteFile(source_path.c_str(), actual_data.data(),
                                actual_data.size()));
 
-  EXPECT_EQ(actual_data, ApplyPayload(payload_data, source_path, false));
+  // The source is checked before any operation is applied.
+  EXPECT_EQ(brillo::Blob(), ApplyPayload(payload_data, source_path, false));
+}
+
+TEST_F(DeltaPerformerTest, PuffdiffSourceHashMismatchTest) {
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 1);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  brillo::Blob puffdiff_payload(std::begin(puffdiff_patch),
+                                std::end(puffdiff_patch));
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(puffdiff_payload.size());
+  aop.op.set_type(InstallOperation::PUFFDIFF);
+  brillo::Blob src(std::begin(src_deflates), std::end(src_deflates));
+  src.resize(4096);  // block size
+  brillo::Blob src_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(src, &src_hash));
+  aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+
+  brillo::Blob payload_data = GeneratePayload(puffdiff_payload, {aop}, false);
+
+  // The source is validated before the patch writes anything.
+  string source_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker path_unlinker(source_path);
+  brillo::Blob actual_src(4096, 0);
+  EXPECT_TRUE(utils::WriteFile(
+      source_path.c_str(), actual_src.data(), actual_src.size()));
+
+  EXPECT_EQ(brillo::Blob(), ApplyPayload(payload_data, source_path, false));
+}
+
+TEST_F(DeltaPerformerTest, CheckSourcePartitionTest) {
+  brillo::Blob source_data(4 * 4096);
+  test_utils::FillWithData(&source_data);
+  string source_path;
+  EXPECT_TRUE(utils::MakeTempFile("Source-XXXXXX", &source_path, nullptr));
+  ScopedPathUnlinker path_unlinker(source_path);
+  EXPECT_TRUE(utils::WriteFile(
+      source_path.c_str(), source_data.data(), source_data.size()));
+
+  PartitionUpdate partition;
+  partition.set_partition_name("system");
+  for (uint64_t block : {2, 0}) {
+    InstallOperation* op = partition.add_operations();
+    op->set_type(InstallOperation::SOURCE_COPY);
+    *op->add_src_extents() = ExtentForRange(block, 1);
+    brillo::Blob src_hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+        source_data.data() + block * 4096, 4096, &src_hash));
+    op->set_src_sha256_hash(src_hash.data(), src_hash.size());
+  }
+  ErrorCode error = ErrorCode::kSuccess;
+  std::atomic<bool> canceled{false};
+  bool matches_partition_hash = true;
+  EXPECT_TRUE(DeltaPerformer::CheckSourcePartition(partition,
+                                                   0,
+                                                   source_path,
+                                                   4096,
+                                                   canceled,
+                                                   &matches_partition_hash,
+                                                   &error));
+  EXPECT_FALSE(matches_partition_hash);
+
+  // Only the operations not applied yet must match.
+  partition.mutable_operations(0)->set_src_sha256_hash("bad");
+  EXPECT_FALSE(DeltaPerformer::CheckSourcePartition(partition,
+                                                    0,
+                                                    source_path,
+                                                    4096,
+                                                    canceled,
+                                                    &matches_partition_hash,
+                                                    &error));
+  EXPECT_EQ(ErrorCode::kDownloadStateInitializationError, error);
+  EXPECT_TRUE(DeltaPerformer::CheckSourcePartition(partition,
+                                                   1,
+                                                   source_path,
+                                                   4096,
+                                                   canceled,
+                                                   &matches_partition_hash,
+                                                   &error));
+
+  // A source matching the partition hash matches every operation.
+  brillo::Blob partition_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(source_data, &partition_hash));
+  PartitionInfo* info = partition.mutable_old_partition_info();
+  info->set_size(source_data.size());
+  info->set_hash(partition_hash.data(), partition_hash.size());
+  EXPECT_TRUE(DeltaPerformer::CheckSourcePartition(partition,
+                                                   0,
+                                                   source_path,
+                                                   4096,
+                                                   canceled,
+                                                   &matches_partition_hash,
+                                                   &error));
+  EXPECT_TRUE(matches_partition_hash);
+
+  // Nothing matches once the update is canceled.
+  canceled = true;
+  EXPECT_FALSE(DeltaPerformer::CheckSourcePartition(partition,
+                                                    0,
+                                                    source_path,
+                                                    4096,
+                                                    canceled,
+                                                    &matches_partition_hash,
+                                                    &error));
+  EXPECT_FALSE(matches_partition_hash);
 }
 
 TEST_F(DeltaPerformerTest, ExtentsToByteStringTest) {
@@ -736,6 +1288,7 @@ TEST_F(DeltaPerformerTest, ValidateManifestDowngrade) {
 }
 
 TEST_F(DeltaPerformerTest, BrilloMetadataSignatureSizeTest) {
+  EXPECT_EQ(0u, performer_.GetMetadataAndSignatureSize());
   EXPECT_TRUE(performer_.Write(kDeltaMagic, sizeof(kDeltaMagic)));
 
   uint64_t major_version = htobe64(kBrilloMajorPayloadVersion);
@@ -755,6 +1308,8 @@ TEST_F(DeltaPerformerTest, BrilloMetadataSignatureSizeTest) {
   EXPECT_EQ(kBrilloMajorPayloadVersion, performer_.major_payload_version_);
   EXPECT_EQ(24 + manifest_size, performer_.metadata_size_);  // 4 + 8 + 8 + 4
   EXPECT_EQ(metadata_signature_size, performer_.metadata_signature_size_);
+  EXPECT_EQ(24 + manifest_size + metadata_signature_size,
+            performer_.GetMetadataAndSignatureSize());
 }
 
 TEST_F(DeltaPerformerTest, BrilloParsePayloadMetadataTest) {
@@ -21,17 +21,21 @@
 #include <algorithm>
 #include <string>
 
+#include <base/bind.h>
 #include <base/files/file_path.h>
 #include <base/metrics/statistics_recorder.h>
 #include <base/strings/stringprintf.h>
+#include <base/synchronization/lock.h>
 
 #include "update_engine/common/action_pipe.h"
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
+#include "update_engine/common/platform_constants.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/p2p_manager.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_state_interface.h"
 
 using base::FilePath;
@@ -39,6 +43,71 @@ using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Sizes of the buffer between the download and the payload application. The
+// spilled data is kept on the stateful partition.
+const size_t kAsyncWriterMemorySize = 4 * 1024 * 1024;  // 4 MiB
+const size_t kAsyncWriterSpillSize = 32 * 1024 * 1024;  // 32 MiB
+const char kAsyncWriterSpillFileName[] = "payload-buffer.XXXXXX";
+
+}  // namespace
+
+// The DeltaPerformer checks whether it should cancel the update between
+// operations, from the |async_writer_| thread, but the DownloadActionDelegate
+// is only used from the main thread. Its ShouldCancel() is therefore polled by
+// DownloadAction::ReceivedBytes() and OnAsyncWriterProgress(), and the
+// DeltaPerformer sees the last result.
+class DownloadAction::ApplierDelegate : public DownloadActionDelegate {
+ public:
+  explicit ApplierDelegate(DownloadActionDelegate* delegate)
+      : delegate_(delegate) {}
+  ~ApplierDelegate() override = default;
+
+  // Polls the wrapped delegate from the main thread. Returns whether the
+  // download should be canceled, setting |cancel_reason| in that case.
+  bool CheckShouldCancel(ErrorCode* cancel_reason) {
+    ErrorCode reason = ErrorCode::kSuccess;
+    if (!delegate_->ShouldCancel(&reason))
+      return false;
+    Cancel(reason);
+    *cancel_reason = reason;
+    return true;
+  }
+
+  // Makes ShouldCancel() return true with |reason| from now on.
+  void Cancel(ErrorCode reason) {
+    base::AutoLock auto_lock(lock_);
+    canceled_ = true;
+    cancel_reason_ = reason;
+  }
+
+  // DownloadActionDelegate overrides.
+  void BytesReceived(uint64_t bytes_progressed,
+                     uint64_t bytes_received,
+                     uint64_t total) override {
+    delegate_->BytesReceived(bytes_progressed, bytes_received, total);
+  }
+
+  bool ShouldCancel(ErrorCode* cancel_reason) override {
+    base::AutoLock auto_lock(lock_);
+    if (canceled_)
+      *cancel_reason = cancel_reason_;
+    return canceled_;
+  }
+
+  void DownloadComplete() override { delegate_->DownloadComplete(); }
+
+ private:
+  DownloadActionDelegate* delegate_;
+
+  base::Lock lock_;
+  bool canceled_{false};
+  ErrorCode cancel_reason_{ErrorCode::kSuccess};
+
+  DISALLOW_COPY_AND_ASSIGN(ApplierDelegate);
+};
+
 DownloadAction::DownloadAction(PrefsInterface* prefs,
                                BootControlInterface* boot_control,
                                HardwareInterface* hardware,
@@ -209,9 +278,35 @@ void DownloadAction::PerformAction() {
 
 void DownloadAction::StartDownloading() {
   download_active_ = true;
+  paused_by_writer_ = false;
+  transfer_complete_pending_ = false;
+  fetching_payload_header_ = false;
+  fetching_payload_metadata_ = false;
   http_fetcher_->ClearRanges();
-  if (install_plan_.is_resume &&
-      payload_ == &install_plan_.payloads[resume_payload_index_]) {
+  // The DeltaPerformer checks the source partitions of a delta payload once
+  // its metadata is parsed, so its data is only requested after that.
+  bool using_test_writer = writer_ && writer_ != delta_performer_.get() &&
+                           writer_ != async_writer_.get();
+  bool source_checked = false;
+  bool check_source_first =
+      !using_test_writer && !payload_->already_applied &&
+      payload_->type == InstallPayloadType::kDelta &&
+      !(prefs_->GetBoolean(kPrefsUpdateStateSourceChecked, &source_checked) &&
+        source_checked);
+  bool resuming = install_plan_.is_resume &&
+                  payload_ == &install_plan_.payloads[resume_payload_index_];
+  if (payload_->already_applied || (check_source_first && !resuming)) {
+    // Only the metadata of a payload already applied is parsed, to fill the
+    // partitions of the install plan. The header is downloaded first to know
+    // the size of the metadata, see TransferComplete().
+    uint64_t header_size = kMaxPayloadHeaderSize;
+    if (payload_->size)
+      header_size = std::min(header_size, payload_->size);
+    http_fetcher_->AddRange(base_offset_, header_size);
+    fetching_payload_header_ = true;
+    fetching_payload_metadata_ = check_source_first;
+    payload_data_offset_ = header_size;
+  } else if (resuming) {
     // Resuming an update so fetch the update manifest metadata first.
     int64_t manifest_metadata_size = 0;
     int64_t manifest_signature_size = 0;
@@ -219,18 +314,18 @@ void DownloadAction::StartDownloading() {
     prefs_->GetInt64(kPrefsManifestSignatureSize, &manifest_signature_size);
     http_fetcher_->AddRange(base_offset_,
                             manifest_metadata_size + manifest_signature_size);
-    // If there're remaining unprocessed data blobs, fetch them. Be careful not
-    // to request data beyond the end of the payload to avoid 416 HTTP response
-    // error codes.
+    // If there're remaining unprocessed data blobs, fetch them. The next data
+    // offset may be in the middle of the blob of an operation partially
+    // applied, which is resumed from there.
     int64_t next_data_offset = 0;
     prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset);
     uint64_t resume_offset =
         manifest_metadata_size + manifest_signature_size + next_data_offset;
-    if (!payload_->size) {
-      http_fetcher_->AddRange(base_offset_ + resume_offset);
-    } else if (resume_offset < payload_->size) {
-      http_fetcher_->AddRange(base_offset_ + resume_offset,
-                              payload_->size - resume_offset);
+    if (check_source_first) {
+      fetching_payload_metadata_ = true;
+      payload_data_offset_ = resume_offset;
+    } else {
+      AddPayloadRange(resume_offset);
     }
   } else {
     if (payload_->size) {
@@ -242,18 +337,55 @@ void DownloadAction::StartDownloading() {
     }
   }
 
-  if (writer_ && writer_ != delta_performer_.get()) {
+  if (using_test_writer) {
     LOG(INFO) << "Using writer for test.";
   } else {
+    async_writer_.reset();
+    applier_delegate_.reset(delegate_ ? new ApplierDelegate(delegate_)
+                                      : nullptr);
     delta_performer_.reset(new DeltaPerformer(prefs_,
                                               boot_control_,
                                               hardware_,
-                                              delegate_,
+                                              applier_delegate_.get(),
                                               &install_plan_,
                                               payload_,
                                               is_interactive_));
     writer_ = delta_performer_.get();
+
+    if (http_fetcher_->IsLocal() &&
+        payload_->type == InstallPayloadType::kFull) {
+      // The payload is applied straight from the data passed to
+      // ReceivedBytes(), instead of copying it to the |async_writer_| buffer
+      // to overlap its application with a download. Other payloads may start
+      // by checking the whole source partitions, which would block the
+      // message loop (see DeltaPerformer::CheckSourcePartitions()).
+      LOG(INFO) << "Applying the local payload while reading it.";
+    } else if (payload_->already_applied) {
+      // The metadata is parsed as it is received, so the header size can be
+      // read as soon as its transfer completes.
+      LOG(INFO) << "Parsing the metadata of the payload already applied.";
+    } else {
+      async_writer_.reset(new AsyncFileWriter(
+          delta_performer_.get(),
+          kAsyncWriterMemorySize,
+          kAsyncWriterSpillSize,
+          base::FilePath(constants::kNonVolatileDirectory)
+              .Append(kAsyncWriterSpillFileName)
+              .value()));
+      if (async_writer_->Init(
+              base::Bind(&DownloadAction::OnAsyncWriterProgress,
+                         base::Unretained(this)))) {
+        writer_ = async_writer_.get();
+      } else {
+        LOG(WARNING) << "Unable to start the payload writer thread, applying "
+                     << "the payload while downloading it.";
+        async_writer_.reset();
+      }
+    }
   }
+  // The payload is downloaded in parallel over all the connections, unless
+  // it comes from a local peer which may not have the following chunks yet.
+  http_fetcher_->set_parallel_transfers(true);
   if (system_state_ != nullptr) {
     const PayloadStateInterface* payload_state = system_state_->payload_state();
     string file_id = utils::CalculateP2PFileId(payload_->hash, payload_->size);
@@ -288,26 +420,49 @@ void DownloadAction::StartDownloading() {
                                          kDownloadP2PLowSpeedTimeSeconds);
       http_fetcher_->set_max_retry_count(kDownloadP2PMaxRetryCount);
       http_fetcher_->set_connect_timeout(kDownloadP2PConnectTimeoutSeconds);
+      http_fetcher_->set_parallel_transfers(false);
     }
   }
 
   http_fetcher_->BeginTransfer(install_plan_.download_url);
 }
 
+bool DownloadAction::AddPayloadRange(uint64_t offset) {
+  // Be careful not to request data beyond the end of the payload to avoid 416
+  // HTTP response error codes.
+  if (!payload_->size) {
+    http_fetcher_->AddRange(base_offset_ + offset);
+  } else if (offset < payload_->size) {
+    http_fetcher_->AddRange(base_offset_ + offset, payload_->size - offset);
+  } else {
+    return false;
+  }
+  return true;
+}
+
 void DownloadAction::SuspendAction() {
-  http_fetcher_->Pause();
+  suspended_ = true;
+  if (!paused_by_writer_)
+    http_fetcher_->Pause();
 }
 
 void DownloadAction::ResumeAction() {
-  http_fetcher_->Unpause();
+  suspended_ = false;
+  if (!paused_by_writer_)
+    http_fetcher_->Unpause();
 }
 
 void DownloadAction::TerminateProcessing() {
+  // Stop the DeltaPerformer after the operation in progress, if any, instead
+  // of waiting for all the buffered data to be applied.
+  if (applier_delegate_)
+    applier_delegate_->Cancel(ErrorCode::kUserCanceled);
   if (writer_) {
     writer_->Close();
     writer_ = nullptr;
   }
   download_active_ = false;
+  transfer_complete_pending_ = false;
   CloseP2PSharingFd(false);  // Keep p2p file.
   // Terminates the transfer. The action is terminated, if necessary, when the
   // TransferTerminated callback is received.
@@ -332,22 +487,26 @@ void DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
   if (delegate_ && download_active_) {
     delegate_->BytesReceived(length, bytes_downloaded_total, bytes_total_);
   }
+  // The DeltaPerformer doesn't call our delegate directly, see
+  // ApplierDelegate.
+  if (writer_ && applier_delegate_ &&
+      applier_delegate_->CheckShouldCancel(&code_)) {
+    TerminateOnWriteError();
+    return;
+  }
   if (writer_ && !writer_->Write(bytes, length, &code_)) {
-    if (code_ != ErrorCode::kSuccess) {
-      LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
-                 << ") in DeltaPerformer's Write method when "
-                 << "processing the received payload -- Terminating processing";
-    }
-    // Delete p2p file, if applicable.
-    if (!p2p_file_id_.empty())
-      CloseP2PSharingFd(true);
-    // Don't tell the action processor that the action is complete until we get
-    // the TransferTerminated callback. Otherwise, this and the HTTP fetcher
-    // objects may get destroyed before all callbacks are complete.
-    TerminateProcessing();
+    TerminateOnWriteError();
     return;
   }
 
+  // Stop downloading while the buffered data is applied.
+  if (async_writer_ && writer_ == async_writer_.get() && !paused_by_writer_ &&
+      async_writer_->IsFull()) {
+    paused_by_writer_ = true;
+    if (!suspended_)
+      http_fetcher_->Pause();
+  }
+
   // Call p2p_manager_->FileMakeVisible() when we've successfully
   // verified the manifest!
   if (!p2p_visible_ && system_state_ && delta_performer_.get() &&
@@ -358,15 +517,101 @@ void DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
   }
 }
 
+void DownloadAction::TerminateOnWriteError() {
+  if (code_ != ErrorCode::kSuccess) {
+    LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
+               << ") in DeltaPerformer's Write method when "
+               << "processing the received payload -- Terminating processing";
+  }
+  // Delete p2p file, if applicable.
+  if (!p2p_file_id_.empty())
+    CloseP2PSharingFd(true);
+  // Don't tell the action processor that the action is complete until we get
+  // the TransferTerminated callback. Otherwise, this and the HTTP fetcher
+  // objects may get destroyed before all callbacks are complete.
+  TerminateProcessing();
+}
+
+void DownloadAction::OnAsyncWriterProgress() {
+  if (!async_writer_ || writer_ != async_writer_.get())
+    return;
+
+  if (async_writer_->Failed(&code_)) {
+    TerminateOnWriteError();
+    return;
+  }
+  // No bytes are received while the buffered data is applied, so poll the
+  // delegate from here too.
+  if (applier_delegate_ && applier_delegate_->CheckShouldCancel(&code_)) {
+    TerminateOnWriteError();
+    return;
+  }
+  if (paused_by_writer_ && !async_writer_->IsFull()) {
+    paused_by_writer_ = false;
+    if (!suspended_)
+      http_fetcher_->Unpause();
+  }
+  if (transfer_complete_pending_ && async_writer_->IsIdle()) {
+    transfer_complete_pending_ = false;
+    TransferComplete(http_fetcher_.get(), true);
+  }
+}
+
 void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  if (async_writer_ && writer_ == async_writer_.get()) {
+    if (async_writer_->Failed(&code_)) {
+      TerminateOnWriteError();
+      return;
+    }
+    // The payload can only be verified once all of it was applied, and its
+    // metadata parsed before the rest of it is requested.
+    if (successful && !async_writer_->IsIdle()) {
+      transfer_complete_pending_ = true;
+      return;
+    }
+  }
+  if (fetching_payload_header_) {
+    fetching_payload_header_ = false;
+    uint64_t metadata_size =
+        delta_performer_ ? delta_performer_->GetMetadataAndSignatureSize() : 0;
+    if (successful && metadata_size > kMaxPayloadHeaderSize) {
+      LOG(INFO) << "Downloading the " << metadata_size
+                << " bytes of metadata of the payload.";
+      http_fetcher_->ClearRanges();
+      http_fetcher_->AddRange(base_offset_ + kMaxPayloadHeaderSize,
+                              metadata_size - kMaxPayloadHeaderSize);
+      if (fetching_payload_metadata_)
+        payload_data_offset_ = metadata_size;
+      http_fetcher_->BeginTransfer(install_plan_.download_url);
+      return;
+    }
+  }
+  if (fetching_payload_metadata_) {
+    fetching_payload_metadata_ = false;
+    // The source partitions were checked while the metadata was applied.
+    http_fetcher_->ClearRanges();
+    if (successful && AddPayloadRange(payload_data_offset_)) {
+      LOG(INFO) << "Downloading the data of the payload.";
+      http_fetcher_->BeginTransfer(install_plan_.download_url);
+      return;
+    }
+  }
   if (writer_) {
     LOG_IF(WARNING, writer_->Close() != 0) << "Error closing the writer.";
-    if (delta_performer_.get() == writer_) {
+    if (delta_performer_.get() == writer_ || async_writer_.get() == writer_) {
       // no delta_performer_ in tests, so leave the test writer in place
       writer_ = nullptr;
     }
   }
   download_active_ = false;
+  // Tell the payload state how fast the URL was, so it can give up sooner on
+  // a slow URL if the download failed.
+  int64_t throughput;
+  base::TimeDelta round_trip_time;
+  if (system_state_ != nullptr &&
+      http_fetcher_->GetThroughputEstimate(&throughput, &round_trip_time)) {
+    system_state_->payload_state()->DownloadThroughputMeasured(throughput);
+  }
   ErrorCode code =
       successful ? ErrorCode::kSuccess : ErrorCode::kDownloadTransferError;
   if (code == ErrorCode::kSuccess) {
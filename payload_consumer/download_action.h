@@ -28,6 +28,7 @@
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/http_fetcher.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
+#include "update_engine/payload_consumer/async_file_writer.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/system_state.h"
@@ -112,11 +113,21 @@ class DownloadAction : public InstallPlanAction,
 
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
+  // Takes ownership of |http_fetcher|, used as an additional connection to
+  // download the payload in parallel.
+  void AddParallelFetcher(HttpFetcher* http_fetcher) {
+    http_fetcher_->AddParallelFetcher(http_fetcher);
+  }
+
   // Returns the p2p file id for the file being written or the empty
   // string if we're not writing to a p2p file.
   std::string p2p_file_id() { return p2p_file_id_; }
 
  private:
+  // The DownloadActionDelegate used by the DeltaPerformer, which runs on the
+  // |async_writer_| thread.
+  class ApplierDelegate;
+
   // Closes the file descriptor for the p2p file being written and
   // clears |p2p_file_id_| to indicate that we're no longer sharing
   // the file. If |delete_p2p_file| is True, also deletes the file.
@@ -138,6 +149,16 @@ class DownloadAction : public InstallPlanAction,
   // Start downloading the current payload using delta_performer.
   void StartDownloading();
 
+  // Adds the range of the current payload from |offset| to its end to the
+  // |http_fetcher_|. Returns false if there's nothing left to download.
+  bool AddPayloadRange(uint64_t offset);
+
+  // Terminates the processing after the |writer_| failed with |code_|.
+  void TerminateOnWriteError();
+
+  // Called from the message loop when the |async_writer_| made progress.
+  void OnAsyncWriterProgress();
+
   // The InstallPlan passed in
   InstallPlan install_plan_;
 
@@ -161,11 +182,35 @@ class DownloadAction : public InstallPlanAction,
   bool is_interactive_;
 
   // The FileWriter that downloaded data should be written to. It will
-  // either point to *decompressing_file_writer_ or *delta_performer_.
+  // either point to *async_writer_, *delta_performer_ or a test writer.
   FileWriter* writer_;
 
+  std::unique_ptr<ApplierDelegate> applier_delegate_;
   std::unique_ptr<DeltaPerformer> delta_performer_;
 
+  // Buffers the downloaded data and applies it with |delta_performer_| on its
+  // own thread, so the download is not stalled by slow operations.
+  std::unique_ptr<AsyncFileWriter> async_writer_;
+
+  // Whether the transfer is paused because the |async_writer_| is full, or
+  // because the action was suspended.
+  bool paused_by_writer_{false};
+  bool suspended_{false};
+
+  // Whether the transfer completed but the |async_writer_| is still applying
+  // the downloaded data.
+  bool transfer_complete_pending_{false};
+
+  // Whether only the header of a payload already applied is being downloaded,
+  // to know the size of its metadata.
+  bool fetching_payload_header_{false};
+
+  // Whether only the metadata of a delta payload is being downloaded, so that
+  // its source partitions are checked before its data is requested, from
+  // |payload_data_offset_| on.
+  bool fetching_payload_metadata_{false};
+  uint64_t payload_data_offset_{0};
+
   // Used by TransferTerminated to figure if this action terminated itself or
   // was terminated by the action processor.
   ErrorCode code_;
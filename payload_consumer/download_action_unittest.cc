@@ -16,6 +16,8 @@
 
 #include "update_engine/payload_consumer/download_action.h"
 
+#include <endian.h>
+
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
@@ -34,6 +36,7 @@
 
 #include "update_engine/common/action_pipe.h"
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/http_common.h"
 #include "update_engine/common/mock_http_fetcher.h"
 #include "update_engine/common/mock_prefs.h"
 #include "update_engine/common/test_utils.h"
@@ -42,13 +45,17 @@
 #include "update_engine/fake_system_state.h"
 #include "update_engine/mock_file_writer.h"
 #include "update_engine/payload_consumer/mock_download_action.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/update_manager/fake_update_manager.h"
+#include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
 using base::FilePath;
 using base::ReadFileToString;
 using base::WriteFile;
+using brillo::MessageLoop;
+using std::pair;
 using std::string;
 using std::unique_ptr;
 using test_utils::ScopedTempFile;
@@ -330,6 +337,172 @@ TEST(DownloadActionTest, MultiPayloadProgressTest) {
   EXPECT_FALSE(loop.PendingTasks());
 }
 
+namespace {
+// An HttpFetcher serving the ranges of |data| it is asked for, each of them in
+// a single chunk, and recording them in |ranges|. Like LibcurlHttpFetcher, it
+// terminates the transfer from the message loop when asked to from a callback.
+class RangeHttpFetcher : public HttpFetcher {
+ public:
+  RangeHttpFetcher(const brillo::Blob& data,
+                   std::vector<pair<off_t, size_t>>* ranges)
+      : HttpFetcher(nullptr), data_(data), ranges_(ranges) {}
+
+  ~RangeHttpFetcher() override {
+    MessageLoop::current()->CancelTask(send_task_);
+    MessageLoop::current()->CancelTask(terminate_task_);
+  }
+
+  void SetOffset(off_t offset) override { offset_ = offset; }
+  void SetLength(size_t length) override { length_ = length; }
+  void UnsetLength() override { length_ = 0; }
+
+  void BeginTransfer(const string& url) override {
+    ASSERT_LE(static_cast<size_t>(offset_), data_.size());
+    size_t length = length_ ? length_ : data_.size() - offset_;
+    ASSERT_LE(offset_ + length, data_.size());
+    ranges_->emplace_back(offset_, length);
+    send_task_ = MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&RangeHttpFetcher::SendData,
+                   base::Unretained(this),
+                   length));
+  }
+
+  void TerminateTransfer() override {
+    if (terminate_task_ != MessageLoop::kTaskIdNull)
+      return;
+    MessageLoop::current()->CancelTask(send_task_);
+    send_task_ = MessageLoop::kTaskIdNull;
+    terminate_task_ = MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&RangeHttpFetcher::SignalTransferTerminated,
+                   base::Unretained(this)));
+  }
+
+  void SetHeader(const string& header_name,
+                 const string& header_value) override {}
+  void Pause() override {}
+  void Unpause() override {}
+  void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {}
+  void set_connect_timeout(int connect_timeout_seconds) override {}
+  void set_max_retry_count(int max_retry_count) override {}
+  size_t GetBytesDownloaded() override { return 0; }
+
+ private:
+  void SendData(size_t length) {
+    send_task_ = MessageLoop::kTaskIdNull;
+    http_response_code_ = kHttpResponsePartialContent;
+    delegate_->ReceivedBytes(this, data_.data() + offset_, length);
+    // The delegate terminates the transfer once it got a range of known size.
+    if (terminate_task_ == MessageLoop::kTaskIdNull)
+      delegate_->TransferComplete(this, true);
+  }
+
+  void SignalTransferTerminated() {
+    terminate_task_ = MessageLoop::kTaskIdNull;
+    delegate_->TransferTerminated(this);
+  }
+
+  const brillo::Blob data_;
+  std::vector<pair<off_t, size_t>>* ranges_;
+  off_t offset_{0};
+  size_t length_{0};
+  MessageLoop::TaskId send_task_{MessageLoop::kTaskIdNull};
+  MessageLoop::TaskId terminate_task_{MessageLoop::kTaskIdNull};
+
+  DISALLOW_COPY_AND_ASSIGN(RangeHttpFetcher);
+};
+}  // namespace
+
+// Resuming the second payload of an update, only the metadata of the first one
+// is downloaded to fill the install plan partitions: its header, to know the
+// size of the metadata, and then the rest of its metadata.
+TEST(DownloadActionTest, ResumeAfterAppliedPayloadTest) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  FakeSystemState fake_system_state;
+
+  DeltaArchiveManifest manifest;
+  manifest.set_minor_version(kFullPayloadMinorVersion);
+  manifest.set_block_size(4096);
+  PartitionUpdate* partition = manifest.add_partitions();
+  partition->set_partition_name(kLegacyPartitionNameRoot);
+  partition->mutable_new_partition_info()->set_size(4096);
+  string manifest_data;
+  ASSERT_TRUE(manifest.SerializeToString(&manifest_data));
+
+  // The first payload has no metadata signature and no data besides its
+  // metadata, the second one is never downloaded.
+  brillo::Blob payload(kDeltaMagic, kDeltaMagic + sizeof(kDeltaMagic));
+  uint64_t major_version_be = htobe64(kBrilloMajorPayloadVersion);
+  uint64_t manifest_size_be = htobe64(manifest_data.size());
+  uint32_t metadata_signature_size_be = htobe32(0);
+  payload.insert(payload.end(),
+                 reinterpret_cast<const uint8_t*>(&major_version_be),
+                 reinterpret_cast<const uint8_t*>(&major_version_be + 1));
+  payload.insert(payload.end(),
+                 reinterpret_cast<const uint8_t*>(&manifest_size_be),
+                 reinterpret_cast<const uint8_t*>(&manifest_size_be + 1));
+  payload.insert(
+      payload.end(),
+      reinterpret_cast<const uint8_t*>(&metadata_signature_size_be),
+      reinterpret_cast<const uint8_t*>(&metadata_signature_size_be + 1));
+  ASSERT_EQ(kMaxPayloadHeaderSize, payload.size());
+  payload.insert(payload.end(), manifest_data.begin(), manifest_data.end());
+  const uint64_t first_payload_size = payload.size();
+  payload.resize(first_payload_size + 1000);
+
+  InstallPlan install_plan;
+  install_plan.is_resume = true;
+  install_plan.payloads.push_back(
+      {.size = first_payload_size, .type = InstallPayloadType::kFull});
+  install_plan.payloads.push_back(
+      {.size = 1000, .type = InstallPayloadType::kFull});
+  ObjectFeederAction<InstallPlan> feeder_action;
+  feeder_action.set_obj(install_plan);
+
+  MockPrefs prefs;
+  EXPECT_CALL(prefs, GetInt64(kPrefsUpdateStatePayloadIndex, _))
+      .WillRepeatedly(DoAll(SetArgPointee<1>(1), Return(true)));
+  // Stop once the first payload is done, the second one would be resumed from
+  // the progress saved in |prefs|.
+  EXPECT_CALL(*fake_system_state.mock_payload_state(), NextPayload())
+      .WillOnce(Return(false));
+
+  std::vector<pair<off_t, size_t>> ranges;
+  DownloadAction download_action(&prefs,
+                                 fake_system_state.boot_control(),
+                                 fake_system_state.hardware(),
+                                 &fake_system_state,
+                                 new RangeHttpFetcher(payload, &ranges),
+                                 false /* is_interactive */);
+  ObjectCollectorAction<InstallPlan> collector_action;
+  BondActions(&feeder_action, &download_action);
+  BondActions(&download_action, &collector_action);
+
+  ActionProcessor processor;
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&download_action);
+  processor.EnqueueAction(&collector_action);
+
+  loop.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor)));
+  loop.Run();
+  EXPECT_FALSE(loop.PendingTasks());
+
+  std::vector<pair<off_t, size_t>> expected_ranges = {
+      {0, kMaxPayloadHeaderSize},
+      {kMaxPayloadHeaderSize, manifest_data.size()}};
+  EXPECT_EQ(expected_ranges, ranges);
+  const InstallPlan& output_plan = collector_action.object();
+  ASSERT_EQ(1U, output_plan.partitions.size());
+  EXPECT_EQ(kLegacyPartitionNameRoot, output_plan.partitions[0].name);
+  EXPECT_EQ(4096U, output_plan.partitions[0].target_size);
+}
+
 namespace {
 class TerminateEarlyTestProcessorDelegate : public ActionProcessorDelegate {
  public:
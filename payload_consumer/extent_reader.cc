@@ -19,6 +19,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cstring>
+
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 
@@ -26,11 +29,17 @@ using google::protobuf::RepeatedPtrField;
 
 namespace chromeos_update_engine {
 
+namespace {
+// The size of the reads hashing the data skipped over.
+const uint64_t kHashReadSize = 128 * 1024;  // bytes
+}  // namespace
+
 bool DirectExtentReader::Init(FileDescriptorPtr fd,
                               const RepeatedPtrField<Extent>& extents,
                               uint32_t block_size) {
   fd_ = fd;
-  extents_ = extents;
+  // Adjacent extents are read at once.
+  extents_ = utils::CoalesceExtents(extents);
   block_size_ = block_size;
   cur_extent_ = extents_.begin();
 
@@ -95,4 +104,92 @@ bool DirectExtentReader::Read(void* buffer, size_t count) {
   return true;
 }
 
+bool HashingExtentReader::Init(FileDescriptorPtr fd,
+                               const RepeatedPtrField<Extent>& extents,
+                               uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(reader_.Init(fd, extents, block_size));
+  total_size_ = 0;
+  for (const auto& extent : extents)
+    total_size_ += extent.num_blocks() * block_size;
+
+  if (total_size_ <= max_preload_size_) {
+    data_.resize(total_size_);
+    TEST_AND_RETURN_FALSE(reader_.Read(data_.data(), data_.size()));
+    TEST_AND_RETURN_FALSE(hasher_.Update(data_.data(), data_.size()));
+    hashed_size_ = total_size_;
+    preloaded_ = true;
+  }
+  return true;
+}
+
+bool HashingExtentReader::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(offset <= total_size_);
+  offset_ = offset;
+  return true;
+}
+
+bool HashingExtentReader::Read(void* buffer, size_t count) {
+  TEST_AND_RETURN_FALSE(offset_ + count <= total_size_);
+  auto bytes = reinterpret_cast<uint8_t*>(buffer);
+  if (preloaded_) {
+    std::copy_n(data_.data() + offset_, count, bytes);
+    offset_ += count;
+    return true;
+  }
+
+  TEST_AND_RETURN_FALSE(HashUpTo(offset_));
+  TEST_AND_RETURN_FALSE(reader_.Seek(offset_));
+  TEST_AND_RETURN_FALSE(reader_.Read(bytes, count));
+  if (offset_ + count > hashed_size_) {
+    uint64_t hashed_bytes = hashed_size_ - offset_;
+    TEST_AND_RETURN_FALSE(
+        hasher_.Update(bytes + hashed_bytes, count - hashed_bytes));
+    hashed_size_ = offset_ + count;
+  }
+  offset_ += count;
+  return true;
+}
+
+bool HashingExtentReader::Finish(brillo::Blob* hash) {
+  TEST_AND_RETURN_FALSE(HashUpTo(total_size_));
+  TEST_AND_RETURN_FALSE(hasher_.Finalize());
+  *hash = hasher_.raw_hash();
+  return true;
+}
+
+bool HashingExtentReader::HashUpTo(uint64_t offset) {
+  if (hashed_size_ >= offset)
+    return true;
+  brillo::Blob buffer(std::min(offset - hashed_size_, kHashReadSize));
+  TEST_AND_RETURN_FALSE(reader_.Seek(hashed_size_));
+  while (hashed_size_ < offset) {
+    uint64_t bytes_to_read = std::min(offset - hashed_size_, kHashReadSize);
+    TEST_AND_RETURN_FALSE(reader_.Read(buffer.data(), bytes_to_read));
+    TEST_AND_RETURN_FALSE(hasher_.Update(buffer.data(), bytes_to_read));
+    hashed_size_ += bytes_to_read;
+  }
+  return true;
+}
+
+bool MemoryExtentReader::Init(FileDescriptorPtr fd,
+                              const RepeatedPtrField<Extent>& extents,
+                              uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(utils::BlocksInExtents(extents) * block_size == size_);
+  offset_ = 0;
+  return true;
+}
+
+bool MemoryExtentReader::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(offset <= size_);
+  offset_ = offset;
+  return true;
+}
+
+bool MemoryExtentReader::Read(void* buffer, size_t count) {
+  TEST_AND_RETURN_FALSE(count <= size_ - offset_);
+  memcpy(buffer, data_ + offset_, count);
+  offset_ += count;
+  return true;
+}
+
 }  // namespace chromeos_update_engine
@@ -19,6 +19,9 @@
 
 #include <vector>
 
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -77,6 +80,82 @@ class DirectExtentReader : public ExtentReader {
   DISALLOW_COPY_AND_ASSIGN(DirectExtentReader);
 };
 
+// HashingExtentReader reads the extents like DirectExtentReader and computes
+// the SHA-256 hash of their data while it's read, so the data doesn't have to
+// be read once to be hashed and once more to be used. The data is hashed in
+// order: the data skipped by seeking forward is read and hashed before the
+// data after it, and Finish() reads and hashes the data never read.
+//
+// If the extents hold up to |max_preload_size| bytes, Init() reads and hashes
+// all of them at once and the reads are then served from memory.
+class HashingExtentReader : public ExtentReader {
+ public:
+  explicit HashingExtentReader(uint64_t max_preload_size)
+      : max_preload_size_(max_preload_size) {}
+  ~HashingExtentReader() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* buffer, size_t count) override;
+
+  // Hashes the data not read yet and stores the hash of the whole extents in
+  // |hash|. Returns false if the data couldn't be read.
+  bool Finish(brillo::Blob* hash);
+
+  // Whether the data was preloaded by Init(), in which case Finish() doesn't
+  // read anything.
+  bool preloaded() const { return preloaded_; }
+
+ private:
+  // Reads and hashes the data from |hashed_size_| up to |offset|.
+  bool HashUpTo(uint64_t offset);
+
+  const uint64_t max_preload_size_;
+
+  DirectExtentReader reader_;
+  HashCalculator hasher_;
+
+  // The data of the extents, if preloaded.
+  brillo::Blob data_;
+  bool preloaded_{false};
+
+  // Offset assuming all extents are concatenated.
+  uint64_t offset_{0};
+  uint64_t total_size_{0};
+
+  // The size of the data hashed so far, from the beginning of the extents.
+  uint64_t hashed_size_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(HashingExtentReader);
+};
+
+// MemoryExtentReader reads the extents from the |size| bytes at |data|, which
+// already hold the data of all of them, concatenated. The file descriptor
+// passed to Init() is not used.
+class MemoryExtentReader : public ExtentReader {
+ public:
+  MemoryExtentReader(const uint8_t* data, size_t size)
+      : data_(data), size_(size) {}
+  ~MemoryExtentReader() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* buffer, size_t count) override;
+
+ private:
+  const uint8_t* data_;
+  const size_t size_;
+
+  // Offset assuming all extents are concatenated.
+  uint64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryExtentReader);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_READER_H_
@@ -25,8 +25,10 @@
 #include <brillo/secure_blob.h>
 #include <gtest/gtest.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/extent_ranges.h"
@@ -167,4 +169,140 @@ TEST_F(ExtentReaderTest, RandomReadTest) {
   }
 }
 
+TEST_F(ExtentReaderTest, AdjacentExtentsTest) {
+  // The extents adjacent on disk are read at once.
+  vector<Extent> extents = {ExtentForRange(1, 1),
+                            ExtentForRange(2, 1),
+                            ExtentForRange(3, 2),
+                            ExtentForRange(7, 1)};
+  auto fake_fd = std::make_shared<FakeFileDescriptor>();
+  DirectExtentReader reader;
+  EXPECT_TRUE(
+      reader.Init(fake_fd, {extents.begin(), extents.end()}, kBlockSize));
+  brillo::Blob blob(utils::BlocksInExtents(extents) * kBlockSize);
+  EXPECT_TRUE(reader.Read(blob.data(), blob.size()));
+  EXPECT_EQ((vector<std::pair<uint64_t, uint64_t>>{
+                {1 * kBlockSize, 4 * kBlockSize}, {7 * kBlockSize, kBlockSize}}),
+            fake_fd->GetReadOps());
+}
+
+TEST_F(ExtentReaderTest, HashingReaderSequentialReadTest) {
+  vector<Extent> extents = {
+      ExtentForRange(1, 1), ExtentForRange(5, 3), ExtentForRange(2, 2)};
+  HashingExtentReader reader(0);
+  EXPECT_TRUE(reader.Init(fd_, {extents.begin(), extents.end()}, kBlockSize));
+  EXPECT_FALSE(reader.preloaded());
+
+  brillo::Blob expected, expected_hash;
+  ReadExtents(extents, &expected);
+  EXPECT_TRUE(HashCalculator::RawHashOfData(expected, &expected_hash));
+
+  brillo::Blob blob(expected.size());
+  for (size_t offset = 0; offset < blob.size(); offset += 5) {
+    size_t size = min(blob.size() - offset, static_cast<size_t>(5));
+    EXPECT_TRUE(reader.Read(blob.data() + offset, size));
+  }
+  ExpectVectorsEq(expected, blob);
+  brillo::Blob hash;
+  EXPECT_TRUE(reader.Finish(&hash));
+  ExpectVectorsEq(expected_hash, hash);
+}
+
+TEST_F(ExtentReaderTest, HashingReaderRandomReadTest) {
+  vector<Extent> extents = {ExtentForRange(0, 0),
+                            ExtentForRange(1, 1),
+                            ExtentForRange(3, 0),
+                            ExtentForRange(4, 2),
+                            ExtentForRange(7, 1)};
+  HashingExtentReader reader(0);
+  EXPECT_TRUE(reader.Init(fd_, {extents.begin(), extents.end()}, kBlockSize));
+
+  brillo::Blob result, expected_hash;
+  ReadExtents(extents, &result);
+  EXPECT_TRUE(HashCalculator::RawHashOfData(result, &expected_hash));
+
+  // The data is hashed in order whatever the order it's read in.
+  brillo::Blob blob(result.size());
+  srand(time(nullptr));
+  uint32_t rand_seed;
+  for (size_t idx = 0; idx < kRandomIterations; idx++) {
+    size_t start = rand_r(&rand_seed) % blob.size();
+    size_t size = rand_r(&rand_seed) % (blob.size() - start);
+    EXPECT_TRUE(reader.Seek(start));
+    EXPECT_TRUE(reader.Read(blob.data(), size));
+    for (size_t i = 0; i < size; i++) {
+      ASSERT_EQ(blob[i], result[start + i]);
+    }
+  }
+  brillo::Blob hash;
+  EXPECT_TRUE(reader.Finish(&hash));
+  ExpectVectorsEq(expected_hash, hash);
+}
+
+TEST_F(ExtentReaderTest, HashingReaderPartialReadTest) {
+  vector<Extent> extents = {ExtentForRange(2, 4), ExtentForRange(9, 3)};
+  HashingExtentReader reader(0);
+  EXPECT_TRUE(reader.Init(fd_, {extents.begin(), extents.end()}, kBlockSize));
+
+  brillo::Blob expected, expected_hash;
+  ReadExtents(extents, &expected);
+  EXPECT_TRUE(HashCalculator::RawHashOfData(expected, &expected_hash));
+
+  // Finish() hashes the data skipped and the data never read.
+  brillo::Blob blob(kBlockSize);
+  EXPECT_TRUE(reader.Seek(3 * kBlockSize + 3));
+  EXPECT_TRUE(reader.Read(blob.data(), blob.size()));
+  EXPECT_TRUE(std::equal(
+      blob.begin(), blob.end(), expected.begin() + 3 * kBlockSize + 3));
+  brillo::Blob hash;
+  EXPECT_TRUE(reader.Finish(&hash));
+  ExpectVectorsEq(expected_hash, hash);
+}
+
+TEST_F(ExtentReaderTest, HashingReaderPreloadTest) {
+  vector<Extent> extents = {ExtentForRange(4, 2), ExtentForRange(1, 1)};
+  FileDescriptorPtr fd(new EintrSafeFileDescriptor());
+  ASSERT_TRUE(fd->Open(temp_file_.path().c_str(), O_RDONLY, 0600));
+  HashingExtentReader reader(3 * kBlockSize);
+  EXPECT_TRUE(reader.Init(fd, {extents.begin(), extents.end()}, kBlockSize));
+  EXPECT_TRUE(reader.preloaded());
+  // The data is read once by Init().
+  EXPECT_TRUE(fd->Close());
+
+  brillo::Blob expected, expected_hash;
+  ReadExtents(extents, &expected);
+  EXPECT_TRUE(HashCalculator::RawHashOfData(expected, &expected_hash));
+
+  brillo::Blob hash;
+  EXPECT_TRUE(reader.Finish(&hash));
+  ExpectVectorsEq(expected_hash, hash);
+
+  brillo::Blob blob(expected.size() - 4);
+  EXPECT_TRUE(reader.Seek(4));
+  EXPECT_TRUE(reader.Read(blob.data(), blob.size()));
+  EXPECT_TRUE(std::equal(blob.begin(), blob.end(), expected.begin() + 4));
+  EXPECT_FALSE(reader.Read(blob.data(), 1));
+}
+
+TEST_F(ExtentReaderTest, MemoryReaderTest) {
+  vector<Extent> extents = {ExtentForRange(4, 2), ExtentForRange(1, 1)};
+  brillo::Blob expected;
+  ReadExtents(extents, &expected);
+  MemoryExtentReader reader(expected.data(), expected.size());
+  EXPECT_TRUE(reader.Init(nullptr, {extents.begin(), extents.end()},
+                          kBlockSize));
+
+  brillo::Blob blob(expected.size() - 5);
+  EXPECT_TRUE(reader.Seek(5));
+  EXPECT_TRUE(reader.Read(blob.data(), blob.size()));
+  EXPECT_TRUE(std::equal(blob.begin(), blob.end(), expected.begin() + 5));
+  EXPECT_FALSE(reader.Read(blob.data(), 1));
+  EXPECT_FALSE(reader.Seek(expected.size() + 1));
+
+  // The data must cover the extents exactly.
+  MemoryExtentReader short_reader(expected.data(), expected.size() - 1);
+  EXPECT_FALSE(short_reader.Init(nullptr, {extents.begin(), extents.end()},
+                                 kBlockSize));
+}
+
 }  // namespace chromeos_update_engine
@@ -71,7 +71,8 @@ class DirectExtentWriter : public ExtentWriter {
             uint32_t block_size) override {
     fd_ = fd;
     block_size_ = block_size;
-    extents_ = extents;
+    // Adjacent extents are written at once.
+    extents_ = utils::CoalesceExtents(extents);
     cur_extent_ = extents_.begin();
     return true;
   }
@@ -67,6 +67,15 @@ class FakeFileDescriptor : public FileDescriptor {
     return false;
   }
 
+  bool CopyRangeFrom(FileDescriptor* source,
+                     uint64_t source_offset,
+                     uint64_t offset,
+                     uint64_t length) override {
+    return false;
+  }
+
+  int GetReadFd() override { return -1; }
+
   bool Flush() override {
     return open_;
   }
@@ -20,7 +20,9 @@
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <base/posix/eintr_wrapper.h>
 
@@ -30,11 +32,13 @@ namespace chromeos_update_engine {
 
 bool EintrSafeFileDescriptor::Open(const char* path, int flags, mode_t mode) {
   CHECK_EQ(fd_, -1);
+  clone_supported_ = copy_supported_ = true;
   return ((fd_ = HANDLE_EINTR(open(path, flags, mode))) >= 0);
 }
 
 bool EintrSafeFileDescriptor::Open(const char* path, int flags) {
   CHECK_EQ(fd_, -1);
+  clone_supported_ = copy_supported_ = true;
   return ((fd_ = HANDLE_EINTR(open(path, flags))) >= 0);
 }
 
@@ -123,6 +127,64 @@ bool EintrSafeFileDescriptor::BlkIoctl(int request,
 #endif  // defined(BLKZEROOUT)
 }
 
+bool EintrSafeFileDescriptor::CopyRangeFrom(FileDescriptor* source,
+                                            uint64_t source_offset,
+                                            uint64_t offset,
+                                            uint64_t length) {
+  CHECK_GE(fd_, 0);
+  int source_fd = source->GetReadFd();
+  if (source_fd < 0)
+    return false;
+  bool copied = false;
+
+#ifdef FICLONERANGE
+  // Filesystems sharing extents between files, like btrfs or XFS, can make
+  // the target blocks point to the source ones instead of copying them.
+  if (clone_supported_) {
+    struct file_clone_range range;
+    range.src_fd = source_fd;
+    range.src_offset = source_offset;
+    range.src_length = length;
+    range.dest_offset = offset;
+    if (ioctl(fd_, FICLONERANGE, &range) == 0) {
+      copied = true;
+    } else {
+      PLOG(INFO) << "Cloning ranges not supported, not trying again";
+      clone_supported_ = false;
+    }
+  }
+#endif  // defined(FICLONERANGE)
+
+#ifdef __NR_copy_file_range
+  if (!copied && copy_supported_) {
+    loff_t source_pos = source_offset;
+    loff_t pos = offset;
+    while (length > 0) {
+      ssize_t ret = HANDLE_EINTR(syscall(
+          __NR_copy_file_range, source_fd, &source_pos, fd_, &pos, length, 0));
+      if (ret <= 0) {
+        // Block devices, and files on different filesystems with older
+        // kernels, can't be copied in the kernel.
+        if (ret < 0 && (errno == ENOSYS || errno == EINVAL ||
+                        errno == EXDEV || errno == EOPNOTSUPP)) {
+          PLOG(INFO) << "Copying ranges not supported, not trying again";
+          copy_supported_ = false;
+        }
+        return false;
+      }
+      length -= ret;
+    }
+    copied = true;
+  }
+#endif  // defined(__NR_copy_file_range)
+
+  if (!copied)
+    return false;
+  // The blocks may be shared instead of written, which O_DSYNC doesn't cover.
+  int flags = fcntl(fd_, F_GETFL, 0);
+  return flags != -1 && ((flags & O_DSYNC) == 0 || fdatasync(fd_) == 0);
+}
+
 bool EintrSafeFileDescriptor::Flush() {
   CHECK_GE(fd_, 0);
   return true;
@@ -87,6 +87,20 @@ class FileDescriptor {
                         uint64_t length,
                         int* result) = 0;
 
+  // Copies |length| bytes at offset |source_offset| of |source| to offset
+  // |offset| of this file in the kernel, without reading them to user space,
+  // if both files support it. Returns whether the whole range was copied;
+  // otherwise the caller must copy it, and part of it may have been written
+  // already. The position of both files is left unchanged.
+  virtual bool CopyRangeFrom(FileDescriptor* source,
+                             uint64_t source_offset,
+                             uint64_t offset,
+                             uint64_t length) = 0;
+
+  // Returns the POSIX file descriptor holding the data returned by Read(),
+  // which the kernel can copy data from, or -1 if there's none.
+  virtual int GetReadFd() = 0;
+
   // Flushes any cached data. The descriptor must be opened prior to this
   // call. Returns false if it fails to write data. Implementations may set
   // errno accrodingly.
@@ -123,6 +137,11 @@ class EintrSafeFileDescriptor : public FileDescriptor {
                 uint64_t start,
                 uint64_t length,
                 int* result) override;
+  bool CopyRangeFrom(FileDescriptor* source,
+                     uint64_t source_offset,
+                     uint64_t offset,
+                     uint64_t length) override;
+  int GetReadFd() override { return fd_; }
   bool Flush() override;
   bool Close() override;
   bool IsSettingErrno() override {
@@ -134,6 +153,12 @@ class EintrSafeFileDescriptor : public FileDescriptor {
 
  protected:
   int fd_;
+
+ private:
+  // Whether the ranges can still be cloned with FICLONERANGE or copied with
+  // copy_file_range(). Each is disabled after failing once.
+  bool clone_supported_{true};
+  bool copy_supported_{true};
 };
 
 }  // namespace chromeos_update_engine
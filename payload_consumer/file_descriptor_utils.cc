@@ -24,6 +24,7 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/extent_reader.h"
 #include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 
 using google::protobuf::RepeatedPtrField;
 using std::min;
@@ -35,6 +36,44 @@ namespace {
 // Size of the buffer used to copy blocks.
 const uint64_t kMaxCopyBufferSize = 1024 * 1024;
 
+// Copies the |src_extents| of |source| to the |tgt_extents| of |target| in the
+// kernel, see FileDescriptor::CopyRangeFrom(). Returns false if any range
+// couldn't be copied.
+bool CopyExtentsInKernel(FileDescriptorPtr source,
+                         const RepeatedPtrField<Extent>& src_extents,
+                         FileDescriptorPtr target,
+                         const RepeatedPtrField<Extent>& tgt_extents,
+                         uint64_t block_size) {
+  if (source->GetReadFd() < 0)
+    return false;
+  auto src_extent = src_extents.begin();
+  auto tgt_extent = tgt_extents.begin();
+  uint64_t src_blocks_done = 0, tgt_blocks_done = 0;
+  while (src_extent != src_extents.end() && tgt_extent != tgt_extents.end()) {
+    uint64_t blocks = min(src_extent->num_blocks() - src_blocks_done,
+                          tgt_extent->num_blocks() - tgt_blocks_done);
+    if (blocks > 0 && tgt_extent->start_block() != kSparseHole &&
+        !target->CopyRangeFrom(
+            source.get(),
+            (src_extent->start_block() + src_blocks_done) * block_size,
+            (tgt_extent->start_block() + tgt_blocks_done) * block_size,
+            blocks * block_size)) {
+      return false;
+    }
+    src_blocks_done += blocks;
+    tgt_blocks_done += blocks;
+    if (src_blocks_done == src_extent->num_blocks()) {
+      src_extent++;
+      src_blocks_done = 0;
+    }
+    if (tgt_blocks_done == tgt_extent->num_blocks()) {
+      tgt_extent++;
+      tgt_blocks_done = 0;
+    }
+  }
+  return true;
+}
+
 bool CommonHashExtents(FileDescriptorPtr source,
                        const RepeatedPtrField<Extent>& src_extents,
                        DirectExtentWriter* writer,
@@ -82,10 +121,22 @@ bool CopyAndHashExtents(FileDescriptorPtr source,
                         const RepeatedPtrField<Extent>& tgt_extents,
                         uint64_t block_size,
                         brillo::Blob* hash_out) {
-  DirectExtentWriter writer;
-  TEST_AND_RETURN_FALSE(writer.Init(target, tgt_extents, block_size));
   TEST_AND_RETURN_FALSE(utils::BlocksInExtents(src_extents) ==
                         utils::BlocksInExtents(tgt_extents));
+  // The data only goes through user space if it has to be hashed or the files
+  // can't be copied in the kernel, in which case the ranges possibly copied
+  // are written again.
+  if (CopyExtentsInKernel(
+          source, src_extents, target, tgt_extents, block_size)) {
+    if (hash_out != nullptr) {
+      TEST_AND_RETURN_FALSE(CommonHashExtents(
+          source, src_extents, nullptr, block_size, hash_out));
+    }
+    return true;
+  }
+
+  DirectExtentWriter writer;
+  TEST_AND_RETURN_FALSE(writer.Init(target, tgt_extents, block_size));
   TEST_AND_RETURN_FALSE(
       CommonHashExtents(source, src_extents, &writer, block_size, hash_out));
   TEST_AND_RETURN_FALSE(writer.End());
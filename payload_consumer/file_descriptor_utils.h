@@ -34,6 +34,9 @@ namespace fd_utils {
 // false and the value pointed by |hash_out| is undefined.
 // The |source| and |target| files must be different, or otherwise |src_extents|
 // and |tgt_extents| must not overlap.
+// When both files support it, the blocks are copied in the kernel without
+// going through user space, see FileDescriptor::CopyRangeFrom(), and are only
+// read to be hashed if |hash_out| is not null.
 bool CopyAndHashExtents(
     FileDescriptorPtr source,
     const google::protobuf::RepeatedPtrField<Extent>& src_extents,
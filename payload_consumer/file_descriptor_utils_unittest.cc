@@ -167,6 +167,38 @@ TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsManyToManyTest) {
   EXPECT_EQ(expected_hash, hash_out);
 }
 
+// Files supporting it are copied in the kernel, which must give the same result
+// as copying through user space.
+TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsFromFileTest) {
+  const char kSourceData[] = "00000001000200030004";
+  std::string src_path;
+  EXPECT_TRUE(utils::MakeTempFile("fd_src.XXXXXX", &src_path, nullptr));
+  ScopedPathUnlinker src_unlinker(src_path);
+  EXPECT_TRUE(
+      utils::WriteFile(src_path.c_str(), kSourceData, strlen(kSourceData)));
+  FileDescriptorPtr source(new EintrSafeFileDescriptor());
+  EXPECT_TRUE(source->Open(src_path.c_str(), O_RDONLY));
+
+  brillo::Blob hash_out;
+  auto src_extents = CreateExtentList({{1, 1}, {4, 1}, {2, 2}, {0, 1}});
+  auto tgt_extents = CreateExtentList({{2, 3}, {0, 2}});
+  EXPECT_TRUE(fd_utils::CopyAndHashExtents(
+      source, src_extents, target_, tgt_extents, 4, &hash_out));
+  ExpectTarget("00030000000100040002");
+
+  const char kExpectedOrderedData[] = "00010004000200030000";
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+      kExpectedOrderedData, strlen(kExpectedOrderedData), &expected_hash));
+  EXPECT_EQ(expected_hash, hash_out);
+
+  // Copy without hashing, overwriting the blocks already copied.
+  tgt_extents = CreateExtentList({{0, 5}});
+  EXPECT_TRUE(fd_utils::CopyAndHashExtents(
+      source, src_extents, target_, tgt_extents, 4, nullptr));
+  ExpectTarget(kExpectedOrderedData);
+}
+
 // Failing to read from the source should fail the hash calculation.
 TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsReadFailureTest) {
   auto extents = CreateExtentList({{0, 5}});
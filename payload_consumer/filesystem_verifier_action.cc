@@ -20,29 +20,43 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <cstdlib>
 #include <string>
 
 #include <base/bind.h>
+#include <base/posix/eintr_wrapper.h>
 #include <brillo/data_encoding.h>
-#include <brillo/streams/file_stream.h>
 
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 
+using brillo::MessageLoop;
 using brillo::data_encoding::Base64Encode;
 using std::string;
 
 namespace chromeos_update_engine {
 
 namespace {
-const off_t kReadFileBufferSize = 128 * 1024;
+// Size of each read from a partition.
+const size_t kReadFileBufferSize = 1024 * 1024;  // 1 MiB
+// How far ahead of the current read the kernel is asked to read the partition,
+// so the next reads are served from the page cache while this one is hashed.
+const off_t kReadAheadSize = 8 * 1024 * 1024;  // 8 MiB
+// Maximum number of partitions hashed concurrently.
+const size_t kMaxHashingThreads = 4;
 }  // namespace
 
+FilesystemVerifierAction::~FilesystemVerifierAction() {
+  // Makes the worker threads give up the partitions they're hashing.
+  cancelled_ = true;
+  StopHashing();
+}
+
 void FilesystemVerifierAction::PerformAction() {
   // Will tell the ActionProcessor we've failed if we return.
   ScopedActionCompleter abort_action_completer(processor_, this);
@@ -61,7 +75,10 @@ void FilesystemVerifierAction::PerformAction() {
     return;
   }
 
-  StartPartitionHashing();
+  if (!StartHashing()) {
+    StopHashing();
+    return;
+  }
   abort_action_completer.set_should_complete(false);
 }
 
@@ -71,13 +88,13 @@ void FilesystemVerifierAction::TerminateProcessing() {
 }
 
 bool FilesystemVerifierAction::IsCleanupPending() const {
-  return src_stream_ != nullptr;
+  return thread_pool_ != nullptr || notify_task_ != MessageLoop::kTaskIdNull;
 }
 
 void FilesystemVerifierAction::Cleanup(ErrorCode code) {
-  src_stream_.reset();
+  StopHashing();
   // This memory is not used anymore.
-  buffer_.clear();
+  jobs_.clear();
 
   if (cancelled_)
     return;
@@ -86,139 +103,203 @@ void FilesystemVerifierAction::Cleanup(ErrorCode code) {
   processor_->ActionComplete(this, code);
 }
 
-void FilesystemVerifierAction::StartPartitionHashing() {
-  if (partition_index_ == install_plan_.partitions.size()) {
-    Cleanup(ErrorCode::kSuccess);
-    return;
+bool FilesystemVerifierAction::StartHashing() {
+  jobs_.clear();
+  size_t num_jobs_to_hash = 0;
+  for (size_t i = 0; i < install_plan_.partitions.size(); i++) {
+    const InstallPlan::Partition& partition = install_plan_.partitions[i];
+    HashJob job{"", 0, ErrorCode::kSuccess, {}};
+    switch (verifier_step_) {
+      case VerifierStep::kVerifySourceHash:
+        if (i != partition_index_)
+          continue;
+        job.path = partition.source_path;
+        job.size = partition.source_size;
+        break;
+      case VerifierStep::kVerifyTargetHash:
+        job.path = partition.target_path;
+        job.size = partition.target_size;
+        // The DeltaPerformer already hashed the partition as it wrote it.
+        job.hash = partition.written_target_hash;
+        break;
+    }
+    if (job.hash.empty()) {
+      LOG(INFO) << "Hashing partition " << i << " (" << partition.name
+                << ") on device " << job.path;
+      num_jobs_to_hash++;
+    } else {
+      LOG(INFO) << "Partition " << i << " (" << partition.name
+                << ") was hashed while it was written.";
+    }
+    jobs_.push_back(job);
   }
-  InstallPlan::Partition& partition =
-      install_plan_.partitions[partition_index_];
-
-  string part_path;
-  switch (verifier_step_) {
-    case VerifierStep::kVerifySourceHash:
-      part_path = partition.source_path;
-      remaining_size_ = partition.source_size;
-      break;
-    case VerifierStep::kVerifyTargetHash:
-      part_path = partition.target_path;
-      remaining_size_ = partition.target_size;
-      break;
+  next_job_ = 0;
+
+  TEST_AND_RETURN_FALSE_ERRNO(pipe2(notify_fds_, O_CLOEXEC | O_NONBLOCK) == 0);
+  notify_task_ = MessageLoop::current()->WatchFileDescriptor(
+      FROM_HERE,
+      notify_fds_[0],
+      MessageLoop::WatchMode::kWatchRead,
+      true,
+      base::Bind(&FilesystemVerifierAction::OnNotifyFdReady,
+                 base::Unretained(this)));
+  TEST_AND_RETURN_FALSE(notify_task_ != MessageLoop::kTaskIdNull);
+
+  const size_t num_threads = std::min(num_jobs_to_hash, kMaxHashingThreads);
+  if (num_threads == 0) {
+    // Nothing to read, but the hashes are still checked from the main loop.
+    Notify();
+    return true;
   }
-  LOG(INFO) << "Hashing partition " << partition_index_ << " ("
-            << partition.name << ") on device " << part_path;
-  if (part_path.empty())
-    return Cleanup(ErrorCode::kFilesystemVerifierError);
-
-  brillo::ErrorPtr error;
-  src_stream_ = brillo::FileStream::Open(
-      base::FilePath(part_path),
-      brillo::Stream::AccessMode::READ,
-      brillo::FileStream::Disposition::OPEN_EXISTING,
-      &error);
+  running_workers_ = num_threads;
+  thread_pool_.reset(
+      new base::DelegateSimpleThreadPool("fs-verifier", num_threads));
+  thread_pool_->Start();
+  thread_pool_->AddWork(this, num_threads);
+  return true;
+}
 
-  if (!src_stream_) {
-    LOG(ERROR) << "Unable to open " << part_path << " for reading";
-    return Cleanup(ErrorCode::kFilesystemVerifierError);
+void FilesystemVerifierAction::Run() {
+  brillo::Blob buffer;
+  while (true) {
+    const size_t job_index = next_job_++;
+    if (job_index >= jobs_.size())
+      break;
+    if (jobs_[job_index].hash.empty())
+      HashPartition(&jobs_[job_index], &buffer);
   }
+  // The last worker to finish wakes up the main loop.
+  if (--running_workers_ == 0)
+    Notify();
+}
 
-  buffer_.resize(kReadFileBufferSize);
-  read_done_ = false;
-  hasher_.reset(new HashCalculator());
-
-  // Start the first read.
-  ScheduleRead();
+void FilesystemVerifierAction::Notify() {
+  const char byte = 0;
+  // A full pipe already has a pending notification.
+  if (HANDLE_EINTR(write(notify_fds_[1], &byte, 1)) < 0 && errno != EAGAIN)
+    PLOG(ERROR) << "Unable to notify that the partitions were hashed";
 }
 
-void FilesystemVerifierAction::ScheduleRead() {
-  size_t bytes_to_read = std::min(static_cast<int64_t>(buffer_.size()),
-                                  remaining_size_);
-  if (!bytes_to_read) {
-    OnReadDoneCallback(0);
+void FilesystemVerifierAction::HashPartition(HashJob* job,
+                                             brillo::Blob* buffer) {
+  if (job->path.empty()) {
+    job->error = ErrorCode::kFilesystemVerifierError;
     return;
   }
-
-  bool read_async_ok = src_stream_->ReadAsync(
-    buffer_.data(),
-    bytes_to_read,
-    base::Bind(&FilesystemVerifierAction::OnReadDoneCallback,
-               base::Unretained(this)),
-    base::Bind(&FilesystemVerifierAction::OnReadErrorCallback,
-               base::Unretained(this)),
-    nullptr);
-
-  if (!read_async_ok) {
-    LOG(ERROR) << "Unable to schedule an asynchronous read from the stream.";
-    Cleanup(ErrorCode::kError);
+  int fd = HANDLE_EINTR(open(job->path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open " << job->path << " for reading";
+    job->error = ErrorCode::kFilesystemVerifierError;
+    return;
   }
-}
-
-void FilesystemVerifierAction::OnReadDoneCallback(size_t bytes_read) {
-  if (bytes_read == 0) {
-    read_done_ = true;
-  } else {
-    remaining_size_ -= bytes_read;
-    CHECK(!read_done_);
-    if (!hasher_->Update(buffer_.data(), bytes_read)) {
+  ScopedFdCloser fd_closer(&fd);
+
+  // The partition is read once from start to end, so let the kernel read ahead
+  // aggressively.
+  posix_fadvise(fd, 0, job->size, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd, 0, kReadAheadSize, POSIX_FADV_WILLNEED);
+
+  buffer->resize(kReadFileBufferSize);
+  HashCalculator hasher;
+  int64_t offset = 0;
+  while (offset < job->size) {
+    if (cancelled_) {
+      job->error = ErrorCode::kError;
+      return;
+    }
+    const size_t bytes_to_read =
+        std::min(static_cast<int64_t>(buffer->size()), job->size - offset);
+    ssize_t bytes_read = HANDLE_EINTR(pread(fd, buffer->data(), bytes_to_read,
+                                            offset));
+    if (bytes_read < 0) {
+      PLOG(ERROR) << "Unable to read from " << job->path;
+      job->error = ErrorCode::kError;
+      return;
+    }
+    if (bytes_read == 0) {
+      LOG(ERROR) << "Failed to read the remaining " << job->size - offset
+                 << " bytes from " << job->path;
+      job->error = ErrorCode::kFilesystemVerifierError;
+      return;
+    }
+    // Keeps the window read ahead |kReadAheadSize| past the current offset.
+    posix_fadvise(fd, offset + kReadAheadSize, bytes_read, POSIX_FADV_WILLNEED);
+    offset += bytes_read;
+    if (!hasher.Update(buffer->data(), bytes_read)) {
       LOG(ERROR) << "Unable to update the hash.";
-      Cleanup(ErrorCode::kError);
+      job->error = ErrorCode::kError;
       return;
     }
   }
-
-  // We either terminate the current partition or have more data to read.
-  if (cancelled_)
-    return Cleanup(ErrorCode::kError);
-
-  if (read_done_ || remaining_size_ == 0) {
-    if (remaining_size_ != 0) {
-      LOG(ERROR) << "Failed to read the remaining " << remaining_size_
-                 << " bytes from partition "
-                 << install_plan_.partitions[partition_index_].name;
-      return Cleanup(ErrorCode::kFilesystemVerifierError);
-    }
-    return FinishPartitionHashing();
+  if (!hasher.Finalize()) {
+    LOG(ERROR) << "Unable to finalize the hash.";
+    job->error = ErrorCode::kError;
+    return;
   }
-  ScheduleRead();
+  job->hash = hasher.raw_hash();
 }
 
-void FilesystemVerifierAction::OnReadErrorCallback(
-      const brillo::Error* error) {
-  // TODO(deymo): Transform the read-error into an specific ErrorCode.
-  LOG(ERROR) << "Asynchronous read failed.";
-  Cleanup(ErrorCode::kError);
+void FilesystemVerifierAction::OnNotifyFdReady() {
+  char buf[16];
+  while (HANDLE_EINTR(read(notify_fds_[0], buf, sizeof(buf))) > 0) {
+  }
+  StopHashing();
+  FinishHashing();
 }
 
-void FilesystemVerifierAction::FinishPartitionHashing() {
-  if (!hasher_->Finalize()) {
-    LOG(ERROR) << "Unable to finalize the hash.";
-    return Cleanup(ErrorCode::kError);
+void FilesystemVerifierAction::StopHashing() {
+  if (thread_pool_) {
+    thread_pool_->JoinAll();
+    thread_pool_.reset();
+  }
+  if (notify_task_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(notify_task_);
+    notify_task_ = MessageLoop::kTaskIdNull;
   }
-  InstallPlan::Partition& partition =
-      install_plan_.partitions[partition_index_];
-  LOG(INFO) << "Hash of " << partition.name << ": "
-            << Base64Encode(hasher_->raw_hash());
+  for (int& fd : notify_fds_) {
+    if (fd >= 0)
+      IGNORE_EINTR(close(fd));
+    fd = -1;
+  }
+}
 
+void FilesystemVerifierAction::FinishHashing() {
   switch (verifier_step_) {
     case VerifierStep::kVerifyTargetHash:
-      if (partition.target_hash != hasher_->raw_hash()) {
-        LOG(ERROR) << "New '" << partition.name
-                   << "' partition verification failed.";
-        if (partition.source_hash.empty()) {
-          // No need to verify source if it is a full payload.
-          return Cleanup(ErrorCode::kNewRootfsVerificationError);
+      for (size_t i = 0; i < install_plan_.partitions.size(); i++) {
+        const InstallPlan::Partition& partition = install_plan_.partitions[i];
+        const HashJob& job = jobs_[i];
+        if (job.error != ErrorCode::kSuccess)
+          return Cleanup(job.error);
+        LOG(INFO) << "Hash of " << partition.name << ": "
+                  << Base64Encode(job.hash);
+        if (partition.target_hash != job.hash) {
+          LOG(ERROR) << "New '" << partition.name
+                     << "' partition verification failed.";
+          if (partition.source_hash.empty()) {
+            // No need to verify source if it is a full payload.
+            return Cleanup(ErrorCode::kNewRootfsVerificationError);
+          }
+          // Now that the target partition does not match, and it's not a full
+          // payload, we need to switch to kVerifySourceHash step to check if
+          // it's because the source partition does not match either.
+          verifier_step_ = VerifierStep::kVerifySourceHash;
+          partition_index_ = i;
+          if (!StartHashing())
+            return Cleanup(ErrorCode::kError);
+          return;
         }
-        // If we have not verified source partition yet, now that the target
-        // partition does not match, and it's not a full payload, we need to
-        // switch to kVerifySourceHash step to check if it's because the source
-        // partition does not match either.
-        verifier_step_ = VerifierStep::kVerifySourceHash;
-      } else {
-        partition_index_++;
       }
-      break;
-    case VerifierStep::kVerifySourceHash:
-      if (partition.source_hash != hasher_->raw_hash()) {
+      return Cleanup(ErrorCode::kSuccess);
+    case VerifierStep::kVerifySourceHash: {
+      const InstallPlan::Partition& partition =
+          install_plan_.partitions[partition_index_];
+      const HashJob& job = jobs_[0];
+      if (job.error != ErrorCode::kSuccess)
+        return Cleanup(job.error);
+      LOG(INFO) << "Hash of " << partition.name << ": "
+                << Base64Encode(job.hash);
+      if (partition.source_hash != job.hash) {
         LOG(ERROR) << "Old '" << partition.name
                    << "' partition verification failed.";
         LOG(ERROR) << "This is a server-side error due to mismatched delta"
@@ -231,7 +312,7 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
                       " means that the delta I've been given doesn't match my"
                       " existing system. The "
                    << partition.name << " partition I have has hash: "
-                   << Base64Encode(hasher_->raw_hash())
+                   << Base64Encode(job.hash)
                    << " but the update expected me to have "
                    << Base64Encode(partition.source_hash) << " .";
         LOG(INFO) << "To get the checksum of the " << partition.name
@@ -251,12 +332,8 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
       // We only need to verify the source partition which the target hash does
       // not match, the rest of the partitions don't matter.
       return Cleanup(ErrorCode::kNewRootfsVerificationError);
+    }
   }
-  // Start hashing the next partition, if any.
-  hasher_.reset();
-  buffer_.clear();
-  src_stream_->CloseBlocking(nullptr);
-  StartPartitionHashing();
 }
 
 }  // namespace chromeos_update_engine
@@ -20,10 +20,14 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 
-#include <brillo/streams/stream.h>
+#include <base/threading/simple_thread.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/hash_calculator.h"
@@ -34,6 +38,13 @@
 // If the target hash does not match, the action will fail. In case of failure,
 // the error code will depend on whether the source slot hashes are provided and
 // match.
+//
+// The partitions are hashed concurrently on worker threads, each reading its
+// partition sequentially in large chunks while the kernel reads ahead the
+// following ones. The results are checked in the partition order, so the error
+// reported is the same as if the partitions were hashed one after another.
+// Target partitions already hashed by the DeltaPerformer while writing them are
+// not read again.
 
 namespace chromeos_update_engine {
 
@@ -47,9 +58,11 @@ enum class VerifierStep {
   kVerifySourceHash,
 };
 
-class FilesystemVerifierAction : public InstallPlanAction {
+class FilesystemVerifierAction : public InstallPlanAction,
+                                 public base::DelegateSimpleThread::Delegate {
  public:
   FilesystemVerifierAction() = default;
+  ~FilesystemVerifierAction() override;
 
   void PerformAction() override;
   void TerminateProcessing() override;
@@ -65,21 +78,44 @@ class FilesystemVerifierAction : public InstallPlanAction {
   std::string Type() const override { return StaticType(); }
 
  private:
-  // Starts the hashing of the current partition. If there aren't any partitions
-  // remaining to be hashed, it finishes the action.
-  void StartPartitionHashing();
-
-  // Schedules the asynchronous read of the filesystem.
-  void ScheduleRead();
-
-  // Called from the main loop when a single read from |src_stream_| succeeds or
-  // fails, calling OnReadDoneCallback() and OnReadErrorCallback() respectively.
-  void OnReadDoneCallback(size_t bytes_read);
-  void OnReadErrorCallback(const brillo::Error* error);
-
-  // When the read is done, finalize the hash checking of the current partition
-  // and continue checking the next one.
-  void FinishPartitionHashing();
+  // A partition device to hash. |error| and |hash| are set by the worker
+  // thread hashing it, unless |hash| was already known.
+  struct HashJob {
+    std::string path;
+    int64_t size;
+    ErrorCode error;
+    brillo::Blob hash;
+  };
+
+  // base::DelegateSimpleThread::Delegate overrides. Run by each worker thread,
+  // hashing the jobs not taken by another thread yet.
+  void Run() override;
+
+  // Reads the first |job->size| bytes of |job->path| and sets |job->hash| to
+  // their hash, or sets |job->error| on failure or cancellation. |buffer| is
+  // used to hold the data read.
+  void HashPartition(HashJob* job, brillo::Blob* buffer);
+
+  // Starts hashing the partitions on the current |verifier_step_|: all the
+  // target partitions on kVerifyTargetHash, or the source partition at
+  // |partition_index_| on kVerifySourceHash. FinishHashing() is called once
+  // they are all hashed. Returns false on error.
+  bool StartHashing();
+
+  // Wakes up the main loop to call OnNotifyFdReady().
+  void Notify();
+
+  // Called from the main loop when the worker threads notified that the last
+  // job was hashed.
+  void OnNotifyFdReady();
+
+  // Joins the worker threads, cancelling the jobs not hashed yet.
+  void StopHashing();
+
+  // Checks the hashes computed by the worker threads against the ones in the
+  // install plan, and either completes the action or continues with the
+  // kVerifySourceHash step.
+  void FinishHashing();
 
   // Cleans up all the variables we use for async operations and tells the
   // ActionProcessor we're done w/ |code| as passed in. |cancelled_| should be
@@ -89,29 +125,30 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // The type of the partition that we are verifying.
   VerifierStep verifier_step_ = VerifierStep::kVerifyTargetHash;
 
-  // The index in the install_plan_.partitions vector of the partition currently
-  // being hashed.
+  // The index in the install_plan_.partitions vector of the partition whose
+  // source is being hashed on the kVerifySourceHash step.
   size_t partition_index_{0};
 
-  // If not null, the FileStream used to read from the device.
-  brillo::StreamPtr src_stream_;
-
-  // Buffer for storing data we read.
-  brillo::Blob buffer_;
-
-  bool read_done_{false};  // true if reached EOF on the input stream.
-  bool cancelled_{false};  // true if the action has been cancelled.
+  // true if the action has been cancelled. Also checked by the worker threads
+  // to stop early.
+  std::atomic<bool> cancelled_{false};
 
   // The install plan we're passed in via the input pipe.
   InstallPlan install_plan_;
 
-  // Calculates the hash of the data.
-  std::unique_ptr<HashCalculator> hasher_;
+  // The partitions being hashed, in the install plan order, and the index of
+  // the next one to be taken by a worker thread.
+  std::vector<HashJob> jobs_;
+  std::atomic<size_t> next_job_{0};
+
+  // The worker threads hashing |jobs_| and how many of them are still running.
+  std::unique_ptr<base::DelegateSimpleThreadPool> thread_pool_;
+  std::atomic<size_t> running_workers_{0};
 
-  // Reads and hashes this many bytes from the head of the input stream. This
-  // field is initialized from the corresponding InstallPlan::Partition size,
-  // when the partition starts to be hashed.
-  int64_t remaining_size_{0};
+  // The pipe used by the last worker thread to wake up the main loop, and the
+  // task watching it.
+  int notify_fds_[2]{-1, -1};
+  brillo::MessageLoop::TaskId notify_task_{brillo::MessageLoop::kTaskIdNull};
 
   DISALLOW_COPY_AND_ASSIGN(FilesystemVerifierAction);
 };
@@ -18,15 +18,17 @@
 
 #include <fcntl.h>
 
+#include <memory>
 #include <set>
 #include <string>
 #include <vector>
 
 #include <base/bind.h>
+#include <base/message_loop/message_loop.h>
 #include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
-#include <brillo/message_loops/fake_message_loop.h>
+#include <brillo/message_loops/base_message_loop.h>
 #include <brillo/message_loops/message_loop_utils.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -56,7 +58,24 @@ class FilesystemVerifierActionTest : public ::testing::Test {
   // Returns true iff test has completed successfully.
   bool DoTest(bool terminate_early, bool hash_fail);
 
-  brillo::FakeMessageLoop loop_{nullptr};
+  // Runs a FilesystemVerifierAction on |install_plan| and returns the error
+  // code it completed with.
+  ErrorCode RunVerifier(const InstallPlan& install_plan);
+
+  // Creates a temporary file holding |data|, removed when the test ends, and
+  // returns its path.
+  string MakePartition(const brillo::Blob& data);
+
+  // Returns an install plan with |num_partitions| partitions whose source and
+  // target are files holding different data, with the matching hashes.
+  InstallPlan MakeInstallPlan(size_t num_partitions);
+
+  // The worker threads hashing the partitions wake up the main loop through a
+  // file descriptor, which needs a real message loop.
+  base::MessageLoopForIO base_loop_;
+  brillo::BaseMessageLoop loop_{&base_loop_};
+
+  vector<std::unique_ptr<ScopedPathUnlinker>> unlinkers_;
 };
 
 class FilesystemVerifierActionTestDelegate : public ActionProcessorDelegate {
@@ -219,6 +238,68 @@ bool FilesystemVerifierActionTest::DoTest(bool terminate_early,
   return success;
 }
 
+ErrorCode FilesystemVerifierActionTest::RunVerifier(
+    const InstallPlan& install_plan) {
+  ActionProcessor processor;
+  ObjectFeederAction<InstallPlan> feeder_action;
+  FilesystemVerifierAction verifier_action;
+  ObjectCollectorAction<InstallPlan> collector_action;
+
+  BondActions(&feeder_action, &verifier_action);
+  BondActions(&verifier_action, &collector_action);
+
+  FilesystemVerifierActionTestDelegate delegate(&verifier_action);
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&verifier_action);
+  processor.EnqueueAction(&collector_action);
+  feeder_action.set_obj(install_plan);
+
+  loop_.PostTask(FROM_HERE, base::Bind(&StartProcessorInRunLoop,
+                                       &processor,
+                                       &verifier_action,
+                                       false));
+  loop_.Run();
+
+  EXPECT_TRUE(delegate.ran());
+  if (delegate.code() == ErrorCode::kSuccess) {
+    EXPECT_TRUE(collector_action.object() == install_plan);
+  }
+  return delegate.code();
+}
+
+string FilesystemVerifierActionTest::MakePartition(const brillo::Blob& data) {
+  string path;
+  EXPECT_TRUE(utils::MakeTempFile("partition.XXXXXX", &path, nullptr));
+  unlinkers_.emplace_back(new ScopedPathUnlinker(path));
+  EXPECT_TRUE(test_utils::WriteFileVector(path, data));
+  return path;
+}
+
+InstallPlan FilesystemVerifierActionTest::MakeInstallPlan(
+    size_t num_partitions) {
+  InstallPlan install_plan;
+  install_plan.source_slot = 0;
+  install_plan.target_slot = 1;
+  for (size_t i = 0; i < num_partitions; i++) {
+    // Partitions of different sizes, some spanning several reads.
+    brillo::Blob source_data(i * 3 * 1024 * 1024 + 4096 + i);
+    test_utils::FillWithData(&source_data);
+    brillo::Blob target_data(source_data.rbegin(), source_data.rend());
+
+    InstallPlan::Partition part;
+    part.name = base::StringPrintf("part%zu", i);
+    part.source_path = MakePartition(source_data);
+    part.source_size = source_data.size();
+    EXPECT_TRUE(HashCalculator::RawHashOfData(source_data, &part.source_hash));
+    part.target_path = MakePartition(target_data);
+    part.target_size = target_data.size();
+    EXPECT_TRUE(HashCalculator::RawHashOfData(target_data, &part.target_hash));
+    install_plan.partitions.push_back(part);
+  }
+  return install_plan;
+}
+
 class FilesystemVerifierActionTest2Delegate : public ActionProcessorDelegate {
  public:
   void ActionCompleted(ActionProcessor* processor,
@@ -298,4 +379,50 @@ TEST_F(FilesystemVerifierActionTest, RunAsRootTerminateEarlyTest) {
   while (loop_.RunOnce(false)) {}
 }
 
+TEST_F(FilesystemVerifierActionTest, MultiplePartitionsTest) {
+  EXPECT_EQ(ErrorCode::kSuccess, RunVerifier(MakeInstallPlan(6)));
+}
+
+TEST_F(FilesystemVerifierActionTest, MultiplePartitionsTargetMismatchTest) {
+  InstallPlan install_plan = MakeInstallPlan(6);
+  install_plan.partitions[4].target_hash[0]++;
+  EXPECT_EQ(ErrorCode::kNewRootfsVerificationError,
+            RunVerifier(install_plan));
+}
+
+TEST_F(FilesystemVerifierActionTest, MultiplePartitionsSourceMismatchTest) {
+  InstallPlan install_plan = MakeInstallPlan(6);
+  // Only the source of the first partition whose target doesn't match is
+  // verified.
+  install_plan.partitions[2].target_hash[0]++;
+  install_plan.partitions[2].source_hash[0]++;
+  install_plan.partitions[3].target_hash[0]++;
+  EXPECT_EQ(ErrorCode::kDownloadStateInitializationError,
+            RunVerifier(install_plan));
+}
+
+TEST_F(FilesystemVerifierActionTest, MultiplePartitionsFirstErrorTest) {
+  InstallPlan install_plan = MakeInstallPlan(6);
+  // The error of the first failing partition is reported, as when hashing the
+  // partitions one after another.
+  install_plan.partitions[1].target_size++;
+  install_plan.partitions[3].target_hash[0]++;
+  EXPECT_EQ(ErrorCode::kFilesystemVerifierError, RunVerifier(install_plan));
+}
+
+TEST_F(FilesystemVerifierActionTest, WrittenTargetHashTest) {
+  InstallPlan install_plan = MakeInstallPlan(3);
+  // Partitions hashed while they were written are not read again.
+  for (InstallPlan::Partition& partition : install_plan.partitions) {
+    partition.written_target_hash = partition.target_hash;
+    partition.target_path = "/no/such/file";
+  }
+  EXPECT_EQ(ErrorCode::kSuccess, RunVerifier(install_plan));
+
+  // The source is still read when the written hash doesn't match.
+  install_plan.partitions[1].written_target_hash[0]++;
+  EXPECT_EQ(ErrorCode::kNewRootfsVerificationError,
+            RunVerifier(install_plan));
+}
+
 }  // namespace chromeos_update_engine
@@ -122,6 +122,7 @@ bool InstallPlan::Partition::operator==(
           target_path == that.target_path &&
           target_size == that.target_size &&
           target_hash == that.target_hash &&
+          written_target_hash == that.written_target_hash &&
           run_postinstall == that.run_postinstall &&
           postinstall_path == that.postinstall_path &&
           filesystem_type == that.filesystem_type &&
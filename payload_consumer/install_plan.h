@@ -101,6 +101,10 @@ struct InstallPlan {
     std::string target_path;
     uint64_t target_size{0};
     brillo::Blob target_hash;
+    // The hash of the target partition computed by the DeltaPerformer while
+    // writing it, or empty if it couldn't hash it in order. The
+    // FilesystemVerifierAction uses it instead of reading the partition.
+    brillo::Blob written_target_hash;
 
     // Whether we should run the postinstall script from this partition and the
     // postinstall parameters.
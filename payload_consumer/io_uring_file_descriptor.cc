@@ -0,0 +1,398 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The |user_data| of sync requests; write requests use their slot index.
+const uint64_t kSyncUserData = ~0ULL;
+
+// Queued write requests are submitted in batches of this size, so the device
+// starts working on them before the queue is full.
+const unsigned kSubmitBatchSize = 4;
+
+int IoUringSetup(unsigned entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int IoUringEnter(int ring_fd,
+                 unsigned to_submit,
+                 unsigned min_complete,
+                 unsigned flags) {
+  return syscall(
+      __NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+}  // namespace
+
+IoUringFileDescriptor::IoUringFileDescriptor(unsigned queue_depth)
+    : queue_depth_(queue_depth) {
+  DCHECK_GT(queue_depth_, 0U);
+}
+
+IoUringFileDescriptor::~IoUringFileDescriptor() {
+  if (in_flight_ > 0)
+    Drain();
+  TeardownRing();
+}
+
+bool IoUringFileDescriptor::IsSupported() {
+  static const bool supported = [] {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = IoUringSetup(1, &params);
+    if (ring_fd < 0)
+      return false;
+    IGNORE_EINTR(close(ring_fd));
+    return true;
+  }();
+  return supported;
+}
+
+bool IoUringFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  sync_ = false;
+  dirty_ = false;
+  error_ = 0;
+  offset_ = 0;
+  if ((flags & O_ACCMODE) != O_RDONLY && SetupRing()) {
+    // Syncing each write would keep a single write in flight.
+    sync_ = (flags & O_DSYNC) != 0;
+    flags &= ~O_DSYNC;
+  }
+  if (!EintrSafeFileDescriptor::Open(path, flags, mode)) {
+    TeardownRing();
+    return false;
+  }
+  return true;
+}
+
+bool IoUringFileDescriptor::Open(const char* path, int flags) {
+  return Open(path, flags, 0);
+}
+
+ssize_t IoUringFileDescriptor::Read(void* buf, size_t count) {
+  CHECK_GE(fd_, 0);
+  // Reads must see the data written before.
+  if (ring_fd_ >= 0 && !Drain())
+    return -1;
+  ssize_t ret = HANDLE_EINTR(pread(fd_, buf, count, offset_));
+  if (ret > 0)
+    offset_ += ret;
+  return ret;
+}
+
+ssize_t IoUringFileDescriptor::Write(const void* buf, size_t count) {
+  CHECK_GE(fd_, 0);
+  if (ring_fd_ < 0) {
+    ssize_t ret = HANDLE_EINTR(pwrite(fd_, buf, count, offset_));
+    if (ret > 0)
+      offset_ += ret;
+    return ret;
+  }
+  if (count == 0)
+    return 0;
+
+  while (free_slots_.empty()) {
+    if (!Enter(1))
+      return -1;
+  }
+  size_t slot_index = free_slots_.back();
+  free_slots_.pop_back();
+  Slot& slot = slots_[slot_index];
+  const uint8_t* data = static_cast<const uint8_t*>(buf);
+  slot.data.assign(data, data + count);
+  slot.iov.iov_base = slot.data.data();
+  slot.iov.iov_len = count;
+  slot.offset = offset_;
+  QueueWrite(slot_index);
+  offset_ += count;
+  dirty_ = true;
+
+  if (pending_submit_ >= kSubmitBatchSize && !Enter(0))
+    return -1;
+  return count;
+}
+
+off64_t IoUringFileDescriptor::Seek(off64_t offset, int whence) {
+  CHECK_GE(fd_, 0);
+  off64_t new_offset;
+  switch (whence) {
+    case SEEK_SET:
+      new_offset = offset;
+      break;
+    case SEEK_CUR:
+      new_offset = offset_ + offset;
+      break;
+    default:
+      new_offset = lseek64(fd_, offset, whence);
+      if (new_offset < 0)
+        return -1;
+  }
+  if (new_offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  offset_ = new_offset;
+  return offset_;
+}
+
+bool IoUringFileDescriptor::BlkIoctl(int request,
+                                     uint64_t start,
+                                     uint64_t length,
+                                     int* result) {
+  // The ioctl must apply after the writes queued before it.
+  if (ring_fd_ >= 0 && !Drain()) {
+    *result = -1;
+    return true;
+  }
+  return EintrSafeFileDescriptor::BlkIoctl(request, start, length, result);
+}
+
+bool IoUringFileDescriptor::CopyRangeFrom(FileDescriptor* source,
+                                          uint64_t source_offset,
+                                          uint64_t offset,
+                                          uint64_t length) {
+  // The copy must apply after the writes queued before it. Their errors are
+  // left to be reported by Flush() or Close().
+  while (ring_fd_ >= 0 && in_flight_ > 0) {
+    if (!Enter(1))
+      return false;
+  }
+  if (!EintrSafeFileDescriptor::CopyRangeFrom(
+          source, source_offset, offset, length)) {
+    return false;
+  }
+  // O_DSYNC is emulated by Flush() when writing through the ring.
+  dirty_ = true;
+  return true;
+}
+
+bool IoUringFileDescriptor::Flush() {
+  CHECK_GE(fd_, 0);
+  if (ring_fd_ < 0)
+    return true;
+  if (sync_ && dirty_) {
+    QueueSync();
+    dirty_ = false;
+  }
+  return Drain();
+}
+
+bool IoUringFileDescriptor::Close() {
+  CHECK_GE(fd_, 0);
+  bool success = Flush();
+  TeardownRing();
+  return EintrSafeFileDescriptor::Close() && success;
+}
+
+bool IoUringFileDescriptor::SetupRing() {
+  TeardownRing();
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // One extra entry for a sync request.
+  ring_fd_ = IoUringSetup(queue_depth_ + 1, &params);
+  if (ring_fd_ < 0) {
+    PLOG(WARNING) << "Unable to create an io_uring, writing synchronously";
+    return false;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sq_ring_ = mmap(nullptr,
+                  sq_ring_size_,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE,
+                  ring_fd_,
+                  IORING_OFF_SQ_RING);
+  cq_ring_ = mmap(nullptr,
+                  cq_ring_size_,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE,
+                  ring_fd_,
+                  IORING_OFF_CQ_RING);
+  void* sqes = mmap(nullptr,
+                    sqes_size_,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    ring_fd_,
+                    IORING_OFF_SQES);
+  if (sq_ring_ == MAP_FAILED)
+    sq_ring_ = nullptr;
+  if (cq_ring_ == MAP_FAILED)
+    cq_ring_ = nullptr;
+  if (sqes != MAP_FAILED)
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+  if (!sq_ring_ || !cq_ring_ || !sqes_) {
+    PLOG(WARNING) << "Unable to map the io_uring, writing synchronously";
+    TeardownRing();
+    return false;
+  }
+
+  uint8_t* sq_ring = static_cast<uint8_t*>(sq_ring_);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.array);
+  uint8_t* cq_ring = static_cast<uint8_t*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq_ring + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq_ring + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq_ring + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq_ring + params.cq_off.cqes);
+
+  slots_.resize(queue_depth_);
+  free_slots_.clear();
+  for (size_t i = 0; i < queue_depth_; i++)
+    free_slots_.push_back(queue_depth_ - 1 - i);
+  pending_submit_ = 0;
+  in_flight_ = 0;
+  return true;
+}
+
+void IoUringFileDescriptor::TeardownRing() {
+  if (sqes_)
+    munmap(sqes_, sqes_size_);
+  if (cq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_)
+    munmap(sq_ring_, sq_ring_size_);
+  sqes_ = nullptr;
+  cq_ring_ = nullptr;
+  sq_ring_ = nullptr;
+  if (ring_fd_ >= 0)
+    IGNORE_EINTR(close(ring_fd_));
+  ring_fd_ = -1;
+  slots_.clear();
+  free_slots_.clear();
+  pending_submit_ = 0;
+  in_flight_ = 0;
+}
+
+void IoUringFileDescriptor::QueueRequest(const struct io_uring_sqe& sqe) {
+  // There's one entry per slot plus one for a sync request, so the submission
+  // queue never overflows.
+  const unsigned tail = *sq_tail_;
+  const unsigned index = tail & *sq_mask_;
+  sqes_[index] = sqe;
+  sq_array_[index] = index;
+  // The kernel must see the entry before the new tail.
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  pending_submit_++;
+  in_flight_++;
+}
+
+void IoUringFileDescriptor::QueueWrite(size_t slot_index) {
+  Slot& slot = slots_[slot_index];
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_WRITEV;
+  sqe.fd = fd_;
+  sqe.off = slot.offset;
+  sqe.addr = reinterpret_cast<uint64_t>(&slot.iov);
+  sqe.len = 1;
+  sqe.user_data = slot_index;
+  QueueRequest(sqe);
+}
+
+void IoUringFileDescriptor::QueueSync() {
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_FSYNC;
+  sqe.flags = IOSQE_IO_DRAIN;
+  sqe.fd = fd_;
+  sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe.user_data = kSyncUserData;
+  QueueRequest(sqe);
+}
+
+bool IoUringFileDescriptor::Enter(unsigned min_complete) {
+  int ret = IoUringEnter(ring_fd_,
+                         pending_submit_,
+                         min_complete,
+                         min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+  if (ret < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      PLOG(ERROR) << "Unable to submit " << pending_submit_
+                  << " io_uring requests";
+      return false;
+    }
+  } else {
+    pending_submit_ -= ret;
+  }
+  ReapCompletions();
+  return true;
+}
+
+void IoUringFileDescriptor::ReapCompletions() {
+  unsigned head = *cq_head_;
+  // The kernel wrote the entries before the new tail.
+  const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    const struct io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+    in_flight_--;
+    if (cqe.user_data == kSyncUserData) {
+      if (cqe.res < 0 && error_ == 0)
+        error_ = -cqe.res;
+      continue;
+    }
+
+    const size_t slot_index = cqe.user_data;
+    Slot& slot = slots_[slot_index];
+    if (cqe.res <= 0) {
+      if (error_ == 0)
+        error_ = cqe.res < 0 ? -cqe.res : EIO;
+    } else if (static_cast<size_t>(cqe.res) < slot.iov.iov_len) {
+      // Write the rest of the data.
+      slot.iov.iov_base = static_cast<uint8_t*>(slot.iov.iov_base) + cqe.res;
+      slot.iov.iov_len -= cqe.res;
+      slot.offset += cqe.res;
+      QueueWrite(slot_index);
+      continue;
+    }
+    free_slots_.push_back(slot_index);
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+bool IoUringFileDescriptor::Drain() {
+  while (in_flight_ > 0) {
+    if (!Enter(1))
+      return false;
+  }
+  if (error_ != 0) {
+    LOG(ERROR) << "io_uring request failed: " << strerror(error_);
+    errno = error_;
+    error_ = 0;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,152 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+
+#include <sys/uio.h>
+
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+struct io_uring_cqe;
+struct io_uring_sqe;
+
+// IoUringFileDescriptor is an EintrSafeFileDescriptor that writes through an
+// io_uring, keeping several writes in flight instead of waiting for each one.
+// Write() only queues the data; errors are reported by the next Flush() or
+// Close(). When the file is opened with O_DSYNC, the flag is dropped and
+// Flush() syncs the written data instead, so data is only known to be on disk
+// after Flush() returns.
+//
+// When the ring can't be created, writes are done synchronously as in
+// EintrSafeFileDescriptor.
+
+namespace chromeos_update_engine {
+
+class IoUringFileDescriptor : public EintrSafeFileDescriptor {
+ public:
+  // Keeps up to |queue_depth| writes in flight.
+  explicit IoUringFileDescriptor(unsigned queue_depth);
+  ~IoUringFileDescriptor() override;
+
+  // Returns whether the running kernel supports io_uring.
+  static bool IsSupported();
+
+  // FileDescriptor overrides.
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool CopyRangeFrom(FileDescriptor* source,
+                     uint64_t source_offset,
+                     uint64_t offset,
+                     uint64_t length) override;
+  bool Flush() override;
+  bool Close() override;
+
+ private:
+  // A write request and the copy of the data it writes.
+  struct Slot {
+    brillo::Blob data;
+    struct iovec iov;
+    off64_t offset;
+  };
+
+  // Creates the ring and maps its queues. Returns false on error.
+  bool SetupRing();
+
+  // Unmaps and closes the ring, if any.
+  void TeardownRing();
+
+  // Adds |sqe| to the submission queue, to be submitted by the next call to
+  // Enter().
+  void QueueRequest(const io_uring_sqe& sqe);
+
+  // Queues the write request of |slots_[slot_index]|.
+  void QueueWrite(size_t slot_index);
+
+  // Queues a request syncing the written data to disk once all the requests
+  // submitted before it completed.
+  void QueueSync();
+
+  // Submits the queued requests and waits for |min_complete| of the
+  // submitted ones to complete, then processes the completed requests.
+  // Returns false on error, setting errno.
+  bool Enter(unsigned min_complete);
+
+  // Processes the requests in the completion queue.
+  void ReapCompletions();
+
+  // Waits until all the queued and submitted requests completed. Returns false
+  // if the ring failed or a request failed since the last call, setting errno.
+  bool Drain();
+
+  const unsigned queue_depth_;
+
+  // The ring, or -1 if writes are done synchronously.
+  int ring_fd_{-1};
+
+  // The mapped ring queues and pointers to their fields.
+  void* sq_ring_{nullptr};
+  size_t sq_ring_size_{0};
+  void* cq_ring_{nullptr};
+  size_t cq_ring_size_{0};
+  io_uring_sqe* sqes_{nullptr};
+  size_t sqes_size_{0};
+  unsigned* sq_tail_{nullptr};
+  unsigned* sq_mask_{nullptr};
+  unsigned* sq_array_{nullptr};
+  unsigned* cq_head_{nullptr};
+  unsigned* cq_tail_{nullptr};
+  unsigned* cq_mask_{nullptr};
+  io_uring_cqe* cqes_{nullptr};
+
+  // The write requests and the indexes of those not in flight.
+  std::vector<Slot> slots_;
+  std::vector<size_t> free_slots_;
+
+  // Number of requests queued but not submitted yet, and number of requests
+  // queued or submitted but not completed yet.
+  unsigned pending_submit_{0};
+  unsigned in_flight_{0};
+
+  // Whether the file was opened with O_DSYNC, which Flush() emulates.
+  bool sync_{false};
+  // Whether data was written since the last sync.
+  bool dirty_{false};
+
+  // The errno of the first request that failed since the last Drain().
+  int error_{0};
+
+  // The position used by Read() and Write(), which are done at explicit
+  // offsets.
+  off64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(IoUringFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
@@ -0,0 +1,86 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kQueueDepth = 2;
+const size_t kChunkSize = 100;
+const size_t kNumChunks = 10;
+}  // namespace
+
+class IoUringFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Writes are done synchronously when io_uring isn't supported, which is
+    // also tested.
+    LOG_IF(INFO, !IoUringFileDescriptor::IsSupported())
+        << "io_uring not supported, testing synchronous writes.";
+    EXPECT_TRUE(fd_.Open(temp_file_.path().c_str(), O_RDWR | O_DSYNC, 0600));
+  }
+
+  IoUringFileDescriptor fd_{kQueueDepth};
+  test_utils::ScopedTempFile temp_file_{"IoUringFileDescriptor-file.XXXXXX"};
+};
+
+TEST_F(IoUringFileDescriptorTest, WriteBackwardsTest) {
+  // Writes more chunks than the queue depth, in reverse order.
+  brillo::Blob expected_data(kChunkSize * kNumChunks);
+  for (size_t i = kNumChunks; i > 0; i--) {
+    brillo::Blob chunk(kChunkSize, 'a' + i);
+    std::copy(chunk.begin(),
+              chunk.end(),
+              expected_data.begin() + (i - 1) * kChunkSize);
+    EXPECT_EQ(static_cast<off64_t>((i - 1) * kChunkSize),
+              fd_.Seek((i - 1) * kChunkSize, SEEK_SET));
+    EXPECT_EQ(static_cast<ssize_t>(kChunkSize),
+              fd_.Write(chunk.data(), chunk.size()));
+  }
+  EXPECT_TRUE(fd_.Flush());
+
+  brillo::Blob data;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &data));
+  EXPECT_EQ(expected_data, data);
+  EXPECT_TRUE(fd_.Close());
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadAfterWriteTest) {
+  brillo::Blob expected_data(kChunkSize, 'x');
+  EXPECT_EQ(static_cast<ssize_t>(kChunkSize),
+            fd_.Write(expected_data.data(), expected_data.size()));
+  EXPECT_EQ(static_cast<off64_t>(kChunkSize), fd_.Seek(0, SEEK_CUR));
+
+  // Reads see the data written before, even if not flushed.
+  brillo::Blob data(kChunkSize);
+  EXPECT_EQ(0, fd_.Seek(0, SEEK_SET));
+  EXPECT_EQ(static_cast<ssize_t>(kChunkSize), fd_.Read(data.data(), kChunkSize));
+  EXPECT_EQ(expected_data, data);
+  EXPECT_EQ(static_cast<off64_t>(kChunkSize), fd_.Seek(0, SEEK_END));
+  EXPECT_TRUE(fd_.Close());
+}
+
+}  // namespace chromeos_update_engine
@@ -47,6 +47,13 @@ class MtdFileDescriptor : public EintrSafeFileDescriptor {
                 int* result) override {
     return false;
   }
+  bool CopyRangeFrom(FileDescriptor* source,
+                     uint64_t source_offset,
+                     uint64_t offset,
+                     uint64_t length) override {
+    return false;
+  }
+  int GetReadFd() override { return -1; }
   bool Close() override;
 
  private:
@@ -83,6 +90,13 @@ class UbiFileDescriptor : public EintrSafeFileDescriptor {
                 int* result) override {
     return false;
   }
+  bool CopyRangeFrom(FileDescriptor* source,
+                     uint64_t source_offset,
+                     uint64_t offset,
+                     uint64_t length) override {
+    return false;
+  }
+  int GetReadFd() override { return -1; }
   bool Close() override;
 
  private:
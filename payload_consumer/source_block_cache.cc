@@ -0,0 +1,247 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_block_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::min;
+using std::pair;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+SourceBlockCache::SourceBlockCache(
+    const RepeatedPtrField<InstallOperation>& operations,
+    size_t first_operation,
+    size_t block_size,
+    size_t max_blocks)
+    : block_size_(block_size), max_blocks_(max_blocks) {
+  // Sum the reads of every block by sweeping the boundaries of the extents,
+  // keeping the ranges read more than once.
+  vector<pair<uint64_t, int64_t>> boundaries;
+  for (int i = first_operation; i < operations.size(); i++) {
+    uint32_t reads = SourceReads(operations.Get(i));
+    if (reads == 0)
+      continue;
+    for (const Extent& extent : operations.Get(i).src_extents()) {
+      if (extent.num_blocks() == 0)
+        continue;
+      boundaries.emplace_back(extent.start_block(), reads);
+      boundaries.emplace_back(extent.start_block() + extent.num_blocks(),
+                              -static_cast<int64_t>(reads));
+    }
+  }
+  std::sort(boundaries.begin(), boundaries.end());
+
+  int64_t reads = 0;
+  for (size_t i = 0; i < boundaries.size();) {
+    uint64_t block = boundaries[i].first;
+    for (; i < boundaries.size() && boundaries[i].first == block; i++)
+      reads += boundaries[i].second;
+    if (reads >= 2 && i < boundaries.size())
+      segments_[block] = {boundaries[i].first, static_cast<uint32_t>(reads)};
+  }
+}
+
+bool SourceBlockCache::Lookup(uint64_t block,
+                              size_t offset,
+                              size_t count,
+                              void* buffer) {
+  DCHECK_LE(offset + count, block_size_);
+  base::AutoLock auto_lock(lock_);
+  auto it = blocks_.find(block);
+  if (it == blocks_.end())
+    return false;
+  lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+  memcpy(buffer, it->second.data.data() + offset, count);
+  return true;
+}
+
+bool SourceBlockCache::IsCached(uint64_t block) {
+  base::AutoLock auto_lock(lock_);
+  return blocks_.count(block) > 0;
+}
+
+bool SourceBlockCache::ShouldCache(uint64_t block) {
+  base::AutoLock auto_lock(lock_);
+  if (max_blocks_ == 0 || blocks_.count(block))
+    return false;
+  auto segment = FindSegment(block);
+  return segment != segments_.end() && segment->second.reads >= 2;
+}
+
+void SourceBlockCache::Insert(uint64_t block, const uint8_t* data) {
+  base::AutoLock auto_lock(lock_);
+  if (max_blocks_ == 0 || blocks_.count(block))
+    return;
+  auto segment = FindSegment(block);
+  if (segment == segments_.end() || segment->second.reads < 2)
+    return;
+
+  if (blocks_.size() >= max_blocks_) {
+    blocks_.erase(lru_.back());
+    lru_.pop_back();
+  }
+  lru_.push_front(block);
+  Entry* entry = &blocks_[block];
+  entry->data.assign(data, data + block_size_);
+  entry->lru_it = lru_.begin();
+}
+
+void SourceBlockCache::OperationApplied(const InstallOperation& operation) {
+  uint32_t reads = SourceReads(operation);
+  if (reads == 0)
+    return;
+  base::AutoLock auto_lock(lock_);
+  for (const Extent& extent : operation.src_extents()) {
+    uint64_t end_block = extent.start_block() + extent.num_blocks();
+    auto it = segments_.lower_bound(extent.start_block());
+    while (it != segments_.end() && it->first < end_block) {
+      it->second.reads -= min(it->second.reads, reads);
+      if (it->second.reads > 0) {
+        ++it;
+        continue;
+      }
+      for (uint64_t block = it->first; block < it->second.end_block; block++) {
+        auto entry = blocks_.find(block);
+        if (entry != blocks_.end()) {
+          lru_.erase(entry->second.lru_it);
+          blocks_.erase(entry);
+        }
+      }
+      it = segments_.erase(it);
+    }
+  }
+}
+
+uint32_t SourceBlockCache::SourceReads(const InstallOperation& operation) {
+  switch (operation.type()) {
+    case InstallOperation::SOURCE_COPY:
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+      // The source blocks are hashed while copied or read by the patch.
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+std::map<uint64_t, SourceBlockCache::Segment>::iterator
+SourceBlockCache::FindSegment(uint64_t block) {
+  auto it = segments_.upper_bound(block);
+  if (it == segments_.begin())
+    return segments_.end();
+  --it;
+  return block < it->second.end_block ? it : segments_.end();
+}
+
+ssize_t SourceCacheFileDescriptor::Read(void* buf, size_t count) {
+  const size_t block_size = cache_->block_size();
+  const uint64_t end_block = (offset_ + count + block_size - 1) / block_size;
+  uint8_t* bytes = static_cast<uint8_t*>(buf);
+  size_t bytes_done = 0;
+  bool failed = false;
+  while (bytes_done < count) {
+    const uint64_t offset = offset_ + bytes_done;
+    const uint64_t block = offset / block_size;
+    const size_t block_offset = offset % block_size;
+    const size_t block_bytes =
+        min(count - bytes_done, block_size - block_offset);
+    if (cache_->Lookup(block, block_offset, block_bytes, bytes + bytes_done)) {
+      bytes_done += block_bytes;
+      continue;
+    }
+
+    // Read all the blocks up to the next cached one at once.
+    bool should_cache = cache_->ShouldCache(block);
+    uint64_t run_end_block = block + 1;
+    for (; run_end_block < end_block; run_end_block++) {
+      if (cache_->ShouldCache(run_end_block))
+        should_cache = true;
+      else if (cache_->IsCached(run_end_block))
+        break;
+    }
+    const size_t size = min(static_cast<uint64_t>(count - bytes_done),
+                            run_end_block * block_size - offset);
+
+    ssize_t bytes_read = 0;
+    if (!should_cache) {
+      if (!utils::PReadAll(fd_, bytes + bytes_done, size, offset, &bytes_read))
+        failed = true;
+    } else {
+      // Read whole blocks, so they can be cached.
+      buffer_.resize((run_end_block - block) * block_size);
+      ssize_t run_bytes_read = 0;
+      if (utils::PReadAll(fd_,
+                          buffer_.data(),
+                          buffer_.size(),
+                          block * block_size,
+                          &run_bytes_read)) {
+        size_t blocks_read = run_bytes_read / block_size;
+        for (size_t i = 0; i < blocks_read; i++)
+          cache_->Insert(block + i, buffer_.data() + i * block_size);
+        if (run_bytes_read > static_cast<ssize_t>(block_offset)) {
+          bytes_read = min(static_cast<ssize_t>(size),
+                           run_bytes_read - static_cast<ssize_t>(block_offset));
+          memcpy(bytes + bytes_done, buffer_.data() + block_offset, bytes_read);
+        }
+      } else {
+        failed = true;
+      }
+    }
+    // Stop on errors and at the end of the file.
+    if (failed)
+      break;
+    bytes_done += bytes_read;
+    if (bytes_read < static_cast<ssize_t>(size))
+      break;
+  }
+  // The bytes read before an error are returned, and the next call fails.
+  if (failed && bytes_done == 0)
+    return -1;
+  offset_ += bytes_done;
+  return bytes_done;
+}
+
+off64_t SourceCacheFileDescriptor::Seek(off64_t offset, int whence) {
+  // Read() doesn't use the position of |fd_|, so it's only moved when the new
+  // position depends on its size.
+  if (whence == SEEK_SET || whence == SEEK_CUR) {
+    off64_t new_offset = whence == SEEK_SET ? offset : offset_ + offset;
+    if (new_offset < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    offset_ = new_offset;
+    return offset_;
+  }
+  off64_t new_offset = fd_->Seek(offset, whence);
+  if (new_offset >= 0)
+    offset_ = new_offset;
+  return new_offset;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,165 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_BLOCK_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_BLOCK_CACHE_H_
+
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include <base/synchronization/lock.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// SourceBlockCache keeps in memory the source partition blocks that will be
+// read again by the operations not applied yet, since several operations may
+// read the same blocks.
+//
+// A block is only cached once read, and only if it will be read again. Up to
+// a maximum number of blocks are kept, evicting the least recently used ones
+// first, and a block is dropped once the operations reading it were applied.
+// The cache can be used by several threads at once.
+class SourceBlockCache {
+ public:
+  // Tracks the reads of the source blocks by |operations|, starting at
+  // |first_operation|. Keeps up to |max_blocks| blocks of |block_size| bytes.
+  SourceBlockCache(
+      const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+      size_t first_operation,
+      size_t block_size,
+      size_t max_blocks);
+
+  size_t block_size() const { return block_size_; }
+
+  // Copies |count| bytes starting |offset| bytes into block |block| to
+  // |buffer| and returns true if the block is cached.
+  bool Lookup(uint64_t block, size_t offset, size_t count, void* buffer);
+
+  // Returns whether block |block| is cached.
+  bool IsCached(uint64_t block);
+
+  // Returns whether block |block| is not cached but read more than once by the
+  // operations not applied yet, so it should be cached once read.
+  bool ShouldCache(uint64_t block);
+
+  // Caches a copy of the |block_size| bytes of block |block| at |data|, if
+  // ShouldCache() returns true.
+  void Insert(uint64_t block, const uint8_t* data);
+
+  // Drops the reads of |operation| once applied, and the cached blocks which
+  // won't be read anymore.
+  void OperationApplied(const InstallOperation& operation);
+
+  // Returns the number of times |operation| reads its source blocks.
+  static uint32_t SourceReads(const InstallOperation& operation);
+
+ private:
+  // A range of blocks read the same number of times by the operations not
+  // applied yet, keyed by its first block in |segments_|.
+  struct Segment {
+    uint64_t end_block;
+    uint32_t reads;
+  };
+
+  // A cached block and its position in |lru_|.
+  struct Entry {
+    brillo::Blob data;
+    std::list<uint64_t>::iterator lru_it;
+  };
+
+  // Returns the segment containing |block|, or |segments_.end()|. Must be
+  // called with |lock_| held.
+  std::map<uint64_t, Segment>::iterator FindSegment(uint64_t block);
+
+  const size_t block_size_;
+  const size_t max_blocks_;
+
+  base::Lock lock_;
+
+  // The ranges of blocks that will be read more than once. Every extent read
+  // by an operation starts and ends at a segment boundary.
+  std::map<uint64_t, Segment> segments_;
+
+  // The cached blocks and their numbers, most recently used first.
+  std::unordered_map<uint64_t, Entry> blocks_;
+  std::list<uint64_t> lru_;
+
+  DISALLOW_COPY_AND_ASSIGN(SourceBlockCache);
+};
+
+// SourceCacheFileDescriptor is a read-only FileDescriptor reading the blocks
+// of |fd| through a SourceBlockCache, which can be shared by several
+// SourceCacheFileDescriptor of the same source partition.
+class SourceCacheFileDescriptor : public FileDescriptor {
+ public:
+  SourceCacheFileDescriptor(FileDescriptorPtr fd,
+                            std::shared_ptr<SourceBlockCache> cache)
+      : fd_(fd), cache_(cache) {}
+  ~SourceCacheFileDescriptor() override = default;
+
+  bool Open(const char* path, int flags, mode_t mode) override {
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override {
+    errno = EROFS;
+    return -1;
+  }
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return fd_->BlkIoctl(request, start, length, result);
+  }
+  bool CopyRangeFrom(FileDescriptor* source,
+                     uint64_t source_offset,
+                     uint64_t offset,
+                     uint64_t length) override {
+    return false;
+  }
+  int GetReadFd() override { return fd_->GetReadFd(); }
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override { return fd_->Close(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+ private:
+  FileDescriptorPtr fd_;
+  std::shared_ptr<SourceBlockCache> cache_;
+
+  // The position used by Read(), which reads |fd_| at explicit offsets.
+  off64_t offset_{0};
+
+  // The buffer the blocks missing from the cache are read to.
+  brillo::Blob buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(SourceCacheFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_BLOCK_CACHE_H_
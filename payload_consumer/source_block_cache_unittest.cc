@@ -0,0 +1,184 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_block_cache.h"
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::pair;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = 16;
+}  // namespace
+
+class SourceBlockCacheTest : public ::testing::Test {
+ protected:
+  // Adds an operation of type |type| reading |extents|.
+  InstallOperation* AddOperation(InstallOperation::Type type,
+                                 const vector<Extent>& extents,
+                                 bool has_src_hash) {
+    InstallOperation* op = operations_.Add();
+    op->set_type(type);
+    StoreExtents(extents, op->mutable_src_extents());
+    if (has_src_hash)
+      op->set_src_sha256_hash("hash");
+    return op;
+  }
+
+  void InitCache(size_t max_blocks) {
+    cache_ = std::make_shared<SourceBlockCache>(
+        operations_, 0, kBlockSize, max_blocks);
+    fd_ = std::make_shared<SourceCacheFileDescriptor>(fake_fd_, cache_);
+  }
+
+  // Reads |count| bytes at |offset| through |fd_| and checks they match the
+  // data of the underlying file.
+  void ExpectRead(uint64_t offset, size_t count) {
+    brillo::Blob data(count), expected_data(count);
+    ssize_t bytes_read;
+    EXPECT_TRUE(utils::PReadAll(fd_, data.data(), count, offset, &bytes_read));
+    EXPECT_EQ(static_cast<ssize_t>(count), bytes_read);
+    EXPECT_TRUE(utils::PReadAll(expected_fd_,
+                                expected_data.data(),
+                                count,
+                                offset,
+                                &bytes_read));
+    EXPECT_EQ(expected_data, data);
+  }
+
+  RepeatedPtrField<InstallOperation> operations_;
+  std::shared_ptr<FakeFileDescriptor> fake_fd_{new FakeFileDescriptor()};
+  FileDescriptorPtr expected_fd_{new FakeFileDescriptor()};
+  std::shared_ptr<SourceBlockCache> cache_;
+  FileDescriptorPtr fd_;
+};
+
+TEST_F(SourceBlockCacheTest, SourceReadsTest) {
+  InstallOperation op;
+  op.set_type(InstallOperation::REPLACE);
+  EXPECT_EQ(0U, SourceBlockCache::SourceReads(op));
+  op.set_type(InstallOperation::SOURCE_COPY);
+  op.set_src_sha256_hash("hash");
+  EXPECT_EQ(1U, SourceBlockCache::SourceReads(op));
+  // The source hash of the diff operations is computed while the patch reads
+  // the source blocks.
+  op.set_type(InstallOperation::PUFFDIFF);
+  EXPECT_EQ(1U, SourceBlockCache::SourceReads(op));
+  op.clear_src_sha256_hash();
+  EXPECT_EQ(1U, SourceBlockCache::SourceReads(op));
+}
+
+TEST_F(SourceBlockCacheTest, DiffOperationsReadTest) {
+  // Both patches read the same blocks once from the file.
+  const InstallOperation* op1 = AddOperation(
+      InstallOperation::SOURCE_BSDIFF, {ExtentForRange(2, 2)}, true);
+  const InstallOperation* op2 = AddOperation(
+      InstallOperation::PUFFDIFF, {ExtentForRange(2, 2)}, true);
+  InitCache(10);
+  ExpectRead(2 * kBlockSize, 2 * kBlockSize);
+  cache_->OperationApplied(*op1);
+  ExpectRead(2 * kBlockSize + 5, kBlockSize);
+  EXPECT_EQ(
+      (vector<pair<uint64_t, uint64_t>>{{2 * kBlockSize, 2 * kBlockSize}}),
+      fake_fd_->GetReadOps());
+  EXPECT_TRUE(cache_->IsCached(2));
+  EXPECT_TRUE(cache_->IsCached(3));
+
+  cache_->OperationApplied(*op2);
+  EXPECT_FALSE(cache_->IsCached(2));
+  EXPECT_FALSE(cache_->IsCached(3));
+}
+
+TEST_F(SourceBlockCacheTest, BlocksReadOnceNotCachedTest) {
+  AddOperation(InstallOperation::SOURCE_COPY, {ExtentForRange(0, 4)}, true);
+  AddOperation(InstallOperation::SOURCE_BSDIFF, {ExtentForRange(6, 1)}, false);
+  InitCache(10);
+  ExpectRead(0, 4 * kBlockSize);
+  ExpectRead(6 * kBlockSize, kBlockSize);
+  EXPECT_FALSE(cache_->IsCached(0));
+  EXPECT_FALSE(cache_->IsCached(6));
+  // Reads outside the operations' extents aren't cached either.
+  ExpectRead(20 * kBlockSize, 3);
+  EXPECT_FALSE(cache_->IsCached(20));
+  EXPECT_EQ(3U, fake_fd_->GetReadOps().size());
+}
+
+TEST_F(SourceBlockCacheTest, SharedBlocksTest) {
+  // Block 3 is read by both operations, and stays cached until the second one
+  // is applied.
+  const InstallOperation* op1 = AddOperation(
+      InstallOperation::SOURCE_COPY, {ExtentForRange(1, 3)}, true);
+  const InstallOperation* op2 = AddOperation(
+      InstallOperation::SOURCE_COPY, {ExtentForRange(3, 2)}, true);
+  InitCache(10);
+  ExpectRead(kBlockSize, 3 * kBlockSize);
+  EXPECT_FALSE(cache_->IsCached(1));
+  EXPECT_TRUE(cache_->IsCached(3));
+  cache_->OperationApplied(*op1);
+  EXPECT_TRUE(cache_->IsCached(3));
+
+  // Only the block not cached is read from the file.
+  ExpectRead(3 * kBlockSize, 2 * kBlockSize);
+  EXPECT_EQ((vector<pair<uint64_t, uint64_t>>{{kBlockSize, 3 * kBlockSize},
+                                              {4 * kBlockSize, kBlockSize}}),
+            fake_fd_->GetReadOps());
+  cache_->OperationApplied(*op2);
+  EXPECT_FALSE(cache_->IsCached(3));
+}
+
+TEST_F(SourceBlockCacheTest, EvictionTest) {
+  AddOperation(InstallOperation::PUFFDIFF, {ExtentForRange(0, 4)}, true);
+  AddOperation(InstallOperation::SOURCE_COPY, {ExtentForRange(0, 4)}, true);
+  InitCache(2);
+  ExpectRead(0, 4 * kBlockSize);
+  EXPECT_FALSE(cache_->IsCached(0));
+  EXPECT_FALSE(cache_->IsCached(1));
+  EXPECT_TRUE(cache_->IsCached(2));
+  EXPECT_TRUE(cache_->IsCached(3));
+
+  // Reading a block evicts the least recently used one.
+  ExpectRead(2 * kBlockSize, 1);
+  ExpectRead(0, kBlockSize);
+  EXPECT_TRUE(cache_->IsCached(0));
+  EXPECT_TRUE(cache_->IsCached(2));
+  EXPECT_FALSE(cache_->IsCached(3));
+}
+
+TEST_F(SourceBlockCacheTest, UnalignedReadsTest) {
+  AddOperation(InstallOperation::SOURCE_BSDIFF, {ExtentForRange(0, 8)}, true);
+  AddOperation(InstallOperation::BROTLI_BSDIFF, {ExtentForRange(0, 8)}, true);
+  InitCache(8);
+  for (size_t offset = 0; offset < 8 * kBlockSize; offset += 7)
+    ExpectRead(offset, std::min(8 * kBlockSize - offset, kBlockSize * 3 / 2));
+  for (uint64_t block = 0; block < 8; block++)
+    EXPECT_TRUE(cache_->IsCached(block));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,184 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_prefetcher.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/extent_reader.h"
+
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The share of the maximum size of the data held that a single operation may
+// read, so several operations are read ahead.
+const uint64_t kMaxOperationSizeDivisor = 4;
+
+}  // namespace
+
+SourcePrefetcher::SourcePrefetcher(
+    const RepeatedPtrField<InstallOperation>* operations,
+    size_t first_operation,
+    FileDescriptorPtr source_fd,
+    uint32_t block_size,
+    size_t max_operations,
+    uint64_t max_size)
+    : operations_(operations),
+      first_operation_(first_operation),
+      source_fd_(source_fd),
+      block_size_(block_size),
+      max_operations_(max_operations),
+      max_size_(max_size),
+      reading_(operations->size()),
+      next_operation_(first_operation) {}
+
+SourcePrefetcher::~SourcePrefetcher() {
+  Stop();
+}
+
+void SourcePrefetcher::Start() {
+  thread_.reset(new base::DelegateSimpleThread(this, "source-prefetcher"));
+  thread_->Start();
+}
+
+void SourcePrefetcher::Stop() {
+  if (thread_) {
+    {
+      base::AutoLock auto_lock(lock_);
+      stopping_ = true;
+      data_taken_.Signal();
+    }
+    thread_->Join();
+    thread_.reset();
+  }
+  if (source_fd_) {
+    source_fd_->Close();
+    source_fd_.reset();
+  }
+  data_.clear();
+  size_ = 0;
+}
+
+bool SourcePrefetcher::Take(size_t operation, brillo::Blob* data) {
+  base::AutoLock auto_lock(lock_);
+  while (reading_ == operation)
+    data_read_.Wait();
+  next_operation_ = std::max(next_operation_, operation + 1);
+
+  bool found = false;
+  auto it = data_.begin();
+  while (it != data_.end() && it->first <= operation) {
+    if (it->first == operation) {
+      data->swap(it->second);
+      found = true;
+      size_ -= data->size();
+    } else {
+      size_ -= it->second.size();
+    }
+    it = data_.erase(it);
+  }
+  data_taken_.Signal();
+  return found;
+}
+
+// static
+bool SourcePrefetcher::ShouldPrefetch(const InstallOperation& operation,
+                                      uint32_t block_size,
+                                      uint64_t max_size) {
+  switch (operation.type()) {
+    case InstallOperation::SOURCE_COPY:
+      // Without a source hash, the blocks may be copied without reading them.
+      if (!operation.has_src_sha256_hash())
+        return false;
+      break;
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+      break;
+    default:
+      return false;
+  }
+  const uint64_t size =
+      utils::BlocksInExtents(operation.src_extents()) * block_size;
+  return size > 0 && size <= max_size / kMaxOperationSizeDivisor;
+}
+
+void SourcePrefetcher::Run() {
+  base::AutoLock auto_lock(lock_);
+  for (size_t index = first_operation_;
+       index < static_cast<size_t>(operations_->size()) && !stopping_;
+       index++) {
+    // Skip the operations already applied.
+    index = std::max(index, next_operation_);
+    if (index >= static_cast<size_t>(operations_->size()))
+      break;
+    const InstallOperation& operation = operations_->Get(index);
+    if (!ShouldPrefetch(operation, block_size_, max_size_))
+      continue;
+
+    const uint64_t size =
+        utils::BlocksInExtents(operation.src_extents()) * block_size_;
+    while (!stopping_ && index >= next_operation_ &&
+           (data_.size() >= max_operations_ || size_ + size > max_size_)) {
+      data_taken_.Wait();
+    }
+    if (stopping_)
+      break;
+    if (index < next_operation_)
+      continue;
+
+    reading_ = index;
+    brillo::Blob data;
+    bool valid;
+    {
+      base::AutoUnlock auto_unlock(lock_);
+      valid = ReadSource(operation, &data);
+    }
+    reading_ = operations_->size();
+    data_read_.Broadcast();
+    // Source data which can't be read or doesn't match its hash is left to
+    // the operation, which reports the error.
+    if (valid && index >= next_operation_) {
+      size_ += data.size();
+      data_[index] = std::move(data);
+    }
+  }
+}
+
+bool SourcePrefetcher::ReadSource(const InstallOperation& operation,
+                                  brillo::Blob* data) {
+  DirectExtentReader reader;
+  data->resize(utils::BlocksInExtents(operation.src_extents()) * block_size_);
+  TEST_AND_RETURN_FALSE(
+      reader.Init(source_fd_, operation.src_extents(), block_size_));
+  TEST_AND_RETURN_FALSE(reader.Read(data->data(), data->size()));
+  if (!operation.has_src_sha256_hash())
+    return true;
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(*data, &hash));
+  return hash == brillo::Blob(operation.src_sha256_hash().begin(),
+                              operation.src_sha256_hash().end());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,120 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
+
+#include <map>
+#include <memory>
+
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/simple_thread.h>
+#include <brillo/secure_blob.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// SourcePrefetcher reads the source blocks of the next operations of a
+// partition on its own thread, while the data of these operations is still
+// being downloaded, and validates them against the source hash of the
+// operations. The operations then take the validated source data instead of
+// reading and hashing it once their data is received.
+//
+// Up to a maximum number of operations and bytes are read ahead; the thread
+// waits for the data to be taken before reading more.
+class SourcePrefetcher : public base::DelegateSimpleThread::Delegate {
+ public:
+  // Reads the source of |operations| from |first_operation| on, from
+  // |source_fd|, which is closed once done. Holds up to |max_operations|
+  // operations and |max_size| bytes of data not taken yet. |operations| must
+  // outlive this object.
+  SourcePrefetcher(
+      const google::protobuf::RepeatedPtrField<InstallOperation>* operations,
+      size_t first_operation,
+      FileDescriptorPtr source_fd,
+      uint32_t block_size,
+      size_t max_operations,
+      uint64_t max_size);
+  ~SourcePrefetcher() override;
+
+  // Starts reading ahead on a new thread.
+  void Start();
+
+  // Stops the thread started by Start(), if any, and closes |source_fd_|.
+  void Stop();
+
+  // Moves the source data of the operation at index |operation| to |data| and
+  // returns true if it was read ahead and matches the source hash of the
+  // operation. Waits for the data if it's being read. The operations before it
+  // can't be taken afterwards.
+  bool Take(size_t operation, brillo::Blob* data);
+
+  // Returns whether the source of |operation| should be read ahead, given the
+  // |max_size| of the data held.
+  static bool ShouldPrefetch(const InstallOperation& operation,
+                             uint32_t block_size,
+                             uint64_t max_size);
+
+  // base::DelegateSimpleThread::Delegate overrides. Returns once all the
+  // operations were read ahead or Stop() was called.
+  void Run() override;
+
+ private:
+  // Reads the source of |operation| to |data| and returns whether it matches
+  // its source hash.
+  bool ReadSource(const InstallOperation& operation, brillo::Blob* data);
+
+  const google::protobuf::RepeatedPtrField<InstallOperation>* operations_;
+  const size_t first_operation_;
+  FileDescriptorPtr source_fd_;
+  const uint32_t block_size_;
+  const size_t max_operations_;
+  const uint64_t max_size_;
+
+  std::unique_ptr<base::DelegateSimpleThread> thread_;
+
+  // Protects all the members below.
+  base::Lock lock_;
+
+  // Signaled when data was taken or the thread should stop.
+  base::ConditionVariable data_taken_{&lock_};
+
+  // Signaled when the thread is done reading an operation.
+  base::ConditionVariable data_read_{&lock_};
+
+  // The validated source data read ahead, by operation index, and its size.
+  std::map<size_t, brillo::Blob> data_;
+  uint64_t size_{0};
+
+  // The index of the operation being read, or |operations_->size()|.
+  size_t reading_;
+
+  // The first operation which may still be taken.
+  size_t next_operation_;
+
+  // Whether the thread should stop.
+  bool stopping_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(SourcePrefetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
@@ -0,0 +1,162 @@
+//
+// Copyright (C) 2018 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_prefetcher.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = 16;
+const uint64_t kMaxSize = 1024;
+}  // namespace
+
+class SourcePrefetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    EXPECT_TRUE(fake_fd_->Open(nullptr, 0));
+    EXPECT_TRUE(expected_fd_->Open(nullptr, 0));
+  }
+
+  // Returns the data of |extents| in the source.
+  brillo::Blob SourceData(const vector<Extent>& extents) {
+    brillo::Blob data;
+    for (const Extent& extent : extents) {
+      brillo::Blob extent_data(extent.num_blocks() * kBlockSize);
+      ssize_t bytes_read;
+      EXPECT_TRUE(utils::PReadAll(expected_fd_,
+                                  extent_data.data(),
+                                  extent_data.size(),
+                                  extent.start_block() * kBlockSize,
+                                  &bytes_read));
+      data.insert(data.end(), extent_data.begin(), extent_data.end());
+    }
+    return data;
+  }
+
+  // Adds an operation of type |type| reading |extents|, with the hash of the
+  // source data if |has_src_hash| or an invalid one if |valid_hash| is false.
+  void AddOperation(InstallOperation::Type type,
+                    const vector<Extent>& extents,
+                    bool has_src_hash,
+                    bool valid_hash) {
+    InstallOperation* op = operations_.Add();
+    op->set_type(type);
+    StoreExtents(extents, op->mutable_src_extents());
+    if (!has_src_hash)
+      return;
+    brillo::Blob hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfData(SourceData(extents), &hash));
+    if (!valid_hash)
+      hash[0] ^= 1;
+    op->set_src_sha256_hash(string(hash.begin(), hash.end()));
+  }
+
+  // Reads ahead all the operations on the test thread, so the data of all the
+  // operations read ahead can be taken afterwards.
+  void ReadAhead(size_t first_operation) {
+    prefetcher_.reset(new SourcePrefetcher(&operations_,
+                                           first_operation,
+                                           fake_fd_,
+                                           kBlockSize,
+                                           operations_.size(),
+                                           kMaxSize));
+    prefetcher_->Run();
+  }
+
+  RepeatedPtrField<InstallOperation> operations_;
+  std::shared_ptr<FakeFileDescriptor> fake_fd_{new FakeFileDescriptor()};
+  FileDescriptorPtr expected_fd_{new FakeFileDescriptor()};
+  std::unique_ptr<SourcePrefetcher> prefetcher_;
+};
+
+TEST_F(SourcePrefetcherTest, ShouldPrefetchTest) {
+  InstallOperation op;
+  *op.add_src_extents() = ExtentForRange(0, 2);
+  op.set_type(InstallOperation::REPLACE);
+  EXPECT_FALSE(SourcePrefetcher::ShouldPrefetch(op, kBlockSize, kMaxSize));
+  // SOURCE_COPY operations without a source hash don't need to read it.
+  op.set_type(InstallOperation::SOURCE_COPY);
+  EXPECT_FALSE(SourcePrefetcher::ShouldPrefetch(op, kBlockSize, kMaxSize));
+  op.set_src_sha256_hash("hash");
+  EXPECT_TRUE(SourcePrefetcher::ShouldPrefetch(op, kBlockSize, kMaxSize));
+  op.clear_src_sha256_hash();
+  op.set_type(InstallOperation::PUFFDIFF);
+  EXPECT_TRUE(SourcePrefetcher::ShouldPrefetch(op, kBlockSize, kMaxSize));
+
+  // Large sources are left to the operations.
+  *op.mutable_src_extents(0) = ExtentForRange(0, kMaxSize / kBlockSize);
+  EXPECT_FALSE(SourcePrefetcher::ShouldPrefetch(op, kBlockSize, kMaxSize));
+}
+
+TEST_F(SourcePrefetcherTest, TakeValidatedDataTest) {
+  vector<Extent> extents1 = {ExtentForRange(4, 1), ExtentForRange(0, 2)};
+  vector<Extent> extents4 = {ExtentForRange(10, 2)};
+  AddOperation(InstallOperation::SOURCE_COPY, extents1, true, true);
+  AddOperation(InstallOperation::SOURCE_COPY, {ExtentForRange(2, 1)}, false,
+               false);
+  AddOperation(InstallOperation::SOURCE_BSDIFF, {ExtentForRange(6, 2)}, true,
+               false);
+  AddOperation(InstallOperation::PUFFDIFF, extents4, false, false);
+  ReadAhead(0);
+  // The SOURCE_COPY without source hash isn't read.
+  for (const auto& read_op : fake_fd_->GetReadOps())
+    EXPECT_NE(2 * kBlockSize, read_op.first);
+
+  brillo::Blob data;
+  EXPECT_TRUE(prefetcher_->Take(0, &data));
+  EXPECT_EQ(SourceData(extents1), data);
+  EXPECT_FALSE(prefetcher_->Take(1, &data));
+  // The source not matching its hash is left to the operation.
+  EXPECT_FALSE(prefetcher_->Take(2, &data));
+  EXPECT_TRUE(prefetcher_->Take(3, &data));
+  EXPECT_EQ(SourceData(extents4), data);
+}
+
+TEST_F(SourcePrefetcherTest, SkippedOperationsDroppedTest) {
+  AddOperation(InstallOperation::SOURCE_COPY, {ExtentForRange(0, 1)}, true,
+               true);
+  AddOperation(InstallOperation::SOURCE_COPY, {ExtentForRange(1, 1)}, true,
+               true);
+  AddOperation(InstallOperation::SOURCE_COPY, {ExtentForRange(2, 1)}, true,
+               true);
+  // The operations before |first_operation| were already applied.
+  ReadAhead(1);
+  for (const auto& read_op : fake_fd_->GetReadOps())
+    EXPECT_LE(kBlockSize, read_op.first);
+
+  brillo::Blob data;
+  EXPECT_FALSE(prefetcher_->Take(0, &data));
+  EXPECT_TRUE(prefetcher_->Take(2, &data));
+  EXPECT_FALSE(prefetcher_->Take(1, &data));
+}
+
+}  // namespace chromeos_update_engine
@@ -50,15 +50,46 @@ const char* XzErrorString(enum xz_ret error) {
 }
 }  // namespace
 
+XzDecoderPool::~XzDecoderPool() {
+  for (xz_dec* decoder : decoders_)
+    xz_dec_end(decoder);
+}
+
+xz_dec* XzDecoderPool::Acquire() {
+  {
+    base::AutoLock auto_lock(lock_);
+    if (!decoders_.empty()) {
+      xz_dec* decoder = decoders_.back();
+      decoders_.pop_back();
+      // The previous stream may not have been fully decoded.
+      xz_dec_reset(decoder);
+      return decoder;
+    }
+  }
+  return xz_dec_init(XZ_DYNALLOC, kXzMaxDictSize);
+}
+
+void XzDecoderPool::Release(xz_dec* decoder) {
+  base::AutoLock auto_lock(lock_);
+  decoders_.push_back(decoder);
+}
+
 XzExtentWriter::~XzExtentWriter() {
-  xz_dec_end(stream_);
+  if (decoder_pool_ && stream_)
+    decoder_pool_->Release(stream_);
+  else
+    xz_dec_end(stream_);
 }
 
 bool XzExtentWriter::Init(FileDescriptorPtr fd,
                           const RepeatedPtrField<Extent>& extents,
                           uint32_t block_size) {
-  stream_ = xz_dec_init(XZ_DYNALLOC, kXzMaxDictSize);
+  if (decoder_pool_)
+    stream_ = decoder_pool_->Acquire();
+  else
+    stream_ = xz_dec_init(XZ_DYNALLOC, kXzMaxDictSize);
   TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  output_buffer_.resize(kOutputBufferLength);
   return underlying_writer_->Init(fd, extents, block_size);
 }
 
@@ -78,9 +109,8 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
   request.in_pos = 0;
   request.in_size = count;
 
-  brillo::Blob output_buffer(kOutputBufferLength);
-  request.out = output_buffer.data();
-  request.out_size = output_buffer.size();
+  request.out = output_buffer_.data();
+  request.out_size = output_buffer_.size();
   for (;;) {
     request.out_pos = 0;
 
@@ -94,13 +124,12 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
       break;
 
     TEST_AND_RETURN_FALSE(
-        underlying_writer_->Write(output_buffer.data(), request.out_pos));
+        underlying_writer_->Write(output_buffer_.data(), request.out_pos));
     if (ret == XZ_STREAM_END)
       CHECK_EQ(request.in_size, request.in_pos);
     if (request.in_size == request.in_pos)
       break;  // No more input to process.
   }
-  output_buffer.clear();
 
   // Store unconsumed data (if any) in |input_buffer_|. Since |input| can point
   // to the existing |input_buffer_| we create a new one before assigning it.
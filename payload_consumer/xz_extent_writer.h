@@ -21,7 +21,9 @@
 
 #include <memory>
 #include <utility>
+#include <vector>
 
+#include <base/synchronization/lock.h>
 #include <brillo/secure_blob.h>
 
 #include "update_engine/payload_consumer/extent_writer.h"
@@ -33,10 +35,38 @@
 
 namespace chromeos_update_engine {
 
+// XzDecoderPool keeps the decoders of the XzExtentWriters done with them, to
+// be reset and reused by the next ones. Reusing a decoder saves allocating it
+// and its dictionary, which is kept as large as the largest one used. The pool
+// holds as many decoders as were used at once, and can be used by several
+// threads at once.
+class XzDecoderPool {
+ public:
+  XzDecoderPool() = default;
+  ~XzDecoderPool();
+
+  // Returns a decoder ready to decode a new stream, or nullptr on error.
+  xz_dec* Acquire();
+
+  // Gives back |decoder|, obtained from Acquire(), to the pool.
+  void Release(xz_dec* decoder);
+
+ private:
+  base::Lock lock_;
+  std::vector<xz_dec*> decoders_;
+
+  DISALLOW_COPY_AND_ASSIGN(XzDecoderPool);
+};
+
 class XzExtentWriter : public ExtentWriter {
  public:
   explicit XzExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer)
       : underlying_writer_(std::move(underlying_writer)) {}
+  // Uses a decoder from |decoder_pool|, which must outlive this writer.
+  XzExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer,
+                 XzDecoderPool* decoder_pool)
+      : underlying_writer_(std::move(underlying_writer)),
+        decoder_pool_(decoder_pool) {}
   ~XzExtentWriter() override;
 
   bool Init(FileDescriptorPtr fd,
@@ -48,9 +78,13 @@ class XzExtentWriter : public ExtentWriter {
  private:
   // The underlying ExtentWriter.
   std::unique_ptr<ExtentWriter> underlying_writer_;
+  // The pool |stream_| comes from, if any.
+  XzDecoderPool* decoder_pool_{nullptr};
   // The opaque xz decompressor struct.
   xz_dec* stream_{nullptr};
   brillo::Blob input_buffer_;
+  // The buffer the data is decompressed to before being written.
+  brillo::Blob output_buffer_;
 
   DISALLOW_COPY_AND_ASSIGN(XzExtentWriter);
 };
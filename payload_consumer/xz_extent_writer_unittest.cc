@@ -156,4 +156,31 @@ TEST_F(XzExtentWriterTest, PartialDataIsKept) {
   EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
 }
 
+TEST_F(XzExtentWriterTest, PooledDecoderReusedTest) {
+  XzDecoderPool pool;
+  brillo::Blob compressed(std::begin(kCompressed30KiBofA),
+                          std::end(kCompressed30KiBofA));
+  {
+    // Stop in the middle of the stream, leaving the decoder in use.
+    XzExtentWriter writer(std::make_unique<FakeExtentWriter>(), &pool);
+    EXPECT_TRUE(writer.Init(fd_, {}, 1024));
+    EXPECT_TRUE(writer.Write(compressed.data(), compressed.size() / 2));
+  }
+  for (size_t i = 0; i < 2; i++) {
+    FakeExtentWriter* fake_writer = new FakeExtentWriter();
+    XzExtentWriter writer(base::WrapUnique(fake_writer), &pool);
+    EXPECT_TRUE(writer.Init(fd_, {}, 1024));
+    EXPECT_TRUE(writer.Write(compressed.data(), compressed.size()));
+    EXPECT_TRUE(writer.End());
+    EXPECT_EQ(brillo::Blob(30 * 1024, 'a'), fake_writer->WrittenData());
+  }
+
+  // A released decoder is handed out again.
+  xz_dec* decoder = pool.Acquire();
+  EXPECT_NE(nullptr, decoder);
+  pool.Release(decoder);
+  EXPECT_EQ(decoder, pool.Acquire());
+  pool.Release(decoder);
+}
+
 }  // namespace chromeos_update_engine
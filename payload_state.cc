@@ -183,6 +183,10 @@ void PayloadState::DownloadProgress(size_t count) {
   SetUrlFailureCount(0);
 }
 
+void PayloadState::DownloadThroughputMeasured(int64_t bytes_per_second) {
+  url_throughput_ = bytes_per_second;
+}
+
 void PayloadState::AttemptStarted(AttemptType attempt_type) {
   // Flush previous state from abnormal attempt failure, if any.
   ReportAndClearPersistedAttemptMetrics();
@@ -323,7 +327,7 @@ void PayloadState::UpdateFailed(ErrorCode error) {
     case ErrorCode::kDownloadWriteError:
     case ErrorCode::kDownloadStateInitializationError:
     case ErrorCode::kOmahaErrorInHTTPResponse:  // Aggregate for HTTP errors.
-      IncrementFailureCount();
+      IncrementFailureCount(error);
       break;
 
     // Errors which are not specific to a URL and hence shouldn't result in
@@ -481,7 +485,23 @@ void PayloadState::IncrementUrlIndex() {
   SetUrlFailureCount(0);
 }
 
-void PayloadState::IncrementFailureCount() {
+void PayloadState::IncrementFailureCount(ErrorCode error) {
+  // A URL whose transfer failed or timed out while it was this slow is
+  // unlikely to ever complete the download, so the next URL is tried right
+  // away if there is one. Other errors say nothing about the URL speed.
+  if (error == ErrorCode::kDownloadTransferError && url_throughput_ > 0 &&
+      url_throughput_ < kDownloadSlowUrlThroughputBps) {
+    size_t max_url_size = 0;
+    for (const auto& urls : candidate_urls_)
+      max_url_size = std::max(max_url_size, urls.size());
+    if (max_url_size > 1) {
+      LOG(INFO) << "Url" << GetUrlIndex() << " failed at only "
+                << url_throughput_ << " bytes/sec. Trying next available URL";
+      IncrementUrlIndex();
+      return;
+    }
+  }
+
   uint32_t next_url_failure_count = GetUrlFailureCount() + 1;
   if (next_url_failure_count < response_.max_failure_count_per_url) {
     LOG(INFO) << "Incrementing the URL failure count";
@@ -899,6 +919,7 @@ void PayloadState::LoadUrlIndex() {
 void PayloadState::SetUrlIndex(uint32_t url_index) {
   CHECK(prefs_);
   url_index_ = url_index;
+  url_throughput_ = 0;
   LOG(INFO) << "Current URL Index = " << url_index_;
   prefs_->SetInt64(kPrefsCurrentUrlIndex, url_index_);
 
@@ -53,6 +53,7 @@ class PayloadState : public PayloadStateInterface {
   void SetResponse(const OmahaResponse& response) override;
   void DownloadComplete() override;
   void DownloadProgress(size_t count) override;
+  void DownloadThroughputMeasured(int64_t bytes_per_second) override;
   void UpdateResumed() override;
   void UpdateRestarted() override;
   void UpdateSucceeded() override;
@@ -187,10 +188,11 @@ class PayloadState : public PayloadStateInterface {
   // updates the URL switch count, if needed.
   void IncrementUrlIndex();
 
-  // Increments the failure count of the current URL. If the configured max
-  // failure count is reached for this URL, it advances the current URL index
-  // to the next URL and resets the failure count for that URL.
-  void IncrementFailureCount();
+  // Increments the failure count of the current URL after a failure with
+  // |error|. If the configured max failure count is reached for this URL, or
+  // if its transfer failed while it was too slow, it advances the current URL
+  // index to the next URL and resets the failure count for that URL.
+  void IncrementFailureCount(ErrorCode error);
 
   // Updates the backoff expiry time exponentially based on the current
   // payload attempt number.
@@ -488,6 +490,11 @@ class PayloadState : public PayloadStateInterface {
   // The number of times we've switched URLs.
   int32_t url_switch_count_;
 
+  // The throughput measured while downloading from the current URL, in bytes
+  // per second, or zero if not measured. This value is not persisted and is
+  // cleared whenever the URL index changes.
+  int64_t url_throughput_ = 0;
+
   // The current download source based on the current URL. This value is
   // not persisted as it can be recomputed everytime we update the URL.
   // We're storing this so as not to recompute this on every few bytes of
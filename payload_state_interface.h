@@ -54,6 +54,12 @@ class PayloadStateInterface {
   // able to make forward progress with the current URL.
   virtual void DownloadProgress(size_t count) = 0;
 
+  // This method should be called with the throughput measured while
+  // downloading the current payload from the current URL, before the download
+  // completes or fails. A URL failing while it is this slow is given up on
+  // sooner.
+  virtual void DownloadThroughputMeasured(int64_t bytes_per_second) = 0;
+
   // This method should be called every time we resume an update attempt.
   virtual void UpdateResumed() = 0;
 
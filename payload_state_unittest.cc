@@ -305,6 +305,39 @@ TEST(PayloadStateTest, CanAdvanceUrlIndexCorrectly) {
   EXPECT_EQ(3U, payload_state.GetUrlSwitchCount());
 }
 
+TEST(PayloadStateTest, SlowUrlFailureAdvancesUrlIndex) {
+  OmahaResponse response;
+  FakeSystemState fake_system_state;
+  PayloadState payload_state;
+
+  EXPECT_TRUE(payload_state.Initialize(&fake_system_state));
+  SetupPayloadStateWith2Urls(
+      "Hash3141", true, false, &payload_state, &response);
+
+  // A transfer error on a URL fast enough only increments its failure count.
+  payload_state.DownloadThroughputMeasured(kDownloadSlowUrlThroughputBps);
+  payload_state.UpdateFailed(ErrorCode::kDownloadTransferError);
+  EXPECT_EQ("http://test", payload_state.GetCurrentUrl());
+  EXPECT_EQ(1U, payload_state.GetUrlFailureCount());
+
+  // Other errors on a slow URL only increment its failure count too.
+  payload_state.DownloadThroughputMeasured(kDownloadSlowUrlThroughputBps - 1);
+  payload_state.UpdateFailed(ErrorCode::kDownloadWriteError);
+  EXPECT_EQ("http://test", payload_state.GetCurrentUrl());
+  EXPECT_EQ(2U, payload_state.GetUrlFailureCount());
+
+  // A transfer error on a slow URL advances to the next one right away.
+  payload_state.UpdateFailed(ErrorCode::kDownloadTransferError);
+  EXPECT_EQ("https://test", payload_state.GetCurrentUrl());
+  EXPECT_EQ(0U, payload_state.GetUrlFailureCount());
+  EXPECT_EQ(1U, payload_state.GetUrlSwitchCount());
+
+  // The throughput measured on the previous URL doesn't apply to this one.
+  payload_state.UpdateFailed(ErrorCode::kDownloadTransferError);
+  EXPECT_EQ("https://test", payload_state.GetCurrentUrl());
+  EXPECT_EQ(1U, payload_state.GetUrlFailureCount());
+}
+
 TEST(PayloadStateTest, NewResponseResetsPayloadState) {
   OmahaResponse response;
   FakeSystemState fake_system_state;
@@ -78,6 +78,13 @@ class ServiceDelegateAndroidInterface {
 
   virtual bool SetPerformanceMode(bool enable, brillo::ErrorPtr* error) = 0;
 
+  // Limits the download rate of the updates to |bytes_per_second|, or removes
+  // the limit if 0. The limit applies right away to an ongoing download and to
+  // the next ones. In case of error, returns false and sets |error|
+  // accordingly.
+  virtual bool SetDownloadRateLimit(int64_t bytes_per_second,
+                                    brillo::ErrorPtr* error) = 0;
+
  protected:
   ServiceDelegateAndroidInterface() = default;
 };
@@ -603,18 +603,23 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
                                            system_state_->hardware()),
       false));
 
-  LibcurlHttpFetcher* download_fetcher =
-      new LibcurlHttpFetcher(GetProxyResolver(), system_state_->hardware());
-  download_fetcher->set_server_to_check(ServerToCheck::kDownload);
-  if (interactive)
-    download_fetcher->set_max_retry_count(kDownloadMaxRetryCountInteractive);
+  auto new_download_fetcher = [this, interactive]() {
+    LibcurlHttpFetcher* download_fetcher =
+        new LibcurlHttpFetcher(GetProxyResolver(), system_state_->hardware());
+    download_fetcher->set_server_to_check(ServerToCheck::kDownload);
+    if (interactive)
+      download_fetcher->set_max_retry_count(kDownloadMaxRetryCountInteractive);
+    return download_fetcher;
+  };
   shared_ptr<DownloadAction> download_action(
       new DownloadAction(prefs_,
                          system_state_->boot_control(),
                          system_state_->hardware(),
                          system_state_,
-                         download_fetcher,  // passes ownership
+                         new_download_fetcher(),  // passes ownership
                          interactive));
+  for (int i = 1; i < kDownloadParallelConnections; i++)
+    download_action->AddParallelFetcher(new_download_fetcher());
   shared_ptr<OmahaRequestAction> download_finished_action(
       new OmahaRequestAction(
           system_state_,
@@ -20,6 +20,7 @@
 #include <map>
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include <android-base/properties.h>
 #include <base/bind.h>
@@ -440,6 +441,23 @@ bool UpdateAttempterAndroid::SetPerformanceMode(bool enable,
   return true;
 }
 
+bool UpdateAttempterAndroid::SetDownloadRateLimit(int64_t bytes_per_second,
+                                                  brillo::ErrorPtr* error) {
+  if (bytes_per_second < 0) {
+    return LogAndSetError(
+        error,
+        FROM_HERE,
+        "Invalid download rate limit: " + std::to_string(bytes_per_second));
+  }
+  if (bytes_per_second == 0)
+    LOG(INFO) << "Removing the download rate limit.";
+  else
+    LOG(INFO) << "Limiting the download rate to " << bytes_per_second
+              << " bytes/sec.";
+  download_rate_limiter_.SetRate(bytes_per_second, base::TimeTicks::Now());
+  return true;
+}
+
 void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
                                             ErrorCode code) {
   LOG(INFO) << "Processing Done.";
@@ -635,6 +653,7 @@ void UpdateAttempterAndroid::BuildUpdateActions(const string& url) {
       new InstallPlanAction(install_plan_));
 
   HttpFetcher* download_fetcher = nullptr;
+  vector<HttpFetcher*> parallel_fetchers;
   if (FileFetcher::SupportedUrl(url)) {
     DLOG(INFO) << "Using FileFetcher for file URL.";
     download_fetcher = new FileFetcher();
@@ -642,10 +661,16 @@ void UpdateAttempterAndroid::BuildUpdateActions(const string& url) {
 #ifdef _UE_SIDELOAD
     LOG(FATAL) << "Unsupported sideload URI: " << url;
 #else
-    LibcurlHttpFetcher* libcurl_fetcher =
-        new LibcurlHttpFetcher(&proxy_resolver_, hardware_);
-    libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
-    download_fetcher = libcurl_fetcher;
+    for (int i = 0; i < kDownloadParallelConnections; i++) {
+      LibcurlHttpFetcher* libcurl_fetcher =
+          new LibcurlHttpFetcher(&proxy_resolver_, hardware_);
+      libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
+      libcurl_fetcher->set_rate_limiter(&download_rate_limiter_);
+      if (i == 0)
+        download_fetcher = libcurl_fetcher;
+      else
+        parallel_fetchers.push_back(libcurl_fetcher);
+    }
 #endif  // _UE_SIDELOAD
   }
   shared_ptr<DownloadAction> download_action(
@@ -661,6 +686,8 @@ void UpdateAttempterAndroid::BuildUpdateActions(const string& url) {
   shared_ptr<PostinstallRunnerAction> postinstall_runner_action(
       new PostinstallRunnerAction(boot_control_, hardware_));
 
+  for (HttpFetcher* parallel_fetcher : parallel_fetchers)
+    download_action->AddParallelFetcher(parallel_fetcher);  // passes ownership
   download_action->set_delegate(this);
   download_action->set_base_offset(base_offset_);
   download_action_ = download_action;
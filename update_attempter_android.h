@@ -31,6 +31,7 @@
 #include "update_engine/common/clock.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/token_bucket.h"
 #include "update_engine/daemon_state_interface.h"
 #include "update_engine/metrics_reporter_interface.h"
 #include "update_engine/metrics_utils.h"
@@ -72,6 +73,8 @@ class UpdateAttempterAndroid
   bool VerifyPayloadApplicable(const std::string& metadata_filename,
                                brillo::ErrorPtr* error) override;
   bool SetPerformanceMode(bool enable, brillo::ErrorPtr* error) override;
+  bool SetDownloadRateLimit(int64_t bytes_per_second,
+                            brillo::ErrorPtr* error) override;
 
   // ActionProcessorDelegate methods:
   void ProcessingDone(const ActionProcessor* processor,
@@ -198,6 +201,9 @@ class UpdateAttempterAndroid
   // Only direct proxy supported.
   DirectProxyResolver proxy_resolver_;
 
+  // Limits the total download rate of the fetchers of the updates.
+  TokenBucket download_rate_limiter_;
+
   // Helper class to select the network to use during the update.
   std::unique_ptr<NetworkSelectorInterface> network_selector_;
 
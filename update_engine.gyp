@@ -28,6 +28,7 @@
       # here when these USE flags are not defined. You can set the default value
       # for the USE flag in the ebuild.
       'USE_hwid_override%': '0',
+      'USE_io_uring%': '0',
     },
     'cflags': [
       '-g',
@@ -51,6 +52,7 @@
       'USE_BINDER=<(USE_binder)',
       'USE_DBUS=<(USE_dbus)',
       'USE_HWID_OVERRIDE=<(USE_hwid_override)',
+      'USE_IO_URING=<(USE_io_uring)',
       'USE_CHROME_KIOSK_APP=<(USE_chrome_kiosk_app)',
       'USE_CHROME_NETWORK_PROXY=<(USE_chrome_network_proxy)',
       'USE_MTD=<(USE_mtd)',
@@ -167,9 +169,13 @@
         'common/multi_range_http_fetcher.cc',
         'common/platform_constants_chromeos.cc',
         'common/prefs.cc',
+        'common/sha256_x86.cc',
         'common/subprocess.cc',
         'common/terminator.cc',
+        'common/throughput_estimator.cc',
+        'common/token_bucket.cc',
         'common/utils.cc',
+        'payload_consumer/async_file_writer.cc',
         'payload_consumer/bzip_extent_writer.cc',
         'payload_consumer/cached_file_descriptor.cc',
         'payload_consumer/delta_performer.cc',
@@ -186,9 +192,16 @@
         'payload_consumer/payload_metadata.cc',
         'payload_consumer/payload_verifier.cc',
         'payload_consumer/postinstall_runner_action.cc',
+        'payload_consumer/source_block_cache.cc',
+        'payload_consumer/source_prefetcher.cc',
         'payload_consumer/xz_extent_writer.cc',
       ],
       'conditions': [
+        ['USE_io_uring == 1', {
+          'sources': [
+            'payload_consumer/io_uring_file_descriptor.cc',
+          ],
+        }],
         ['USE_mtd == 1', {
           'sources': [
             'payload_consumer/mtd_file_descriptor.cc',
@@ -512,6 +525,8 @@
             'common/subprocess_unittest.cc',
             'common/terminator_unittest.cc',
             'common/test_utils.cc',
+            'common/throughput_estimator_unittest.cc',
+            'common/token_bucket_unittest.cc',
             'common/utils_unittest.cc',
             'common_service_unittest.cc',
             'connection_manager_unittest.cc',
@@ -526,6 +541,7 @@
             'omaha_response_handler_action_unittest.cc',
             'omaha_utils_unittest.cc',
             'p2p_manager_unittest.cc',
+            'payload_consumer/async_file_writer_unittest.cc',
             'payload_consumer/bzip_extent_writer_unittest.cc',
             'payload_consumer/cached_file_descriptor_unittest.cc',
             'payload_consumer/delta_performer_integration_test.cc',
@@ -538,6 +554,8 @@
             'payload_consumer/file_writer_unittest.cc',
             'payload_consumer/filesystem_verifier_action_unittest.cc',
             'payload_consumer/postinstall_runner_action_unittest.cc',
+            'payload_consumer/source_block_cache_unittest.cc',
+            'payload_consumer/source_prefetcher_unittest.cc',
             'payload_consumer/xz_extent_writer_unittest.cc',
             'payload_generator/ab_generator_unittest.cc',
             'payload_generator/blob_file_writer_unittest.cc',
@@ -579,6 +597,13 @@
             'update_manager/update_manager_unittest.cc',
             'update_manager/variable_unittest.cc',
           ],
+          'conditions': [
+            ['USE_io_uring == 1', {
+              'sources': [
+                'payload_consumer/io_uring_file_descriptor_unittest.cc',
+              ],
+            }],
+          ],
         },
       ],
     }],
@@ -133,6 +133,10 @@ int UpdateEngineClientAndroid::OnInit() {
               "Follow status update changes until a final state is reached. "
               "Exit status is 0 if the update succeeded, and 1 otherwise.");
   DEFINE_bool(perf_mode, false, "Enable perf mode.");
+  DEFINE_int64(download_rate_limit,
+               -1,
+               "Limit the download rate of the updates to this many bytes per "
+               "second, or remove the limit if 0, and exit.");
 
   // Boilerplate init commands.
   base::CommandLine::Init(argc_, argv_);
@@ -187,6 +191,11 @@ int UpdateEngineClientAndroid::OnInit() {
     return ExitWhenIdle(service_->setPerformanceMode(true));
   }
 
+  if (FLAGS_download_rate_limit >= 0) {
+    return ExitWhenIdle(
+        service_->setDownloadRateLimit(FLAGS_download_rate_limit));
+  }
+
   if (FLAGS_follow) {
     // Register a callback object with the service.
     callback_ = new UECallback(this);